@@ -0,0 +1,535 @@
+// pmdmini-gui-bench: throughput of the player's hot paths, written as JSON so two builds
+// can be compared. progress goes to stderr
+//
+//   pmdmini-gui-bench [--corpus DIR] [--out FILE] [--quick] [--only GROUP]...
+//
+// groups: render, ring, scan, playlist, ui
+
+#include "alloc_counter.h"
+#include "engine.h"
+#include "playlist.h"
+#include "ring_buffer.h"
+#include "scanner.h"
+#include "song_info.h"
+#include "ui.h"
+#include <imgui.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/utsname.h>
+#endif
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    fs::path corpus = PMDMINI_GUI_MUSIC_DIR;
+    fs::path out;
+    bool quick = false;
+    std::set<std::string> only;
+
+    bool Runs(const std::string &group) const { return only.empty() || only.count(group) > 0; }
+};
+
+double Seconds(Clock::time_point since)
+{
+    return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+// value at fraction q of sorted samples
+double Quantile(std::vector<double> samples, double q)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t)(q * (double)samples.size()))];
+}
+
+void Progress(const std::string &msg)
+{
+    std::cerr << msg << std::endl;
+}
+
+std::string CpuModel()
+{
+#if defined(__APPLE__)
+    char buf[256] = {};
+    size_t size = sizeof(buf);
+    if (sysctlbyname("machdep.cpu.brand_string", buf, &size, nullptr, 0) == 0)
+        return buf;
+#elif defined(_WIN32)
+    if (auto *id = std::getenv("PROCESSOR_IDENTIFIER"))
+        return id;
+#else
+    std::ifstream f("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(f, line))
+    {
+        if (line.rfind("model name", 0) == 0 || line.rfind("Model", 0) == 0)
+        {
+            auto colon = line.find(':');
+            if (colon != line.npos)
+                return line.substr(line.find_first_not_of(" \t", colon + 1));
+        }
+    }
+#endif
+    return "unknown";
+}
+
+json Machine()
+{
+    json m;
+    m["cpu"] = CpuModel();
+    m["threads"] = std::thread::hardware_concurrency();
+#ifdef _WIN32
+    m["os"] = "Windows";
+#else
+    utsname u{};
+    if (uname(&u) == 0)
+    {
+        m["os"] = std::string(u.sysname) + " " + u.release;
+        m["arch"] = u.machine;
+    }
+#endif
+    return m;
+}
+
+json Build()
+{
+    json b;
+    b["revision"] = PMDMINI_GUI_REVISION;
+    b["type"] = PMDMINI_GUI_BUILD_TYPE;
+#if defined(__clang__)
+    b["compiler"] = std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+    b["compiler"] = std::string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+    b["compiler"] = "msvc " + std::to_string(_MSC_VER);
+#endif
+    b["engine"] = Engine::Reentrant() ? "reentrant" : "shared";
+    return b;
+}
+
+std::string Timestamp()
+{
+    auto now = std::time(nullptr);
+    char buf[32] = {};
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return buf;
+}
+
+// every song of the corpus, rendered for a while in the decoder's blocks
+json BenchRender(const Options &opt)
+{
+    constexpr int kRate = 44100;
+    constexpr int kBlock = 1024;
+    const int seconds = opt.quick ? 2 : 10;
+
+    std::vector<fs::path> songs;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(opt.corpus, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        if (it->is_regular_file(ec) && IsPmdFile(it->path().filename().string()))
+            songs.push_back(it->path());
+    }
+    std::sort(songs.begin(), songs.end());
+
+    json tracks = json::array();
+    std::vector<double> speeds;
+    std::vector<int16_t> pcm(kBlock * 2);
+    for (auto &song : songs)
+    {
+        auto name = song.lexically_relative(opt.corpus).generic_string();
+        auto dir = song.parent_path().string();
+        Engine engine;
+        auto t0 = Clock::now();
+        if (!engine.Init(dir, kRate) || !engine.Play(song, dir))
+        {
+            tracks.push_back({{"track", name}, {"ok", false}});
+            continue;
+        }
+        double load = Seconds(t0);
+
+        size_t frames = (size_t)kRate * seconds;
+        t0 = Clock::now();
+        for (size_t done = 0; done < frames; done += kBlock)
+            engine.Render(pcm.data(), kBlock);
+        double secs = Seconds(t0);
+        double speed = seconds / secs;
+        speeds.push_back(speed);
+        tracks.push_back({{"track", name},
+                          {"ok", true},
+                          {"load_ms", load * 1000.0},
+                          {"x_realtime", speed}});
+    }
+    Progress("render: " + std::to_string(speeds.size()) + " tracks");
+
+    json out;
+    out["seconds_per_track"] = seconds;
+    out["tracks"] = std::move(tracks);
+    out["x_realtime_min"] = Quantile(speeds, 0.0);
+    out["x_realtime_median"] = Quantile(speeds, 0.5);
+    return out;
+}
+
+// a producer and a consumer thread, like the decoder and the audio callback
+json BenchRing(const Options &opt)
+{
+    constexpr size_t kBlock = 1024;
+    const size_t total = opt.quick ? (1u << 24) : (1u << 27);
+    json out;
+
+    {
+        RingBuffer ring(262144);
+        std::vector<float> in(kBlock, 0.5f);
+        auto t0 = Clock::now();
+        std::thread producer(
+            [&]
+            {
+                for (size_t sent = 0; sent < total;)
+                {
+                    size_t n = ring.Write(in.data(), std::min(kBlock, total - sent));
+                    sent += n;
+                    if (n == 0)
+                        std::this_thread::yield();
+                }
+            });
+        std::vector<float> buf(kBlock);
+        for (size_t got = 0; got < total;)
+        {
+            size_t n = ring.Read(buf.data(), buf.size());
+            got += n;
+            if (n == 0)
+                std::this_thread::yield();
+        }
+        producer.join();
+        out["samples"] = total;
+        out["msamples_per_s"] = (double)total / Seconds(t0) / 1e6;
+    }
+
+    {
+        // one sample there and back through a pair of rings, half of it is the latency
+        const int rounds = opt.quick ? 20000 : 200000;
+        RingBuffer ping(1024), pong(1024);
+        std::atomic<bool> done{false};
+        // a short spin, then the other side gets the core if there's only one
+        auto wait = [](int &spins)
+        {
+            if (++spins > 64)
+                std::this_thread::yield();
+        };
+        std::thread echo(
+            [&]
+            {
+                float v;
+                int spins = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    if (ping.Read(&v, 1) == 1)
+                    {
+                        pong.Write(&v, 1);
+                        spins = 0;
+                    }
+                    else
+                        wait(spins);
+                }
+            });
+        std::vector<double> ns;
+        ns.reserve((size_t)rounds);
+        for (int i = 0; i < rounds; i++)
+        {
+            float v = (float)i, back = 0;
+            auto t0 = Clock::now();
+            ping.Write(&v, 1);
+            int spins = 0;
+            while (pong.Read(&back, 1) == 0)
+                wait(spins);
+            ns.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / 2);
+        }
+        done.store(true);
+        echo.join();
+        out["latency_ns_median"] = Quantile(ns, 0.5);
+        out["latency_ns_p99"] = Quantile(ns, 0.99);
+    }
+    Progress("ring: done");
+    return out;
+}
+
+// dirs x files_per_dir files over a two level tree, a quarter of them not playable
+void MakeTree(const fs::path &root, int dirs, int files_per_dir)
+{
+    fs::remove_all(root);
+    for (int d = 0; d < dirs; d++)
+    {
+        auto dir = root / ("g" + std::to_string(d % 10)) / ("d" + std::to_string(d));
+        fs::create_directories(dir);
+        for (int f = 0; f < files_per_dir; f++)
+            std::ofstream(dir / ("T_" + std::to_string(f) + (f % 4 ? ".M" : ".MDT")));
+    }
+}
+
+json BenchScan(const Options &opt)
+{
+    json out = json::array();
+    std::vector<int> sizes = {100};
+    if (!opt.quick)
+        sizes.push_back(1000);
+    int cores = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    for (int dirs : sizes)
+    {
+        auto root = fs::temp_directory_path() / "pmdmini-gui-bench-scan";
+        MakeTree(root, dirs, 100);
+        for (int threads : {1, cores})
+        {
+            Scanner scanner;
+            scanner.SetThreadCount(threads);
+            auto t0 = Clock::now();
+            scanner.Start(root, true, SortMode::Name);
+            std::vector<TrackEntry> batch;
+            size_t found = 0;
+            while (true)
+            {
+                bool running = scanner.IsRunning();
+                if (scanner.ConsumeBatch(batch))
+                    found += batch.size();
+                else if (!running)
+                    break;
+                else
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            double secs = Seconds(t0);
+            out.push_back({{"files", dirs * 100},
+                           {"threads", threads},
+                           {"found", found},
+                           {"ms", secs * 1000.0},
+                           {"files_per_s", (double)found / secs}});
+            if (threads == cores)
+                break;
+        }
+        fs::remove_all(root);
+        Progress("scan: " + std::to_string(dirs * 100) + " files");
+    }
+    return out;
+}
+
+// synthetic entries with metadata, some of them matching the searches below
+std::vector<TrackEntry> MakeEntries(size_t count)
+{
+    static const char *kComposers[] = {"ZUN", "KAJA", "M.Kajihara", "Y.Kobayashi"};
+    std::mt19937 rng(42);
+    std::vector<TrackEntry> entries(count);
+    auto base = fs::file_time_type::clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        auto &e = entries[i];
+        auto folder = "/music/album_" + std::to_string(rng() % (count / 16 + 1));
+        e.path = folder + "/T_" + std::to_string(rng() % 100000) + "_" + std::to_string(i) + ".M";
+        e.display_name = e.path.filename().string();
+        e.size = 1000 + rng() % 60000;
+        e.modified = base - std::chrono::seconds(rng() % 10000000);
+        auto info = std::make_shared<SongInfo>();
+        info->title = "Song " + std::to_string(i % 5000) + " of the eastern wonderland";
+        info->composer = kComposers[i % 4];
+        e.info = std::move(info);
+        BuildSortKeys(e);
+    }
+    return entries;
+}
+
+json BenchPlaylist(const Options &opt)
+{
+    json out = json::array();
+    std::vector<size_t> sizes = {1000, 100000};
+    if (!opt.quick)
+        sizes.push_back(1000000);
+
+    for (size_t count : sizes)
+    {
+        Playlist playlist;
+        auto entries = MakeEntries(count);
+        auto t0 = Clock::now();
+        playlist.SetItems(std::move(entries));
+        json row;
+        row["entries"] = count;
+        row["add_ms"] = Seconds(t0) * 1000.0;
+
+        const std::pair<const char *, SortMode> modes[] = {{"name", SortMode::Name},
+                                                           {"date", SortMode::Date},
+                                                           {"size", SortMode::Size},
+                                                           {"folder", SortMode::Folder}};
+        for (auto &[label, mode] : modes)
+        {
+            t0 = Clock::now();
+            playlist.Sort(mode);
+            // large lists sort in the background, the new order counts once it's applied
+            if (count >= Playlist::kAsyncSortThreshold)
+            {
+                while (!playlist.ApplyPendingSort())
+                    std::this_thread::yield();
+            }
+            row[std::string("sort_") + label + "_ms"] = Seconds(t0) * 1000.0;
+        }
+
+        // typing into the search box: the one pass over the list a new text costs
+        for (auto [label, text] : {std::pair{"search_hit", "kaja"}, {"search_miss", "zzzz"}})
+        {
+            t0 = Clock::now();
+            playlist.SetFilter(text);
+            row[std::string(label) + "_ms"] = Seconds(t0) * 1000.0;
+            row[std::string(label) + "_rows"] = playlist.RowCount();
+        }
+        playlist.SetFilter("");
+        out.push_back(std::move(row));
+        Progress("playlist: " + std::to_string(count) + " entries");
+    }
+    return out;
+}
+
+// UI::Draw() and ImGui's draw lists, without a backend to hand them to
+json BenchUi(const Options &opt)
+{
+    ImGui::CreateContext();
+    ImGuiIO &io = ImGui::GetIO();
+    io.IniFilename = nullptr;
+    io.DisplaySize = ImVec2(1280, 800);
+    io.DeltaTime = 1.0f / 60.0f;
+    unsigned char *pixels = nullptr;
+    int w = 0, h = 0;
+    io.Fonts->GetTexDataAsRGBA32(&pixels, &w, &h);
+
+    json out = json::array();
+    std::vector<size_t> sizes = {1000, 10000};
+    if (!opt.quick)
+        sizes.push_back(100000);
+    std::vector<float> waveform(2048, 0.25f);
+
+    for (size_t count : sizes)
+    {
+        UI ui;
+        UIState state;
+        Playlist playlist;
+        playlist.SetItems(MakeEntries(count));
+        state.playlist = &playlist;
+        state.selected_index = state.current_index = 0;
+        state.current_track = &playlist.At(0);
+        state.player_state = PlayerState::Playing;
+        state.duration_known = true;
+        state.duration_sec = 180;
+        state.position_sec = 42;
+
+        std::vector<double> us;
+        us.reserve(300);
+        uint64_t allocs = 0;
+        auto start = Clock::now();
+        for (int frame = 0; frame < 300 && (frame < 10 || Seconds(start) < 2.0); frame++)
+        {
+            UIActions actions;
+            auto t0 = Clock::now();
+            auto allocs0 = AllocCounter::ThisThread();
+            ImGui::NewFrame();
+            ui.Draw(state, actions, waveform.data(), waveform.size());
+            ImGui::Render();
+            // the first frames lay out the windows
+            if (frame >= 3)
+            {
+                allocs += AllocCounter::ThisThread() - allocs0;
+                us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+            }
+        }
+        json row = {{"tracks", count},
+                    {"frames", us.size()},
+                    {"frame_us_median", Quantile(us, 0.5)},
+                    {"frame_us_p99", Quantile(us, 0.99)}};
+        // operator new only, ImGui's own buffers come from malloc
+        if (AllocCounter::kCompiledIn)
+            row["allocs_per_frame"] = us.empty() ? 0.0 : (double)allocs / us.size();
+        out.push_back(std::move(row));
+        Progress("ui: " + std::to_string(count) + " tracks");
+    }
+    ImGui::DestroyContext();
+    return out;
+}
+
+int Usage()
+{
+    std::cerr << "usage: pmdmini-gui-bench [--corpus DIR] [--out FILE] [--quick] "
+                 "[--only render|ring|scan|playlist|ui]...\n";
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--corpus" && has_value)
+            opt.corpus = argv[++i];
+        else if (arg == "--out" && has_value)
+            opt.out = argv[++i];
+        else if (arg == "--only" && has_value)
+            opt.only.insert(argv[++i]);
+        else if (arg == "--quick")
+            opt.quick = true;
+        else
+            return Usage();
+    }
+
+    json report;
+    report["schema"] = 1;
+    report["started"] = Timestamp();
+    report["machine"] = Machine();
+    report["build"] = Build();
+    report["quick"] = opt.quick;
+
+    json &results = report["results"];
+    if (opt.Runs("render"))
+        results["render"] = BenchRender(opt);
+    if (opt.Runs("ring"))
+        results["ring"] = BenchRing(opt);
+    if (opt.Runs("scan"))
+        results["scan"] = BenchScan(opt);
+    if (opt.Runs("playlist"))
+        results["playlist"] = BenchPlaylist(opt);
+    if (opt.Runs("ui"))
+        results["ui"] = BenchUi(opt);
+
+    auto text = report.dump(2);
+    if (opt.out.empty())
+    {
+        std::cout << text << std::endl;
+        return 0;
+    }
+    std::ofstream f(opt.out);
+    f << text << '\n';
+    return f ? 0 : 1;
+}
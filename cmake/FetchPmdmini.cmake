@@ -19,4 +19,55 @@ if (TARGET pmdmini)
   if(WIN32)
     target_compile_definitions(pmdmini PRIVATE NOMINMAX)
   endif()
+
+  # pmdmini drives one PMDWin instance through globals. pmd_engine.cpp gives every
+  # Engine (src/engine.h) an instance of its own, which needs the PMDWin class where we
+  # expect it. PMDMINI_GUI_SHARED_DRIVER builds without it, engines then take turns on
+  # pmdmini's driver and variant switches pre-roll on the decode thread
+  if (PMDMINI_GUI_SHARED_DRIVER)
+    message(STATUS "pmdmini: engines share one driver (PMDMINI_GUI_SHARED_DRIVER)")
+    return()
+  endif()
+
+  file(GLOB_RECURSE PMDMINI_HEADERS "${pmdmini_SOURCE_DIR}/*.h")
+  set(PMDMINI_INCLUDE_DIRS "")
+  foreach(header ${PMDMINI_HEADERS})
+    get_filename_component(dir "${header}" DIRECTORY)
+    list(APPEND PMDMINI_INCLUDE_DIRS "${dir}")
+  endforeach()
+  list(REMOVE_DUPLICATES PMDMINI_INCLUDE_DIRS)
+
+  include(CheckCXXSourceCompiles)
+  set(CMAKE_REQUIRED_INCLUDES ${PMDMINI_INCLUDE_DIRS})
+  set(CMAKE_TRY_COMPILE_TARGET_TYPE STATIC_LIBRARY)
+  check_cxx_source_compiles("
+    #include \"pmdwin.h\"
+    void probe(char *path, short *buf)
+    {
+      PMDWIN driver;
+      char *dirs[2] = {path, nullptr};
+      int length, loop;
+      driver.init(path);
+      driver.setpcmrate(44100);
+      driver.setpcmdir(dirs);
+      driver.getlength(path, &length, &loop);
+      if (driver.music_load(path) == PMDWIN_OK)
+        driver.music_start();
+      driver.getpcmdata(buf, 1);
+      driver.music_stop();
+    }" PMDMINI_GUI_HAS_PMDWIN)
+  unset(CMAKE_REQUIRED_INCLUDES)
+  unset(CMAKE_TRY_COMPILE_TARGET_TYPE)
+
+  if (PMDMINI_GUI_HAS_PMDWIN)
+    target_sources(pmdmini PRIVATE ${CMAKE_CURRENT_LIST_DIR}/pmdmini/pmd_engine.cpp)
+    target_include_directories(pmdmini
+      PRIVATE ${PMDMINI_INCLUDE_DIRS}
+      PUBLIC ${CMAKE_CURRENT_LIST_DIR}/pmdmini)
+    target_compile_definitions(pmdmini PUBLIC PMDMINI_GUI_ENGINE)
+  else()
+    message(FATAL_ERROR "pmdmini: PMDWin class not found in ${pmdmini_SOURCE_DIR}, the "
+                        "reentrant driver can't be built. Configure with "
+                        "-DPMDMINI_GUI_SHARED_DRIVER=ON to have engines share one driver")
+  endif()
 endif()
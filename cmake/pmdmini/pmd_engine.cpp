@@ -0,0 +1,87 @@
+#include "pmd_engine.h"
+#include "pmdwin.h"
+#include <chrono>
+#include <mutex>
+#include <new>
+
+// pmdmini.c drives a single PMDWIN through globals. the class itself keeps all of its state
+// in the instance, only fmgen's shared lookup tables are built on first use
+struct pmd_engine
+{
+    PMDWIN driver;
+    int length_ms = 0;
+    int loop_ms = 0;
+    double load_ms = 0;
+};
+
+namespace
+{
+
+// creating a driver may build the static tables, loading a song sets the rate on them
+std::mutex g_setup;
+
+} // namespace
+
+pmd_engine *pmd_engine_create(const char *pcmdir, int rate)
+{
+    std::lock_guard lock(g_setup);
+    auto *engine = new (std::nothrow) pmd_engine;
+    if (!engine)
+        return nullptr;
+
+    // missing rhythm samples only silence the rhythm part, as with pmd_init()
+    engine->driver.init(const_cast<char *>(pcmdir));
+    engine->driver.setpcmrate(rate);
+    return engine;
+}
+
+void pmd_engine_destroy(pmd_engine *engine)
+{
+    delete engine;
+}
+
+int pmd_engine_play(pmd_engine *engine, const char *file, const char *pcmdir)
+{
+    std::lock_guard lock(g_setup);
+    char *dirs[2] = {const_cast<char *>(pcmdir), nullptr};
+    engine->driver.setpcmdir(dirs);
+
+    // same order as pmd_play(): measure, then load and start
+    char *path = const_cast<char *>(file);
+    if (!engine->driver.getlength(path, &engine->length_ms, &engine->loop_ms))
+        engine->length_ms = engine->loop_ms = 0;
+    auto start = std::chrono::steady_clock::now();
+    int result = engine->driver.music_load(path);
+    engine->load_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    if (result != PMDWIN_OK)
+        return 1;
+    engine->driver.music_start();
+    return 0;
+}
+
+void pmd_engine_render(pmd_engine *engine, short *buf, int frames)
+{
+    engine->driver.getpcmdata(buf, frames);
+}
+
+void pmd_engine_stop(pmd_engine *engine)
+{
+    engine->driver.music_stop();
+}
+
+int pmd_engine_length_sec(const pmd_engine *engine)
+{
+    return engine->length_ms / 1000;
+}
+
+int pmd_engine_loop_sec(const pmd_engine *engine)
+{
+    return engine->loop_ms / 1000;
+}
+
+double pmd_engine_load_ms(const pmd_engine *engine)
+{
+    return engine->load_ms;
+}
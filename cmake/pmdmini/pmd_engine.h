@@ -0,0 +1,30 @@
+#pragma once
+
+// independent PMD drivers on top of pmdmini's PMDWin core. every handle owns its driver,
+// OPNA and PCM drivers, so different handles may be used on different threads at once.
+// added to the pmdmini target by FetchPmdmini.cmake, which also defines PMDMINI_GUI_ENGINE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pmd_engine pmd_engine;
+
+// loads the YM2608 rhythm samples from pcmdir. null on failure
+pmd_engine *pmd_engine_create(const char *pcmdir, int rate);
+void pmd_engine_destroy(pmd_engine *engine);
+
+// 0 on success, like pmd_play()
+int pmd_engine_play(pmd_engine *engine, const char *file, const char *pcmdir);
+// interleaved stereo
+void pmd_engine_render(pmd_engine *engine, short *buf, int frames);
+void pmd_engine_stop(pmd_engine *engine);
+int pmd_engine_length_sec(const pmd_engine *engine);
+int pmd_engine_loop_sec(const pmd_engine *engine);
+// milliseconds the last pmd_engine_play() spent in the driver's music_load(), which reads
+// the song and its PCM banks
+double pmd_engine_load_ms(const pmd_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif
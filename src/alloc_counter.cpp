@@ -0,0 +1,106 @@
+#include "alloc_counter.h"
+
+#ifdef PMDMINI_GUI_COUNT_ALLOCS
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+
+// plain data, usable before the thread's other statics are set up and after they are gone
+thread_local uint64_t t_allocs = 0;
+
+void *Allocate(std::size_t size)
+{
+    t_allocs++;
+    if (size == 0)
+        size = 1;
+    for (;;)
+    {
+        if (void *p = std::malloc(size))
+            return p;
+        auto handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *AllocateNoThrow(std::size_t size) noexcept
+{
+    try
+    {
+        return Allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+} // namespace
+
+// the aligned forms are left to the library, they pair with its own delete
+void *operator new(std::size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return AllocateNoThrow(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return AllocateNoThrow(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+uint64_t AllocCounter::ThisThread()
+{
+    return t_allocs;
+}
+
+#else
+
+uint64_t AllocCounter::ThisThread()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+// heap allocations through operator new, counted per thread: what the frame loop or an
+// audio callback allocated. only in builds configured with PMDMINI_GUI_COUNT_ALLOCS, which
+// replace the global operator new and delete with counting ones over malloc
+class AllocCounter
+{
+  public:
+#ifdef PMDMINI_GUI_COUNT_ALLOCS
+    static constexpr bool kCompiledIn = true;
+#else
+    static constexpr bool kCompiledIn = false;
+#endif
+
+    // allocations the calling thread made so far, always 0 without the counter
+    static uint64_t ThisThread();
+};
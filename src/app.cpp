@@ -1,10 +1,12 @@
 #include "app.h"
+#include "alloc_counter.h"
 #include "icon_data.h"
 #include "logger.h"
-#include "utils.h"
+#include "trace.h"
 #include <SDL.h>
 #include <SDL_opengl.h>
 #include <algorithm>
+#include <cstdio>
 #include <cstdlib>
 #include <imgui.h>
 #include <imgui_impl_opengl3.h>
@@ -14,31 +16,50 @@
 namespace
 {
 
-int MapIndexToVisible(int idx, const std::vector<int> &map)
-{
-    for (size_t i = 0; i < map.size(); i++)
-    {
-        if (map[i] == idx)
-            return (int)i;
-    }
-    return -1;
-}
+// how long the pointer rests on a row before its intro plays
+constexpr auto kPreviewDelay = std::chrono::milliseconds(600);
 
-std::filesystem::path GetConfigPath()
+// where the settings, library and caches go
+std::filesystem::path GetDataDir()
 {
 #ifdef _WIN32
     auto appdata = std::getenv("APPDATA");
     if (!appdata)
-        return "config.json";
-    return std::filesystem::path(appdata) / "pmdmini-gui" / "config.json";
+        return {};
+    return std::filesystem::path(appdata) / "pmdmini-gui";
 #else
     auto home = std::getenv("HOME");
     if (!home)
-        return "config.json";
-    return std::filesystem::path(home) / ".config" / "pmdmini-gui" / "config.json";
+        return {};
+    return std::filesystem::path(home) / ".config" / "pmdmini-gui";
 #endif
 }
 
+std::filesystem::path GetConfigPath(const std::filesystem::path &data_dir)
+{
+    return data_dir / "config.json";
+}
+
+std::filesystem::path GetLibraryPath(const std::filesystem::path &data_dir)
+{
+    return data_dir / "library.bin";
+}
+
+std::filesystem::path GetInfoCachePath(const std::filesystem::path &data_dir)
+{
+    return data_dir / "metadata.bin";
+}
+
+std::filesystem::path GetTracePath(const std::filesystem::path &data_dir)
+{
+    return data_dir / "trace.json";
+}
+
+std::filesystem::path GetUnderrunDir(const std::filesystem::path &data_dir)
+{
+    return data_dir / "underruns";
+}
+
 void EnsureParentDir(const std::filesystem::path &p)
 {
     std::error_code ec;
@@ -51,12 +72,14 @@ void App::SyncConfig()
 {
     config_.last_directory = directory_;
     config_.recursive_scan = recursive_;
-    config_.shuffle = shuffle_;
-    config_.repeat = repeat_;
+    config_.shuffle = sequencer_.Shuffle();
+    config_.repeat = sequencer_.Repeat();
     config_.volume = volume_;
     config_.mute = mute_;
-    config_.crossfade_enabled = crossfade_enabled_;
-    config_.crossfade_duration_ms = crossfade_duration_ms_;
+    config_.crossfade_enabled = sequencer_.CrossfadeEnabled();
+    config_.crossfade_duration_ms = sequencer_.CrossfadeMs();
+    config_.hover_preview = hover_preview_;
+    config_.group_variants = playlist_.Grouping();
 
     if (!audio_devices_.empty())
     {
@@ -65,92 +88,193 @@ void App::SyncConfig()
     }
 }
 
-App::App()
+// a plain scan rebuilds the list as batches stream in. a revalidation keeps the list
+// restored from the index on screen and applies only what changed on disk
+void App::StartScan(bool revalidate)
 {
-    Logger::Init();
+    if (!revalidate)
+    {
+        playlist_.Clear();
+        probe_.Clear();
+    }
+    watcher_.Stop();
+    revalidating_ = revalidate;
+    revalidated_.clear();
+    scanner_.Start(directory_, recursive_, sort_, sort_descending_, library_);
+    scanning_active_ = true;
+    scan_status_count_ = 0;
+    status_ = revalidate ? "Checking library..." : "Scanning...";
 }
 
-App::~App()
+// "Scanning (N)" written into the status line's own buffer, and only when N moved
+void App::ShowScanProgress()
 {
-    Logger::Shutdown();
+    size_t count = playlist_.Size();
+    if (count == scan_status_count_)
+        return;
+    scan_status_count_ = count;
+    char text[48];
+    std::snprintf(text, sizeof(text), "Scanning (%zu)", count);
+    status_.assign(text);
 }
 
-bool App::PlayIndex(int index, bool fade_in)
+void App::FinishScan()
 {
-    auto &items = playlist_.Items();
-    if (index < 0 || index >= (int)items.size())
-        return false;
+    scanning_active_ = false;
+    auto stats = scanner_.Stats();
 
-    auto &entry = items[index];
-    if (!player_.Load(entry.path))
+    if (revalidating_ && stats.Changes() > 0)
     {
-        status_ = "Failed to load track";
-        return false;
+        // only what changed on disk is touched, playback and selection keep their ids
+        probe_.Submit(revalidated_);
+        probing_ = true;
+        playlist_.Revalidate(std::move(revalidated_));
     }
+    revalidating_ = false;
+    revalidated_.clear();
 
-    playlist_.SetCurrent(index);
-    player_.SetVolume(volume_);
-    player_.SetMute(mute_);
-
-    if (fade_in)
+    if (auto index = scanner_.TakeIndex())
     {
-        player_.SetPendingFadeIn(crossfade_duration_ms_);
-        status_ = "Fading in...";
+        library_ = std::move(index);
+        auto library_path = GetLibraryPath(data_dir_);
+        EnsureParentDir(library_path);
+        if (!library_->Save(library_path))
+            Logger::Warn("Failed to save library index");
+
+        // new rips dropped into the folder show up without another scan
+        watcher_.Start(library_);
     }
 
-    player_.Play();
-    if (!fade_in)
-        status_ = "Playing";
+    status_ = "Scan complete (" + std::to_string(playlist_.Size()) + ", " +
+              std::to_string(stats.dirs_listed) + " dirs read, " +
+              std::to_string(stats.dirs_skipped) + " unchanged)";
+    Logger::Info("Scan: " + std::to_string(stats.dirs_listed) + " dirs listed, " +
+                 std::to_string(stats.dirs_skipped) + " skipped, " +
+                 std::to_string(stats.files_probed) + " files probed, " +
+                 std::to_string(stats.files_reused) + " reused, " +
+                 std::to_string(stats.files_removed) + " removed");
+}
+
+// shows the library saved by the last scan of this directory, then revalidates it
+bool App::RestoreLibrary()
+{
+    if (directory_.empty())
+        return false;
+
+    auto index = std::make_shared<LibraryIndex>();
+    std::error_code ec;
+    auto root = std::filesystem::weakly_canonical(directory_, ec);
+    if (ec || !index->Load(GetLibraryPath(data_dir_)) || index->root != root ||
+        index->recursive != recursive_)
+        return false;
+
+    library_ = index;
+    auto entries = EntriesFromIndex(*index);
+    probe_.Submit(entries);
+    probing_ = true;
+    // sorted on the way in, unlike SetItems()
+    playlist_.Clear();
+    playlist_.AddBatch(std::move(entries));
+    StartScan(true);
     return true;
 }
 
-void App::PlayNext()
+// attaches probed metadata, saves the cache once a round of probing is done
+void App::UpdateProbe()
 {
-    int next = playlist_.NextIndex(repeat_, shuffle_);
-    if (next < 0)
+    bool idle = probe_.Idle();
+    std::vector<ProbeResult> results;
+    if (probe_.ConsumeResults(results))
     {
-        player_.Stop();
-        status_ = "Playlist ended";
-        return;
+        for (auto &r : results)
+        {
+            if (r.info)
+                playlist_.SetInfo(r.file.path, r.file.size, r.file.modified, std::move(r.info));
+        }
+        playlist_.CollapseDuplicates();
     }
 
-    if (crossfade_enabled_ && player_.GetState() == PlayerState::Playing)
-    {
-        fading_to_next_ = true;
-        pending_next_index_ = next;
-        player_.StartFadeOut(crossfade_duration_ms_);
-        status_ = "Fading out...";
-    }
-    else
+    if (!probing_ || !idle)
+        return;
+    probing_ = false;
+
+    auto stats = probe_.Stats();
+    Logger::Info("Probe: " + std::to_string(stats.parsed) + " parsed, " +
+                 std::to_string(stats.cached) + " cached, " + std::to_string(stats.failed) +
+                 " failed, " + std::to_string((int)stats.FilesPerSecond()) + " files/s, " +
+                 std::to_string(playlist_.FoldedCount()) + " variants and copies folded");
+
+    if (probe_.Cache().Dirty())
     {
-        PlayIndex(next);
+        auto cache_path = GetInfoCachePath(data_dir_);
+        EnsureParentDir(cache_path);
+        if (!probe_.Cache().Save(cache_path))
+            Logger::Warn("Failed to save metadata cache");
     }
 }
 
-void App::BuildVisibleList(std::vector<TrackEntry> &out_tracks, std::vector<int> &out_map) const
+App::App(Clock &clock) : App(nullptr, GetDataDir(), clock)
+{
+}
+
+App::App(std::unique_ptr<AudioSink> sink, std::filesystem::path data_dir, Clock &clock)
+    : clock_(clock), data_dir_(std::move(data_dir)), player_(std::move(sink), clock),
+      sequencer_(player_, playlist_)
+{
+    Logger::Init();
+    waveform_.resize(2048);
+}
+
+App::~App()
+{
+    Logger::Shutdown();
+}
+
+// switches a song to another of its files. the playing one carries on at the same spot
+void App::SelectVariant(TrackId id, int index)
 {
-    out_tracks.clear();
-    out_map.clear();
+    auto variants = playlist_.Variants(id);
+    if (index < 0 || index >= (int)variants.size() ||
+        !playlist_.SetActiveVariant(id, variants[index]->id))
+        return;
 
-    auto &items = playlist_.Items();
-    for (int i = 0; i < (int)items.size(); i++)
+    prefetched_selection_ = kInvalidTrackId;
+    intro_ids_.clear();
+    if (id == playlist_.CurrentId() && player_.SwitchVariant(variants[index]->path))
+        status_ = "Switched to " + variants[index]->display_name;
+}
+
+void App::WriteTrace(const std::filesystem::path &path)
+{
+    if (!Trace::kCompiledIn)
     {
-        if (utils::contains_ignore_case(items[i].display_name, search_))
-        {
-            out_tracks.push_back(items[i]);
-            out_map.push_back(i);
-        }
+        status_ = "Tracing is off in this build (PMDMINI_GUI_TRACE)";
+        return;
     }
+    EnsureParentDir(path);
+    if (Trace::WriteChromeJson(path))
+        status_ = "Trace written to " + path.string();
+    else
+        status_ = "Failed to write " + path.string();
+    Logger::Info(status_);
 }
 
-void App::UpdateUIState(UIState &state, const std::vector<int> &visible_map) const
+// status lines from playback go over whatever the app said before
+void App::PullStatus()
+{
+    if (auto status = sequencer_.TakeStatus(); !status.empty())
+        status_ = std::move(status);
+}
+
+void App::UpdateUIState(UIState &state) const
 {
     state.directory = directory_;
     state.recursive = recursive_;
     state.search = search_;
     state.sort = sort_;
-    state.shuffle = shuffle_;
-    state.repeat = repeat_;
+    state.sort_descending = sort_descending_;
+    state.shuffle = sequencer_.Shuffle();
+    state.repeat = sequencer_.Repeat();
     state.volume = volume_;
     state.mute = mute_;
     state.audio_devices = audio_devices_;
@@ -159,21 +283,35 @@ void App::UpdateUIState(UIState &state, const std::vector<int> &visible_map) con
     state.status = status_;
     state.scanning = scanning_active_;
 
-    auto info = player_.GetTrackInfo();
+    auto info = player_.GetTrackLength();
     float sr = info.sample_rate > 0 ? (float)info.sample_rate : 44100.0f;
 
     state.position_sec = player_.GetPositionSamples() / sr;
     state.duration_known = info.duration_known;
     state.duration_sec = info.duration_known ? info.duration_samples / sr : 0.0f;
 
-    state.selected_index = MapIndexToVisible(playlist_.SelectedIndex(), visible_map);
-    state.current_index = MapIndexToVisible(playlist_.CurrentIndex(), visible_map);
-    state.crossfade_enabled = crossfade_enabled_;
-    state.crossfade_duration_ms = crossfade_duration_ms_;
+    state.playlist = &playlist_;
+    state.selected_index = playlist_.RowOf(playlist_.SelectedIndex());
+    state.current_index = playlist_.RowOf(playlist_.CurrentIndex());
+    state.current_track = playlist_.Find(playlist_.CurrentId());
+    state.crossfade_enabled = sequencer_.CrossfadeEnabled();
+    state.crossfade_duration_ms = sequencer_.CrossfadeMs();
+    state.hover_preview = hover_preview_;
+    state.group_variants = playlist_.Grouping();
+
+    TrackId selected = playlist_.SelectedId();
+    playlist_.Variants(selected, state.variants);
+    auto active = std::find(state.variants.begin(), state.variants.end(),
+                            playlist_.ActiveVariant(selected));
+    state.variant_index =
+        active != state.variants.end() ? (int)(active - state.variants.begin()) : -1;
+
+    state.perf_overlay = perf_overlay_;
+    if (perf_overlay_)
+        state.perf = perf_view_;
 }
 
-bool App::HandleActions(const UIActions &actions, const std::vector<int> &visible_map,
-                        std::chrono::steady_clock::time_point now)
+bool App::HandleActions(const UIActions &actions, std::chrono::steady_clock::time_point now)
 {
     bool changed = false;
 
@@ -195,14 +333,19 @@ bool App::HandleActions(const UIActions &actions, const std::vector<int> &visibl
     if (actions.sort_changed)
     {
         sort_ = actions.sort;
-        playlist_.Sort(sort_);
+        sort_descending_ = actions.sort_descending;
+        playlist_.Sort(sort_, sort_descending_);
     }
 
-    if (actions.select_index >= 0 && actions.select_index < (int)visible_map.size())
-        playlist_.SetSelected(visible_map[actions.select_index]);
+    // before a click in the list moves the selection the variants belong to
+    if (actions.select_variant >= 0)
+        SelectVariant(playlist_.SelectedId(), actions.select_variant);
+
+    if (actions.select_index >= 0)
+        playlist_.SetSelected(playlist_.RowIndex(actions.select_index));
 
     if (actions.play_selected)
-        PlayIndex(playlist_.SelectedIndex());
+        sequencer_.PlayIndex(playlist_.SelectedIndex());
 
     if (actions.toggle_play_pause)
     {
@@ -212,51 +355,39 @@ bool App::HandleActions(const UIActions &actions, const std::vector<int> &visibl
         else if (st == PlayerState::Paused)
             player_.Play();
         else
-            PlayIndex(playlist_.SelectedIndex());
+            sequencer_.PlayIndex(playlist_.SelectedIndex());
     }
 
     if (actions.stop)
         player_.Stop();
 
     if (actions.next)
-        PlayNext();
+        sequencer_.PlayNext();
 
     if (actions.prev)
-    {
-        int prev = playlist_.PrevIndex(repeat_);
-        if (prev >= 0)
-        {
-            if (crossfade_enabled_ && player_.GetState() == PlayerState::Playing)
-            {
-                fading_to_next_ = true;
-                pending_next_index_ = prev;
-                player_.StartFadeOut(crossfade_duration_ms_);
-                status_ = "Fading out...";
-            }
-            else
-            {
-                PlayIndex(prev);
-            }
-        }
-    }
+        sequencer_.PlayPrev();
 
     if (actions.shuffle_toggled)
     {
-        shuffle_ = !shuffle_;
+        sequencer_.SetShuffle(!sequencer_.Shuffle());
         changed = true;
     }
 
     if (actions.repeat_cycle)
     {
-        if (repeat_ == RepeatMode::Off)
-            repeat_ = RepeatMode::One;
-        else if (repeat_ == RepeatMode::One)
-            repeat_ = RepeatMode::All;
+        auto repeat = sequencer_.Repeat();
+        if (repeat == RepeatMode::Off)
+            sequencer_.SetRepeat(RepeatMode::One);
+        else if (repeat == RepeatMode::One)
+            sequencer_.SetRepeat(RepeatMode::All);
         else
-            repeat_ = RepeatMode::Off;
+            sequencer_.SetRepeat(RepeatMode::Off);
         changed = true;
     }
 
+    if ((actions.shuffle_toggled || actions.repeat_cycle) && playlist_.CurrentIndex() >= 0)
+        sequencer_.PrefetchUpcoming();
+
     if (actions.volume_changed)
     {
         volume_ = actions.volume;
@@ -284,24 +415,37 @@ bool App::HandleActions(const UIActions &actions, const std::vector<int> &visibl
 
     if (actions.crossfade_toggled)
     {
-        crossfade_enabled_ = actions.crossfade_enabled;
+        sequencer_.SetCrossfade(actions.crossfade_enabled, sequencer_.CrossfadeMs());
         changed = true;
     }
 
     if (actions.crossfade_duration_changed)
     {
-        crossfade_duration_ms_ = actions.crossfade_duration_ms;
+        sequencer_.SetCrossfade(sequencer_.CrossfadeEnabled(), actions.crossfade_duration_ms);
+        changed = true;
+    }
+
+    if (actions.hover_preview_toggled)
+    {
+        hover_preview_ = actions.hover_preview;
+        changed = true;
+    }
+
+    if (actions.group_variants_toggled)
+    {
+        playlist_.SetGrouping(actions.group_variants);
+        intro_ids_.clear();
         changed = true;
     }
 
+    CacheIntros(actions);
+    UpdateHoverPreview(actions, now);
+
     if (actions.request_scan)
     {
         if (!directory_.empty() && std::filesystem::exists(directory_))
         {
-            playlist_.Clear();
-            scanner_.Start(directory_, recursive_, sort_);
-            scanning_active_ = true;
-            status_ = "Scanning...";
+            StartScan();
         }
         else
         {
@@ -315,6 +459,57 @@ bool App::HandleActions(const UIActions &actions, const std::vector<int> &visibl
     return changed;
 }
 
+// intros of what plays next and of the rows on screen, so a click sounds at once
+void App::CacheIntros(const UIActions &actions)
+{
+    auto &ids = intro_candidates_;
+    ids.clear();
+    ids.push_back(sequencer_.UpcomingId());
+    ids.push_back(playlist_.SelectedId());
+    for (int i = std::max(0, actions.visible_first); i <= actions.visible_last; i++)
+        ids.push_back(playlist_.IdAt(playlist_.RowIndex(i)));
+    ids.erase(std::remove(ids.begin(), ids.end(), kInvalidTrackId), ids.end());
+    if (ids == intro_ids_)
+        return;
+
+    intro_ids_ = ids;
+    std::vector<std::filesystem::path> paths;
+    for (auto id : ids)
+    {
+        if (auto *e = playlist_.ActiveVariant(id))
+            paths.push_back(e->path);
+    }
+    player_.CacheIntros(paths);
+}
+
+void App::UpdateHoverPreview(const UIActions &actions,
+                             std::chrono::steady_clock::time_point now)
+{
+    TrackId hovered = kInvalidTrackId;
+    if (hover_preview_)
+        hovered = playlist_.IdAt(playlist_.RowIndex(actions.hover_index));
+
+    if (hovered != hover_id_)
+    {
+        hover_id_ = hovered;
+        hover_since_ = now;
+        if (previewing_)
+        {
+            player_.StopPreview();
+            previewing_ = false;
+        }
+        return;
+    }
+
+    // the current track is already audible
+    if (hovered == kInvalidTrackId || previewing_ || hovered == playlist_.CurrentId() ||
+        now - hover_since_ < kPreviewDelay)
+        return;
+    // not rendered yet it's asked for again next frame, by then it's first in line
+    if (auto *e = playlist_.ActiveVariant(hovered))
+        previewing_ = player_.Preview(e->path);
+}
+
 void App::HandleShortcuts(bool capture_keyboard, const SDL_Event &ev)
 {
     if (capture_keyboard)
@@ -333,13 +528,25 @@ void App::HandleShortcuts(bool capture_keyboard, const SDL_Event &ev)
         else if (st == PlayerState::Paused)
             player_.Play();
         else
-            PlayIndex(playlist_.SelectedIndex());
+            sequencer_.PlayIndex(playlist_.SelectedIndex());
         return;
     }
 
     if (key == SDLK_RETURN)
     {
-        PlayIndex(playlist_.SelectedIndex());
+        sequencer_.PlayIndex(playlist_.SelectedIndex());
+        return;
+    }
+
+    // next variant of the playing song, or of the selected one when nothing plays
+    if (key == SDLK_v)
+    {
+        TrackId id = player_.GetState() != PlayerState::Stopped ? playlist_.CurrentId()
+                                                                : playlist_.SelectedId();
+        auto variants = playlist_.Variants(id);
+        auto active = std::find(variants.begin(), variants.end(), playlist_.ActiveVariant(id));
+        if (variants.size() > 1 && active != variants.end())
+            SelectVariant(id, (int)((active - variants.begin() + 1) % variants.size()));
         return;
     }
 
@@ -349,6 +556,18 @@ void App::HandleShortcuts(bool capture_keyboard, const SDL_Event &ev)
         return;
     }
 
+    if (key == SDLK_F3)
+    {
+        TogglePerfOverlay();
+        return;
+    }
+
+    if (key == SDLK_F4)
+    {
+        WriteTrace(GetTracePath(data_dir_));
+        return;
+    }
+
     if (key == SDLK_UP)
     {
         int sel = playlist_.SelectedIndex();
@@ -360,32 +579,123 @@ void App::HandleShortcuts(bool capture_keyboard, const SDL_Event &ev)
     if (key == SDLK_DOWN)
     {
         int sel = playlist_.SelectedIndex();
-        int count = (int)playlist_.Items().size();
+        int count = (int)playlist_.Size();
         if (sel < count - 1)
             playlist_.SetSelected(sel + 1);
         return;
     }
 }
 
-int App::Run()
+// the timers only count while the overlay is open, the first second starts now
+void App::TogglePerfOverlay()
 {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO) != 0)
-    {
-        Logger::Error("SDL init failed");
-        return 1;
-    }
+    perf_overlay_ = !perf_overlay_;
+    PerfTimer::SetEnabled(perf_overlay_ || metrics_server_.IsRunning());
+    perf_view_ = {};
+    perf_mark_ = TakePerfMark();
+}
 
-    auto config_path = GetConfigPath();
-    config_.Load(config_path);
+App::PerfMark App::TakePerfMark() const
+{
+    PerfMark mark;
+    mark.at = clock_.Now();
+    auto &perf = player_.GetPerf();
+    mark.decode = perf.decode.Take();
+    mark.decoded_ns = perf.decoded_ns.load(std::memory_order_relaxed);
+    mark.callback = perf.callback.Take();
+    mark.jitter = perf.jitter.Take();
+    mark.frame_build = frame_build_.Take();
+    mark.frame_swap = frame_swap_.Take();
+    mark.frame_allocs = frame_allocs_;
+    mark.callback_allocs = perf.callback_allocs.load(std::memory_order_relaxed);
+    auto scan = scanner_.Stats();
+    mark.scanned = scan.files_probed + scan.files_reused;
+    auto probe = probe_.Stats();
+    mark.probed = probe.parsed + probe.cached + probe.failed;
+    return mark;
+}
+
+void App::UpdatePerf()
+{
+    constexpr size_t kFillFrames = 300; // 5 s at 60 fps
+    auto &fill = perf_view_.buffer_fill;
+    if (fill.size() >= kFillFrames)
+        fill.erase(fill.begin());
+    fill.push_back(player_.GetBufferFill());
+    perf_view_.underruns = player_.GetUnderruns();
+
+    if (clock_.Now() - perf_mark_.at < std::chrono::seconds(1))
+        return;
+
+    auto mark = TakePerfMark();
+    auto &last = perf_mark_;
+    double seconds = std::chrono::duration<double>(mark.at - last.at).count();
+    perf_view_.decode = mark.decode.Since(last.decode);
+    uint64_t decoded_ns = mark.decoded_ns - last.decoded_ns;
+    perf_view_.decode_load = decoded_ns > 0 ? (double)perf_view_.decode.total_ns / decoded_ns : 0;
+    perf_view_.callback = mark.callback.Since(last.callback);
+    perf_view_.jitter = mark.jitter.Since(last.jitter);
+    perf_view_.frame_build = mark.frame_build.Since(last.frame_build);
+    perf_view_.frame_swap = mark.frame_swap.Since(last.frame_swap);
+    auto per = [](uint64_t allocs, uint64_t count) { return count ? (double)allocs / count : 0; };
+    perf_view_.frame_allocs =
+        per(mark.frame_allocs - last.frame_allocs, perf_view_.frame_build.count);
+    perf_view_.callback_allocs =
+        per(mark.callback_allocs - last.callback_allocs, perf_view_.callback.count);
+    // a new scan counts from zero again
+    auto rate = [&](size_t now, size_t before)
+    { return (double)(now >= before ? now - before : now) / seconds; };
+    perf_view_.scan_files_per_sec = rate(mark.scanned, last.scanned);
+    perf_view_.probe_files_per_sec = rate(mark.probed, last.probed);
+    perf_mark_ = mark;
+}
+
+void App::StartMetrics(int port)
+{
+    using R = MetricsRegistry;
+    player_.RegisterMetrics(metrics_);
+    scanner_.RegisterMetrics(metrics_);
+    playlist_.RegisterMetrics(metrics_);
+    metrics_.AddGauge("pmdmini_playlist_tracks", "Tracks listed", R::Value(metric_tracks_));
+    metrics_.AddCounter("pmdmini_metadata_parsed_total", "Songs whose metadata was read",
+                        [this] { return (double)probe_.Stats().parsed; });
+    metrics_.AddCounter("pmdmini_metadata_cache_hits_total",
+                        "Songs whose metadata came from the cache",
+                        [this] { return (double)probe_.Stats().cached; });
+    metrics_.AddCounter("pmdmini_metadata_failed_total", "Songs whose metadata was unreadable",
+                        [this] { return (double)probe_.Stats().failed; });
+    metrics_.AddHistogram("pmdmini_frame_build_seconds", "Building a UI frame, up to the swap",
+                          frame_build_);
+    metrics_.AddHistogram("pmdmini_frame_swap_seconds", "Swapping a UI frame", frame_swap_);
+    metrics_.AddGauge("process_resident_memory_bytes", "Resident memory size in bytes",
+                      &MetricsRegistry::ResidentBytes);
+
+    // the timings behind the histograms are kept from now on, overlay or not
+    if (metrics_server_.Start(port))
+        PerfTimer::SetEnabled(true);
+}
+
+void App::Start()
+{
+    config_.Load(GetConfigPath(data_dir_));
 
     directory_ = config_.last_directory;
     recursive_ = config_.recursive_scan;
-    shuffle_ = config_.shuffle;
-    repeat_ = config_.repeat;
+    sequencer_.SetShuffle(config_.shuffle);
+    sequencer_.SetRepeat(config_.repeat);
     volume_ = config_.volume;
     mute_ = config_.mute;
-    crossfade_enabled_ = config_.crossfade_enabled;
-    crossfade_duration_ms_ = config_.crossfade_duration_ms;
+    player_.SetVolume(volume_);
+    player_.SetMute(mute_);
+    sequencer_.SetCrossfade(config_.crossfade_enabled, config_.crossfade_duration_ms);
+    hover_preview_ = config_.hover_preview;
+    player_.SetIntroBudget((size_t)std::max(0, config_.intro_cache_mb) << 20);
+    playlist_.SetGrouping(config_.group_variants);
+    player_.SetRenderProcess(config_.render_process);
+    if (config_.underrun_reports)
+        player_.SetUnderrunReports(GetUnderrunDir(data_dir_));
+    if (config_.metrics_port > 0)
+        StartMetrics(config_.metrics_port);
 
     audio_devices_ = Player::ListOutputDevices();
     audio_device_index_ = 0;
@@ -400,6 +710,104 @@ int App::Run()
     if (!audio_devices_.empty())
         player_.SetOutputDevice(audio_devices_[audio_device_index_]);
 
+    status_ = "Ready";
+    probe_.Cache().Load(GetInfoCachePath(data_dir_));
+    RestoreLibrary();
+}
+
+void App::Frame(std::chrono::steady_clock::time_point now, UIActions &actions)
+{
+    // scanner batches. checked before consuming so the last batch isn't missed
+    bool scan_done = scanning_active_ && !scanner_.IsRunning();
+    std::vector<TrackEntry> batch;
+    std::vector<size_t> runs;
+    if (scanner_.ConsumeBatch(batch, revalidating_ ? nullptr : &runs))
+    {
+        if (revalidating_)
+        {
+            revalidated_.insert(revalidated_.end(), std::make_move_iterator(batch.begin()),
+                                std::make_move_iterator(batch.end()));
+        }
+        else
+        {
+            // batches are sorted runs, merging keeps the list ordered during the scan
+            probe_.Submit(batch);
+            probing_ = true;
+            playlist_.AddBatch(std::move(batch), runs);
+            ShowScanProgress();
+        }
+    }
+
+    if (scan_done)
+        FinishScan();
+
+    WatchChanges changes;
+    if (watcher_.ConsumeChanges(changes))
+    {
+        status_ = "Library updated (+" + std::to_string(changes.upserts.size()) + " -" +
+                  std::to_string(changes.removed.size()) + ")";
+        probe_.Submit(changes.upserts);
+        probing_ = true;
+        playlist_.ApplyChanges(std::move(changes.upserts), changes.removed);
+    }
+
+    UpdateProbe();
+
+    // background sort finished
+    playlist_.ApplyPendingSort();
+
+    // a selected row is likely to be played next
+    if (playlist_.SelectedId() != prefetched_selection_)
+    {
+        prefetched_selection_ = playlist_.SelectedId();
+        if (auto *e = playlist_.ActiveVariant(prefetched_selection_))
+            player_.Prefetch(e->path);
+    }
+
+    sequencer_.Update();
+    PullStatus();
+    metric_tracks_.store(playlist_.Size(), std::memory_order_relaxed);
+
+    auto waveform_count = player_.ReadWaveform(waveform_.data(), waveform_.size());
+
+    // the search rows only go through the list when the text changed
+    playlist_.SetFilter(search_);
+
+    if (perf_overlay_)
+        UpdatePerf();
+
+    // kept from the frame before, a steady frame allocates nothing
+    UpdateUIState(ui_state_);
+    ui_.Draw(ui_state_, actions, waveform_.data(), waveform_count);
+
+    if (actions.request_browse)
+    {
+        auto folder = tinyfd_selectFolderDialog(
+            "Select PMD folder", directory_.empty() ? nullptr : directory_.c_str());
+
+        if (folder)
+        {
+            directory_ = folder;
+            config_.MarkDirty(now);
+            StartScan();
+        }
+    }
+
+    HandleActions(actions, now);
+    PullStatus();
+}
+
+int App::Run()
+{
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO) != 0)
+    {
+        Logger::Error("SDL init failed");
+        return 1;
+    }
+
+    auto config_path = GetConfigPath(data_dir_);
+    Start();
+
     // opengl
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -441,17 +849,18 @@ int App::Run()
     ImGui_ImplSDL2_InitForOpenGL(window, gl_ctx);
     ImGui_ImplOpenGL3_Init("#version 150");
 
-    status_ = "Ready";
-    waveform_.resize(2048);
-
+    TRACE_THREAD("main");
     bool running = true;
     while (running)
     {
-        auto now = std::chrono::steady_clock::now();
+        TRACE_SCOPE("App::Frame");
+        auto now = clock_.Now();
+        auto allocs = AllocCounter::ThisThread();
 
         SDL_Event ev;
         while (SDL_PollEvent(&ev))
         {
+            TRACE_SCOPE("App::Event");
             ImGui_ImplSDL2_ProcessEvent(&ev);
 
             if (ev.type == SDL_QUIT)
@@ -466,136 +875,32 @@ int App::Run()
                 {
                     directory_ = p.string();
                     config_.MarkDirty(now);
-                    playlist_.Clear();
-                    scanner_.Start(directory_, recursive_, sort_);
-                    scanning_active_ = true;
-                    status_ = "Scanning...";
+                    StartScan();
                 }
                 else if (IsPmdFile(p.filename().string()))
                 {
                     TrackEntry entry;
                     entry.display_name = p.filename().string();
                     entry.path = std::filesystem::absolute(p);
-                    playlist_.Add(entry);
-                    playlist_.SetSelected((int)playlist_.Items().size() - 1);
-                    PlayIndex(playlist_.SelectedIndex());
+                    std::error_code ec;
+                    entry.size = std::filesystem::file_size(p, ec);
+                    entry.modified = std::filesystem::last_write_time(p, ec);
+                    probe_.Submit(std::vector<TrackEntry>{entry});
+                    probing_ = true;
+                    playlist_.SetSelectedId(playlist_.Add(entry));
+                    sequencer_.PlayIndex(playlist_.SelectedIndex());
                 }
             }
 
             HandleShortcuts(ImGui::GetIO().WantCaptureKeyboard, ev);
         }
 
-        // scanner batches
-        std::vector<TrackEntry> batch;
-        if (scanner_.ConsumeBatch(batch))
-        {
-            for (auto &e : batch)
-                playlist_.Add(e);
-            status_ = "Scanning (" + std::to_string(playlist_.Items().size()) + ")";
-        }
-
-        if (!scanner_.IsRunning() && scanning_active_)
-        {
-            scanning_active_ = false;
-            playlist_.Sort(sort_);
-            status_ = "Scan complete (" + std::to_string(playlist_.Items().size()) + ")";
-        }
-
-        // update status when fade in finishes
-        if (status_ == "Fading in..." && !player_.IsFadingIn())
-            status_ = "Playing";
-
-        // crossfade: anticipate track end and start fading out early
-        if (crossfade_enabled_ && !fading_to_next_ &&
-            player_.GetState() == PlayerState::Playing)
-        {
-            auto info = player_.GetTrackInfo();
-            if (info.duration_known)
-            {
-                float sr = info.sample_rate > 0 ? (float)info.sample_rate : 44100.0f;
-                float pos_sec = player_.GetPositionSamples() / sr;
-                float dur_sec = info.duration_samples / sr;
-                float remaining_ms = (dur_sec - pos_sec) * 1000.0f;
-
-                if (remaining_ms <= crossfade_duration_ms_ && remaining_ms > 0)
-                {
-                    int next = playlist_.NextIndex(repeat_, shuffle_);
-                    if (next >= 0)
-                    {
-                        fading_to_next_ = true;
-                        pending_next_index_ = next;
-                        player_.StartFadeOut((int)remaining_ms);
-                        status_ = "Fading out...";
-                    }
-                }
-            }
-        }
-
-        // fade-out completed: load pending next track with fade in
-        if (fading_to_next_ && player_.IsFadeOutComplete())
-        {
-            fading_to_next_ = false;
-            PlayIndex(pending_next_index_, true);
-            pending_next_index_ = -1;
-        }
-
-        // auto-next on track end (no crossfade, or no next track during fade)
-        if (player_.HasTrackEnded())
-        {
-            if (fading_to_next_)
-            {
-                // fade was in progress but track ended, load the pending track now
-                fading_to_next_ = false;
-                PlayIndex(pending_next_index_, true);
-                pending_next_index_ = -1;
-            }
-            else
-            {
-                int next = playlist_.NextIndex(repeat_, shuffle_);
-                if (next >= 0)
-                    PlayIndex(next);
-                else
-                {
-                    player_.Stop();
-                    status_ = "Playlist ended";
-                }
-            }
-        }
-
-        auto waveform_count = player_.ReadWaveform(waveform_.data(), waveform_.size());
-
-        std::vector<TrackEntry> visible_tracks;
-        std::vector<int> visible_map;
-        BuildVisibleList(visible_tracks, visible_map);
-
-        UIState ui_state;
-        ui_state.tracks = std::move(visible_tracks);
-        UpdateUIState(ui_state, visible_map);
-
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame();
         ImGui::NewFrame();
 
         UIActions actions{};
-        ui_.Draw(ui_state, actions, waveform_.data(), waveform_count);
-
-        if (actions.request_browse)
-        {
-            auto folder = tinyfd_selectFolderDialog(
-                "Select PMD folder", directory_.empty() ? nullptr : directory_.c_str());
-
-            if (folder)
-            {
-                directory_ = folder;
-                config_.MarkDirty(now);
-                playlist_.Clear();
-                scanner_.Start(directory_, recursive_, sort_);
-                scanning_active_ = true;
-                status_ = "Scanning...";
-            }
-        }
-
-        HandleActions(actions, visible_map, now);
+        Frame(now, actions);
 
         if (config_.ShouldSave(now, std::chrono::milliseconds(750)))
         {
@@ -605,20 +910,41 @@ int App::Run()
             config_.Saved();
         }
 
-        ImGui::Render();
+        {
+            TRACE_SCOPE("App::Render");
+            ImGui::Render();
 
-        glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x, (int)ImGui::GetIO().DisplaySize.y);
-        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
+            glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x,
+                       (int)ImGui::GetIO().DisplaySize.y);
+            glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
 
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-        SDL_GL_SwapWindow(window);
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
+        bool timed = PerfTimer::Enabled();
+        auto &recorder = player_.GetUnderrunRecorder();
+        bool recorded = recorder.Active();
+        auto swap_start = timed || recorded ? clock_.Now() : now;
+        if (timed)
+            frame_build_.Add(swap_start - now);
+        {
+            TRACE_SCOPE("SDL_GL_SwapWindow");
+            SDL_GL_SwapWindow(window);
+        }
+        if (timed || recorded)
+        {
+            auto swap = clock_.Now() - swap_start;
+            if (timed)
+                frame_swap_.Add(swap);
+            if (recorded)
+                recorder.Frame(now, swap_start - now, swap);
+        }
+        frame_allocs_ += AllocCounter::ThisThread() - allocs;
 
         // frame limiter - cap at ~60fps if vsync fails
-        auto frame_end = std::chrono::steady_clock::now();
-        auto frame_time = std::chrono::duration_cast<std::chrono::milliseconds>(frame_end - now);
-        if (frame_time.count() < 16)
-            SDL_Delay((Uint32)(16 - frame_time.count()));
+        auto frame_time = clock_.Now() - now;
+        if (frame_time < std::chrono::milliseconds(16))
+            clock_.SleepFor(std::chrono::milliseconds(16) - frame_time);
     }
 
     int w, h, x, y;
@@ -633,6 +959,10 @@ int App::Run()
     EnsureParentDir(config_path);
     config_.Save(config_path);
 
+    if (!trace_output_.empty())
+        WriteTrace(trace_output_);
+    metrics_server_.Stop();
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -1,58 +1,140 @@
 #pragma once
 
+#include "clock.h"
 #include "config.h"
+#include "metrics.h"
+#include "metrics_server.h"
 #include "player.h"
 #include "playlist.h"
+#include "probe.h"
 #include "scanner.h"
+#include "sequencer.h"
 #include "ui.h"
+#include "watcher.h"
 #include <SDL.h>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <memory>
 #include <vector>
 
 class App
 {
   public:
-    App();
+    explicit App(Clock &clock = Clock::Real());
+    // plays into sink and keeps its settings and library in data_dir, for running without
+    // a window
+    App(std::unique_ptr<AudioSink> sink, std::filesystem::path data_dir,
+        Clock &clock = Clock::Real());
     ~App();
 
     int Run();
+    // what Run() does before the window opens: the saved settings, the output devices and
+    // the library of the last session
+    void Start();
+    // one frame short of the window: the library and playback move on, the UI is drawn into
+    // the ImGui frame the caller has begun and what it asked for is done. actions may come in
+    // with requests of the caller's own, Run() passes none
+    void Frame(std::chrono::steady_clock::time_point now, UIActions &actions);
+    // what the last frame drew
+    const UIState &GetUIState() const { return ui_state_; }
+    // writes the trace recorded so far to path on quitting, see trace.h
+    void SetTraceOutput(std::filesystem::path path) { trace_output_ = std::move(path); }
 
   private:
-    bool PlayIndex(int index, bool fade_in = false);
-    void PlayNext();
+    void SelectVariant(TrackId id, int index);
+    void PullStatus();
+    void WriteTrace(const std::filesystem::path &path);
     void SyncConfig();
+    void StartScan(bool revalidate = false);
+    void FinishScan();
+    void ShowScanProgress();
+    bool RestoreLibrary();
+    void UpdateProbe();
+    void CacheIntros(const UIActions &actions);
+    void UpdateHoverPreview(const UIActions &actions, std::chrono::steady_clock::time_point now);
 
-    void UpdateUIState(UIState &state, const std::vector<int> &visible_map) const;
-    void BuildVisibleList(std::vector<TrackEntry> &out_tracks, std::vector<int> &out_map) const;
+    void UpdateUIState(UIState &state) const;
 
-    bool HandleActions(const UIActions &actions, const std::vector<int> &visible_map,
-                       std::chrono::steady_clock::time_point now);
+    bool HandleActions(const UIActions &actions, std::chrono::steady_clock::time_point now);
     void HandleShortcuts(bool capture_keyboard, const SDL_Event &ev);
 
+    // counters behind the performance overlay at one moment, a second apart
+    struct PerfMark
+    {
+        std::chrono::steady_clock::time_point at;
+        PerfTimer::Snapshot decode;
+        uint64_t decoded_ns = 0;
+        PerfTimer::Snapshot callback;
+        PerfTimer::Snapshot jitter;
+        PerfTimer::Snapshot frame_build;
+        PerfTimer::Snapshot frame_swap;
+        uint64_t frame_allocs = 0;
+        uint64_t callback_allocs = 0;
+        size_t scanned = 0;
+        size_t probed = 0;
+    };
+    void TogglePerfOverlay();
+    PerfMark TakePerfMark() const;
+    void UpdatePerf();
+    void StartMetrics(int port);
+
+    Clock &clock_;
+    std::filesystem::path data_dir_;
     Config config_;
     Player player_;
     Scanner scanner_;
+    DirectoryWatcher watcher_;
+    MetadataProbe probe_;
     Playlist playlist_;
+    Sequencer sequencer_;
     UI ui_;
+    // what the UI draws, rebuilt in place each frame
+    UIState ui_state_;
 
     std::string directory_;
     std::string search_;
     SortMode sort_ = SortMode::Name;
+    bool sort_descending_ = false;
     bool recursive_ = false;
-    bool shuffle_ = false;
-    RepeatMode repeat_ = RepeatMode::Off;
     int volume_ = 100;
     bool mute_ = false;
     std::string status_;
     bool scanning_active_ = false;
+    size_t scan_status_count_ = 0; // tracks in the "Scanning (N)" status
+
+    // index of the last completed scan, also saved to disk
+    std::shared_ptr<const LibraryIndex> library_;
+    bool revalidating_ = false;
+    std::vector<TrackEntry> revalidated_;
+    bool probing_ = false;
+
+    bool hover_preview_ = false;
+    bool previewing_ = false;
+    TrackId hover_id_ = kInvalidTrackId;
+    std::chrono::steady_clock::time_point hover_since_{};
+    std::vector<TrackId> intro_ids_; // last set handed to the intro cache
+    std::vector<TrackId> intro_candidates_; // this frame's, compared with it
 
-    bool crossfade_enabled_ = false;
-    int crossfade_duration_ms_ = 1000;
-    bool fading_to_next_ = false;
-    int pending_next_index_ = -1;
+    TrackId prefetched_selection_ = kInvalidTrackId;
 
     std::vector<std::string> audio_devices_;
     int audio_device_index_ = 0;
 
     std::vector<float> waveform_;
+    std::filesystem::path trace_output_;
+
+    // performance overlay, F3
+    bool perf_overlay_ = false;
+    PerfTimer frame_build_;
+    PerfTimer frame_swap_;
+    uint64_t frame_allocs_ = 0; // by the frame loop, see AllocCounter
+    PerfMark perf_mark_;
+    PerfView perf_view_;
+
+    // Prometheus endpoint, with metrics_port set in the config. stops before the parts of
+    // the app it reads go away
+    MetricsRegistry metrics_;
+    std::atomic<size_t> metric_tracks_{0};
+    MetricsServer metrics_server_{metrics_};
 };
@@ -0,0 +1,267 @@
+#include "audio_sink.h"
+#include "logger.h"
+#include <SDL.h>
+#include <chrono>
+#include <cstring>
+
+SdlSink::~SdlSink()
+{
+    Close();
+}
+
+std::vector<std::string> SdlSink::ListDevices()
+{
+    std::vector<std::string> devices;
+    int count = SDL_GetNumAudioDevices(0);
+    for (int i = 0; i < count; i++)
+    {
+        auto name = SDL_GetAudioDeviceName(i, 0);
+        if (name)
+            devices.emplace_back(name);
+    }
+    return devices;
+}
+
+bool SdlSink::Open(const std::string &device, int sample_rate, int channels, Callback callback,
+                   void *userdata)
+{
+    if (SDL_WasInit(SDL_INIT_AUDIO) == 0)
+    {
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
+            return false;
+    }
+
+    // close existing device so multiple devices can't consume the same buffer
+    // without it they can consume from same ring buffer causing x3 speedup
+    Close();
+    callback_ = callback;
+    userdata_ = userdata;
+
+    SDL_AudioSpec want{}, got{};
+    want.freq = sample_rate;
+    want.format = AUDIO_F32SYS;
+    want.channels = (Uint8)channels;
+    want.samples = 1024;
+    want.callback = &SdlSink::Trampoline;
+    want.userdata = this;
+
+    auto dev_ptr = device.empty() ? nullptr : device.c_str();
+
+    // exact format
+    device_id_ = SDL_OpenAudioDevice(dev_ptr, 0, &want, &got, 0);
+
+    // retry with format negotiation
+    if (device_id_ == 0)
+    {
+        device_id_ =
+            SDL_OpenAudioDevice(dev_ptr, 0, &want, &got,
+                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+    }
+
+    // last resort: default device
+    if (device_id_ == 0 && dev_ptr != nullptr)
+    {
+        Logger::Warn("Failed to open audio device, trying default");
+        device_id_ =
+            SDL_OpenAudioDevice(nullptr, 0, &want, &got,
+                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+    }
+
+    if (device_id_ == 0)
+    {
+        Logger::Error("SDL audio init failed: " + std::string(SDL_GetError()));
+        return false;
+    }
+
+    if (got.freq != want.freq || got.channels != want.channels)
+    {
+        Logger::Warn("Audio device negotiated different format: " + std::to_string(got.freq) +
+                     "Hz " + std::to_string(got.channels) + "ch");
+    }
+
+    sample_rate_ = got.freq;
+    channels_ = got.channels;
+    device_ = device;
+    return true;
+}
+
+void SdlSink::Close()
+{
+    if (device_id_)
+    {
+        SDL_CloseAudioDevice(device_id_);
+        device_id_ = 0;
+    }
+}
+
+void SdlSink::Pause(bool paused)
+{
+    if (device_id_)
+        SDL_PauseAudioDevice(device_id_, paused ? 1 : 0);
+}
+
+void SdlSink::Lock()
+{
+    if (device_id_)
+        SDL_LockAudioDevice(device_id_);
+}
+
+void SdlSink::Unlock()
+{
+    if (device_id_)
+        SDL_UnlockAudioDevice(device_id_);
+}
+
+void SdlSink::Trampoline(void *userdata, uint8_t *stream, int len)
+{
+    auto sink = (SdlSink *)userdata;
+    sink->callback_(sink->userdata_, (float *)stream, (size_t)len / sizeof(float));
+}
+
+NullSink::~NullSink()
+{
+    Close();
+}
+
+bool NullSink::Open(const std::string &device, int sample_rate, int channels, Callback callback,
+                    void *userdata)
+{
+    Close();
+    if (sample_rate <= 0 || channels <= 0)
+        return false;
+
+    callback_ = callback;
+    userdata_ = userdata;
+    sample_rate_ = sample_rate;
+    channels_ = channels;
+    device_ = device;
+    paused_.store(true);
+    stop_.store(false);
+    clock_.AddThread();
+    thread_ = std::thread(&NullSink::Run, this);
+    return true;
+}
+
+void NullSink::Close()
+{
+    if (!thread_.joinable())
+        return;
+    {
+        std::lock_guard lock(wait_mutex_);
+        stop_.store(true);
+    }
+    clock_.Notify(wait_cv_);
+    thread_.join();
+}
+
+void NullSink::Run()
+{
+    std::vector<float> block((size_t)kBlockFrames * channels_);
+    auto period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(kBlockFrames / (sample_rate_ * speed_)));
+
+    // paced against the start, sleeping late doesn't slow the clock down
+    auto next = clock_.Now();
+    bool was_paused = true;
+    uint64_t last_pauses = pauses_.load();
+    while (!stop_.load())
+    {
+        // a pause between two blocks resumes the sink all the same
+        auto pauses = pauses_.load();
+        bool paused = paused_.load();
+        bool resumed = !paused && (was_paused || pauses != last_pauses);
+        was_paused = paused;
+        last_pauses = pauses;
+        if (paused)
+        {
+            std::fill(block.begin(), block.end(), 0.0f);
+        }
+        else
+        {
+            std::lock_guard lock(callback_mutex_);
+            callback_(userdata_, block.data(), block.size());
+        }
+        Consume(block.data(), block.size(), paused, resumed);
+        frames_.fetch_add(kBlockFrames);
+
+        next += period;
+        std::unique_lock lock(wait_mutex_);
+        clock_.WaitUntil(lock, wait_cv_, next, [this] { return stop_.load(); });
+    }
+    clock_.RemoveThread();
+}
+
+FileSink::~FileSink()
+{
+    Close();
+}
+
+bool FileSink::Open(const std::string &device, int sample_rate, int channels, Callback callback,
+                    void *userdata)
+{
+    NullSink::Close();
+    if (!file_.is_open() || sample_rate != file_rate_ || channels != file_channels_)
+    {
+        file_.close();
+        file_.open(path_, std::ios::binary | std::ios::trunc);
+        if (!file_)
+        {
+            Logger::Error("Failed to open " + path_.string() + " for writing");
+            return false;
+        }
+        file_rate_ = sample_rate;
+        file_channels_ = channels;
+        data_bytes_ = 0;
+        WriteHeader();
+    }
+    return NullSink::Open(device, sample_rate, channels, callback, userdata);
+}
+
+// the header is kept up to date on every close, so the file is complete whenever the sink
+// isn't playing
+void FileSink::Close()
+{
+    NullSink::Close();
+    if (!file_.is_open())
+        return;
+    file_.seekp(0);
+    WriteHeader();
+    file_.seekp(0, std::ios::end);
+    file_.flush();
+}
+
+void FileSink::Consume(const float *pcm, size_t samples, bool paused, bool resumed)
+{
+    (void)paused;
+    (void)resumed;
+    file_.write(reinterpret_cast<const char *>(pcm), (std::streamsize)(samples * sizeof(float)));
+    data_bytes_ += samples * sizeof(float);
+}
+
+void FileSink::WriteHeader()
+{
+    auto u32 = [this](uint32_t v)
+    {
+        uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+        file_.write(reinterpret_cast<const char *>(b), 4);
+    };
+    auto u16 = [this](uint16_t v)
+    {
+        uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+        file_.write(reinterpret_cast<const char *>(b), 2);
+    };
+
+    auto data = (uint32_t)std::min<uint64_t>(data_bytes_, 0xffffffffu - 36);
+    file_.write("RIFF", 4);
+    u32(36 + data);
+    file_.write("WAVEfmt ", 8);
+    u32(16);
+    u16(3); // IEEE float
+    u16((uint16_t)file_channels_);
+    u32((uint32_t)file_rate_);
+    u32((uint32_t)(file_rate_ * file_channels_ * sizeof(float)));
+    u16((uint16_t)(file_channels_ * sizeof(float)));
+    u16(32);
+    file_.write("data", 4);
+    u32(data);
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "clock.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// where the player's output goes. like an SDL device, a sink is opened paused and then asks
+// for interleaved float samples through the callback, on a thread of its own
+class AudioSink
+{
+  public:
+    using Callback = void (*)(void *userdata, float *out, size_t samples);
+
+    virtual ~AudioSink() = default;
+
+    // device is a name from ListOutputDevices(), empty for the default one. the sink may
+    // settle on another rate or channel count, SampleRate() and Channels() tell
+    virtual bool Open(const std::string &device, int sample_rate, int channels, Callback callback,
+                      void *userdata) = 0;
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+    virtual void Pause(bool paused) = 0;
+    // holds the callback off, nests
+    virtual void Lock() = 0;
+    virtual void Unlock() = 0;
+
+    int SampleRate() const { return sample_rate_; }
+    int Channels() const { return channels_; }
+    const std::string &Device() const { return device_; }
+
+  protected:
+    int sample_rate_ = 0;
+    int channels_ = 0;
+    std::string device_;
+};
+
+class SdlSink : public AudioSink
+{
+  public:
+    ~SdlSink() override;
+
+    static std::vector<std::string> ListDevices();
+
+    bool Open(const std::string &device, int sample_rate, int channels, Callback callback,
+              void *userdata) override;
+    void Close() override;
+    bool IsOpen() const override { return device_id_ != 0; }
+    void Pause(bool paused) override;
+    void Lock() override;
+    void Unlock() override;
+
+  private:
+    static void Trampoline(void *userdata, uint8_t *stream, int len);
+
+    uint32_t device_id_ = 0;
+    Callback callback_ = nullptr;
+    void *userdata_ = nullptr;
+};
+
+// no device, a thread pulls blocks as fast as a device at speed times the sample rate
+// would, in the time of clock. paused, it plays silence without asking the callback, like
+// a paused device. for playback without a sound card, faster than real time, or on a
+// SimClock as fast as the player keeps up
+class NullSink : public AudioSink
+{
+  public:
+    static constexpr int kBlockFrames = 1024;
+
+    explicit NullSink(double speed = 1.0, Clock &clock = Clock::Real())
+        : speed_(speed > 0 ? speed : 1.0), clock_(clock)
+    {
+    }
+    ~NullSink() override;
+
+    bool Open(const std::string &device, int sample_rate, int channels, Callback callback,
+              void *userdata) override;
+    void Close() override;
+    bool IsOpen() const override { return thread_.joinable(); }
+    void Pause(bool paused) override
+    {
+        if (paused)
+            pauses_.fetch_add(1);
+        paused_.store(paused);
+    }
+    void Lock() override { callback_mutex_.lock(); }
+    void Unlock() override { callback_mutex_.unlock(); }
+
+    // frames played since construction, silence included
+    uint64_t Frames() const { return frames_.load(); }
+
+  protected:
+    // every block played, on the sink thread. paused blocks are the silence in between,
+    // resumed is the first one played after a pause, however short the pause was
+    virtual void Consume(const float *pcm, size_t samples, bool paused, bool resumed)
+    {
+        (void)pcm;
+        (void)samples;
+        (void)paused;
+        (void)resumed;
+    }
+
+  private:
+    void Run();
+
+    double speed_;
+    Clock &clock_;
+    Callback callback_ = nullptr;
+    void *userdata_ = nullptr;
+    std::recursive_mutex callback_mutex_;
+    std::atomic<bool> paused_{true};
+    std::atomic<uint64_t> pauses_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    std::atomic<uint64_t> frames_{0};
+    std::thread thread_;
+};
+
+// a NullSink that writes what it plays to a 32-bit float WAV file. reopening with the same
+// format appends, another format starts the file over
+class FileSink : public NullSink
+{
+  public:
+    explicit FileSink(std::filesystem::path path, double speed = 1.0,
+                      Clock &clock = Clock::Real())
+        : NullSink(speed, clock), path_(std::move(path))
+    {
+    }
+    ~FileSink() override;
+
+    bool Open(const std::string &device, int sample_rate, int channels, Callback callback,
+              void *userdata) override;
+    void Close() override;
+
+  protected:
+    void Consume(const float *pcm, size_t samples, bool paused, bool resumed) override;
+
+  private:
+    void WriteHeader();
+
+    std::filesystem::path path_;
+    std::ofstream file_;
+    int file_rate_ = 0;
+    int file_channels_ = 0;
+    uint64_t data_bytes_ = 0;
+};
@@ -0,0 +1,116 @@
+#include "bank_prefetch.h"
+#include <iterator>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void AdviseWillNeed(const std::filesystem::path &path)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+BankPrefetch &BankPrefetch::Instance()
+{
+    static BankPrefetch prefetch;
+    return prefetch;
+}
+
+std::shared_ptr<const MappedFile> BankPrefetch::Acquire(const std::filesystem::path &path,
+                                                        bool *hit)
+{
+    if (hit)
+        *hit = false;
+
+    std::error_code ec;
+    auto canonical = std::filesystem::canonical(path, ec);
+    if (ec)
+        return nullptr;
+    auto modified = std::filesystem::last_write_time(canonical, ec);
+    if (ec)
+        return nullptr;
+
+    {
+        std::lock_guard lk(mtx_);
+        auto it = entries_.find(canonical.native());
+        if (it != entries_.end() && it->second->modified == modified)
+        {
+            hits_++;
+            if (hit)
+                *hit = true;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->file;
+        }
+    }
+
+    // mapped outside the lock, a slow disk doesn't hold up other lookups
+    auto file = MappedFile::Open(canonical);
+    std::lock_guard lk(mtx_);
+    misses_++;
+    if (auto it = entries_.find(canonical.native()); it != entries_.end())
+        EraseLocked(it->second);
+    if (file)
+    {
+        lru_.push_front({canonical.native(), modified, file});
+        entries_[canonical.native()] = lru_.begin();
+        bytes_ += file->Size();
+        EvictLocked();
+    }
+    return file;
+}
+
+void BankPrefetch::SetBudget(uint64_t bytes)
+{
+    std::lock_guard lk(mtx_);
+    budget_ = bytes;
+    EvictLocked();
+}
+
+BankPrefetchStats BankPrefetch::Stats() const
+{
+    std::lock_guard lk(mtx_);
+    BankPrefetchStats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.evicted = evicted_;
+    stats.files = entries_.size();
+    stats.bytes = bytes_;
+    return stats;
+}
+
+void BankPrefetch::Clear()
+{
+    std::lock_guard lk(mtx_);
+    lru_.clear();
+    entries_.clear();
+    bytes_ = 0;
+    hits_ = 0;
+    misses_ = 0;
+    evicted_ = 0;
+}
+
+void BankPrefetch::EraseLocked(std::list<Entry>::iterator it)
+{
+    bytes_ -= it->file->Size();
+    entries_.erase(it->path);
+    lru_.erase(it);
+}
+
+// a dropped mapping stays valid for whoever still holds it
+void BankPrefetch::EvictLocked()
+{
+    while (bytes_ > budget_ && !lru_.empty())
+    {
+        EraseLocked(std::prev(lru_.end()));
+        evicted_++;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "mapped_file.h"
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// asks the OS to start reading path into the page cache and returns right away.
+// a no-op where there is no such hint
+void AdviseWillNeed(const std::filesystem::path &path);
+
+struct BankPrefetchStats
+{
+    size_t hits = 0;
+    size_t misses = 0; // first use, or the file changed on disk
+    size_t evicted = 0;
+    size_t files = 0;
+    uint64_t bytes = 0;
+};
+
+// PCM banks (.PPC/.P86/.PPS/.PPZ) and YM2608 rhythm samples, mapped and read through once
+// so they are in the page cache when the driver needs them. PMDWin opens and reads the
+// files itself and has no hook to hand it memory, so this doesn't replace its reads, it
+// makes them hit memory instead of the disk. mappings are kept, keyed by canonical path
+// and mtime, under a byte budget with the least recently used dropped first
+class BankPrefetch
+{
+  public:
+    static constexpr uint64_t kDefaultBudget = 64u << 20;
+
+    static BankPrefetch &Instance();
+
+    // maps path on first use or after it changed on disk. null if it can't be read
+    std::shared_ptr<const MappedFile> Acquire(const std::filesystem::path &path,
+                                              bool *hit = nullptr);
+    void SetBudget(uint64_t bytes);
+    BankPrefetchStats Stats() const;
+    void Clear();
+
+  private:
+    struct Entry
+    {
+        std::filesystem::path::string_type path;
+        std::filesystem::file_time_type modified;
+        std::shared_ptr<const MappedFile> file;
+    };
+
+    void EraseLocked(std::list<Entry>::iterator it);
+    void EvictLocked();
+
+    mutable std::mutex mtx_;
+    std::list<Entry> lru_; // most recently used first
+    std::unordered_map<std::filesystem::path::string_type, std::list<Entry>::iterator> entries_;
+    uint64_t budget_ = kDefaultBudget;
+    uint64_t bytes_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evicted_ = 0;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// MPSC handoff of pre-sized blocks - scan workers push, the UI thread takes.
+// producers push a full block with a CAS, the consumer takes the whole list with one
+// exchange, so neither side waits on the other. consumed blocks go back through a pool:
+// the consumer pushes them, a producer that runs dry takes all of them at once. both
+// stacks are only ever emptied as a whole, which keeps them free of ABA
+template <typename T> class BatchQueue
+{
+  public:
+    struct Block
+    {
+        std::vector<T> items;
+        Block *next = nullptr;
+    };
+
+    explicit BatchQueue(size_t block_size) : block_size_(block_size) {}
+    BatchQueue(const BatchQueue &) = delete;
+    BatchQueue &operator=(const BatchQueue &) = delete;
+
+    size_t BlockSize() const { return block_size_; }
+
+    // producer side. cache is the calling thread's private free list
+    Block *Acquire(Block *&cache)
+    {
+        if (!cache)
+            cache = free_.exchange(nullptr, std::memory_order_acquire);
+        if (!cache)
+            return Allocate();
+
+        Block *block = cache;
+        cache = block->next;
+        block->next = nullptr;
+        return block;
+    }
+
+    void Push(Block *block) { PushChain(ready_, block, block); }
+
+    // consumer side, everything pushed so far in push order
+    Block *TakeAll()
+    {
+        Block *list = ready_.exchange(nullptr, std::memory_order_acquire);
+        Block *fifo = nullptr;
+        while (list)
+        {
+            Block *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        return fifo;
+    }
+
+    // hands consumed blocks back to the producers, cleared but keeping their capacity
+    void Recycle(Block *chain)
+    {
+        if (!chain)
+            return;
+
+        Block *last = chain;
+        while (true)
+        {
+            last->items.clear();
+            if (!last->next)
+                break;
+            last = last->next;
+        }
+        PushChain(free_, chain, last);
+    }
+
+    // stays flat once the pool is warm
+    size_t Allocated() const
+    {
+        std::lock_guard lk(alloc_mtx_);
+        return blocks_.size();
+    }
+
+  private:
+    static void PushChain(std::atomic<Block *> &head, Block *first, Block *last)
+    {
+        last->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(last->next, first, std::memory_order_release,
+                                           std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // only reached while the pool is still filling up
+    Block *Allocate()
+    {
+        auto block = std::make_unique<Block>();
+        block->items.reserve(block_size_);
+        std::lock_guard lk(alloc_mtx_);
+        blocks_.push_back(std::move(block));
+        return blocks_.back().get();
+    }
+
+    size_t block_size_;
+    std::atomic<Block *> ready_{nullptr};
+    std::atomic<Block *> free_{nullptr};
+    mutable std::mutex alloc_mtx_;
+    std::vector<std::unique_ptr<Block>> blocks_; // owns every block
+};
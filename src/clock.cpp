@@ -0,0 +1,151 @@
+#include "clock.h"
+#include <algorithm>
+
+namespace
+{
+
+class RealClock : public Clock
+{
+  public:
+    time_point Now() const override { return std::chrono::steady_clock::now(); }
+
+    bool WaitUntil(std::unique_lock<std::mutex> &lock, std::condition_variable &cv,
+                   time_point deadline, const std::function<bool()> &done) override
+    {
+        return cv.wait_until(lock, deadline, done);
+    }
+
+    void Notify(std::condition_variable &cv) override { cv.notify_all(); }
+};
+
+} // namespace
+
+Clock &Clock::Real()
+{
+    static RealClock clock;
+    return clock;
+}
+
+void Clock::SleepFor(duration d)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unique_lock lock(mutex);
+    WaitFor(lock, cv, d, [] { return false; });
+}
+
+SimClock::SimClock() = default;
+
+Clock::time_point SimClock::Now() const
+{
+    std::lock_guard lock(mutex_);
+    return now_;
+}
+
+uint64_t SimClock::Steps() const
+{
+    std::lock_guard lock(mutex_);
+    return steps_;
+}
+
+bool SimClock::WaitUntil(std::unique_lock<std::mutex> &lock, std::condition_variable &cv,
+                         time_point deadline, const std::function<bool()> &done)
+{
+    while (!done())
+    {
+        Waiter self{deadline, &cv, lock.mutex()};
+        std::vector<Waiter *> woken;
+        {
+            std::lock_guard guard(mutex_);
+            if (now_ >= deadline)
+                return false;
+            waiters_.push_back(&self);
+            running_--;
+            if (running_ == 0)
+                woken = AdvanceLocked();
+        }
+
+        // this thread may be among the woken, its lock is already held. the others are woken
+        // without it, a thread waking this one at the same time would wait on it otherwise
+        auto mine = std::find(woken.begin(), woken.end(), &self);
+        if (mine != woken.end())
+        {
+            self.woken = true;
+            woken.erase(mine);
+        }
+        if (!woken.empty())
+        {
+            lock.unlock();
+            Wake(woken);
+            lock.lock();
+        }
+        cv.wait(lock, [&] { return self.woken; });
+    }
+    return true;
+}
+
+// without the lock of cv held
+void SimClock::Notify(std::condition_variable &cv)
+{
+    std::vector<Waiter *> woken;
+    {
+        std::lock_guard guard(mutex_);
+        auto it = std::partition(waiters_.begin(), waiters_.end(),
+                                 [&](Waiter *w) { return w->cv != &cv; });
+        woken.assign(it, waiters_.end());
+        waiters_.erase(it, waiters_.end());
+        running_ += (int)woken.size();
+    }
+    Wake(woken);
+}
+
+void SimClock::AddThread()
+{
+    std::lock_guard guard(mutex_);
+    running_++;
+}
+
+void SimClock::RemoveThread()
+{
+    std::vector<Waiter *> woken;
+    {
+        std::lock_guard guard(mutex_);
+        running_--;
+        if (running_ == 0)
+            woken = AdvanceLocked();
+    }
+    Wake(woken);
+}
+
+std::vector<SimClock::Waiter *> SimClock::AdvanceLocked()
+{
+    std::vector<Waiter *> woken;
+    if (waiters_.empty())
+        return woken;
+
+    auto next = (*std::min_element(waiters_.begin(), waiters_.end(),
+                                   [](Waiter *a, Waiter *b) { return a->deadline < b->deadline; }))
+                    ->deadline;
+    if (next > now_)
+    {
+        now_ = next;
+        steps_++;
+    }
+    auto it = std::partition(waiters_.begin(), waiters_.end(),
+                             [&](Waiter *w) { return w->deadline > now_; });
+    woken.assign(it, waiters_.end());
+    waiters_.erase(it, waiters_.end());
+    running_ += (int)woken.size();
+    return woken;
+}
+
+void SimClock::Wake(const std::vector<Waiter *> &woken)
+{
+    for (auto *w : woken)
+    {
+        // the waiter can't return before woken is set, nor touch it after it was
+        std::lock_guard lock(*w->mutex);
+        w->woken = true;
+        w->cv->notify_all();
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// time as the player, its sinks and the app see it. Real() is steady_clock. a SimClock
+// only moves when every thread on it waits, then straight to the earliest wake up, so
+// hours of playback logic run in the time their work takes
+class Clock
+{
+  public:
+    using time_point = std::chrono::steady_clock::time_point;
+    using duration = std::chrono::steady_clock::duration;
+
+    virtual ~Clock() = default;
+
+    static Clock &Real();
+
+    virtual time_point Now() const = 0;
+    // like cv.wait_until(lock, deadline, done). the lock has to be the one cv is used with
+    virtual bool WaitUntil(std::unique_lock<std::mutex> &lock, std::condition_variable &cv,
+                           time_point deadline, const std::function<bool()> &done) = 0;
+    // in place of cv.notify_all(), after the condition changed
+    virtual void Notify(std::condition_variable &cv) = 0;
+    // threads that wait on the clock are added to it while they run
+    virtual void AddThread() {}
+    virtual void RemoveThread() {}
+
+    bool WaitFor(std::unique_lock<std::mutex> &lock, std::condition_variable &cv, duration d,
+                 const std::function<bool()> &done)
+    {
+        return WaitUntil(lock, cv, Now() + d, done);
+    }
+    void SleepFor(duration d);
+};
+
+class SimClock : public Clock
+{
+  public:
+    // the thread that makes it is on the clock, until it calls RemoveThread()
+    SimClock();
+
+    time_point Now() const override;
+    bool WaitUntil(std::unique_lock<std::mutex> &lock, std::condition_variable &cv,
+                   time_point deadline, const std::function<bool()> &done) override;
+    void Notify(std::condition_variable &cv) override;
+    void AddThread() override;
+    void RemoveThread() override;
+
+    // how often time moved, and how far
+    uint64_t Steps() const;
+
+  private:
+    struct Waiter
+    {
+        time_point deadline;
+        std::condition_variable *cv;
+        std::mutex *mutex;
+        bool woken = false; // under *mutex
+    };
+
+    // with the lock held and no thread running, time moves to the earliest deadline. the
+    // waiters woken are counted as running again before anyone else gets to look
+    std::vector<Waiter *> AdvanceLocked();
+    void Wake(const std::vector<Waiter *> &woken);
+
+    mutable std::mutex mutex_;
+    time_point now_{};
+    int running_ = 1;
+    std::vector<Waiter *> waiters_;
+    uint64_t steps_ = 0;
+};
@@ -1,4 +1,5 @@
 #include "config.h"
+#include "trace.h"
 #include <fstream>
 #include <nlohmann/json.hpp>
 
@@ -60,12 +61,19 @@ bool Config::Load(const std::filesystem::path &path)
     audio_device = j.value("audio_device", "");
     crossfade_enabled = j.value("crossfade_enabled", false);
     crossfade_duration_ms = j.value("crossfade_duration_ms", 1000);
+    hover_preview = j.value("hover_preview", false);
+    intro_cache_mb = j.value("intro_cache_mb", 64);
+    group_variants = j.value("group_variants", true);
+    render_process = j.value("render_process", false);
+    metrics_port = j.value("metrics_port", 0);
+    underrun_reports = j.value("underrun_reports", true);
 
     return true;
 }
 
 bool Config::Save(const std::filesystem::path &path) const
 {
+    TRACE_SCOPE("Config::Save");
     json j;
     j["last_directory"] = last_directory;
     j["volume"] = volume;
@@ -80,6 +88,12 @@ bool Config::Save(const std::filesystem::path &path) const
     j["audio_device"] = audio_device;
     j["crossfade_enabled"] = crossfade_enabled;
     j["crossfade_duration_ms"] = crossfade_duration_ms;
+    j["hover_preview"] = hover_preview;
+    j["intro_cache_mb"] = intro_cache_mb;
+    j["group_variants"] = group_variants;
+    j["render_process"] = render_process;
+    j["metrics_port"] = metrics_port;
+    j["underrun_reports"] = underrun_reports;
 
     std::ofstream f(path);
     if (!f)
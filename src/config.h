@@ -30,6 +30,15 @@ struct Config
     bool crossfade_enabled = false;
     int crossfade_duration_ms = 1000;
 
+    bool hover_preview = false;
+    int intro_cache_mb = 64;
+    bool group_variants = true;
+    bool render_process = false;
+    // serves Prometheus metrics on 127.0.0.1 at this port, 0 is off
+    int metrics_port = 0;
+    // writes the last seconds of audio timing to underruns/ when playback runs dry
+    bool underrun_reports = true;
+
     bool Load(const std::filesystem::path &path);
     bool Save(const std::filesystem::path &path) const;
 
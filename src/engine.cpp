@@ -0,0 +1,212 @@
+#include "engine.h"
+#include "logger.h"
+#include "render_host.h"
+#include "trace.h"
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+#ifdef PMDMINI_GUI_ENGINE
+#include "pmd_engine.h"
+#else
+#include "pmdmini.h"
+#endif
+
+namespace
+{
+
+#ifndef PMDMINI_GUI_ENGINE
+// the engine using pmdmini's globals
+std::mutex g_shared_mtx;
+const Engine *g_shared_owner = nullptr;
+#endif
+
+} // namespace
+
+Engine::Engine() = default;
+
+Engine::~Engine()
+{
+    Release();
+}
+
+bool Engine::Reentrant()
+{
+#ifdef PMDMINI_GUI_ENGINE
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Engine::SetIsolated(bool isolated)
+{
+    isolated_ = isolated && RenderHost::Supported();
+}
+
+void Engine::SetHostExecutable(std::filesystem::path exe)
+{
+    host_exe_ = std::move(exe);
+    if (host_ && !host_exe_.empty())
+        host_->SetExecutable(host_exe_);
+}
+
+bool Engine::Init(const std::string &pcm_dir, int sample_rate)
+{
+    Stop();
+    if (isolated_)
+    {
+        Release();
+        if (!host_)
+        {
+            host_ = std::make_unique<RenderHost>();
+            if (!host_exe_.empty())
+                host_->SetExecutable(host_exe_);
+        }
+        hosted_ = ready_ = host_->Init(pcm_dir, sample_rate);
+        if (ready_)
+            return true;
+        Logger::Warn("Rendering in process, the render host didn't start");
+    }
+    host_.reset();
+    hosted_ = false;
+#ifdef PMDMINI_GUI_ENGINE
+    if (driver_)
+        pmd_engine_destroy(driver_);
+    driver_ = pmd_engine_create(pcm_dir.c_str(), sample_rate);
+    ready_ = driver_ != nullptr;
+#else
+    {
+        std::lock_guard lock(g_shared_mtx);
+        if (g_shared_owner && g_shared_owner != this)
+            return false;
+        g_shared_owner = this;
+    }
+    auto dir = pcm_dir;
+    pmd_init(dir.data());
+    pmd_setrate(sample_rate);
+    ready_ = true;
+#endif
+    return ready_;
+}
+
+bool Engine::Play(const std::filesystem::path &song, const std::string &pcm_dir)
+{
+    Stop();
+    load_ms_ = 0;
+    if (!ready_)
+        return false;
+    auto ms_since = [](std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t)
+            .count();
+    };
+    auto start = std::chrono::steady_clock::now();
+    if (hosted_)
+    {
+        playing_ = host_->Play(song, pcm_dir);
+        load_ms_ = ms_since(start);
+        return playing_;
+    }
+
+    auto path = song.string();
+    auto dir = pcm_dir;
+#ifdef PMDMINI_GUI_ENGINE
+    playing_ = pmd_engine_play(driver_, path.c_str(), dir.c_str()) == 0;
+    load_ms_ = pmd_engine_load_ms(driver_);
+    // a failed load may leave part of the song in the driver
+    if (!playing_)
+        pmd_engine_stop(driver_);
+#else
+    char *argv[4] = {(char *)"pmdmini-gui", path.data(), nullptr, nullptr};
+    playing_ = pmd_play(argv, dir.data()) == 0;
+    load_ms_ = ms_since(start);
+    if (!playing_)
+        pmd_stop();
+#endif
+    return playing_;
+}
+
+void Engine::Render(int16_t *out, int frames)
+{
+    TRACE_SCOPE("Engine::Render");
+    if (!playing_)
+    {
+        std::memset(out, 0, (size_t)frames * 2 * sizeof(int16_t));
+        return;
+    }
+    if (hosted_)
+    {
+        host_->Render(out, frames);
+        return;
+    }
+#ifdef PMDMINI_GUI_ENGINE
+    pmd_engine_render(driver_, out, frames);
+#else
+    pmd_renderer(out, frames);
+#endif
+}
+
+void Engine::Stop()
+{
+    if (!playing_)
+        return;
+    playing_ = false;
+    if (hosted_)
+    {
+        host_->Stop();
+        return;
+    }
+#ifdef PMDMINI_GUI_ENGINE
+    pmd_engine_stop(driver_);
+#else
+    pmd_stop();
+#endif
+}
+
+int Engine::LengthSec() const
+{
+    if (!playing_)
+        return 0;
+    if (hosted_)
+        return host_->LengthSec();
+#ifdef PMDMINI_GUI_ENGINE
+    return pmd_engine_length_sec(driver_);
+#else
+    return pmd_length_sec();
+#endif
+}
+
+int Engine::LoopSec() const
+{
+    if (!playing_)
+        return 0;
+    if (hosted_)
+        return host_->LoopSec();
+#ifdef PMDMINI_GUI_ENGINE
+    return pmd_engine_loop_sec(driver_);
+#else
+    return pmd_loop_sec();
+#endif
+}
+
+void Engine::Release()
+{
+    Stop();
+    ready_ = false;
+    if (hosted_)
+    {
+        // the host stays up for the next Init()
+        hosted_ = false;
+        return;
+    }
+#ifdef PMDMINI_GUI_ENGINE
+    if (driver_)
+        pmd_engine_destroy(driver_);
+    driver_ = nullptr;
+#else
+    std::lock_guard lock(g_shared_mtx);
+    if (g_shared_owner == this)
+        g_shared_owner = nullptr;
+#endif
+}
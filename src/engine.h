@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+struct pmd_engine;
+class RenderHost;
+
+// one PMD driver with its own OPNA. with the reentrant driver FetchPmdmini.cmake adds to
+// pmdmini, engines are independent and render on different threads at once. without it
+// they fall back to pmdmini's globals, and only one engine at a time gets to use them.
+// an isolated engine runs its driver in a RenderHost process instead
+class Engine
+{
+  public:
+    Engine();
+    ~Engine();
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    static bool Reentrant();
+
+    // renders in a child process from the next Init() on, or back in this one. without
+    // process support, or if the host can't be started, the driver stays in process
+    void SetIsolated(bool isolated);
+    bool Isolated() const { return isolated_; }
+    // the executable a host is started from, the app itself by default
+    void SetHostExecutable(std::filesystem::path exe);
+    // null unless the driver runs in a host
+    RenderHost *Host() const { return hosted_ ? host_.get() : nullptr; }
+
+    // loads the rhythm samples from pcm_dir and sets the output rate. false if the
+    // shared driver is taken by another engine
+    bool Init(const std::string &pcm_dir, int sample_rate);
+    bool Play(const std::filesystem::path &song, const std::string &pcm_dir);
+    // interleaved stereo, silence unless a song plays
+    void Render(int16_t *out, int frames);
+    void Stop();
+
+    int LengthSec() const;
+    int LoopSec() const;
+    // time the last Play() spent with the driver reading the song and its PCM banks. the
+    // whole load with pmdmini's shared driver, the round trip with a host
+    double LoadMs() const { return load_ms_; }
+
+  private:
+    void Release();
+
+    pmd_engine *driver_ = nullptr; // reentrant driver only
+    bool ready_ = false;
+    bool playing_ = false;
+    double load_ms_ = 0;
+
+    std::unique_ptr<RenderHost> host_;
+    std::filesystem::path host_exe_;
+    bool isolated_ = false;
+    bool hosted_ = false; // host_ has the driver since the last Init()
+};
@@ -0,0 +1,399 @@
+#include "intro_cache.h"
+#include "engine.h"
+#include "process.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+IntroCache::IntroCache(size_t budget_bytes) : budget_(budget_bytes), renderer_(CurrentExecutable())
+{
+}
+
+IntroCache::~IntroCache()
+{
+    {
+        std::lock_guard lk(mtx_);
+        stop_ = true;
+        queue_.clear();
+        for (auto child : children_)
+        {
+#ifdef _WIN32
+            TerminateProcess(child, 1);
+#else
+            kill(child, SIGKILL);
+#endif
+        }
+    }
+    cv_.notify_all();
+    for (auto &t : threads_)
+        t.join();
+}
+
+void IntroCache::SetFormat(int sample_rate, size_t frames)
+{
+    std::lock_guard lk(mtx_);
+    if (sample_rate == sample_rate_ && frames == frames_)
+        return;
+    sample_rate_ = sample_rate;
+    frames_ = frames;
+    lru_.clear();
+    entries_.clear();
+    bytes_ = 0;
+}
+
+void IntroCache::SetBudget(size_t bytes)
+{
+    std::lock_guard lk(mtx_);
+    budget_ = bytes;
+    EvictLocked();
+}
+
+void IntroCache::SetRenderer(std::filesystem::path exe)
+{
+    std::lock_guard lk(mtx_);
+    renderer_ = std::move(exe);
+}
+
+void IntroCache::Request(const std::vector<std::filesystem::path> &paths)
+{
+    {
+        std::lock_guard lk(mtx_);
+        queue_.clear();
+        for (auto &path : paths)
+        {
+            if (Wanted(path))
+                queue_.push_back(path);
+        }
+        if (queue_.empty())
+            return;
+        StartWorkersLocked();
+    }
+    cv_.notify_all();
+}
+
+void IntroCache::Prioritize(const std::filesystem::path &path)
+{
+    {
+        std::lock_guard lk(mtx_);
+        if (!Wanted(path))
+            return;
+        queue_.erase(std::remove(queue_.begin(), queue_.end(), path), queue_.end());
+        queue_.push_front(path);
+        StartWorkersLocked();
+    }
+    cv_.notify_one();
+}
+
+std::shared_ptr<const IntroBuffer> IntroCache::Find(const std::filesystem::path &path)
+{
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return nullptr;
+
+    std::lock_guard lk(mtx_);
+    auto it = entries_.find(path.native());
+    if (it == entries_.end())
+        return nullptr;
+    if (it->second->modified != modified)
+    {
+        // changed on disk, rendered again on the next request
+        bytes_ -= it->second->intro->pcm.size() * sizeof(int16_t);
+        lru_.erase(it->second);
+        entries_.erase(it);
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->intro;
+}
+
+void IntroCache::Insert(const std::filesystem::path &path,
+                        std::filesystem::file_time_type modified,
+                        std::shared_ptr<const IntroBuffer> intro)
+{
+    std::lock_guard lk(mtx_);
+    InsertLocked(path, modified, std::move(intro));
+}
+
+IntroCacheStats IntroCache::Stats() const
+{
+    std::lock_guard lk(mtx_);
+    IntroCacheStats stats;
+    stats.entries = entries_.size();
+    stats.bytes = bytes_;
+    stats.rendered = rendered_;
+    stats.failed = failed_count_;
+    stats.render_seconds = render_seconds_;
+    return stats;
+}
+
+void IntroCache::Worker()
+{
+    std::unique_lock lk(mtx_);
+    while (true)
+    {
+        cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+        if (stop_)
+            return;
+
+        auto path = std::move(queue_.front());
+        queue_.pop_front();
+        if (!Wanted(path))
+            continue;
+
+        std::error_code ec;
+        auto modified = std::filesystem::last_write_time(path, ec);
+        auto bad = failed_.find(path.native());
+        if (ec || (bad != failed_.end() && bad->second == modified))
+            continue;
+
+        rendering_.push_back(path);
+        int sample_rate = sample_rate_;
+        size_t frames = frames_;
+        lk.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        auto intro = Render(path, sample_rate, frames);
+        auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+        lk.lock();
+        rendering_.erase(std::find(rendering_.begin(), rendering_.end(), path));
+        render_seconds_ += secs.count();
+        if (stop_)
+            return;
+        if (!intro)
+        {
+            failed_count_++;
+            failed_[path.native()] = modified;
+            continue;
+        }
+        rendered_++;
+        // the player switched rates while this was rendering
+        if (sample_rate == sample_rate_ && frames == frames_)
+            InsertLocked(path, modified, std::move(intro));
+    }
+}
+
+void IntroCache::StartWorkersLocked()
+{
+    if (!threads_.empty())
+        return;
+    for (int i = 0; i < kWorkers; i++)
+        threads_.emplace_back(&IntroCache::Worker, this);
+}
+
+// not cached, not being rendered, and there's a format to render in
+bool IntroCache::Wanted(const std::filesystem::path &path) const
+{
+    return frames_ > 0 && entries_.find(path.native()) == entries_.end() &&
+           std::find(rendering_.begin(), rendering_.end(), path) == rendering_.end();
+}
+
+void IntroCache::InsertLocked(const std::filesystem::path &path,
+                              std::filesystem::file_time_type modified,
+                              std::shared_ptr<const IntroBuffer> intro)
+{
+    auto it = entries_.find(path.native());
+    if (it != entries_.end())
+    {
+        bytes_ -= it->second->intro->pcm.size() * sizeof(int16_t);
+        lru_.erase(it->second);
+        entries_.erase(it);
+    }
+    bytes_ += intro->pcm.size() * sizeof(int16_t);
+    lru_.push_front({path, modified, std::move(intro)});
+    entries_[path.native()] = lru_.begin();
+    EvictLocked();
+}
+
+void IntroCache::EvictLocked()
+{
+    while (bytes_ > budget_ && !lru_.empty())
+    {
+        auto &last = lru_.back();
+        bytes_ -= last.intro->pcm.size() * sizeof(int16_t);
+        entries_.erase(last.path.native());
+        lru_.pop_back();
+    }
+}
+
+std::shared_ptr<const IntroBuffer> IntroCache::Render(const std::filesystem::path &path,
+                                                      int sample_rate, size_t frames)
+{
+    auto intro = std::make_shared<IntroBuffer>();
+    intro->sample_rate = sample_rate;
+    intro->pcm.resize(frames * 2);
+    auto *dst = reinterpret_cast<char *>(intro->pcm.data());
+    size_t want = intro->pcm.size() * sizeof(int16_t);
+    size_t got = 0;
+
+#ifdef _WIN32
+    HANDLE read_end = nullptr;
+    PROCESS_INFORMATION pi{};
+    {
+        // spawned under the lock, a sibling worker must not inherit this pipe
+        std::lock_guard lk(mtx_);
+        if (stop_)
+            return nullptr;
+        SECURITY_ATTRIBUTES sa{sizeof(sa), nullptr, TRUE};
+        HANDLE write_end = nullptr;
+        if (!CreatePipe(&read_end, &write_end, &sa, 0))
+            return nullptr;
+        SetHandleInformation(read_end, HANDLE_FLAG_INHERIT, 0);
+
+        std::string arg = kIntroRenderArg;
+        std::wstring cmd = L"\"" + renderer_.wstring() + L"\" " +
+                           std::wstring(arg.begin(), arg.end()) + L" \"" + path.wstring() +
+                           L"\" " + std::to_wstring(sample_rate) + L" " + std::to_wstring(frames);
+        STARTUPINFOW si{};
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdOutput = write_end;
+        BOOL ok = CreateProcessW(renderer_.c_str(), cmd.data(), nullptr, nullptr, TRUE,
+                                 CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi);
+        CloseHandle(write_end);
+        if (!ok)
+        {
+            CloseHandle(read_end);
+            return nullptr;
+        }
+        CloseHandle(pi.hThread);
+        children_.push_back(pi.hProcess);
+    }
+
+    DWORD n = 0;
+    while (got < want &&
+           ReadFile(read_end, dst + got, (DWORD)std::min<size_t>(want - got, 1 << 20), &n,
+                    nullptr) &&
+           n > 0)
+        got += n;
+    CloseHandle(read_end);
+
+    {
+        std::lock_guard lk(mtx_);
+        children_.erase(std::find(children_.begin(), children_.end(), pi.hProcess));
+    }
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD code = 1;
+    GetExitCodeProcess(pi.hProcess, &code);
+    CloseHandle(pi.hProcess);
+    bool ok = code == 0;
+#else
+    std::string exe = renderer_.string();
+    std::string song = path.string();
+    std::string rate = std::to_string(sample_rate);
+    std::string count = std::to_string(frames);
+    char *argv[] = {exe.data(), (char *)kIntroRenderArg, song.data(), rate.data(),
+                    count.data(),  nullptr};
+
+    int fds[2];
+    pid_t pid = -1;
+    {
+        // spawned under the lock, a sibling worker must not inherit this pipe
+        std::lock_guard lk(mtx_);
+        if (stop_ || pipe(fds) != 0)
+            return nullptr;
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        int rc = posix_spawn(&pid, exe.c_str(), &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (rc != 0)
+        {
+            close(fds[0]);
+            return nullptr;
+        }
+        children_.push_back(pid);
+    }
+
+    while (got < want)
+    {
+        auto n = read(fds[0], dst + got, want - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += (size_t)n;
+    }
+    close(fds[0]);
+
+    // off the list before it's reaped, the pid may be reused afterwards
+    {
+        std::lock_guard lk(mtx_);
+        children_.erase(std::find(children_.begin(), children_.end(), pid));
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+
+    if (!ok || got != want)
+        return nullptr;
+    return intro;
+}
+
+int RunIntroRenderer(int argc, char **argv)
+{
+    if (argc < 5)
+        return 2;
+
+    // stay out of the way of the player and the UI
+#ifdef _WIN32
+    SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+    _setmode(_fileno(stdout), _O_BINARY);
+#else
+    setpriority(PRIO_PROCESS, 0, 10);
+#endif
+
+    auto song = std::filesystem::u8path(argv[2]);
+    int sample_rate = std::atoi(argv[3]);
+    long frames = std::atol(argv[4]);
+    if (sample_rate <= 0 || frames <= 0)
+        return 2;
+
+    // the same calls as Player::DoLoad(), so the intro matches what the player renders
+    auto pcm_dir = song.parent_path().string();
+    if (pcm_dir.empty())
+        pcm_dir = ".";
+    Engine engine;
+    if (!engine.Init(pcm_dir, sample_rate) || !engine.Play(song, pcm_dir))
+        return 1;
+
+    std::vector<int16_t> block(IntroCache::kBlockFrames * 2);
+    for (long done = 0; done < frames; done += IntroCache::kBlockFrames)
+    {
+        engine.Render(block.data(), IntroCache::kBlockFrames);
+        auto n = std::min<long>(IntroCache::kBlockFrames, frames - done);
+        if (fwrite(block.data(), sizeof(int16_t) * 2, (size_t)n, stdout) != (size_t)n)
+            return 1;
+    }
+    engine.Stop();
+    return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// first argument that turns the executable into an intro render worker
+constexpr const char *kIntroRenderArg = "--render-intro";
+
+// the opening seconds of a track as the driver renders them, stereo 16 bit
+struct IntroBuffer
+{
+    int sample_rate = 0;
+    std::vector<int16_t> pcm; // interleaved
+
+    size_t Frames() const { return pcm.size() / 2; }
+};
+
+struct IntroCacheStats
+{
+    size_t entries = 0;
+    uint64_t bytes = 0;
+    size_t rendered = 0;
+    size_t failed = 0;
+    double render_seconds = 0; // wall time spent in workers
+};
+
+// renders track intros in low priority worker processes and keeps them in memory
+// under a byte budget, least recently used first out. a process of its own keeps a
+// worker off the player's threads, and works with pmdmini's shared driver too
+class IntroCache
+{
+  public:
+    // renders in blocks of this many frames, like the decoder, so both agree sample
+    // for sample
+    static constexpr int kBlockFrames = 1024;
+    static constexpr int kWorkers = 2;
+
+    explicit IntroCache(size_t budget_bytes = 64u << 20);
+    ~IntroCache();
+    IntroCache(const IntroCache &) = delete;
+    IntroCache &operator=(const IntroCache &) = delete;
+
+    // rate and length of the intros to render. a rate change drops what was cached
+    void SetFormat(int sample_rate, size_t frames);
+    void SetBudget(size_t bytes);
+    // the executable run as a worker with kIntroRenderArg, the app itself by default
+    void SetRenderer(std::filesystem::path exe);
+
+    // queues tracks to render, most wanted first. replaces what is still queued, a
+    // scrolled away list shouldn't keep the workers busy
+    void Request(const std::vector<std::filesystem::path> &paths);
+    // moves path to the front of the queue unless it's cached or rendering
+    void Prioritize(const std::filesystem::path &path);
+    // null unless cached for the current rate and unchanged on disk
+    std::shared_ptr<const IntroBuffer> Find(const std::filesystem::path &path);
+    void Insert(const std::filesystem::path &path, std::filesystem::file_time_type modified,
+                std::shared_ptr<const IntroBuffer> intro);
+    IntroCacheStats Stats() const;
+
+  private:
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type modified;
+        std::shared_ptr<const IntroBuffer> intro;
+    };
+
+    void Worker();
+    void StartWorkersLocked();
+    bool Wanted(const std::filesystem::path &path) const;
+    void InsertLocked(const std::filesystem::path &path,
+                      std::filesystem::file_time_type modified,
+                      std::shared_ptr<const IntroBuffer> intro);
+    void EvictLocked();
+    std::shared_ptr<const IntroBuffer> Render(const std::filesystem::path &path, int sample_rate,
+                                              size_t frames);
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+
+    int sample_rate_ = 44100;
+    size_t frames_ = 0;
+    size_t budget_ = 0;
+    std::filesystem::path renderer_;
+
+    std::deque<std::filesystem::path> queue_;
+    std::vector<std::filesystem::path> rendering_;
+    std::list<Entry> lru_; // most recently used first
+    std::unordered_map<std::filesystem::path::string_type, std::list<Entry>::iterator> entries_;
+    // renders that failed, not retried until the file changes
+    std::unordered_map<std::filesystem::path::string_type, std::filesystem::file_time_type>
+        failed_;
+    uint64_t bytes_ = 0;
+    size_t rendered_ = 0;
+    size_t failed_count_ = 0;
+    double render_seconds_ = 0;
+
+    // live worker processes, killed on shutdown so the threads don't wait them out
+#ifdef _WIN32
+    std::vector<void *> children_;
+#else
+    std::vector<int> children_;
+#endif
+};
+
+// entry point of a worker process: renders argv[2] at argv[3] Hz for argv[4] frames
+// and writes the samples to stdout. returns the exit code
+int RunIntroRenderer(int argc, char **argv);
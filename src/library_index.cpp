@@ -0,0 +1,477 @@
+#include "library_index.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+using Char = std::filesystem::path::value_type;
+
+namespace
+{
+
+constexpr char kMagic[8] = {'P', 'M', 'D', 'L', 'I', 'B', 0, 0};
+
+int64_t TimeToDisk(std::filesystem::file_time_type t)
+{
+    return (int64_t)t.time_since_epoch().count();
+}
+
+std::filesystem::file_time_type TimeFromDisk(int64_t v)
+{
+    using Duration = std::filesystem::file_time_type::duration;
+    return std::filesystem::file_time_type(Duration((Duration::rep)v));
+}
+
+} // namespace
+
+// the layout, in this order: header, directories sorted by path, files (a directory's
+// files are consecutive and sorted by name), subdirectory names, the path pool, the key
+// pool and the root path. records refer to the pools by offset and length. every table
+// starts 8 byte aligned, so a mapping is read through these structs directly
+struct LibraryIndex::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t char_size; // native path characters, rejects copies from another OS
+    uint32_t recursive;
+    uint32_t dir_count;
+    uint32_t file_count;
+    uint32_t name_count;
+    uint32_t root_len;
+    uint32_t reserved;
+    uint64_t pool_size; // in path characters
+    uint64_t key_size;  // in bytes
+};
+
+struct LibraryIndex::DirRecord
+{
+    int64_t modified;
+    uint32_t path_off;
+    uint32_t path_len;
+    uint32_t first_file;
+    uint32_t file_count;
+    uint32_t first_subdir;
+    uint32_t subdir_count;
+    uint32_t key_off;
+    uint32_t key_len;
+};
+
+struct LibraryIndex::FileRecord
+{
+    int64_t modified;
+    uint64_t size;
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t name_key_off;
+    uint32_t name_key_len;
+    uint32_t variant_key_off;
+    uint32_t variant_key_len;
+};
+
+struct LibraryIndex::NameRecord
+{
+    uint32_t off;
+    uint32_t len;
+};
+
+const LibraryIndex::File *LibraryIndex::Dir::FindFile(const String &name) const
+{
+    auto it = std::lower_bound(files.begin(), files.end(), name,
+                               [](const File &f, const String &n) { return f.name < n; });
+    return (it != files.end() && it->name == name) ? &*it : nullptr;
+}
+
+LibraryIndex::StringView LibraryIndex::DirView::Path() const
+{
+    auto &d = index_->dirs_[i_];
+    return index_->Str(d.path_off, d.path_len);
+}
+
+std::filesystem::file_time_type LibraryIndex::DirView::Modified() const
+{
+    return TimeFromDisk(index_->dirs_[i_].modified);
+}
+
+std::string_view LibraryIndex::DirView::FolderKey() const
+{
+    auto &d = index_->dirs_[i_];
+    return index_->Key(d.key_off, d.key_len);
+}
+
+size_t LibraryIndex::DirView::FileCount() const
+{
+    return index_->dirs_[i_].file_count;
+}
+
+LibraryIndex::FileView LibraryIndex::DirView::FileAt(size_t i) const
+{
+    auto &f = index_->files_[index_->dirs_[i_].first_file + i];
+    return {index_->Str(f.name_off, f.name_len), f.size, TimeFromDisk(f.modified),
+            index_->Key(f.name_key_off, f.name_key_len),
+            index_->Key(f.variant_key_off, f.variant_key_len)};
+}
+
+size_t LibraryIndex::DirView::SubdirCount() const
+{
+    return index_->dirs_[i_].subdir_count;
+}
+
+LibraryIndex::StringView LibraryIndex::DirView::SubdirAt(size_t i) const
+{
+    auto &n = index_->names_[index_->dirs_[i_].first_subdir + i];
+    return index_->Str(n.off, n.len);
+}
+
+std::optional<LibraryIndex::FileView> LibraryIndex::DirView::FindFile(StringView name) const
+{
+    size_t lo = 0, hi = FileCount();
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        auto &f = index_->files_[index_->dirs_[i_].first_file + mid];
+        if (index_->Str(f.name_off, f.name_len) < name)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == FileCount() || FileAt(lo).name != name)
+        return std::nullopt;
+    return FileAt(lo);
+}
+
+LibraryIndex::Dir LibraryIndex::DirView::Copy() const
+{
+    Dir dir;
+    dir.modified = Modified();
+    dir.folder_key = FolderKey();
+    dir.files.resize(FileCount());
+    for (size_t i = 0; i < dir.files.size(); i++)
+    {
+        auto view = FileAt(i);
+        auto &file = dir.files[i];
+        file.name = view.name;
+        file.size = view.size;
+        file.modified = view.modified;
+        file.name_key = view.name_key;
+        file.variant_key = view.variant_key;
+    }
+    dir.subdirs.reserve(SubdirCount());
+    for (size_t i = 0; i < SubdirCount(); i++)
+        dir.subdirs.emplace_back(SubdirAt(i));
+    return dir;
+}
+
+LibraryIndex::LibraryIndex() = default;
+
+void LibraryIndex::Build(std::vector<std::pair<String, Dir>> dirs)
+{
+    // one record per path, the last one given wins
+    std::stable_sort(dirs.begin(), dirs.end(),
+                     [](const auto &a, const auto &b) { return a.first < b.first; });
+    size_t kept = 0;
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        if (i + 1 < dirs.size() && dirs[i + 1].first == dirs[i].first)
+            continue;
+        if (kept != i)
+            dirs[kept] = std::move(dirs[i]);
+        kept++;
+    }
+    dirs.resize(kept);
+
+    std::vector<DirRecord> dir_records;
+    std::vector<FileRecord> file_records;
+    std::vector<NameRecord> names;
+    String pool;
+    std::string keys;
+    auto add = [&](const String &s)
+    {
+        auto off = (uint32_t)pool.size();
+        pool += s;
+        return NameRecord{off, (uint32_t)s.size()};
+    };
+    auto add_key = [&](const std::string &s)
+    {
+        auto off = (uint32_t)keys.size();
+        keys += s;
+        return NameRecord{off, (uint32_t)s.size()};
+    };
+
+    dir_records.reserve(dirs.size());
+    for (auto &[path, dir] : dirs)
+    {
+        DirRecord d{};
+        d.modified = TimeToDisk(dir.modified);
+        auto p = add(path);
+        d.path_off = p.off;
+        d.path_len = p.len;
+        d.first_file = (uint32_t)file_records.size();
+        d.file_count = (uint32_t)dir.files.size();
+        d.first_subdir = (uint32_t)names.size();
+        d.subdir_count = (uint32_t)dir.subdirs.size();
+        auto k = add_key(dir.folder_key);
+        d.key_off = k.off;
+        d.key_len = k.len;
+        dir_records.push_back(d);
+
+        for (auto &file : dir.files)
+        {
+            FileRecord f{};
+            f.modified = TimeToDisk(file.modified);
+            f.size = file.size;
+            auto n = add(file.name);
+            f.name_off = n.off;
+            f.name_len = n.len;
+            auto nk = add_key(file.name_key);
+            f.name_key_off = nk.off;
+            f.name_key_len = nk.len;
+            auto vk = add_key(file.variant_key);
+            f.variant_key_off = vk.off;
+            f.variant_key_len = vk.len;
+            file_records.push_back(f);
+        }
+        for (auto &sub : dir.subdirs)
+            names.push_back(add(sub));
+    }
+
+    Header h{};
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.char_size = sizeof(Char);
+    h.dir_count = (uint32_t)dir_records.size();
+    h.file_count = (uint32_t)file_records.size();
+    h.name_count = (uint32_t)names.size();
+    h.pool_size = pool.size();
+    h.key_size = keys.size();
+
+    // laid out as the file is, root and recursion are added by Save()
+    size_t size = 0;
+    auto append = [&](const void *src, size_t bytes)
+    {
+        std::memcpy(reinterpret_cast<uint8_t *>(built_.data()) + size, src, bytes);
+        size += bytes;
+    };
+    size_t total = sizeof(h) + dir_records.size() * sizeof(DirRecord) +
+                   file_records.size() * sizeof(FileRecord) + names.size() * sizeof(NameRecord) +
+                   pool.size() * sizeof(Char) + keys.size();
+    file_.reset();
+    built_.assign((total + 7) / 8, 0);
+    append(&h, sizeof(h));
+    append(dir_records.data(), dir_records.size() * sizeof(DirRecord));
+    append(file_records.data(), file_records.size() * sizeof(FileRecord));
+    append(names.data(), names.size() * sizeof(NameRecord));
+    append(pool.data(), pool.size() * sizeof(Char));
+    append(keys.data(), keys.size());
+    Attach(reinterpret_cast<const uint8_t *>(built_.data()), size);
+}
+
+void LibraryIndex::Clear()
+{
+    file_.reset();
+    built_.clear();
+    data_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+    dirs_ = nullptr;
+    files_ = nullptr;
+    names_ = nullptr;
+    pool_ = nullptr;
+    keys_ = nullptr;
+    root.clear();
+    recursive = false;
+}
+
+// points the tables into data after checking that every record stays inside it
+bool LibraryIndex::Attach(const uint8_t *data, size_t size)
+{
+    static_assert(sizeof(Header) == 56 && sizeof(DirRecord) == 40 && sizeof(FileRecord) == 40 &&
+                  sizeof(NameRecord) == 8);
+    static_assert(std::is_trivially_copyable_v<Header> && std::is_trivially_copyable_v<DirRecord>);
+
+    Header h;
+    if (size < sizeof(h))
+        return false;
+    std::memcpy(&h, data, sizeof(h));
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion ||
+        h.char_size != sizeof(Char))
+        return false;
+
+    uint64_t dirs_at = sizeof(h);
+    uint64_t files_at = dirs_at + (uint64_t)h.dir_count * sizeof(DirRecord);
+    uint64_t names_at = files_at + (uint64_t)h.file_count * sizeof(FileRecord);
+    uint64_t pool_at = names_at + (uint64_t)h.name_count * sizeof(NameRecord);
+    uint64_t keys_at = pool_at + h.pool_size * sizeof(Char);
+    uint64_t root_at = keys_at + h.key_size;
+    if (h.pool_size > size || h.key_size > size ||
+        root_at + (uint64_t)h.root_len * sizeof(Char) != size)
+        return false;
+
+    auto *dirs = reinterpret_cast<const DirRecord *>(data + dirs_at);
+    auto *files = reinterpret_cast<const FileRecord *>(data + files_at);
+    auto *names = reinterpret_cast<const NameRecord *>(data + names_at);
+    auto fits = [](uint64_t off, uint64_t len, uint64_t total) { return off + len <= total; };
+
+    uint64_t file_count = 0;
+    for (uint32_t i = 0; i < h.dir_count; i++)
+    {
+        auto &d = dirs[i];
+        if (!fits(d.path_off, d.path_len, h.pool_size) ||
+            !fits(d.key_off, d.key_len, h.key_size) ||
+            !fits(d.first_file, d.file_count, h.file_count) ||
+            !fits(d.first_subdir, d.subdir_count, h.name_count))
+            return false;
+        file_count += d.file_count;
+    }
+    for (uint32_t i = 0; i < h.file_count; i++)
+    {
+        auto &f = files[i];
+        if (!fits(f.name_off, f.name_len, h.pool_size) ||
+            !fits(f.name_key_off, f.name_key_len, h.key_size) ||
+            !fits(f.variant_key_off, f.variant_key_len, h.key_size))
+            return false;
+    }
+    for (uint32_t i = 0; i < h.name_count; i++)
+    {
+        if (!fits(names[i].off, names[i].len, h.pool_size))
+            return false;
+    }
+    if (file_count != h.file_count)
+        return false;
+
+    data_ = data;
+    size_ = size;
+    header_ = reinterpret_cast<const Header *>(data);
+    dirs_ = dirs;
+    files_ = files;
+    names_ = names;
+    pool_ = reinterpret_cast<const Char *>(data + pool_at);
+    keys_ = reinterpret_cast<const char *>(data + keys_at);
+    return true;
+}
+
+LibraryIndex::StringView LibraryIndex::Str(uint32_t off, uint32_t len) const
+{
+    return StringView(pool_ + off, len);
+}
+
+std::string_view LibraryIndex::Key(uint32_t off, uint32_t len) const
+{
+    return std::string_view(keys_ + off, len);
+}
+
+size_t LibraryIndex::LowerBound(StringView path) const
+{
+    size_t lo = 0, hi = DirCount();
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (Str(dirs_[mid].path_off, dirs_[mid].path_len) < path)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+std::optional<LibraryIndex::DirView> LibraryIndex::Find(StringView dir) const
+{
+    size_t i = LowerBound(dir);
+    if (i == DirCount() || Str(dirs_[i].path_off, dirs_[i].path_len) != dir)
+        return std::nullopt;
+    return DirView(this, i);
+}
+
+// the paths below dir all start with dir and a separator, so they sit together in the table
+size_t LibraryIndex::FileCountUnder(StringView dir) const
+{
+    size_t count = 0;
+    if (auto d = Find(dir))
+        count += d->FileCount();
+
+    String prefix(dir);
+    prefix += std::filesystem::path::preferred_separator;
+    for (size_t i = LowerBound(prefix); i < DirCount(); i++)
+    {
+        auto path = Str(dirs_[i].path_off, dirs_[i].path_len);
+        if (path.substr(0, prefix.size()) != prefix)
+            break;
+        count += DirAt(i).FileCount();
+    }
+    return count;
+}
+
+size_t LibraryIndex::DirCount() const
+{
+    return header_ ? header_->dir_count : 0;
+}
+
+LibraryIndex::DirView LibraryIndex::DirAt(size_t i) const
+{
+    return DirView(this, i);
+}
+
+size_t LibraryIndex::FileCount() const
+{
+    return header_ ? header_->file_count : 0;
+}
+
+bool LibraryIndex::Load(const std::filesystem::path &path)
+{
+    Clear();
+    auto file = MappedFile::Open(path);
+    if (!file || !Attach(file->Data(), file->Size()))
+    {
+        Clear();
+        return false;
+    }
+    file_ = std::move(file);
+
+    String root_str(header_->root_len, Char());
+    std::memcpy(root_str.data(), data_ + size_ - root_str.size() * sizeof(Char),
+                root_str.size() * sizeof(Char));
+    root = root_str;
+    recursive = header_->recursive != 0;
+    return true;
+}
+
+bool LibraryIndex::Save(const std::filesystem::path &path) const
+{
+    Header h{};
+    size_t tables = 0;
+    if (header_)
+    {
+        h = *header_;
+        tables = size_ - (size_t)header_->root_len * sizeof(Char);
+    }
+    else
+    {
+        std::memcpy(h.magic, kMagic, sizeof(kMagic));
+        h.version = kVersion;
+        h.char_size = sizeof(Char);
+    }
+    h.recursive = recursive ? 1 : 0;
+    h.root_len = (uint32_t)root.native().size();
+
+    // write next to the target and rename, a crash never leaves a half written index
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f)
+            return false;
+        f.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        if (tables > sizeof(h))
+        {
+            f.write(reinterpret_cast<const char *>(data_ + sizeof(h)),
+                    (std::streamsize)(tables - sizeof(h)));
+        }
+        f.write(reinterpret_cast<const char *>(root.native().data()),
+                (std::streamsize)(root.native().size() * sizeof(Char)));
+        if (!f)
+            return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
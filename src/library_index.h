@@ -0,0 +1,128 @@
+#pragma once
+
+#include "mapped_file.h"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// directory listings from the last scan, keyed by absolute directory path. a directory
+// whose mtime hasn't changed is replayed from here instead of being listed again.
+// the index is a few flat tables (directories sorted by path, files, subdirectory names)
+// over two string pools. the file on disk is those tables as they are in memory, so a
+// loaded index is the mapped file itself: checked once, then read in place
+class LibraryIndex
+{
+  public:
+    using String = std::filesystem::path::string_type;
+    using StringView = std::basic_string_view<std::filesystem::path::value_type>;
+
+    // a file as the scanner lists it. the keys are derived from the name and saved with
+    // it, so the list shown at startup doesn't build them again (see BuildSortKeys())
+    struct File
+    {
+        String name;
+        uintmax_t size = 0;
+        std::filesystem::file_time_type modified;
+        std::string name_key;
+        std::string variant_key;
+    };
+
+    struct Dir
+    {
+        std::filesystem::file_time_type modified;
+        std::string folder_key;
+        std::vector<File> files; // playable files only, sorted by name
+        std::vector<String> subdirs;
+
+        const File *FindFile(const String &name) const;
+    };
+
+    // read-only views into the tables, valid while the index lives
+    struct FileView
+    {
+        StringView name;
+        uintmax_t size = 0;
+        std::filesystem::file_time_type modified;
+        std::string_view name_key;
+        std::string_view variant_key;
+    };
+
+    class DirView
+    {
+      public:
+        StringView Path() const;
+        std::filesystem::file_time_type Modified() const;
+        std::string_view FolderKey() const;
+        size_t FileCount() const;
+        FileView FileAt(size_t i) const;
+        size_t SubdirCount() const;
+        StringView SubdirAt(size_t i) const;
+        // files are sorted by name
+        std::optional<FileView> FindFile(StringView name) const;
+        Dir Copy() const;
+
+      private:
+        friend class LibraryIndex;
+        DirView(const LibraryIndex *index, size_t i) : index_(index), i_(i) {}
+
+        const LibraryIndex *index_;
+        size_t i_;
+    };
+
+    // bumped whenever the on-disk layout changes, older files are ignored
+    static constexpr uint32_t kVersion = 2;
+
+    LibraryIndex();
+    LibraryIndex(const LibraryIndex &) = delete;
+    LibraryIndex &operator=(const LibraryIndex &) = delete;
+
+    std::filesystem::path root;
+    bool recursive = false;
+
+    // replaces the tables with dirs, one entry per directory path
+    void Build(std::vector<std::pair<String, Dir>> dirs);
+    void Clear();
+
+    // binary search over the directory table, safe from any number of threads
+    std::optional<DirView> Find(StringView dir) const;
+    // files of dir and of every directory below it
+    size_t FileCountUnder(StringView dir) const;
+    size_t DirCount() const;
+    DirView DirAt(size_t i) const;
+    size_t FileCount() const;
+
+    // the tables are the file. Load() maps it and checks every record once, returns false
+    // (and stays empty) on a missing, truncated or foreign file
+    bool Load(const std::filesystem::path &path);
+    bool Save(const std::filesystem::path &path) const;
+
+  private:
+    struct Header;
+    struct DirRecord;
+    struct FileRecord;
+    struct NameRecord;
+
+    bool Attach(const uint8_t *data, size_t size);
+    // first directory whose path isn't less than path
+    size_t LowerBound(StringView path) const;
+    StringView Str(uint32_t off, uint32_t len) const;
+    std::string_view Key(uint32_t off, uint32_t len) const;
+
+    // one of the two holds the bytes the table pointers below point into
+    std::shared_ptr<const MappedFile> file_;
+    std::vector<uint64_t> built_; // 8 byte aligned, like a mapping
+
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    const Header *header_ = nullptr;
+    const DirRecord *dirs_ = nullptr;
+    const FileRecord *files_ = nullptr;
+    const NameRecord *names_ = nullptr;
+    const std::filesystem::path::value_type *pool_ = nullptr;
+    const char *keys_ = nullptr;
+};
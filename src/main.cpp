@@ -1,7 +1,23 @@
 #include "app.h"
+#include "intro_cache.h"
+#include "render_host.h"
+#include <cstring>
 
-int main(int, char **)
+int main(int argc, char **argv)
 {
+    // the intro cache runs this executable as its render worker
+    if (argc > 1 && std::strcmp(argv[1], kIntroRenderArg) == 0)
+        return RunIntroRenderer(argc, argv);
+    // and the player this one as its out of process driver
+    if (argc > 1 && std::strcmp(argv[1], kRenderHostArg) == 0)
+        return RunRenderHost(argc, argv);
+
     App app;
+    // --trace out.json writes a Chrome trace on quitting, in builds with PMDMINI_GUI_TRACE
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--trace") == 0)
+            app.SetTraceOutput(argv[i + 1]);
+    }
     return app.Run();
 }
@@ -0,0 +1,97 @@
+#include "mapped_file.h"
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    if (!mapped_)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+#else
+    munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+}
+
+std::shared_ptr<const MappedFile> MappedFile::Open(const std::filesystem::path &path)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+        {
+            file->mapping_ = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (file->mapping_)
+            {
+                file->data_ = static_cast<const uint8_t *>(
+                    MapViewOfFile(file->mapping_, FILE_MAP_READ, 0, 0, 0));
+                if (file->data_)
+                {
+                    file->size_ = (size_t)size.QuadPart;
+                    file->mapped_ = true;
+                }
+                else
+                {
+                    CloseHandle(file->mapping_);
+                    file->mapping_ = nullptr;
+                }
+            }
+        }
+        CloseHandle(handle);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            flags |= MAP_POPULATE; // read it in now, not on the driver's first access
+#endif
+            void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                file->data_ = static_cast<const uint8_t *>(p);
+                file->size_ = (size_t)st.st_size;
+                file->mapped_ = true;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (file->mapped_)
+        return file;
+
+    // empty files, or file systems that can't map
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+        return nullptr;
+    file->copy_.resize((size_t)f.tellg());
+    f.seekg(0);
+    if (!f.read(reinterpret_cast<char *>(file->copy_.data()), (std::streamsize)file->copy_.size()))
+        return nullptr;
+    file->data_ = file->copy_.data();
+    file->size_ = file->copy_.size();
+    return file;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// read-only view of a whole file, memory mapped where the platform allows it and
+// read into memory otherwise
+class MappedFile
+{
+  public:
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // null if the file can't be opened
+    static std::shared_ptr<const MappedFile> Open(const std::filesystem::path &path);
+
+    const uint8_t *Data() const { return data_; }
+    size_t Size() const { return size_; }
+    bool IsMapped() const { return mapped_; }
+
+  private:
+    MappedFile() = default;
+
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<uint8_t> copy_; // fallback when mapping fails
+#ifdef _WIN32
+    void *mapping_ = nullptr;
+#endif
+};
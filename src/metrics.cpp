@@ -0,0 +1,82 @@
+#include "metrics.h"
+#include <cstdio>
+#include <fstream>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+void MetricsRegistry::AddCounter(std::string name, std::string help, Read read)
+{
+    std::lock_guard lock(mutex_);
+    metrics_.push_back({std::move(name), std::move(help), Kind::Counter, std::move(read)});
+}
+
+void MetricsRegistry::AddGauge(std::string name, std::string help, Read read)
+{
+    std::lock_guard lock(mutex_);
+    metrics_.push_back({std::move(name), std::move(help), Kind::Gauge, std::move(read)});
+}
+
+void MetricsRegistry::AddHistogram(std::string name, std::string help, const PerfTimer &timer)
+{
+    std::lock_guard lock(mutex_);
+    metrics_.push_back({std::move(name), std::move(help), Kind::Histogram, nullptr, &timer});
+}
+
+std::string MetricsRegistry::Render() const
+{
+    static const char *kTypes[] = {"counter", "gauge", "histogram"};
+
+    std::string out;
+    char line[256];
+    auto value = [&](const std::string &name, const char *suffix, double v)
+    {
+        std::snprintf(line, sizeof(line), "%s%s %.15g\n", name.c_str(), suffix, v);
+        out += line;
+    };
+
+    std::lock_guard lock(mutex_);
+    for (auto &m : metrics_)
+    {
+        out += "# HELP " + m.name + " " + m.help + "\n";
+        out += "# TYPE " + m.name + " " + kTypes[(int)m.kind] + "\n";
+        if (m.kind != Kind::Histogram)
+        {
+            value(m.name, "", m.read());
+            continue;
+        }
+
+        // the last bucket has no upper end, it is the +Inf one
+        auto s = m.timer->Take();
+        uint64_t cumulative = 0;
+        for (int i = 0; i + 1 < PerfTimer::kBuckets; i++)
+        {
+            cumulative += s.buckets[i];
+            std::snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", m.name.c_str(),
+                          PerfTimer::BucketLimitUs(i) / 1e6, (unsigned long long)cumulative);
+            out += line;
+        }
+        // snapshots read the fields one by one, count is what the buckets add up to
+        cumulative += s.buckets[PerfTimer::kBuckets - 1];
+        std::snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", m.name.c_str(),
+                      (unsigned long long)cumulative);
+        out += line;
+        value(m.name, "_sum", s.total_ns / 1e9);
+        value(m.name, "_count", (double)cumulative);
+    }
+    return out;
+}
+
+double MetricsRegistry::ResidentBytes()
+{
+#ifdef __linux__
+    // pages: size, resident, ...
+    std::ifstream statm("/proc/self/statm");
+    long size = 0;
+    long resident = 0;
+    if (statm >> size >> resident)
+        return (double)resident * (double)sysconf(_SC_PAGESIZE);
+#endif
+    return 0;
+}
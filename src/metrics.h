@@ -0,0 +1,55 @@
+#pragma once
+
+#include "perf_stats.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// counters, gauges and histograms for Prometheus to scrape. the player, scanner, playlist
+// and app register what they already count, Render() reads it on the scrape thread: the
+// readers must be safe to call from there, relaxed atomics mostly. registered values must
+// outlive the scrapes
+class MetricsRegistry
+{
+  public:
+    using Read = std::function<double()>;
+
+    void AddCounter(std::string name, std::string help, Read read);
+    void AddGauge(std::string name, std::string help, Read read);
+    // durations in seconds, the timer's power of two buckets are the bounds
+    void AddHistogram(std::string name, std::string help, const PerfTimer &timer);
+
+    // reads an atomic counter, times scale
+    template <typename T> static Read Value(const std::atomic<T> &value, double scale = 1.0)
+    {
+        return [&value, scale] { return (double)value.load(std::memory_order_relaxed) * scale; };
+    }
+
+    // Prometheus text exposition format 0.0.4
+    std::string Render() const;
+
+    // resident set size of this process in bytes, 0 where that isn't known (Linux only)
+    static double ResidentBytes();
+
+  private:
+    enum class Kind
+    {
+        Counter,
+        Gauge,
+        Histogram,
+    };
+
+    struct Metric
+    {
+        std::string name;
+        std::string help;
+        Kind kind;
+        Read read;
+        const PerfTimer *timer = nullptr;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<Metric> metrics_;
+};
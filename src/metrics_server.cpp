@@ -0,0 +1,136 @@
+#include "metrics_server.h"
+#include "logger.h"
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS, where SIGPIPE stays on
+#endif
+#endif
+
+MetricsServer::~MetricsServer()
+{
+    Stop();
+}
+
+bool MetricsServer::Supported()
+{
+#ifdef _WIN32
+    return false;
+#else
+    return true;
+#endif
+}
+
+bool MetricsServer::Start(int port)
+{
+    Stop();
+#ifdef _WIN32
+    (void)port;
+    return false;
+#else
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    // loopback only, the numbers aren't meant for the network
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0 ||
+        getsockname(fd, (sockaddr *)&addr, &len) != 0)
+    {
+        Logger::Warn("Metrics: can't listen on 127.0.0.1:" + std::to_string(port) + ", " +
+                     std::strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    listen_fd_ = fd;
+    port_ = ntohs(addr.sin_port);
+    stop_.store(false);
+    thread_ = std::thread(&MetricsServer::Run, this);
+    Logger::Info("Metrics on http://127.0.0.1:" + std::to_string(port_) + "/metrics");
+    return true;
+#endif
+}
+
+void MetricsServer::Stop()
+{
+    if (!thread_.joinable())
+        return;
+    stop_.store(true);
+    thread_.join();
+#ifndef _WIN32
+    close(listen_fd_);
+#endif
+    listen_fd_ = -1;
+}
+
+void MetricsServer::Run()
+{
+#ifndef _WIN32
+    pollfd pfd{listen_fd_, POLLIN, 0};
+    while (!stop_.load())
+    {
+        // woken up now and then to see if it should stop
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        Answer(fd);
+        close(fd);
+    }
+#endif
+}
+
+void MetricsServer::Answer(int fd)
+{
+#ifdef _WIN32
+    (void)fd;
+#else
+    // a client that stalls costs a second, not the server
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return;
+        request.append(buf, (size_t)n);
+    }
+
+    bool metrics = request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0;
+    std::string body = metrics ? registry_.Render() : "not found\n";
+    std::string response = metrics ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n";
+    response += "Content-Type: text/plain; version=0.0.4\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "Connection: close\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        sent += (size_t)n;
+    }
+#endif
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "metrics.h"
+#include <atomic>
+#include <thread>
+
+// answers GET /metrics on 127.0.0.1 with the registry's text, one request at a time on a
+// thread of its own. Linux and macOS only, Start() fails elsewhere
+class MetricsServer
+{
+  public:
+    explicit MetricsServer(const MetricsRegistry &registry) : registry_(registry) {}
+    ~MetricsServer();
+
+    static bool Supported();
+
+    // port 0 takes any free one, see Port()
+    bool Start(int port);
+    void Stop();
+    bool IsRunning() const { return thread_.joinable(); }
+    int Port() const { return port_; }
+
+  private:
+    void Run();
+    void Answer(int fd);
+
+    const MetricsRegistry &registry_;
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    int listen_fd_ = -1;
+    int port_ = 0;
+};
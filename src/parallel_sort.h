@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+// merges the sorted runs [first + bounds[i], first + bounds[i + 1]) into one, pairwise so
+// it costs O(n log runs). bounds starts at 0 and ends with the total size
+template <typename It, typename Compare>
+void MergeRuns(It first, std::vector<size_t> bounds, Compare comp)
+{
+    while (bounds.size() > 2)
+    {
+        std::vector<size_t> next{0};
+        size_t i = 0;
+        for (; i + 2 < bounds.size(); i += 2)
+        {
+            std::inplace_merge(first + bounds[i], first + bounds[i + 1], first + bounds[i + 2],
+                               comp);
+            next.push_back(bounds[i + 2]);
+        }
+        if (i + 1 < bounds.size())
+            next.push_back(bounds.back());
+        bounds.swap(next);
+    }
+}
+
+// sorts chunks of [first, last) on separate threads, then merges neighbouring runs pairwise
+// small ranges just use std::sort. not stable
+template <typename It, typename Compare>
+void ParallelSort(It first, It last, Compare comp, size_t min_chunk = 16384)
+{
+    size_t n = (size_t)std::distance(first, last);
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::min(threads, n / std::max<size_t>(1, min_chunk));
+
+    if (chunks < 2)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    std::vector<size_t> bounds(chunks + 1);
+    for (size_t i = 0; i <= chunks; i++)
+        bounds[i] = n * i / chunks;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < chunks; i++)
+    {
+        auto lo = bounds[i], hi = bounds[i + 1];
+        workers.emplace_back([=] { std::sort(first + lo, first + hi, comp); });
+    }
+    for (auto &t : workers)
+        t.join();
+
+    // merge pairs of runs until only one is left
+    while (bounds.size() > 2)
+    {
+        std::vector<size_t> next{0};
+        workers.clear();
+
+        size_t i = 0;
+        for (; i + 2 < bounds.size(); i += 2)
+        {
+            auto lo = first + bounds[i], mid = first + bounds[i + 1], hi = first + bounds[i + 2];
+            workers.emplace_back([=] { std::inplace_merge(lo, mid, hi, comp); });
+            next.push_back(bounds[i + 2]);
+        }
+        if (i + 1 < bounds.size())
+            next.push_back(bounds.back());
+
+        for (auto &t : workers)
+            t.join();
+        bounds.swap(next);
+    }
+}
@@ -0,0 +1,35 @@
+#include "perf_stats.h"
+
+void PerfTimer::Add(std::chrono::nanoseconds duration)
+{
+    uint64_t ns = duration.count() > 0 ? (uint64_t)duration.count() : 0;
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && us >= BucketLimitUs(bucket))
+        bucket++;
+
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(ns, std::memory_order_relaxed);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// the fields are read one by one, a snapshot taken during an Add() may be off by that one
+PerfTimer::Snapshot PerfTimer::Take() const
+{
+    Snapshot s;
+    s.count = count_.load(std::memory_order_relaxed);
+    s.total_ns = total_ns_.load(std::memory_order_relaxed);
+    for (int i = 0; i < kBuckets; i++)
+        s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    return s;
+}
+
+PerfTimer::Snapshot PerfTimer::Snapshot::Since(const Snapshot &older) const
+{
+    Snapshot s;
+    s.count = count - older.count;
+    s.total_ns = total_ns - older.total_ns;
+    for (int i = 0; i < kBuckets; i++)
+        s.buckets[i] = buckets[i] - older.buckets[i];
+    return s;
+}
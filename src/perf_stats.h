@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// durations of one kind of event, for the performance overlay: how many, their sum and a
+// histogram in power of two microseconds. Add() may run on any thread, the audio callback
+// included, it only touches relaxed atomics. nothing is kept unless the overlay is open
+class PerfTimer
+{
+  public:
+    // under 1 us, under 2 us, ... under 262 ms, and longer
+    static constexpr int kBuckets = 20;
+
+    struct Snapshot
+    {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        std::array<uint64_t, kBuckets> buckets{};
+
+        double MeanUs() const { return count > 0 ? total_ns / 1000.0 / count : 0.0; }
+        // what happened between older and this one
+        Snapshot Since(const Snapshot &older) const;
+    };
+
+    // one relaxed load, the only cost of a timed spot while the overlay is closed
+    static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+    void Add(std::chrono::nanoseconds duration);
+    Snapshot Take() const;
+
+    // upper end of bucket i in microseconds
+    static uint64_t BucketLimitUs(int i) { return uint64_t(1) << i; }
+
+  private:
+    static inline std::atomic<bool> enabled_{false};
+
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> total_ns_{0};
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+};
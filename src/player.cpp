@@ -1,28 +1,122 @@
 #include "player.h"
+#include "alloc_counter.h"
+#include "bank_prefetch.h"
 #include "logger.h"
-#include "pmdmini.h"
+#include "song_info.h"
+#include "trace.h"
 #include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
 #include <vector>
 
-Player::Player()
+namespace
 {
+
+using Ms = std::chrono::duration<double, std::milli>;
+
+// prefetched tracks kept around, the upcoming one and the selection
+constexpr size_t kPrefetchKeep = 4;
+
+constexpr int kIntroSeconds = 2;
+
+// level of the current track under a hover preview, and how fast it gets there
+constexpr float kPreviewDuck = 0.3f;
+constexpr float kDuckSeconds = 0.05f;
+
+// variant switch: the new file is pre-rolled to this far ahead of the play position, then
+// the two are crossfaded. fast forward renders in large blocks, the output is thrown away
+constexpr int kSwitchLeadMs = 10;
+constexpr int kSwitchFadeMs = 20;
+constexpr int kSeekBlockFrames = 16384;
+
+// YM2608 rhythm samples, loaded by Engine::Init() from the PCM folder
+constexpr const char *kRhythmFiles[] = {"2608_bd.wav", "2608_sd.wav",  "2608_top.wav",
+                                        "2608_hh.wav", "2608_tom.wav", "2608_rim.wav"};
+
+// name as written, then upper and lower case, like the driver's own lookup
+std::filesystem::path FindInDir(const std::filesystem::path &dir, std::string name)
+{
+    std::error_code ec;
+    for (int pass = 0; pass < 3; pass++)
+    {
+        if (pass > 0)
+        {
+            std::transform(name.begin(), name.end(), name.begin(),
+                           [pass](unsigned char c)
+                           { return (char)(pass == 1 ? std::toupper(c) : std::tolower(c)); });
+        }
+        auto p = dir / name;
+        if (std::filesystem::is_regular_file(p, ec))
+            return p;
+    }
+    return {};
+}
+
+// bank files named in the song's memo table
+std::vector<std::filesystem::path> FindSampleBanks(const std::filesystem::path &song)
+{
+    std::vector<std::filesystem::path> banks;
+    std::ifstream f(song, std::ios::binary);
+    if (!f)
+        return banks;
+
+    std::vector<uint8_t> data(kMaxPmdSize);
+    f.read(reinterpret_cast<char *>(data.data()), (std::streamsize)data.size());
+    SongInfo info;
+    if (!ParsePmdInfo(data.data(), (size_t)f.gcount(), info))
+        return banks;
+
+    for (auto *name : {&info.pcm_file, &info.pps_file, &info.ppz_file})
+    {
+        if (name->empty())
+            continue;
+        // the memo may carry a PC-98 drive path, only the file name is looked up
+        auto file = std::filesystem::path(*name).filename().string();
+        if (auto p = FindInDir(song.parent_path(), file); !p.empty())
+            banks.push_back(std::move(p));
+    }
+    return banks;
+}
+
+} // namespace
+
+Player::Player(std::unique_ptr<AudioSink> sink, Clock &clock)
+    : clock_(clock), sink_(sink ? std::move(sink) : std::make_unique<SdlSink>())
+{
+    intro_cache_.SetFormat(sample_rate_, IntroFrames(sample_rate_));
     stop_decode_.store(false);
+    // on the clock before it starts, time can't move on without it
+    clock_.AddThread();
     decode_thread_ = std::thread(&Player::DecodeThread, this);
+    prefetch_thread_ = std::thread(&Player::PrefetchThread, this);
 }
 
 Player::~Player()
 {
-    stop_decode_.store(true);
-    request_cv_.notify_one();
+    {
+        // under the lock, a decode thread about to wait can't miss it
+        std::lock_guard lock(request_mutex_);
+        stop_decode_.store(true);
+    }
+    clock_.Notify(request_cv_);
 
     if (decode_thread_.joinable())
         decode_thread_.join();
+    CancelSwitch();
 
-    if (loaded_.load())
-        pmd_stop();
+    {
+        std::lock_guard lock(prefetch_mutex_);
+        prefetch_stop_ = true;
+    }
+    prefetch_cv_.notify_one();
+    if (prefetch_thread_.joinable())
+        prefetch_thread_.join();
 
+    engine_->Stop();
     ShutdownAudio();
 }
 
@@ -47,15 +141,7 @@ std::vector<std::string> Player::NormalizeDeviceList(const std::vector<std::stri
 
 std::vector<std::string> Player::ListOutputDevices()
 {
-    std::vector<std::string> devices;
-    int count = SDL_GetNumAudioDevices(0);
-    for (int i = 0; i < count; i++)
-    {
-        auto name = SDL_GetAudioDeviceName(i, 0);
-        if (name)
-            devices.emplace_back(name);
-    }
-    return NormalizeDeviceList(devices);
+    return NormalizeDeviceList(SdlSink::ListDevices());
 }
 
 bool Player::Load(const std::filesystem::path &path)
@@ -66,30 +152,94 @@ bool Player::Load(const std::filesystem::path &path)
         request_pending_ = true;
     }
     loading_.store(true);
+    start_pending_.store(true);
     track_ended_.store(false);
-    request_cv_.notify_one();
+    clock_.Notify(request_cv_);
+    return true;
+}
+
+bool Player::SwitchVariant(const std::filesystem::path &path)
+{
+    if (!loaded_.load() || state_.load() == PlayerState::Stopped)
+        return false;
+
+    {
+        std::lock_guard lock(request_mutex_);
+        switch_path_ = path;
+        switch_pending_ = true;
+    }
+    spliced_at_.store(-1);
+    clock_.Notify(request_cv_);
     return true;
 }
 
+void Player::Prefetch(const std::filesystem::path &path)
+{
+    {
+        std::lock_guard lock(prefetch_mutex_);
+        prefetch_request_ = path;
+    }
+    prefetch_cv_.notify_one();
+}
+
+void Player::CacheIntros(const std::vector<std::filesystem::path> &paths)
+{
+    intro_cache_.Request(paths);
+}
+
+bool Player::Preview(const std::filesystem::path &path)
+{
+    auto intro = intro_cache_.Find(path);
+    if (!intro)
+    {
+        intro_cache_.Prioritize(path);
+        return false;
+    }
+
+    {
+        std::lock_guard lock(request_mutex_);
+        preview_request_ = std::move(intro);
+        preview_pending_ = true;
+    }
+    clock_.Notify(request_cv_);
+    return true;
+}
+
+void Player::StopPreview()
+{
+    {
+        std::lock_guard lock(request_mutex_);
+        preview_request_.reset();
+        preview_pending_ = true;
+    }
+    clock_.Notify(request_cv_);
+}
+
 void Player::Play()
 {
-    if (device_)
-        SDL_PauseAudioDevice(device_, 0);
+    // a track being loaded starts once there is something of it to play
+    if (!start_pending_.load())
+        sink_->Pause(false);
     state_.store(PlayerState::Playing);
 }
 
 void Player::Pause()
 {
-    if (device_)
-        SDL_PauseAudioDevice(device_, 1);
+    sink_->Pause(true);
     state_.store(PlayerState::Paused);
 }
 
 void Player::Stop()
 {
-    if (device_)
-        SDL_PauseAudioDevice(device_, 1);
-    audio_ring_.Clear();
+    sink_->Pause(true);
+    // a switch not handed over yet is dropped, the decoder goes on in the ring it fills
+    sink_->Lock();
+    rings_[0].Clear();
+    rings_[1].Clear();
+    switch_at_.store(-1);
+    switch_faded_ = 0;
+    played_.store(0);
+    sink_->Unlock();
     viz_ring_.Clear();
     position_samples_.store(0);
     track_ended_.store(false);
@@ -110,9 +260,11 @@ void Player::StartFadeOut(int duration_ms)
     float total_samples = (duration_ms / 1000.0f) * sample_rate_ * channels_;
     if (total_samples < 1.0f)
         total_samples = 1.0f;
+    sink_->Lock();
     fade_target_ = 0.0f;
     fade_delta_ = -fade_gain_ / total_samples;
     fade_out_complete_.store(false);
+    sink_->Unlock();
 }
 
 void Player::SetPendingFadeIn(int duration_ms)
@@ -122,10 +274,12 @@ void Player::SetPendingFadeIn(int duration_ms)
 
 void Player::ResetFade()
 {
+    sink_->Lock();
     fade_gain_ = 1.0f;
     fade_target_ = 1.0f;
     fade_delta_ = 0.0f;
     fade_out_complete_.store(false);
+    sink_->Unlock();
 }
 
 bool Player::IsFadeOutComplete()
@@ -135,7 +289,10 @@ bool Player::IsFadeOutComplete()
 
 bool Player::IsFadingIn() const
 {
-    return fade_target_ == 1.0f && fade_delta_ > 0.0f;
+    sink_->Lock();
+    bool fading = fade_target_ == 1.0f && fade_delta_ > 0.0f;
+    sink_->Unlock();
+    return fading;
 }
 
 void Player::SetOutputDevice(const std::string &name)
@@ -149,16 +306,9 @@ void Player::SetOutputDevice(const std::string &name)
         output_device_ = next;
     }
 
-    if (device_)
-    {
-        SDL_CloseAudioDevice(device_);
-        device_ = 0;
-    }
-
+    sink_->Close();
     if (InitAudio(sample_rate_, channels_))
-    {
-        SDL_PauseAudioDevice(device_, state_.load() != PlayerState::Playing);
-    }
+        sink_->Pause(state_.load() != PlayerState::Playing);
 }
 
 PlayerState Player::GetState() const
@@ -175,11 +325,96 @@ std::string Player::GetOutputDevice() const
 }
 TrackInfo Player::GetTrackInfo() const
 {
+    std::lock_guard lock(track_mutex_);
     return track_;
 }
+TrackLength Player::GetTrackLength() const
+{
+    std::lock_guard lock(track_mutex_);
+    return {track_.sample_rate, track_.duration_known, track_.duration_samples};
+}
+LoadTiming Player::GetLoadTiming() const
+{
+    std::lock_guard lock(timing_mutex_);
+    return timing_;
+}
+
+SwitchTiming Player::GetSwitchTiming() const
+{
+    std::lock_guard lock(timing_mutex_);
+    SwitchTiming timing = switch_timing_;
+    timing.spliced_at = spliced_at_.load();
+    return timing;
+}
+void Player::SetIntroBudget(size_t bytes)
+{
+    intro_cache_.SetBudget(bytes);
+}
+void Player::SetRenderProcess(bool enabled)
+{
+    render_process_.store(enabled);
+}
+IntroCacheStats Player::GetIntroStats() const
+{
+    return intro_cache_.Stats();
+}
 int64_t Player::GetPositionSamples() const
 {
-    return position_samples_.load();
+    return played_.load();
+}
+uint64_t Player::GetUnderruns() const
+{
+    return underrun_count_.load();
+}
+
+float Player::GetBufferFill() const
+{
+    return (float)rings_[main_ring_.load()].Available() / ring_capacity_;
+}
+
+void Player::RegisterMetrics(MetricsRegistry &registry)
+{
+    using R = MetricsRegistry;
+    registry.AddCounter("pmdmini_underruns_total", "Callbacks that found the audio ring short",
+                        R::Value(underrun_count_));
+    registry.AddCounter("pmdmini_dropped_samples_total",
+                        "Rendered samples the full audio ring had no room for",
+                        R::Value(counts_.dropped_samples));
+    registry.AddHistogram("pmdmini_decode_block_seconds", "Rendering one block of a song",
+                          perf_.decode);
+    registry.AddCounter("pmdmini_decoded_audio_seconds_total",
+                        "Length of the audio those blocks hold",
+                        R::Value(perf_.decoded_ns, 1e-9));
+    registry.AddGauge("pmdmini_decode_realtime_factor",
+                      "Seconds of audio rendered per second of rendering, since the start",
+                      [this]
+                      {
+                          double render_ns = (double)perf_.decode.Take().total_ns;
+                          double audio_ns = (double)perf_.decoded_ns.load();
+                          return render_ns > 0 ? audio_ns / render_ns : 0.0;
+                      });
+    registry.AddHistogram("pmdmini_callback_seconds", "Audio callback duration", perf_.callback);
+    registry.AddHistogram("pmdmini_callback_jitter_seconds",
+                          "How far a callback came early or late on the one before",
+                          perf_.jitter);
+    registry.AddCounter("pmdmini_track_loads_total", "Tracks loaded", R::Value(counts_.loads));
+    registry.AddCounter("pmdmini_track_load_failures_total", "Tracks that failed to load",
+                        R::Value(counts_.load_failures));
+    registry.AddHistogram("pmdmini_track_load_seconds",
+                          "Load until there was something to play", counts_.first_sound);
+    registry.AddCounter("pmdmini_intro_cache_hits_total", "Loads started from a cached intro",
+                        R::Value(counts_.intro_hits));
+    registry.AddCounter("pmdmini_prefetch_hits_total", "Loads of a prefetched track",
+                        R::Value(counts_.prefetch_hits));
+    registry.AddCounter("pmdmini_sample_banks_total", "Sample banks loaded with a track",
+                        R::Value(counts_.banks));
+    registry.AddCounter("pmdmini_sample_bank_cache_hits_total",
+                        "Sample banks that were still prefetched", R::Value(counts_.banks_cached));
+}
+
+void Player::SetUnderrunReports(const std::filesystem::path &dir)
+{
+    recorder_.SetDirectory(dir);
 }
 
 bool Player::HasTrackEnded()
@@ -200,99 +435,176 @@ size_t Player::ReadWaveform(float *out, size_t count)
 
 void Player::DecodeThread()
 {
-    const int frames = 1024;
+    TRACE_THREAD("decode");
+    const int frames = IntroCache::kBlockFrames;
     std::vector<int16_t> pcm(frames * channels_);
     std::vector<float> float_pcm(frames * channels_);
 
     uint64_t last_underrun = 0;
-    auto last_log = std::chrono::steady_clock::now();
+    auto last_log = clock_.Now();
+    bool first_render = false;
 
     while (!stop_decode_.load())
     {
         std::filesystem::path request_path;
+        std::filesystem::path switch_path;
+        bool preview_changed = false;
+        std::shared_ptr<const IntroBuffer> preview;
         {
+            // requests are only waited for when there's nothing to render
+            bool busy = state_.load() == PlayerState::Playing && loaded_.load() &&
+                        rings_[write_ring_].Available() <= ring_capacity_ * 3 / 4;
             std::unique_lock lock(request_mutex_);
-            request_cv_.wait_for(lock, std::chrono::milliseconds(5),
-                                 [this] { return request_pending_ || stop_decode_.load(); });
+            if (!busy)
+                clock_.WaitFor(lock, request_cv_, std::chrono::milliseconds(5),
+                               [this] { return RequestPending(); });
 
             if (request_pending_)
             {
                 request_path = pending_path_;
                 request_pending_ = false;
+                switch_pending_ = false; // the new track replaces whatever it was for
+            }
+            if (switch_pending_)
+            {
+                switch_path = std::move(switch_path_);
+                switch_pending_ = false;
+            }
+            if (preview_pending_)
+            {
+                preview_changed = true;
+                preview = std::move(preview_request_);
+                preview_pending_ = false;
             }
         }
 
+        if (preview_changed)
+            SetPreview(std::move(preview));
+        else if (preview_done_.exchange(false))
+            SetPreview(nullptr);
+
         if (!request_path.empty())
         {
             loading_.store(true);
             bool ok = DoLoad(request_path);
+            counts_.loads.fetch_add(1, std::memory_order_relaxed);
+            if (!ok)
+                counts_.load_failures.fetch_add(1, std::memory_order_relaxed);
             loaded_.store(ok);
             loading_.store(false);
-
-            if (ok)
-            {
-                int fade_ms = pending_fade_in_ms_.exchange(0);
-                if (fade_ms > 0)
-                {
-                    float total = (fade_ms / 1000.0f) * sample_rate_ * channels_;
-                    if (total < 1.0f)
-                        total = 1.0f;
-                    fade_gain_ = 0.0f;
-                    fade_target_ = 1.0f;
-                    fade_delta_ = 1.0f / total;
-                    fade_out_complete_.store(false);
-                }
-                else
-                {
-                    ResetFade();
-                }
-
-                if (state_.load() == PlayerState::Playing)
-                    SDL_PauseAudioDevice(device_, 0);
-            }
+            first_render = ok;
+        }
+        else if (!switch_path.empty() && loaded_.load())
+        {
+            queued_switch_ = std::move(switch_path);
         }
+        UpdateSwitch();
 
         if (state_.load() != PlayerState::Playing || !loaded_.load())
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            Idle(std::chrono::milliseconds(10));
             continue;
         }
 
-        // check if track ended (position >= duration)
+        // the track ends once all of it has been heard, not when the last block is rendered
+        int block = frames;
         if (track_.duration_known)
         {
             auto pos = position_samples_.load();
+            if (pos >= track_.duration_samples &&
+                (switching_ || rings_[write_ring_].Available() > 0))
+            {
+                Idle(std::chrono::milliseconds(1));
+                continue;
+            }
             if (pos >= track_.duration_samples)
             {
-                track_ended_.store(true);
-                state_.store(PlayerState::Stopped);
+                {
+                    // a track loaded meanwhile has been told to play, it isn't stopped
+                    std::lock_guard lock(request_mutex_);
+                    if (request_pending_)
+                        continue;
+                    track_ended_.store(true);
+                    state_.store(PlayerState::Stopped);
+                }
 
                 std::lock_guard lock(callback_mutex_);
                 if (on_track_end_)
                     on_track_end_();
                 continue;
             }
+            block = (int)std::min<int64_t>(frames, track_.duration_samples - pos);
+            // set before the callback can see the ring run dry on it
+            tail_rendered_.store(block == track_.duration_samples - pos);
         }
 
-        auto available = audio_ring_.Available();
-        if (available > ring_capacity_ * 3 / 4)
+        RingBuffer &ring = rings_[write_ring_];
+        if (ring.Available() > ring_capacity_ * 3 / 4)
         {
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(FrameDurationMs(frames, sample_rate_)));
+            Idle(std::chrono::milliseconds(FrameDurationMs(frames, sample_rate_)));
             continue;
         }
 
-        pmd_renderer(pcm.data(), frames);
+        TRACE_SCOPE("Player::DecodeBlock");
+        auto render_start = std::chrono::steady_clock::now();
+        engine_->Render(pcm.data(), block);
+        bool timed = PerfTimer::Enabled();
+        bool recorded = recorder_.Active();
+        std::chrono::steady_clock::duration took{};
+        if (timed || recorded)
+            took = std::chrono::steady_clock::now() - render_start;
+        if (timed)
+        {
+            perf_.decode.Add(took);
+            perf_.decoded_ns.fetch_add((uint64_t)block * 1000000000 / sample_rate_,
+                                       std::memory_order_relaxed);
+        }
+        if (first_render)
+        {
+            first_render = false;
+            std::lock_guard lock(timing_mutex_);
+            timing_.first_render_ms = Ms(std::chrono::steady_clock::now() - render_start).count();
+            if (timing_.intro_frames == 0)
+            {
+                timing_.first_sound_ms = timing_.io_wait_ms + timing_.init_ms +
+                                         timing_.play_ms + timing_.first_render_ms;
+            }
+            counts_.first_sound.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Ms(timing_.first_sound_ms)));
+            counts_.intro_hits.fetch_add(timing_.intro_frames > 0, std::memory_order_relaxed);
+            counts_.prefetch_hits.fetch_add(timing_.prefetched, std::memory_order_relaxed);
+            counts_.banks.fetch_add(timing_.banks, std::memory_order_relaxed);
+            counts_.banks_cached.fetch_add(timing_.banks_cached, std::memory_order_relaxed);
+            Logger::Info("Load " + track_.display_name + ": first sound " +
+                         std::to_string(timing_.first_sound_ms) + " ms" +
+                         (timing_.intro_frames > 0 ? " (cached intro)" : "") + ", io wait " +
+                         std::to_string(timing_.io_wait_ms) + " ms" +
+                         (timing_.prefetched ? " (prefetched)" : "") + ", banks " +
+                         std::to_string(timing_.banks_cached) + "/" +
+                         std::to_string(timing_.banks) + " cached, init " +
+                         (timing_.driver_reused ? std::string("kept")
+                                                : std::to_string(timing_.init_ms) + " ms") +
+                         ", play " + std::to_string(timing_.play_ms) + " ms (driver load " +
+                         std::to_string(timing_.load_ms) + " ms), first render " +
+                         std::to_string(timing_.first_render_ms) + " ms");
+        }
 
-        for (size_t i = 0; i < float_pcm.size(); i++)
+        size_t samples = (size_t)block * channels_;
+        for (size_t i = 0; i < samples; i++)
             float_pcm[i] = (float)pcm[i] / 32768.0f;
 
-        audio_ring_.Write(float_pcm.data(), float_pcm.size());
-        viz_ring_.Write(float_pcm.data(), float_pcm.size());
-        position_samples_.fetch_add(frames);
+        size_t written = ring.Write(float_pcm.data(), samples);
+        if (written < samples)
+            counts_.dropped_samples.fetch_add(samples - written, std::memory_order_relaxed);
+        viz_ring_.Write(float_pcm.data(), samples);
+        position_samples_.fetch_add(block);
+        if (recorded)
+            recorder_.Decode(render_start, took, block, ring.Available());
+        if (start_pending_.exchange(false))
+            sink_->Pause(false);
 
         auto underruns = underrun_count_.load();
-        auto now = std::chrono::steady_clock::now();
+        auto now = clock_.Now();
         if (underruns > last_underrun &&
             std::chrono::duration_cast<std::chrono::seconds>(now - last_log).count() >= 1)
         {
@@ -301,20 +613,48 @@ void Player::DecodeThread()
             last_log = now;
         }
     }
+    clock_.RemoveThread();
+}
+
+// under request_mutex_
+bool Player::RequestPending() const
+{
+    return request_pending_ || switch_pending_ || preview_pending_ || preroll_done_ ||
+           stop_decode_.load();
+}
+
+// the decode thread's pause, cut short by a request
+void Player::Idle(std::chrono::milliseconds ms)
+{
+    std::unique_lock lock(request_mutex_);
+    clock_.WaitFor(lock, request_cv_, ms, [this] { return RequestPending(); });
 }
 
 bool Player::DoLoad(const std::filesystem::path &path)
 {
+    auto load_start = std::chrono::steady_clock::now();
+    CancelSwitch();
     if (loaded_.load())
     {
-        pmd_stop();
+        engine_->Stop();
         loaded_.store(false);
     }
 
-    audio_ring_.Clear();
+    // nothing of the old track is heard past here, and the empty ring isn't an underrun
+    sink_->Pause(true);
+    sink_->Lock();
+    rings_[0].Clear();
+    rings_[1].Clear();
+    main_ring_.store(0);
+    switch_at_.store(-1);
+    switch_faded_ = 0;
+    played_.store(0);
+    sink_->Unlock();
+    write_ring_ = 0;
     viz_ring_.Clear();
     position_samples_.store(0);
     track_ended_.store(false);
+    tail_rendered_.store(false);
 
     auto pcm_dir = path.parent_path().string();
     if (pcm_dir.empty())
@@ -323,120 +663,573 @@ bool Player::DoLoad(const std::filesystem::path &path)
     if (!InitAudio(sample_rate_, channels_))
         return false;
 
-    pmd_init(pcm_dir.data());
-    pmd_setrate(sample_rate_);
+    LoadTiming timing;
+
+    // a cached intro plays right away, the decoder joins in behind it once the driver is
+    // ready. its last block is held back and crossfaded with the decoder's own render of
+    // it, in case the driver state differs
+    auto intro = channels_ == 2 ? intro_cache_.Find(path) : nullptr;
+    if (intro && (intro->sample_rate != sample_rate_ ||
+                  intro->Frames() <= (size_t)IntroCache::kBlockFrames))
+        intro = nullptr;
+    std::vector<float> splice;
+    if (intro)
+    {
+        size_t lead = intro->pcm.size() - IntroCache::kBlockFrames * 2;
+        std::vector<float> pcm(intro->pcm.size());
+        for (size_t i = 0; i < pcm.size(); i++)
+            pcm[i] = (float)intro->pcm[i] / 32768.0f;
+        rings_[0].Write(pcm.data(), lead);
+        viz_ring_.Write(pcm.data(), lead);
+        splice.assign(pcm.begin() + (std::ptrdiff_t)lead, pcm.end());
+        position_samples_.store((int64_t)(lead / 2));
+
+        ApplyPendingFadeIn();
+        if (state_.load() == PlayerState::Playing)
+            sink_->Pause(false);
+        timing.intro_frames = intro->Frames();
+        timing.first_sound_ms = Ms(std::chrono::steady_clock::now() - load_start).count();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // the driver reads the banks itself, prefetching them here has its reads hit memory
+    std::vector<std::filesystem::path> banks;
+    timing.prefetched = TakePrefetched(path, banks);
+    if (!timing.prefetched)
+        banks = FindSampleBanks(path);
+    for (auto &bank : banks)
+    {
+        bool hit = false;
+        if (!BankPrefetch::Instance().Acquire(bank, &hit))
+            continue;
+        timing.banks++;
+        timing.banks_cached += hit ? 1 : 0;
+    }
+    auto banks_done = std::chrono::steady_clock::now();
+    timing.io_wait_ms = Ms(banks_done - start).count();
+
+    // moving the driver in or out of a render host takes a fresh Engine::Init()
+    if (engine_->Isolated() != render_process_.load())
+    {
+        engine_->SetIsolated(render_process_.load());
+        driver_dir_.clear();
+    }
 
-    auto path_str = path.string();
-    char *argv[4] = {(char *)"pmdmini-gui", path_str.data(), nullptr, nullptr};
+    // Engine::Init() reloads the rhythm samples, so the driver is only reset when the
+    // folder or the rate changed
+    timing.driver_reused = pcm_dir == driver_dir_ && sample_rate_ == driver_rate_;
+    if (!timing.driver_reused)
+        InitDriver(pcm_dir);
+    auto init_done = std::chrono::steady_clock::now();
+    timing.init_ms = Ms(init_done - banks_done).count();
 
-    if (pmd_play(argv, pcm_dir.data()) != 0)
+    bool ok = engine_->Play(path, pcm_dir);
+    if (!ok && timing.driver_reused)
+    {
+        // a kept driver gets one retry from a clean state before giving up
+        InitDriver(pcm_dir);
+        timing.driver_reused = false;
+        ok = engine_->Play(path, pcm_dir);
+    }
+    if (!ok)
     {
-        pmd_stop();
+        driver_dir_.clear();
+        if (intro)
+        {
+            sink_->Pause(true);
+            rings_[0].Clear();
+            viz_ring_.Clear();
+        }
         return false;
     }
+    timing.play_ms = Ms(std::chrono::steady_clock::now() - init_done).count();
+    timing.load_ms = engine_->LoadMs();
 
-    track_.path = path;
-    track_.display_name = path.filename().string();
-    track_.sample_rate = sample_rate_;
-    track_.channels = channels_;
+    if (intro)
+    {
+        // catch the driver up with the intro, rendering in the same blocks it was made of
+        std::vector<int16_t> block(IntroCache::kBlockFrames * 2);
+        for (size_t done = IntroCache::kBlockFrames; done < intro->Frames();
+             done += IntroCache::kBlockFrames)
+            engine_->Render(block.data(), IntroCache::kBlockFrames);
+        engine_->Render(block.data(), IntroCache::kBlockFrames);
+
+        for (size_t i = 0; i < splice.size(); i++)
+        {
+            float t = (float)(i / 2) / IntroCache::kBlockFrames;
+            splice[i] = splice[i] * (1.0f - t) + (float)block[i] / 32768.0f * t;
+        }
+        rings_[0].Write(splice.data(), splice.size());
+        viz_ring_.Write(splice.data(), splice.size());
+        position_samples_.fetch_add(IntroCache::kBlockFrames);
+    }
 
-    int len_sec = pmd_length_sec();
-    track_.duration_known = len_sec > 0;
-    track_.duration_samples = track_.duration_known ? (int64_t)len_sec * sample_rate_ : 0;
+    {
+        std::lock_guard lock(timing_mutex_);
+        timing_ = timing;
+    }
 
-    SDL_PauseAudioDevice(device_, 1);
+    int len_sec = engine_->LengthSec();
+    {
+        std::lock_guard lock(track_mutex_);
+        track_.path = path;
+        track_.display_name = path.filename().string();
+        track_.sample_rate = sample_rate_;
+        track_.channels = channels_;
+        track_.duration_known = len_sec > 0;
+        track_.duration_samples = track_.duration_known ? (int64_t)len_sec * sample_rate_ : 0;
+    }
+    recorder_.SetTrack(path.string());
+
+    if (!intro)
+    {
+        ApplyPendingFadeIn();
+        sink_->Pause(true);
+    }
     return true;
 }
 
-bool Player::InitAudio(int sample_rate, int channels)
+// moves a variant switch on: a handover the callback finished, a pre-roll that is done, and
+// a request waiting for the switch before it
+void Player::UpdateSwitch()
+{
+    if (switching_ && switch_at_.load(std::memory_order_acquire) < 0)
+    {
+        // Stop() drops a switch the callback didn't get to, the new file plays on its own
+        switching_ = false;
+        main_ring_.store(write_ring_);
+    }
+
+    if (preroll_thread_.joinable())
+    {
+        // a newer request makes the one being pre-rolled pointless
+        if (!queued_switch_.empty())
+            preroll_cancel_.store(true);
+        {
+            std::lock_guard lock(request_mutex_);
+            if (!preroll_done_)
+                return;
+            preroll_done_ = false;
+        }
+        FinishPreroll();
+    }
+
+    if (!queued_switch_.empty() && !switching_)
+    {
+        auto path = std::move(queued_switch_);
+        queued_switch_.clear();
+        BeginSwitch(path);
+    }
+}
+
+// the driver has no seek, the new file is rendered from its start up to the play position
+// and the output dropped. the reentrant driver and a render host do that on a second engine
+// while the decoder goes on with the old file. pmdmini's shared driver plays one song at a
+// time, there the new file is fast forwarded in place of the old one and what is buffered
+// of that covers the wait
+void Player::BeginSwitch(const std::filesystem::path &path)
 {
-    if (SDL_WasInit(SDL_INIT_AUDIO) == 0)
+    switch_start_ = std::chrono::steady_clock::now();
+    preroll_cancel_.store(false);
+    if (Engine::Reentrant() || engine_->Host())
     {
-        if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
-            return false;
+        if (!preroll_engine_)
+            preroll_engine_ = std::make_unique<Engine>();
+        preroll_path_ = path;
+        preroll_thread_ = std::thread(&Player::PrerollThread, this, path);
+        return;
     }
 
-    // close existing device so multiple devices can't consume the same buffer
-    // without it they can consume from same ring buffer causing x3 speedup
-    if (device_)
+    auto old_path = track_.path;
+    PrefetchBanks(path);
+    int64_t frame = PlayOnDriver(path) ? Preroll(*engine_, -1) : -1;
+    if (frame >= 0)
     {
-        SDL_CloseAudioDevice(device_);
-        device_ = 0;
+        ArmSwitch(path, frame, false);
+        return;
     }
 
-    SDL_AudioSpec want{}, got{};
-    want.freq = sample_rate;
-    want.format = AUDIO_F32SYS;
-    want.channels = (Uint8)channels;
-    want.samples = 1024;
-    want.callback = &Player::SDLAudioCallback;
-    want.userdata = this;
+    // back to the old file where the buffer ends, playback goes on as if nothing happened
+    Logger::Warn("Failed to switch to " + path.filename().string());
+    if (!PlayOnDriver(old_path))
+    {
+        loaded_.store(false);
+        return;
+    }
+    Preroll(*engine_, position_samples_.load());
+}
+
+void Player::PrerollThread(std::filesystem::path path)
+{
+    TRACE_THREAD("preroll");
+    auto pcm_dir = path.parent_path().string();
+    if (pcm_dir.empty())
+        pcm_dir = ".";
+
+    PrefetchBanks(path);
+    Engine &engine = *preroll_engine_;
+    bool ok = true;
+    if (engine.Isolated() != render_process_.load() || pcm_dir != preroll_dir_ ||
+        sample_rate_ != preroll_rate_)
+    {
+        engine.SetIsolated(render_process_.load());
+        ok = engine.Init(pcm_dir, sample_rate_);
+        preroll_dir_ = ok ? pcm_dir : std::string();
+        preroll_rate_ = sample_rate_;
+    }
+    int64_t frame = ok && engine.Play(path, pcm_dir) ? Preroll(engine, -1) : -1;
 
-    std::string dev_name;
     {
         std::lock_guard lock(request_mutex_);
-        dev_name = output_device_;
+        preroll_frame_ = frame;
+        preroll_done_ = true;
+    }
+    clock_.Notify(request_cv_);
+}
+
+// the pre-rolled engine takes over from the decoder's own, which is kept for the next switch
+void Player::FinishPreroll()
+{
+    preroll_thread_.join();
+    if (preroll_cancel_.load())
+        return;
+    if (preroll_frame_ < 0)
+    {
+        // the old file plays on
+        Logger::Warn("Failed to switch to " + preroll_path_.filename().string());
+        return;
+    }
+
+    std::swap(engine_, preroll_engine_);
+    std::swap(driver_dir_, preroll_dir_);
+    std::swap(driver_rate_, preroll_rate_);
+    preroll_engine_->Stop();
+    ArmSwitch(preroll_path_, preroll_frame_, true);
+}
+
+// engine_ plays the new file and has rendered it up to frame. from here on the decoder fills
+// the other ring with it, and the callback takes over once playback gets to frame
+void Player::ArmSwitch(const std::filesystem::path &path, int64_t frame, bool background)
+{
+    // with no switch armed the callback plays the ring written so far, the other one is free
+    write_ring_ = 1 - write_ring_;
+    rings_[write_ring_].Clear();
+    switching_ = true;
+    position_samples_.store(frame);
+    tail_rendered_.store(false);
+    switch_fade_ = (size_t)sample_rate_ * kSwitchFadeMs / 1000;
+    int64_t heard = played_.load();
+    switch_at_.store(frame, std::memory_order_release);
+
+    int len_sec = engine_->LengthSec();
+    {
+        std::lock_guard lock(track_mutex_);
+        track_.path = path;
+        track_.display_name = path.filename().string();
+        track_.duration_known = len_sec > 0;
+        track_.duration_samples = track_.duration_known ? (int64_t)len_sec * sample_rate_ : 0;
+    }
+    recorder_.SetTrack(path.string());
+
+    SwitchTiming timing;
+    timing.preroll_ms = Ms(std::chrono::steady_clock::now() - switch_start_).count();
+    timing.background = background;
+    timing.rendered_from = frame;
+    timing.fade_frames = switch_fade_;
+    {
+        std::lock_guard lock(timing_mutex_);
+        switch_timing_ = timing;
+    }
+    double heard_ms = timing.preroll_ms + (double)std::max<int64_t>(0, frame - heard) * 1000.0 /
+                                              sample_rate_;
+    Logger::Info("Switch to " + path.filename().string() + " at " +
+                 std::to_string((double)frame / sample_rate_) + " s: pre-roll " +
+                 std::to_string(timing.preroll_ms) + " ms" +
+                 (background ? " (background)" : "") + ", heard after " +
+                 std::to_string(heard_ms) + " ms");
+}
+
+// drops a switch being pre-rolled or waiting for one. an armed switch is the callback's,
+// DoLoad() and Stop() disarm it under the sink lock
+void Player::CancelSwitch()
+{
+    queued_switch_.clear();
+    if (preroll_thread_.joinable())
+    {
+        preroll_cancel_.store(true);
+        preroll_thread_.join();
+        std::lock_guard lock(request_mutex_);
+        preroll_done_ = false;
     }
+    switching_ = false;
+}
 
-    auto dev_ptr = dev_name.empty() ? nullptr : dev_name.c_str();
+// banks found by an earlier prefetch of path or looked up now, into the page cache
+void Player::PrefetchBanks(const std::filesystem::path &path)
+{
+    std::vector<std::filesystem::path> banks;
+    if (!TakePrefetched(path, banks))
+        banks = FindSampleBanks(path);
+    for (auto &bank : banks)
+        BankPrefetch::Instance().Acquire(bank);
+}
 
-    // exact format
-    device_ = SDL_OpenAudioDevice(dev_ptr, 0, &want, &got, 0);
+// plays path on the decoder's engine, which is reset for another folder
+bool Player::PlayOnDriver(const std::filesystem::path &path)
+{
+    auto pcm_dir = path.parent_path().string();
+    if (pcm_dir.empty())
+        pcm_dir = ".";
+    bool reused = pcm_dir == driver_dir_ && sample_rate_ == driver_rate_;
+    if (!reused)
+        InitDriver(pcm_dir);
 
-    // retry with format negotiation
-    if (device_ == 0)
+    bool ok = engine_->Play(path, pcm_dir);
+    if (!ok && reused)
     {
-        device_ =
-            SDL_OpenAudioDevice(dev_ptr, 0, &want, &got,
-                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+        InitDriver(pcm_dir);
+        ok = engine_->Play(path, pcm_dir);
     }
+    if (!ok)
+        driver_dir_.clear();
+    return ok;
+}
 
-    // last resort: default device
-    if (device_ == 0 && dev_ptr != nullptr)
+// fast forwards the song engine just started to frame until, or to a little ahead of the play
+// position if until is -1, chasing it while playback goes on. the frame it got to
+int64_t Player::Preroll(Engine &engine, int64_t until)
+{
+    int64_t lead = (int64_t)sample_rate_ * kSwitchLeadMs / 1000;
+    int64_t length = engine.LengthSec() > 0 ? (int64_t)engine.LengthSec() * sample_rate_
+                                             : std::numeric_limits<int64_t>::max();
+    std::vector<int16_t> skip((size_t)kSeekBlockFrames * channels_);
+    int64_t pos = 0;
+    while (!stop_decode_.load() && !preroll_cancel_.load())
     {
-        Logger::Warn("Failed to open audio device, trying default");
-        device_ =
-            SDL_OpenAudioDevice(nullptr, 0, &want, &got,
-                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+        int64_t target = std::min(until >= 0 ? until : played_.load() + lead, length);
+        if (pos >= target)
+            break;
+        int n = (int)std::min<int64_t>(kSeekBlockFrames, target - pos);
+        engine.Render(skip.data(), n);
+        pos += n;
     }
+    return pos;
+}
 
-    if (device_ == 0)
+// fade in requested for this load, or full level. set before any of it is heard
+void Player::ApplyPendingFadeIn()
+{
+    int fade_ms = pending_fade_in_ms_.exchange(0);
+    if (fade_ms <= 0)
     {
-        Logger::Error("SDL audio init failed: " + std::string(SDL_GetError()));
+        ResetFade();
+        return;
+    }
+
+    float total = (fade_ms / 1000.0f) * sample_rate_ * channels_;
+    if (total < 1.0f)
+        total = 1.0f;
+    fade_gain_ = 0.0f;
+    fade_target_ = 1.0f;
+    fade_delta_ = 1.0f / total;
+    fade_out_complete_.store(false);
+}
+
+// swaps the preview the callback mixes in. the device runs for it if nothing plays
+void Player::SetPreview(std::shared_ptr<const IntroBuffer> intro)
+{
+    if (intro && !sink_->IsOpen() && !InitAudio(sample_rate_, channels_))
+        return;
+    if (!sink_->IsOpen())
+        return;
+    if (intro && (intro->sample_rate != sample_rate_ || channels_ != 2))
+        intro = nullptr;
+
+    sink_->Lock();
+    preview_ = intro.get();
+    preview_pos_ = 0;
+    preview_done_.store(false);
+    sink_->Unlock();
+    // the old buffer is released here, not in the callback
+    preview_owner_ = std::move(intro);
+
+    if (state_.load() != PlayerState::Playing)
+        sink_->Pause(preview_ == nullptr);
+}
+
+// two seconds, at most what the decoder keeps buffered, in whole render blocks
+size_t Player::IntroFrames(int sample_rate)
+{
+    size_t frames = std::min((size_t)sample_rate * kIntroSeconds, ring_capacity_ * 3 / 4 / 2);
+    return frames / IntroCache::kBlockFrames * IntroCache::kBlockFrames;
+}
+
+void Player::PrefetchThread()
+{
+    TRACE_THREAD("prefetch");
+    while (true)
+    {
+        std::filesystem::path song;
+        {
+            std::unique_lock lock(prefetch_mutex_);
+            prefetch_cv_.wait(lock,
+                              [this] { return prefetch_stop_ || !prefetch_request_.empty(); });
+            if (prefetch_stop_)
+                return;
+            song = std::move(prefetch_request_);
+            prefetch_request_.clear();
+        }
+
+        std::error_code ec;
+        auto modified = std::filesystem::last_write_time(song, ec);
+        if (ec)
+            continue;
+
+        // every read is queued before waiting on any, so a seeking disk can order them
+        AdviseWillNeed(song);
+        auto banks = FindSampleBanks(song);
+        for (auto &bank : banks)
+            AdviseWillNeed(bank);
+        for (auto &bank : banks)
+            BankPrefetch::Instance().Acquire(bank);
+
+        std::lock_guard lock(prefetch_mutex_);
+        auto same = [&](const Prefetched &p) { return p.song == song; };
+        prefetched_.erase(std::remove_if(prefetched_.begin(), prefetched_.end(), same),
+                          prefetched_.end());
+        if (prefetched_.size() >= kPrefetchKeep)
+            prefetched_.erase(prefetched_.begin());
+        prefetched_.push_back({std::move(song), modified, std::move(banks)});
+    }
+}
+
+// banks found by an earlier prefetch of path, if the file hasn't changed since
+bool Player::TakePrefetched(const std::filesystem::path &path,
+                            std::vector<std::filesystem::path> &banks)
+{
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(path, ec);
+    if (ec)
         return false;
+
+    std::lock_guard lock(prefetch_mutex_);
+    for (auto &p : prefetched_)
+    {
+        if (p.song == path && p.modified == modified)
+        {
+            banks = p.banks;
+            return true;
+        }
     }
+    return false;
+}
 
-    if (got.freq != want.freq || got.channels != want.channels)
+void Player::InitDriver(const std::string &pcm_dir)
+{
+    for (auto *name : kRhythmFiles)
     {
-        Logger::Warn("Audio device negotiated different format: " + std::to_string(got.freq) +
-                     "Hz " + std::to_string(got.channels) + "ch");
+        if (auto p = FindInDir(pcm_dir, name); !p.empty())
+            BankPrefetch::Instance().Acquire(p);
     }
 
-    sample_rate_ = got.freq;
-    channels_ = got.channels;
-    return true;
+    engine_->Init(pcm_dir, sample_rate_);
+    driver_dir_ = pcm_dir;
+    driver_rate_ = sample_rate_;
 }
 
-void Player::ShutdownAudio()
+bool Player::InitAudio(int sample_rate, int channels)
 {
-    if (device_)
+    std::string dev_name;
     {
-        SDL_CloseAudioDevice(device_);
-        device_ = 0;
+        std::lock_guard lock(request_mutex_);
+        dev_name = output_device_;
     }
+
+    // the open device is kept from track to track, reopening one can take a while
+    if (sink_->IsOpen() && sink_->Device() == dev_name && sink_->SampleRate() == sample_rate &&
+        sink_->Channels() == channels)
+    {
+        sink_->Pause(true);
+        return true;
+    }
+
+    if (!sink_->Open(dev_name, sample_rate, channels, &Player::AudioCallback, this))
+        return false;
+
+    // read by the other threads without a lock, only written when the device changes them
+    if (sink_->SampleRate() != sample_rate_ || sink_->Channels() != channels_)
+    {
+        sample_rate_ = sink_->SampleRate();
+        channels_ = sink_->Channels();
+        intro_cache_.SetFormat(sample_rate_, IntroFrames(sample_rate_));
+    }
+    return true;
 }
 
-void Player::SDLAudioCallback(void *userdata, Uint8 *stream, int len)
+void Player::ShutdownAudio()
 {
+    sink_->Close();
+}
+
+void Player::AudioCallback(void *userdata, float *out, size_t samples)
+{
+    TRACE_SCOPE("Player::AudioCallback");
     auto player = (Player *)userdata;
-    auto out = (float *)stream;
-    size_t samples = len / sizeof(float);
+    bool timed = PerfTimer::Enabled();
+    bool recorded = player->recorder_.Active();
+    if (!timed && !recorded)
+    {
+        player->last_callback_ = {};
+        Mix(player, out, samples);
+        return;
+    }
+
+    // jitter: a callback due when the block of the one before has played, early or late
+    auto start = std::chrono::steady_clock::now();
+    if (timed && player->last_callback_ != std::chrono::steady_clock::time_point{})
+    {
+        auto due = player->last_callback_ +
+                   std::chrono::nanoseconds((int64_t)player->last_callback_frames_ *
+                                            1000000000 / player->sample_rate_);
+        player->perf_.jitter.Add(start > due ? start - due : due - start);
+    }
+    player->last_callback_ = timed ? start : std::chrono::steady_clock::time_point{};
+    player->last_callback_frames_ = samples / player->channels_;
+
+    auto underruns = player->underrun_count_.load(std::memory_order_relaxed);
+    auto allocs = AllocCounter::ThisThread();
+    Mix(player, out, samples);
+    auto took = std::chrono::steady_clock::now() - start;
+    if (timed)
+    {
+        player->perf_.callback.Add(took);
+        player->perf_.callback_allocs.fetch_add(AllocCounter::ThisThread() - allocs,
+                                                std::memory_order_relaxed);
+    }
+    if (recorded)
+    {
+        bool dry = player->underrun_count_.load(std::memory_order_relaxed) != underruns;
+        auto buffered = player->rings_[player->main_ring_.load()].Available();
+        player->recorder_.Callback(start, took, samples, buffered, dry);
+        if (dry)
+            player->recorder_.Underrun(start);
+    }
+}
 
-    size_t got = player->audio_ring_.Read(out, samples);
+void Player::Mix(Player *player, float *out, size_t samples)
+{
+    // a preview may run the device while paused, the track keeps its place
+    auto state = player->state_.load();
+    size_t got = 0;
+    if (state != PlayerState::Paused)
+        got = player->ReadRings(out, samples);
     if (got < samples)
     {
         memset(out + got, 0, (samples - got) * sizeof(float));
-        player->underrun_count_.fetch_add(1);
+        // running out after the last block of the track isn't an underrun
+        if (state == PlayerState::Playing && !player->tail_rendered_.load())
+            player->underrun_count_.fetch_add(1);
     }
 
     if (player->mute_.load())
@@ -452,9 +1245,19 @@ void Player::SDLAudioCallback(void *userdata, Uint8 *stream, int len)
     float delta = player->fade_delta_;
     float target = player->fade_target_;
 
+    auto *preview = player->preview_;
+    float duck = player->duck_gain_;
+    float duck_target = preview ? kPreviewDuck : 1.0f;
+    float duck_step = 1.0f / (kDuckSeconds * player->sample_rate_ * player->channels_);
+
     for (size_t i = 0; i < samples; i++)
     {
-        out[i] *= vol * gain;
+        if (duck != duck_target)
+        {
+            duck = duck < duck_target ? std::min(duck + duck_step, duck_target)
+                                      : std::max(duck - duck_step, duck_target);
+        }
+        out[i] *= vol * gain * duck;
 
         if (delta != 0.0f)
         {
@@ -472,4 +1275,122 @@ void Player::SDLAudioCallback(void *userdata, Uint8 *stream, int len)
 
     player->fade_gain_ = gain;
     player->fade_delta_ = delta;
+    player->duck_gain_ = duck;
+
+    if (!preview)
+        return;
+
+    // short ramps at both ends, the preview starts and stops with the music going
+    size_t pos = player->preview_pos_;
+    size_t total = preview->Frames();
+    float ramp = std::max(1.0f, preview->sample_rate / 100.0f);
+    for (size_t i = 0; i + 1 < samples && pos < total; i += 2, pos++)
+    {
+        float level = vol * std::min({1.0f, pos / ramp, (total - pos) / ramp}) / 32768.0f;
+        out[i] += preview->pcm[pos * 2] * level;
+        out[i + 1] += preview->pcm[pos * 2 + 1] * level;
+    }
+    player->preview_pos_ = pos;
+    if (pos >= total)
+        player->preview_done_.store(true);
+}
+
+// the callback's read of the decoded audio, through a variant switch while one is armed
+size_t Player::ReadRings(float *out, size_t samples)
+{
+    if (switch_at_.load(std::memory_order_acquire) >= 0)
+        return Handover(out, samples);
+    size_t got = rings_[main_ring_.load()].Read(out, samples);
+    played_.fetch_add((int64_t)(got / channels_), std::memory_order_relaxed);
+    return got;
+}
+
+// a variant switch as the callback plays it: the old file up to the frame the new one was
+// rendered from, a crossfade, then the new file alone and the rest of the old one dropped
+size_t Player::Handover(float *out, size_t samples)
+{
+    const size_t ch = (size_t)channels_;
+    int main = main_ring_.load();
+    RingBuffer &from = rings_[main];
+    RingBuffer &to = rings_[1 - main];
+    size_t frames = samples / ch;
+    size_t done = 0;
+    int64_t heard = played_.load(std::memory_order_relaxed);
+
+    if (switch_faded_ == 0)
+    {
+        int64_t at = switch_at_.load(std::memory_order_relaxed);
+        if (heard < at)
+        {
+            size_t n = (size_t)std::min<int64_t>((int64_t)frames, at - heard);
+            done = from.Read(out, n * ch) / ch;
+            heard += (int64_t)done;
+        }
+        if (done == frames)
+        {
+            played_.store(heard, std::memory_order_relaxed);
+            return samples;
+        }
+
+        // armed late, the new file is lined up with what is heard. if the old one ran out
+        // before the new one starts, that starts at once
+        int64_t skip = std::max<int64_t>(0, heard - at);
+        size_t want = frames - done;
+        if ((int64_t)(to.Available() / ch) < skip + (int64_t)want)
+        {
+            // not rendered that far yet, the old file goes on meanwhile
+            size_t more = from.Read(out + done * ch, want * ch) / ch;
+            played_.store(heard + (int64_t)more, std::memory_order_relaxed);
+            return (done + more) * ch;
+        }
+        float drop[512];
+        while (skip > 0)
+        {
+            size_t n = std::min<size_t>((size_t)skip, std::size(drop) / ch);
+            to.Read(drop, n * ch);
+            skip -= (int64_t)n;
+        }
+        heard = std::max(heard, at);
+        spliced_at_.store(heard, std::memory_order_relaxed);
+        // nothing left to fade from
+        if (from.Available() == 0)
+            switch_faded_ = switch_fade_;
+    }
+
+    float old[512];
+    while (done < frames && switch_faded_ < switch_fade_)
+    {
+        size_t n = std::min({frames - done, switch_fade_ - switch_faded_, std::size(old) / ch});
+        size_t b = to.Read(out + done * ch, n * ch) / ch;
+        size_t a = from.Read(old, b * ch) / ch;
+        for (size_t f = 0; f < a; f++)
+        {
+            float t = (float)(switch_faded_ + f + 1) / (float)(switch_fade_ + 1);
+            for (size_t c = 0; c < ch; c++)
+            {
+                size_t k = (done + f) * ch + c;
+                out[k] = old[f * ch + c] * (1.0f - t) + out[k] * t;
+            }
+        }
+        done += b;
+        heard += (int64_t)b;
+        // the old file ran out, the new one is at full level from here
+        switch_faded_ = a < b ? switch_fade_ : switch_faded_ + b;
+        if (b < n)
+            break;
+    }
+    if (switch_faded_ < switch_fade_)
+    {
+        played_.store(heard, std::memory_order_relaxed);
+        return done * ch;
+    }
+
+    // over to the new file for good, the rest of the block is from it
+    from.Clear();
+    switch_faded_ = 0;
+    main_ring_.store(1 - main);
+    switch_at_.store(-1, std::memory_order_release);
+    size_t more = to.Read(out + done * ch, samples - done * ch);
+    played_.store(heard + (int64_t)(more / ch), std::memory_order_relaxed);
+    return done * ch + more;
 }
@@ -1,11 +1,19 @@
 #pragma once
 
+#include "audio_sink.h"
+#include "clock.h"
+#include "engine.h"
+#include "intro_cache.h"
+#include "metrics.h"
+#include "perf_stats.h"
 #include "ring_buffer.h"
-#include <SDL.h>
+#include "underrun_recorder.h"
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -28,10 +36,46 @@ struct TrackInfo
     int64_t duration_samples = 0;
 };
 
+// what TrackInfo says of the length, without its strings to copy, for every frame
+struct TrackLength
+{
+    int sample_rate = 44100;
+    bool duration_known = false;
+    int64_t duration_samples = 0;
+};
+
+// where the time of the last track load went
+struct LoadTiming
+{
+    double io_wait_ms = 0; // finding the banks and prefetching them, ~0 if prefetched
+    double init_ms = 0;    // Engine::Init() with the rhythm samples, 0 when the driver was kept
+    double play_ms = 0;    // Engine::Play(), song and banks into the driver
+    double load_ms = 0;    // the driver's own reads of the song and banks, see Engine::LoadMs()
+    double first_render_ms = 0;
+    double first_sound_ms = 0; // Load() until there was something to play
+    size_t intro_frames = 0;   // played from the cached intro while the driver loaded
+    bool prefetched = false;
+    bool driver_reused = false;
+    size_t banks = 0;
+    size_t banks_cached = 0;
+};
+
+// where the time of the last variant switch went
+struct SwitchTiming
+{
+    double preroll_ms = 0;   // the new file rendered from its start up to the play position
+    bool background = false; // on an engine of its own, the old file was decoded meanwhile
+    int64_t rendered_from = -1; // frame the new file was ready from
+    int64_t spliced_at = -1;    // frame the crossfade started on, -1 until it was heard
+    size_t fade_frames = 0;
+};
+
 class Player
 {
   public:
-    Player();
+    // plays through an SDL device unless given another sink. the decode thread waits and
+    // paces itself on clock
+    explicit Player(std::unique_ptr<AudioSink> sink = nullptr, Clock &clock = Clock::Real());
     ~Player();
 
     static int FrameDurationMs(int frames, int sample_rate);
@@ -39,6 +83,26 @@ class Player
     static std::vector<std::string> ListOutputDevices();
 
     bool Load(const std::filesystem::path &path);
+    // continues the loaded song in another file of it (R_00.M -> R_00.M2) from where
+    // playback is, with a short crossfade. the driver has no seek, the new file is rendered
+    // from its start on a second engine while the old one keeps sounding, and taken over by
+    // the callback at the frame it got to. false if no track is loaded
+    bool SwitchVariant(const std::filesystem::path &path);
+    // warms the page cache with a track likely to be loaded next and its sample banks,
+    // on a background thread. the newest request replaces one not started yet
+    void Prefetch(const std::filesystem::path &path);
+    // renders the opening seconds of these tracks in the background, so loading one of
+    // them starts sounding at once. the newest call replaces what is still queued
+    void CacheIntros(const std::vector<std::filesystem::path> &paths);
+    // plays the cached intro of path over the current track, which is ducked but keeps
+    // going. false, and the intro is rendered next, if it isn't cached yet
+    bool Preview(const std::filesystem::path &path);
+    void StopPreview();
+    void SetIntroBudget(size_t bytes);
+    // runs the driver in a child process from the next load on, a song that crashes or
+    // hangs it then costs a restart of that process instead of the app
+    void SetRenderProcess(bool enabled);
+    IntroCacheStats GetIntroStats() const;
     void Play();
     void Pause();
     void Stop();
@@ -57,7 +121,32 @@ class Player
     bool IsLoading() const;
     std::string GetOutputDevice() const;
     TrackInfo GetTrackInfo() const;
+    TrackLength GetTrackLength() const;
+    LoadTiming GetLoadTiming() const;
+    SwitchTiming GetSwitchTiming() const;
+    // the frame being heard, behind the decoder by what is buffered
     int64_t GetPositionSamples() const;
+    uint64_t GetUnderruns() const;
+    // share of the audio ring waiting to be played, 0 to 1
+    float GetBufferFill() const;
+
+    // timings for the performance overlay, kept while PerfTimer::Enabled()
+    struct Perf
+    {
+        PerfTimer decode;                    // one block of the driver rendering
+        std::atomic<uint64_t> decoded_ns{0}; // length of the audio of those blocks
+        PerfTimer callback;                  // the sink's callback, mixing included
+        PerfTimer jitter; // how far a callback came off the length of the one before
+        std::atomic<uint64_t> callback_allocs{0}; // heap allocations in them, AllocCounter
+    };
+    const Perf &GetPerf() const { return perf_; }
+    // underruns, decoding, the callback, loads and cache hits. the timings come from Perf,
+    // they are only kept while PerfTimer::Enabled()
+    void RegisterMetrics(MetricsRegistry &registry);
+    // from now on keeps the last seconds of decode and callback timings, and writes them
+    // to a report in dir when the audio runs dry. the UI adds its frames to it
+    void SetUnderrunReports(const std::filesystem::path &dir);
+    UnderrunRecorder &GetUnderrunRecorder() { return recorder_; }
 
     // track end notification
     bool HasTrackEnded();
@@ -67,39 +156,90 @@ class Player
 
   private:
     void DecodeThread();
+    bool RequestPending() const;
+    void Idle(std::chrono::milliseconds ms);
+    void PrefetchThread();
+    bool TakePrefetched(const std::filesystem::path &path,
+                        std::vector<std::filesystem::path> &banks);
     bool DoLoad(const std::filesystem::path &path);
+    void UpdateSwitch();
+    void BeginSwitch(const std::filesystem::path &path);
+    void PrerollThread(std::filesystem::path path);
+    void FinishPreroll();
+    void ArmSwitch(const std::filesystem::path &path, int64_t frame, bool background);
+    void CancelSwitch();
+    void PrefetchBanks(const std::filesystem::path &path);
+    bool PlayOnDriver(const std::filesystem::path &path);
+    int64_t Preroll(Engine &engine, int64_t until);
+    void ApplyPendingFadeIn();
+    void SetPreview(std::shared_ptr<const IntroBuffer> intro);
+    static size_t IntroFrames(int sample_rate);
+    void InitDriver(const std::string &pcm_dir);
     bool InitAudio(int sample_rate, int channels);
     void ShutdownAudio();
 
-    static void SDLAudioCallback(void *userdata, Uint8 *stream, int len);
+    static void AudioCallback(void *userdata, float *out, size_t samples);
+    static void Mix(Player *player, float *out, size_t samples);
+    size_t ReadRings(float *out, size_t samples);
+    size_t Handover(float *out, size_t samples);
 
+    Clock &clock_;
     std::atomic<PlayerState> state_{PlayerState::Stopped};
     std::atomic<bool> stop_decode_{false};
     std::atomic<bool> loading_{false};
     std::atomic<bool> loaded_{false};
     std::atomic<bool> track_ended_{false};
+    std::atomic<bool> render_process_{false};
+    std::atomic<bool> tail_rendered_{false}; // the decoder is done, the ring drains
+    std::atomic<bool> start_pending_{false}; // loaded, the sink waits for the first block
 
     std::thread decode_thread_;
     std::mutex request_mutex_;
     std::condition_variable request_cv_;
     bool request_pending_ = false;
     std::filesystem::path pending_path_;
+    bool switch_pending_ = false;
+    std::filesystem::path switch_path_;
 
+    // the callback plays main_ring_. a variant switch has the decoder fill the other one
+    // with the new file, and the callback swaps them once it has crossfaded over
     static constexpr size_t ring_capacity_ = 262144;
-    RingBuffer audio_ring_{ring_capacity_};
+    RingBuffer rings_[2] = {RingBuffer(ring_capacity_), RingBuffer(ring_capacity_)};
+    std::atomic<int> main_ring_{0};
+    int write_ring_ = 0; // decode thread only, the ring it fills
     RingBuffer viz_ring_{ring_capacity_};
 
-    SDL_AudioDeviceID device_ = 0;
+    std::unique_ptr<AudioSink> sink_;
     int sample_rate_ = 44100;
     int channels_ = 2;
     std::string output_device_;
 
     std::atomic<int> volume_{100};
     std::atomic<bool> mute_{false};
-    std::atomic<int64_t> position_samples_{0};
+    std::atomic<int64_t> position_samples_{0}; // rendered, ahead of what is heard
+    std::atomic<int64_t> played_{0};           // taken from the rings by the callback
     std::atomic<uint64_t> underrun_count_{0};
 
-    // fade state (manipulated from audio callback)
+    Perf perf_;
+    // totals for RegisterMetrics(), counted by the decode thread
+    struct Counts
+    {
+        std::atomic<uint64_t> dropped_samples{0}; // the ring had no room for them
+        std::atomic<uint64_t> loads{0};
+        std::atomic<uint64_t> load_failures{0};
+        std::atomic<uint64_t> intro_hits{0};
+        std::atomic<uint64_t> prefetch_hits{0};
+        std::atomic<uint64_t> banks{0};
+        std::atomic<uint64_t> banks_cached{0};
+        PerfTimer first_sound; // Load() until there was something to play
+    };
+    Counts counts_;
+    UnderrunRecorder recorder_;
+    // callback only, when the last timed one started and how many frames it played
+    std::chrono::steady_clock::time_point last_callback_;
+    size_t last_callback_frames_ = 0;
+
+    // fade state (manipulated from audio callback, set under the sink lock)
     float fade_gain_ = 1.0f;
     float fade_target_ = 1.0f;
     float fade_delta_ = 0.0f;
@@ -109,5 +249,62 @@ class Player
     std::function<void()> on_track_end_;
     std::mutex callback_mutex_;
 
+    // written by the decode thread only, which reads it without the lock
+    mutable std::mutex track_mutex_;
     TrackInfo track_;
+
+    // decode thread only, like the folder and rate it was last initialized for
+    std::unique_ptr<Engine> engine_ = std::make_unique<Engine>();
+    std::string driver_dir_;
+    int driver_rate_ = 0;
+
+    // variant switch, decode thread side. the new file is pre-rolled on preroll_engine_ by
+    // preroll_thread_, the two engines trade places once it is done
+    std::unique_ptr<Engine> preroll_engine_;
+    std::string preroll_dir_;
+    int preroll_rate_ = 0;
+    std::thread preroll_thread_;
+    std::filesystem::path preroll_path_;
+    std::atomic<bool> preroll_cancel_{false};
+    bool preroll_done_ = false;  // under request_mutex_, like preroll_frame_
+    int64_t preroll_frame_ = -1; // what the pre-roll got to, -1 if the file didn't load
+    std::filesystem::path queued_switch_; // waits for the switch before it
+    bool switching_ = false; // armed, the decoder fills the other ring until the handover
+    std::chrono::steady_clock::time_point switch_start_;
+    // armed by the decode thread, handed over by the callback. switch_at_ is the frame the
+    // new file starts on, -1 when no switch is armed, switch_fade_ is set before it
+    std::atomic<int64_t> switch_at_{-1};
+    std::atomic<int64_t> spliced_at_{-1};
+    size_t switch_fade_ = 0;
+    size_t switch_faded_ = 0; // audio callback only, 0 until the crossfade started
+
+    mutable std::mutex timing_mutex_;
+    LoadTiming timing_;
+    SwitchTiming switch_timing_;
+
+    struct Prefetched
+    {
+        std::filesystem::path song;
+        std::filesystem::file_time_type modified;
+        std::vector<std::filesystem::path> banks;
+    };
+
+    std::thread prefetch_thread_;
+    std::mutex prefetch_mutex_;
+    std::condition_variable prefetch_cv_;
+    std::filesystem::path prefetch_request_;
+    bool prefetch_stop_ = false;
+    std::vector<Prefetched> prefetched_; // newest last, a few entries
+
+    IntroCache intro_cache_;
+
+    // preview handoff, UI thread -> decode thread (under request_mutex_)
+    bool preview_pending_ = false;
+    std::shared_ptr<const IntroBuffer> preview_request_;
+    // decode thread keeps the playing preview alive, the callback only reads it
+    std::shared_ptr<const IntroBuffer> preview_owner_;
+    const IntroBuffer *preview_ = nullptr; // under the sink lock
+    size_t preview_pos_ = 0;
+    float duck_gain_ = 1.0f; // audio callback only
+    std::atomic<bool> preview_done_{false};
 };
@@ -1,59 +1,770 @@
 #include "playlist.h"
+#include "hash.h"
+#include "parallel_sort.h"
+#include "song_info.h"
+#include "utils.h"
 #include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <tuple>
+
+void Playlist::Store::PushBack(TrackEntry entry)
+{
+    if (size_ % kChunk == 0)
+        chunks_.emplace_back(new TrackEntry[kChunk]);
+    chunks_.back()[size_ % kChunk] = std::move(entry);
+    size_++;
+}
+
+void Playlist::Store::Reserve(size_t count)
+{
+    size_t chunks = (count + kChunk - 1) / kChunk;
+    if (chunks > chunks_.capacity())
+        chunks_.reserve(std::max(chunks, chunks_.capacity() * 2));
+}
+
+Playlist::Playlist() : main_(std::make_shared<const std::vector<int>>()) {}
+
+Playlist::~Playlist()
+{
+    {
+        std::lock_guard lk(sort_mtx_);
+        sort_stop_ = true;
+    }
+    sort_cv_.notify_one();
+    if (sort_thread_.joinable())
+        sort_thread_.join();
+}
 
 void Playlist::Clear()
 {
-    items_.clear();
-    current_ = -1;
-    selected_ = -1;
+    // a running job keeps its own reference to the old chunks
+    store_ = Store();
+    main_ = std::make_shared<const std::vector<int>>();
+    main_pos_.clear();
+    tail_.clear();
+    tail_pos_.clear();
+    tail_at_.clear();
+    tail_base_ = 0;
+    dead_.clear();
+    dead_count_ = 0;
+    as_added_ = false;
+    match_.clear();
+    match_main_.clear();
+    match_tail_.clear();
+    slot_by_id_.clear();
+    id_by_path_.clear();
+    current_ = kInvalidTrackId;
+    selected_ = kInvalidTrackId;
+    groups_.clear();
+    by_stem_.clear();
+    by_content_.clear();
+    hashed_.clear();
+    folded_ = 0;
+
+    sort_generation_++;
+    std::lock_guard lk(sort_mtx_);
+    sort_request_.reset();
+    sort_result_.reset();
 }
 
-void Playlist::Add(const TrackEntry &entry)
+TrackId Playlist::Add(const TrackEntry &entry)
 {
-    items_.push_back(entry);
-    if (selected_ < 0)
-        selected_ = 0;
+    auto found = id_by_path_.find(entry.path.native());
+    if (found != id_by_path_.end())
+        return found->second;
+
+    TrackId id = Insert(entry);
+    int slot = slot_by_id_[id];
+    if (!Hidden(slot))
+        MergeIntoTail({slot});
+    return id;
+}
+
+void Playlist::AddBatch(std::vector<TrackEntry> batch, const std::vector<size_t> &runs)
+{
+    // one reserve up front, grown geometrically so a stream of small batches
+    // doesn't rehash on every call
+    size_t needed = slot_by_id_.size() + batch.size();
+    if (needed > slot_by_id_.bucket_count() * slot_by_id_.max_load_factor())
+    {
+        size_t target = std::max(needed, slot_by_id_.size() * 2);
+        slot_by_id_.reserve(target);
+        id_by_path_.reserve(target);
+    }
+    store_.Reserve(store_.Size() + batch.size());
+
+    // order the batch on its own contiguous entries first. ids are handed out in insertion
+    // order, so inserting in that order leaves the new slots sorted. scanner runs are only
+    // merged, anything else (or runs from before a sort mode change) is sorted here
+    for (auto &e : batch)
+    {
+        if (e.folder_key.empty())
+            BuildSortKeys(e);
+    }
+
+    std::vector<int> order(batch.size());
+    std::iota(order.begin(), order.end(), 0);
+    auto less = [&](int a, int b) { return TrackLess(batch[a], batch[b], mode_, descending_); };
+    if (!as_added_ && runs.size() > 1)
+    {
+        std::vector<size_t> bounds = runs;
+        bounds.push_back(batch.size());
+        MergeRuns(order.begin(), std::move(bounds), less);
+    }
+    if (!as_added_ && !std::is_sorted(order.begin(), order.end(), less))
+        ParallelSort(order.begin(), order.end(), less);
+
+    std::vector<int> run;
+    run.reserve(batch.size());
+    for (int i : order)
+    {
+        size_t before = store_.Size();
+        Insert(std::move(batch[i]));
+        if (store_.Size() != before && !Hidden((int)before))
+            run.push_back((int)before);
+    }
+
+    MergeIntoTail(std::move(run));
 }
 
 void Playlist::SetItems(std::vector<TrackEntry> items)
 {
-    items_ = std::move(items);
-    current_ = items_.empty() ? -1 : 0;
+    Clear();
+    as_added_ = true;
+    AddBatch(std::move(items));
+
+    current_ = IdAt(0);
     selected_ = current_;
 }
 
-const std::vector<TrackEntry> &Playlist::Items() const
+void Playlist::ApplyChanges(std::vector<TrackEntry> upserts,
+                            const std::vector<std::filesystem::path> &removed)
+{
+    std::vector<int> dead;
+    std::vector<TrackId> relist;
+    for (auto &path : removed)
+    {
+        TrackId id = Unlink(path, dead, relist);
+        if (id == current_)
+            current_ = kInvalidTrackId;
+        if (id == selected_)
+            selected_ = kInvalidTrackId;
+    }
+
+    // a changed file gets a new slot under its old id
+    std::vector<int> run;
+    for (auto &e : upserts)
+    {
+        TrackId id = Unlink(e.path, dead, relist);
+        size_t before = store_.Size();
+        Insert(std::move(e), id);
+        if (store_.Size() != before && !Hidden((int)before))
+            run.push_back((int)before);
+    }
+
+    DropSlots(dead);
+    // members that took over a group from a removed entry
+    for (TrackId id : relist)
+    {
+        int slot = Relist(id);
+        if (slot >= 0)
+            run.push_back(slot);
+    }
+    std::sort(run.begin(), run.end(), [this](int a, int b) { return Less(a, b); });
+    MergeIntoTail(std::move(run));
+}
+
+void Playlist::Revalidate(std::vector<TrackEntry> listing)
+{
+    std::vector<uint8_t> listed(store_.Size(), 0);
+    std::vector<TrackEntry> upserts;
+    for (auto &e : listing)
+    {
+        auto it = id_by_path_.find(e.path.native());
+        if (it != id_by_path_.end())
+        {
+            int slot = slot_by_id_.at(it->second);
+            listed[slot] = 1;
+            auto &old = store_[slot];
+            if (old.size == e.size && old.modified == e.modified)
+                continue;
+        }
+        upserts.push_back(std::move(e));
+    }
+
+    std::vector<std::filesystem::path> removed;
+    for (auto &[path, id] : id_by_path_)
+    {
+        if (!listed[slot_by_id_.at(id)])
+            removed.emplace_back(path);
+    }
+    if (!upserts.empty() || !removed.empty())
+        ApplyChanges(std::move(upserts), removed);
+}
+
+bool Playlist::SetInfo(const std::filesystem::path &path, uintmax_t size,
+                       std::filesystem::file_time_type modified,
+                       std::shared_ptr<const SongInfo> info)
+{
+    auto it = id_by_path_.find(path.native());
+    if (it == id_by_path_.end())
+        return false;
+
+    int slot = slot_by_id_.at(it->second);
+    auto &entry = store_.Mutable(slot);
+    if (entry.size != size || entry.modified != modified)
+        return false;
+    entry.info = std::move(info);
+    if (grouping_ && entry.info && entry.info->hash != 0)
+        hashed_.push_back(entry.id);
+    // a title or composer may match the search now
+    if (!filter_.empty() && !Hidden(slot))
+        UpdateMatch(slot);
+    return true;
+}
+
+void Playlist::SetGrouping(bool on)
+{
+    if (on == grouping_)
+        return;
+    grouping_ = on;
+
+    // rebuilt under the same ids. inserting by id keeps the member that came first listed
+    std::vector<TrackEntry> live;
+    live.reserve(slot_by_id_.size());
+    for (auto &[id, slot] : slot_by_id_)
+        live.push_back(store_[slot]);
+    std::sort(live.begin(), live.end(),
+              [](const TrackEntry &a, const TrackEntry &b) { return a.id < b.id; });
+
+    TrackId current = current_;
+    TrackId selected = selected_;
+    bool as_added = as_added_;
+    Clear();
+    as_added_ = as_added;
+
+    std::vector<int> run;
+    for (auto &e : live)
+    {
+        TrackId id = e.id;
+        size_t before = store_.Size();
+        Insert(std::move(e), id);
+        if (!Hidden((int)before))
+            run.push_back((int)before);
+    }
+    std::sort(run.begin(), run.end(), [this](int a, int b) { return Less(a, b); });
+    MergeIntoTail(std::move(run));
+    CollapseDuplicates();
+
+    SetCurrentId(current);
+    SetSelectedId(selected);
+}
+
+bool Playlist::Grouping() const
+{
+    return grouping_;
+}
+
+size_t Playlist::CollapseDuplicates()
+{
+    std::vector<int> fold;
+    for (TrackId id : hashed_)
+    {
+        const TrackEntry *entry = Find(id);
+        uint64_t key = entry ? ContentKey(*entry) : 0;
+        if (key == 0)
+            continue;
+
+        auto [it, added] = by_content_.try_emplace(key, id);
+        if (!added && it->second != id)
+            Merge(it->second, id, fold);
+    }
+    hashed_.clear();
+
+    DropSlots(fold);
+    folded_ += fold.size();
+    return fold.size();
+}
+
+std::vector<const TrackEntry *> Playlist::Variants(TrackId id) const
+{
+    std::vector<const TrackEntry *> variants;
+    Variants(id, variants);
+    return variants;
+}
+
+void Playlist::Variants(TrackId id, std::vector<const TrackEntry *> &out) const
+{
+    out.clear();
+    auto it = groups_.find(id);
+    if (it == groups_.end())
+    {
+        if (auto entry = Find(id))
+            out.push_back(entry);
+        return;
+    }
+
+    // one per content, the active member first stands in for its copies. a group is a
+    // few files, looking through what was taken beats a set
+    auto &group = *it->second;
+    auto &members = group.members;
+    size_t active = (size_t)(std::find(members.begin(), members.end(), group.active) -
+                             members.begin());
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        const TrackEntry *entry = Find(members[i == 0 ? active : i == active ? 0 : i]);
+        uint64_t key = ContentKey(*entry);
+        if (key == 0 || std::none_of(out.begin(), out.end(),
+                                     [&](const TrackEntry *e) { return ContentKey(*e) == key; }))
+            out.push_back(entry);
+    }
+
+    std::sort(out.begin(), out.end(),
+              [](const TrackEntry *a, const TrackEntry *b)
+              {
+                  return std::tie(a->variant_key, a->folder_key, a->name_key, a->id) <
+                         std::tie(b->variant_key, b->folder_key, b->name_key, b->id);
+              });
+}
+
+const TrackEntry *Playlist::ActiveVariant(TrackId id) const
+{
+    auto it = groups_.find(id);
+    return Find(it != groups_.end() ? it->second->active : id);
+}
+
+bool Playlist::SetActiveVariant(TrackId id, TrackId variant)
+{
+    auto it = groups_.find(id);
+    if (it == groups_.end())
+        return id == variant && Find(id);
+
+    auto &members = it->second->members;
+    if (std::find(members.begin(), members.end(), variant) == members.end())
+        return false;
+    it->second->active = variant;
+    return true;
+}
+
+size_t Playlist::FoldedCount() const
+{
+    return folded_;
+}
+
+Playlist::String Playlist::StemKey(const TrackEntry &entry)
+{
+    // folder plus the name without extension, ASCII case folded: R_00.M and r_00.m2 meet
+    String key = entry.path.parent_path().native();
+    key += std::filesystem::path::value_type('/');
+    auto stem = entry.path.stem();
+    for (auto c : stem.native())
+        key += (c >= 'A' && c <= 'Z') ? (decltype(c))(c - 'A' + 'a') : c;
+    return key;
+}
+
+uint64_t Playlist::ContentKey(const TrackEntry &entry)
+{
+    if (!entry.info || entry.info->hash == 0)
+        return 0;
+    uint64_t size = entry.size;
+    return hash::Xxh64(&size, sizeof(size), entry.info->hash);
+}
+
+void Playlist::Join(TrackId anchor, TrackId id)
+{
+    auto &group = groups_[anchor];
+    if (!group)
+        group = std::make_shared<Group>(Group{anchor, anchor, {anchor}});
+    group->members.push_back(id);
+    groups_[id] = group;
+}
+
+// folds the group of id into the group of anchor. the listed slot of id's group goes to fold
+void Playlist::Merge(TrackId anchor, TrackId id, std::vector<int> &fold)
+{
+    auto from = groups_.find(id);
+    if (from != groups_.end())
+    {
+        auto other = from->second;
+        auto to = groups_.find(anchor);
+        if (to != groups_.end() && to->second == other)
+            return;
+
+        Join(anchor, other->members.front());
+        auto &group = groups_[anchor];
+        for (size_t i = 1; i < other->members.size(); i++)
+        {
+            group->members.push_back(other->members[i]);
+            groups_[other->members[i]] = group;
+        }
+        id = other->listed;
+    }
+    else
+    {
+        Join(anchor, id);
+    }
+
+    fold.push_back(slot_by_id_.at(id));
+    TrackId listed = groups_[anchor]->listed;
+    if (current_ == id)
+        current_ = listed;
+    if (selected_ == id)
+        selected_ = listed;
+}
+
+// takes id out of its group and out of the lookup keys. a new listed member, if one is
+// needed, goes to relist
+void Playlist::Leave(TrackId id, const TrackEntry &entry, std::vector<TrackId> &relist)
+{
+    std::shared_ptr<Group> group;
+    if (auto it = groups_.find(id); it != groups_.end())
+    {
+        group = std::move(it->second);
+        groups_.erase(it);
+
+        auto &members = group->members;
+        members.erase(std::find(members.begin(), members.end(), id));
+        if (group->active == id)
+            group->active = group->listed != id ? group->listed : members.front();
+        if (group->listed == id)
+        {
+            group->listed = group->active;
+            relist.push_back(group->listed);
+            if (current_ == id)
+                current_ = group->listed;
+            if (selected_ == id)
+                selected_ = group->listed;
+        }
+        if (members.size() == 1)
+            groups_.erase(members.front());
+    }
+
+    // hand each key on to a member that shares it
+    auto heir = [&](auto key_of, auto &map)
+    {
+        auto key = key_of(entry);
+        auto found = map.find(key);
+        if (found == map.end() || found->second != id)
+            return;
+        for (TrackId member : group ? group->members : std::vector<TrackId>())
+        {
+            if (key_of(*Find(member)) == key)
+            {
+                found->second = member;
+                return;
+            }
+        }
+        map.erase(found);
+    };
+    heir(StemKey, by_stem_);
+    heir(ContentKey, by_content_);
+}
+
+TrackId Playlist::Unlink(const std::filesystem::path &path, std::vector<int> &dead,
+                         std::vector<TrackId> &relist)
+{
+    auto it = id_by_path_.find(path.native());
+    if (it == id_by_path_.end())
+        return kInvalidTrackId;
+
+    TrackId id = it->second;
+    auto slot = slot_by_id_.find(id);
+    Leave(id, store_[slot->second], relist);
+    // folded slots are out of the order already
+    if (Hidden(slot->second))
+        folded_--;
+    else
+        dead.push_back(slot->second);
+    slot_by_id_.erase(slot);
+    id_by_path_.erase(it);
+    return id;
+}
+
+TrackId Playlist::ListedOf(TrackId id) const
+{
+    auto it = groups_.find(id);
+    return it != groups_.end() ? it->second->listed : id;
+}
+
+// folded slots stay dead, a member coming back to the list gets a fresh copy
+int Playlist::Relist(TrackId id)
+{
+    auto it = slot_by_id_.find(id);
+    if (it == slot_by_id_.end() || !Hidden(it->second))
+        return -1;
+
+    int slot = (int)store_.Size();
+    store_.PushBack(store_[it->second]);
+    it->second = slot;
+    folded_--;
+    return slot;
+}
+
+void Playlist::Hide(int slot)
+{
+    dead_.resize(store_.Size(), 0);
+    dead_[slot] = 1;
+    dead_count_++;
+    folded_++;
+}
+
+bool Playlist::Hidden(int slot) const
+{
+    return slot < (int)dead_.size() && dead_[slot];
+}
+
+// O(size) per call, the watcher coalesces changes so this stays rare
+void Playlist::DropSlots(const std::vector<int> &dead)
+{
+    if (dead.empty())
+        return;
+
+    dead_.resize(store_.Size(), 0);
+    for (int slot : dead)
+        dead_[slot] = 1;
+    dead_count_ += dead.size();
+
+    size_t kept = 0;
+    for (size_t j = 0; j < tail_.size(); j++)
+    {
+        if (!dead_[tail_[j]])
+        {
+            tail_[kept] = tail_[j];
+            tail_at_[kept] = tail_at_[j];
+            kept++;
+        }
+    }
+    tail_.resize(kept);
+    tail_at_.resize(kept);
+    for (int j = 0; j < (int)tail_.size(); j++)
+        tail_pos_[tail_[j] - tail_base_] = j;
+
+    if (std::none_of(dead.begin(), dead.end(), [this](int slot)
+                     { return slot < (int)tail_base_; }))
+    {
+        RematchTail();
+        return;
+    }
+
+    auto main = std::make_shared<std::vector<int>>(*main_);
+    FilterDead(*main);
+    for (int i = 0; i < (int)main->size(); i++)
+        main_pos_[(*main)[i]] = i;
+    main_ = std::move(main);
+    for (int j = 0; j < (int)tail_.size(); j++)
+        tail_at_[j] = MainBefore(tail_[j]);
+    Rematch();
+}
+
+void Playlist::FilterDead(std::vector<int> &order) const
+{
+    order.erase(std::remove_if(order.begin(), order.end(),
+                               [this](int slot)
+                               { return slot < (int)dead_.size() && dead_[slot]; }),
+                order.end());
+}
+
+TrackId Playlist::Insert(TrackEntry entry, TrackId id)
+{
+    // same file twice maps to the existing entry
+    auto found = id_by_path_.find(entry.path.native());
+    if (found != id_by_path_.end())
+        return found->second;
+
+    if (entry.folder_key.empty())
+        BuildSortKeys(entry);
+
+    if (id == kInvalidTrackId)
+        id = next_id_++;
+    entry.id = id;
+    id_by_path_.emplace(entry.path.native(), id);
+    int slot = (int)store_.Size();
+    slot_by_id_[id] = slot;
+    store_.PushBack(std::move(entry));
+
+    if (grouping_)
+    {
+        // a variant of a listed song goes behind it
+        auto [it, added] = by_stem_.try_emplace(StemKey(store_[slot]), id);
+        if (!added)
+        {
+            Join(it->second, id);
+            Hide(slot);
+        }
+        if (ContentKey(store_[slot]) != 0)
+            hashed_.push_back(id);
+    }
+
+    if (selected_ == kInvalidTrackId)
+        selected_ = ListedOf(id);
+    return id;
+}
+
+bool Playlist::Less(int slot_a, int slot_b) const
+{
+    if (as_added_)
+        return store_[slot_a].id < store_[slot_b].id;
+    return TrackLess(store_[slot_a], store_[slot_b], mode_, descending_);
+}
+
+// how many main_ entries a tail entry goes behind: the ones it doesn't sort before
+int Playlist::MainBefore(int slot) const
+{
+    auto &main = *main_;
+    return (int)(std::upper_bound(main.begin(), main.end(), slot,
+                                  [this](int a, int b) { return Less(a, b); }) -
+                 main.begin());
+}
+
+// display index of main_[i] and of tail_[j]
+int Playlist::MainIndex(int i) const
+{
+    return i + (int)(std::upper_bound(tail_at_.begin(), tail_at_.end(), i) - tail_at_.begin());
+}
+
+int Playlist::TailIndex(int j) const
+{
+    return j + tail_at_[j];
+}
+
+void Playlist::MergeIntoTail(std::vector<int> run)
+{
+    if (run.empty())
+        return;
+
+    // O(tail + run) plus a search of the main run per new entry, the main run is not
+    // touched
+    std::vector<int> at(run.size());
+    for (size_t k = 0; k < run.size(); k++)
+        at[k] = MainBefore(run[k]);
+
+    std::vector<int> merged, merged_at;
+    merged.reserve(tail_.size() + run.size());
+    merged_at.reserve(tail_.size() + run.size());
+    size_t j = 0, k = 0;
+    while (j < tail_.size() || k < run.size())
+    {
+        bool take_run = j == tail_.size() || (k < run.size() && Less(run[k], tail_[j]));
+        merged.push_back(take_run ? run[k] : tail_[j]);
+        merged_at.push_back(take_run ? at[k++] : tail_at_[j++]);
+    }
+    tail_.swap(merged);
+    tail_at_.swap(merged_at);
+
+    tail_pos_.resize(store_.Size() - tail_base_);
+    for (int t = 0; t < (int)tail_.size(); t++)
+        tail_pos_[tail_[t] - tail_base_] = t;
+
+    if (!filter_.empty())
+    {
+        match_.resize(store_.Size(), 0);
+        for (int slot : run)
+            match_[slot] = MatchesSearch(store_[slot], filter_);
+        RematchTail();
+    }
+
+    MaybeCompact();
+}
+
+size_t Playlist::Size() const
+{
+    return main_->size() + tail_.size();
+}
+
+int Playlist::SlotAt(int k) const
+{
+    // tail entries placed before k, then either the tail entry at k or a main one
+    int lo = 0;
+    int hi = (int)tail_.size();
+    while (lo < hi)
+    {
+        int j = (lo + hi) / 2;
+        if (TailIndex(j) < k)
+            lo = j + 1;
+        else
+            hi = j;
+    }
+    if (lo < (int)tail_.size() && TailIndex(lo) == k)
+        return tail_[lo];
+    return (*main_)[k - lo];
+}
+
+const TrackEntry &Playlist::At(int index) const
+{
+    return store_[SlotAt(index)];
+}
+
+const TrackEntry *Playlist::Find(TrackId id) const
+{
+    auto it = slot_by_id_.find(id);
+    return it != slot_by_id_.end() ? &store_[it->second] : nullptr;
+}
+
+int Playlist::IndexOf(TrackId id) const
+{
+    auto it = slot_by_id_.find(ListedOf(id));
+    if (it == slot_by_id_.end())
+        return -1;
+
+    int slot = it->second;
+    if (slot < (int)tail_base_)
+        return MainIndex(main_pos_[slot]);
+    return TailIndex(tail_pos_[slot - tail_base_]);
+}
+
+TrackId Playlist::IdAt(int index) const
 {
-    return items_;
+    return (index >= 0 && index < (int)Size()) ? At(index).id : kInvalidTrackId;
 }
+
 int Playlist::CurrentIndex() const
 {
-    return current_;
+    return IndexOf(current_);
 }
 int Playlist::SelectedIndex() const
+{
+    return IndexOf(selected_);
+}
+TrackId Playlist::CurrentId() const
+{
+    return current_;
+}
+TrackId Playlist::SelectedId() const
 {
     return selected_;
 }
 
 void Playlist::SetCurrent(int idx)
 {
-    current_ = (idx >= 0 && idx < (int)items_.size()) ? idx : -1;
+    current_ = IdAt(idx);
 }
 
 void Playlist::SetSelected(int idx)
 {
-    selected_ = (idx >= 0 && idx < (int)items_.size()) ? idx : -1;
+    selected_ = IdAt(idx);
+}
+
+void Playlist::SetCurrentId(TrackId id)
+{
+    current_ = slot_by_id_.count(id) ? ListedOf(id) : kInvalidTrackId;
+}
+
+void Playlist::SetSelectedId(TrackId id)
+{
+    selected_ = slot_by_id_.count(id) ? ListedOf(id) : kInvalidTrackId;
 }
 
 int Playlist::RandomIndex(int exclude) const
 {
-    if (items_.empty())
+    int count = (int)Size();
+    if (count == 0)
         return -1;
-    if (items_.size() == 1)
+    if (count == 1)
         return 0;
 
     static thread_local std::mt19937 rng{std::random_device{}()};
-    std::uniform_int_distribution<int> dist(0, (int)items_.size() - 1);
+    std::uniform_int_distribution<int> dist(0, count - 1);
 
     int pick = exclude;
     while (pick == exclude)
@@ -63,59 +774,392 @@ int Playlist::RandomIndex(int exclude) const
 
 int Playlist::NextIndex(RepeatMode repeat, bool shuffle) const
 {
-    if (items_.empty())
+    int count = (int)Size();
+    if (count == 0)
         return -1;
 
-    if (repeat == RepeatMode::One && current_ >= 0)
-        return current_;
+    int current = CurrentIndex();
+    if (repeat == RepeatMode::One && current >= 0)
+        return current;
 
     if (shuffle)
-        return RandomIndex(current_);
+        return RandomIndex(current);
 
-    int next = current_ + 1;
-    if (next >= (int)items_.size())
+    int next = current + 1;
+    if (next >= count)
         return (repeat == RepeatMode::All) ? 0 : -1;
     return next;
 }
 
 int Playlist::PrevIndex(RepeatMode repeat) const
 {
-    if (items_.empty())
+    int count = (int)Size();
+    if (count == 0)
         return -1;
 
-    if (repeat == RepeatMode::One && current_ >= 0)
-        return current_;
+    int current = CurrentIndex();
+    if (repeat == RepeatMode::One && current >= 0)
+        return current;
 
-    int prev = current_ - 1;
+    int prev = current - 1;
     if (prev < 0)
-        return (repeat == RepeatMode::All) ? (int)items_.size() - 1 : -1;
+        return (repeat == RepeatMode::All) ? count - 1 : -1;
     return prev;
 }
 
 int Playlist::FindIndexByPath(const std::filesystem::path &path) const
 {
-    for (size_t i = 0; i < items_.size(); i++)
+    auto it = id_by_path_.find(path.native());
+    return it != id_by_path_.end() ? IndexOf(it->second) : -1;
+}
+
+bool Playlist::JobLess(const SortJob &job, int slot_a, int slot_b)
+{
+    auto &a = job.store[slot_a];
+    auto &b = job.store[slot_b];
+    return job.as_added ? a.id < b.id : TrackLess(a, b, job.mode, job.descending);
+}
+
+Playlist::SortResult Playlist::RunJob(const SortJob &job)
+{
+    SortResult result;
+    result.count = job.count;
+    result.mode = job.mode;
+    result.descending = job.descending;
+    result.generation = job.generation;
+
+    auto &store = job.store;
+    if (job.main)
+    {
+        // fold the tail into the main run
+        result.as_added = job.as_added;
+        result.order.resize(job.main->size() + job.tail.size());
+        std::merge(job.main->begin(), job.main->end(), job.tail.begin(), job.tail.end(),
+                   result.order.begin(), [&](int a, int b) { return JobLess(job, a, b); });
+    }
+    else
+    {
+        struct Row
+        {
+            const TrackEntry *entry;
+            int slot;
+        };
+
+        std::vector<Row> rows(job.count);
+        for (size_t i = 0; i < rows.size(); i++)
+            rows[i] = {&store[i], (int)i};
+
+        ParallelSort(rows.begin(), rows.end(), [&](const Row &a, const Row &b)
+                     { return TrackLess(*a.entry, *b.entry, job.mode, job.descending); });
+
+        result.order.resize(rows.size());
+        for (size_t i = 0; i < rows.size(); i++)
+            result.order[i] = rows[i].slot;
+    }
+
+    result.position.resize(job.count);
+    for (int i = 0; i < (int)result.order.size(); i++)
+        result.position[result.order[i]] = i;
+    return result;
+}
+
+bool Playlist::MatchesSearch(const TrackEntry &entry, const std::string &text)
+{
+    auto *info = entry.info.get();
+    return utils::contains_ignore_case(entry.display_name, text) ||
+           (info && (utils::contains_ignore_case(info->title, text) ||
+                     utils::contains_ignore_case(info->composer, text)));
+}
+
+// O(size) when the text changes, and free when it doesn't
+void Playlist::SetFilter(const std::string &text)
+{
+    if (text == filter_)
+        return;
+    filter_ = text;
+
+    match_.assign(filter_.empty() ? 0 : store_.Size(), 0);
+    if (!filter_.empty())
+    {
+        for (int slot : *main_)
+            match_[slot] = MatchesSearch(store_[slot], filter_);
+        for (int slot : tail_)
+            match_[slot] = MatchesSearch(store_[slot], filter_);
+    }
+    Rematch();
+}
+
+const std::string &Playlist::FilterText() const
+{
+    return filter_;
+}
+
+size_t Playlist::RowCount() const
+{
+    return filter_.empty() ? Size() : match_main_.size() + match_tail_.size();
+}
+
+int Playlist::RowIndex(int row) const
+{
+    if (row < 0 || row >= (int)RowCount())
+        return -1;
+    if (filter_.empty())
+        return row;
+
+    // like SlotAt(), over the matching entries of both runs: how many of the rows before
+    // this one come from the main run
+    int m = (int)match_main_.size();
+    int t = (int)match_tail_.size();
+    int lo = std::max(0, row - t);
+    int hi = std::min(row, m);
+    while (lo < hi)
+    {
+        int a = (lo + hi) / 2;
+        if (MainIndex(match_main_[a]) < TailIndex(match_tail_[row - a - 1]))
+            lo = a + 1;
+        else
+            hi = a;
+    }
+
+    int a = lo;
+    int b = row - lo;
+    if (a == m)
+        return TailIndex(match_tail_[b]);
+    if (b == t)
+        return MainIndex(match_main_[a]);
+    return std::min(MainIndex(match_main_[a]), TailIndex(match_tail_[b]));
+}
+
+int Playlist::RowOf(int index) const
+{
+    if (index < 0 || index >= (int)Size())
+        return -1;
+    if (filter_.empty())
+        return index;
+
+    int slot = SlotAt(index);
+    if (!match_[slot])
+        return -1;
+
+    // matching entries of each run that come before it
+    int main_before, tail_before;
+    if (slot < (int)tail_base_)
+    {
+        main_before = main_pos_[slot];
+        tail_before = index - main_before;
+    }
+    else
+    {
+        tail_before = tail_pos_[slot - tail_base_];
+        main_before = index - tail_before;
+    }
+    auto before = [](const std::vector<int> &v, int n)
+    { return (int)(std::lower_bound(v.begin(), v.end(), n) - v.begin()); };
+    return before(match_main_, main_before) + before(match_tail_, tail_before);
+}
+
+void Playlist::UpdateMatch(int slot)
+{
+    bool matches = MatchesSearch(store_[slot], filter_);
+    if (matches == (bool)match_[slot])
+        return;
+    match_[slot] = matches;
+    if (slot >= (int)tail_base_)
+    {
+        RematchTail();
+        return;
+    }
+
+    // O(matches) to keep the main run's rows in order
+    int i = main_pos_[slot];
+    auto it = std::lower_bound(match_main_.begin(), match_main_.end(), i);
+    if (matches)
+        match_main_.insert(it, i);
+    else
+        match_main_.erase(it);
+}
+
+void Playlist::Rematch()
+{
+    match_main_.clear();
+    if (!filter_.empty())
+    {
+        auto &main = *main_;
+        for (int i = 0; i < (int)main.size(); i++)
+        {
+            if (match_[main[i]])
+                match_main_.push_back(i);
+        }
+    }
+    RematchTail();
+}
+
+void Playlist::RematchTail()
+{
+    match_tail_.clear();
+    if (filter_.empty())
+        return;
+    for (int j = 0; j < (int)tail_.size(); j++)
+    {
+        if (match_[tail_[j]])
+            match_tail_.push_back(j);
+    }
+}
+
+void Playlist::Sort(SortMode mode, bool descending)
+{
+    SortJob job;
+    job.store = store_;
+    job.count = store_.Size();
+    job.mode = mode;
+    job.descending = descending;
+    job.generation = ++sort_generation_;
+
+    if (job.count < kAsyncSortThreshold)
+    {
+        {
+            std::lock_guard lk(sort_mtx_);
+            sort_request_.reset();
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto result = RunJob(job);
+        sort_time_.Add(std::chrono::steady_clock::now() - start);
+        Publish(std::move(result));
+        return;
+    }
+
+    SubmitJob(std::move(job));
+}
+
+void Playlist::RegisterMetrics(MetricsRegistry &registry)
+{
+    registry.AddHistogram("pmdmini_playlist_sort_seconds",
+                          "Sorting the list, or merging new entries into it", sort_time_);
+}
+
+void Playlist::SubmitJob(SortJob job)
+{
+    std::lock_guard lk(sort_mtx_);
+    if (!sort_thread_.joinable())
+        sort_thread_ = std::thread(&Playlist::SortThread, this);
+    sort_request_ = std::move(job);
+    sort_cv_.notify_one();
+}
+
+void Playlist::MaybeCompact()
+{
+    if (tail_.size() < kCompactThreshold)
+        return;
+
     {
-        if (items_[i].path == path)
-            return (int)i;
+        std::lock_guard lk(sort_mtx_);
+        if (sort_busy_ || sort_request_ || sort_result_)
+            return;
     }
-    return -1;
+
+    // snapshot is O(chunks), the merge itself runs on the sort thread
+    SortJob job;
+    job.store = store_;
+    job.count = store_.Size();
+    job.main = main_;
+    job.tail = tail_;
+    job.mode = mode_;
+    job.descending = descending_;
+    job.as_added = as_added_;
+    job.generation = ++sort_generation_;
+    SubmitJob(std::move(job));
 }
 
-void Playlist::Sort(SortMode mode)
+bool Playlist::ApplyPendingSort()
 {
-    switch (mode)
+    std::optional<SortResult> result;
     {
-    case SortMode::Name:
-        std::sort(items_.begin(), items_.end(),
-                  [](auto &a, auto &b) { return a.display_name < b.display_name; });
-        break;
-    case SortMode::Date:
-        std::sort(items_.begin(), items_.end(),
-                  [](auto &a, auto &b) { return a.modified < b.modified; });
-        break;
-    case SortMode::Size:
-        std::sort(items_.begin(), items_.end(), [](auto &a, auto &b) { return a.size < b.size; });
-        break;
+        std::lock_guard lk(sort_mtx_);
+        result.swap(sort_result_);
+    }
+
+    if (!result)
+        return false;
+
+    // superseded by a newer sort or a clear
+    bool current = result->generation == sort_generation_;
+    if (current)
+        Publish(std::move(*result));
+    MaybeCompact();
+    return current;
+}
+
+bool Playlist::IsSorting() const
+{
+    std::lock_guard lk(sort_mtx_);
+    return sort_busy_ || sort_request_.has_value();
+}
+
+void Playlist::Publish(SortResult result)
+{
+    // slots removed while the job ran
+    if (dead_count_ > 0)
+    {
+        FilterDead(result.order);
+        for (int i = 0; i < (int)result.order.size(); i++)
+            result.position[result.order[i]] = i;
+    }
+
+    main_ = std::make_shared<const std::vector<int>>(std::move(result.order));
+    main_pos_ = std::move(result.position);
+
+    // entries added after the job's snapshot stay in the tail
+    std::vector<int> rest;
+    for (int slot : tail_)
+    {
+        if (slot >= (int)result.count)
+            rest.push_back(slot);
+    }
+
+    bool resorted = result.mode != mode_ || result.descending != descending_ ||
+                    result.as_added != as_added_;
+    mode_ = result.mode;
+    descending_ = result.descending;
+    as_added_ = result.as_added;
+    if (resorted)
+        std::sort(rest.begin(), rest.end(), [this](int a, int b) { return Less(a, b); });
+
+    tail_.swap(rest);
+    tail_base_ = result.count;
+    tail_pos_.assign(store_.Size() - tail_base_, 0);
+    tail_at_.resize(tail_.size());
+    for (int j = 0; j < (int)tail_.size(); j++)
+    {
+        tail_pos_[tail_[j] - tail_base_] = j;
+        tail_at_[j] = MainBefore(tail_[j]);
+    }
+
+    // a new main run, the search rows are read off it again. once a sort or once per
+    // kCompactThreshold new entries, not per frame
+    Rematch();
+}
+
+void Playlist::SortThread()
+{
+    std::unique_lock lk(sort_mtx_);
+    while (true)
+    {
+        sort_cv_.wait(lk, [this] { return sort_stop_ || sort_request_.has_value(); });
+        if (sort_stop_)
+            return;
+
+        SortJob job = std::move(*sort_request_);
+        sort_request_.reset();
+        sort_busy_ = true;
+        lk.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        SortResult result = RunJob(job);
+        sort_time_.Add(std::chrono::steady_clock::now() - start);
+        job = {};
+
+        lk.lock();
+        sort_result_ = std::move(result);
+        sort_busy_ = false;
     }
 }
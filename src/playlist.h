@@ -1,35 +1,260 @@
 #pragma once
 
 #include "config.h"
+#include "metrics.h"
+#include "perf_stats.h"
 #include "scanner.h"
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// the display order is kept as two sorted runs: a large main run and a small tail
+// that new entries are merged into. each tail entry remembers how many main entries sort
+// before it, so positions are resolved across both runs without comparing entries. the
+// tail is folded into the main run on a background thread once it grows
 class Playlist
 {
   public:
+    Playlist();
+    ~Playlist();
+
     void Clear();
-    void Add(const TrackEntry &entry);
+    TrackId Add(const TrackEntry &entry);
+    // runs are the start offsets of sorted runs in batch, see Scanner::ConsumeBatch()
+    void AddBatch(std::vector<TrackEntry> batch, const std::vector<size_t> &runs = {});
+    // lists items in the order given, later entries go after them until the next Sort()
     void SetItems(std::vector<TrackEntry> items);
 
-    const std::vector<TrackEntry> &Items() const;
+    // incremental changes from the directory watcher. entries whose path is already
+    // listed are replaced and keep their id, removed paths drop out of the list
+    void ApplyChanges(std::vector<TrackEntry> upserts,
+                      const std::vector<std::filesystem::path> &removed);
+    // a fresh listing of the whole library, applied as the changes it makes: files with
+    // the same size and mtime are left alone, so ids, metadata and groups carry over
+    void Revalidate(std::vector<TrackEntry> listing);
+
+    // attaches probed metadata. ignored if the file is gone or changed since the probe
+    bool SetInfo(const std::filesystem::path &path, uintmax_t size,
+                 std::filesystem::file_time_type modified, std::shared_ptr<const SongInfo> info);
+
+    // with grouping on, files in one folder that differ only in the extension (R_00.M,
+    // R_00.M2) and identical copies anywhere are listed once. the listed entry stands for
+    // the group, the variant picked for it is what plays. folded entries keep their ids
+    // and paths but have no index
+    void SetGrouping(bool on);
+    bool Grouping() const;
+    // folds copies found by the content hashes SetInfo() attached since the last call.
+    // returns how many entries went behind another one
+    size_t CollapseDuplicates();
+    // distinct variants of the group id belongs to, by extension. just the entry when
+    // it isn't grouped
+    std::vector<const TrackEntry *> Variants(TrackId id) const;
+    // the same into out, which keeps its capacity from call to call
+    void Variants(TrackId id, std::vector<const TrackEntry *> &out) const;
+    const TrackEntry *ActiveVariant(TrackId id) const;
+    bool SetActiveVariant(TrackId id, TrackId variant);
+    size_t FoldedCount() const;
+
+    // display order
+    size_t Size() const;
+    const TrackEntry &At(int index) const;
+    template <typename Fn> void ForEach(Fn &&fn) const;
+
+    // id <-> position lookups
+    const TrackEntry *Find(TrackId id) const;
+    int IndexOf(TrackId id) const;
+    TrackId IdAt(int index) const;
 
     int CurrentIndex() const;
     void SetCurrent(int index);
+    TrackId CurrentId() const;
+    void SetCurrentId(TrackId id);
 
     int SelectedIndex() const;
     void SetSelected(int index);
+    TrackId SelectedId() const;
+    void SetSelectedId(TrackId id);
 
     int NextIndex(RepeatMode repeat, bool shuffle = false) const;
     int PrevIndex(RepeatMode repeat) const;
 
     int FindIndexByPath(const std::filesystem::path &path) const;
-    void Sort(SortMode mode);
+
+    // the search box filter: file name, title or composer contain text, ignoring case
+    static bool MatchesSearch(const TrackEntry &entry, const std::string &text);
+    // the rows the search box leaves, in display order. they are kept up to date as
+    // entries come and go, only a different text goes through the whole list. with no
+    // text every entry is a row
+    void SetFilter(const std::string &text);
+    const std::string &FilterText() const;
+    size_t RowCount() const;
+    // display index of a row, and the row of a display index (-1 if it's filtered out)
+    int RowIndex(int row) const;
+    int RowOf(int index) const;
+
+    // large lists are sorted on a background thread, the new order shows up
+    // on the next ApplyPendingSort() after the job finishes
+    void Sort(SortMode mode, bool descending = false);
+    bool ApplyPendingSort();
+    bool IsSorting() const;
+
+    // sorts and merges, with the time they took
+    void RegisterMetrics(MetricsRegistry &registry);
+
+    static constexpr size_t kAsyncSortThreshold = 20000;
+    static constexpr size_t kCompactThreshold = 4096;
 
   private:
+    // append-only slot storage. chunks never move, so a copy of the chunk list is a
+    // snapshot a background job can read while the UI thread keeps appending
+    class Store
+    {
+      public:
+        static constexpr size_t kChunk = 1024;
+
+        size_t Size() const { return size_; }
+        const TrackEntry &operator[](size_t slot) const
+        {
+            return chunks_[slot / kChunk][slot % kChunk];
+        }
+        // only for fields the sort jobs don't read
+        TrackEntry &Mutable(size_t slot) { return chunks_[slot / kChunk][slot % kChunk]; }
+        void PushBack(TrackEntry entry);
+        void Reserve(size_t count);
+
+      private:
+        std::vector<std::shared_ptr<TrackEntry[]>> chunks_;
+        size_t size_ = 0;
+    };
+
+    struct SortJob
+    {
+        Store store;
+        size_t count = 0; // slots [0, count) are covered
+        std::shared_ptr<const std::vector<int>> main; // merge job if set, full sort otherwise
+        std::vector<int> tail;
+        SortMode mode = SortMode::Name;
+        bool descending = false;
+        bool as_added = false;
+        uint64_t generation = 0;
+    };
+
+    struct SortResult
+    {
+        std::vector<int> order;
+        std::vector<int> position;
+        size_t count = 0;
+        SortMode mode = SortMode::Name;
+        bool descending = false;
+        bool as_added = false;
+        uint64_t generation = 0;
+    };
+
+    static bool JobLess(const SortJob &job, int slot_a, int slot_b);
+    static SortResult RunJob(const SortJob &job);
+
+    struct Group
+    {
+        TrackId listed = kInvalidTrackId; // the member in the display order
+        TrackId active = kInvalidTrackId; // the member that plays for it
+        std::vector<TrackId> members;
+    };
+
+    using String = std::filesystem::path::string_type;
+    static String StemKey(const TrackEntry &entry);
+    static uint64_t ContentKey(const TrackEntry &entry);
+
+    TrackId Insert(TrackEntry entry, TrackId id = kInvalidTrackId);
+    TrackId Unlink(const std::filesystem::path &path, std::vector<int> &dead,
+                   std::vector<TrackId> &relist);
+    void Join(TrackId anchor, TrackId id);
+    void Leave(TrackId id, const TrackEntry &entry, std::vector<TrackId> &relist);
+    void Merge(TrackId anchor, TrackId id, std::vector<int> &fold);
+    TrackId ListedOf(TrackId id) const;
+    int Relist(TrackId id);
+    void Hide(int slot);
+    bool Hidden(int slot) const;
+    void DropSlots(const std::vector<int> &dead);
+    void FilterDead(std::vector<int> &order) const;
+    bool Less(int slot_a, int slot_b) const;
+    int MainBefore(int slot) const;
+    int MainIndex(int i) const;
+    int TailIndex(int j) const;
+    int SlotAt(int index) const;
+    void MergeIntoTail(std::vector<int> run);
+    void UpdateMatch(int slot);
+    void Rematch();
+    void RematchTail();
+    void Publish(SortResult result);
+    void SubmitJob(SortJob job);
+    void MaybeCompact();
+    void SortThread();
     int RandomIndex(int exclude) const;
 
-    std::vector<TrackEntry> items_;
-    int current_ = -1;
-    int selected_ = -1;
+    Store store_;
+    std::shared_ptr<const std::vector<int>> main_; // sorted slots [0, tail_base_)
+    std::vector<int> main_pos_;                    // slot -> index in main_
+    std::vector<int> tail_;                        // sorted slots [tail_base_, size)
+    std::vector<int> tail_pos_;                    // slot - tail_base_ -> index in tail_
+    std::vector<int> tail_at_; // index in tail_ -> main_ entries that sort before it
+    size_t tail_base_ = 0;
+    // slot -> not listed: removed (jobs started before still list it) or folded into a
+    // group
+    std::vector<uint8_t> dead_;
+    size_t dead_count_ = 0;
+    SortMode mode_ = SortMode::Name;
+    bool descending_ = false;
+    bool as_added_ = false; // ordered by id, from SetItems() until a Sort()
+
+    // search filter, the matching entries as indices into main_ and tail_
+    std::string filter_;
+    std::vector<uint8_t> match_; // slot -> matches filter_
+    std::vector<int> match_main_;
+    std::vector<int> match_tail_;
+
+    std::unordered_map<TrackId, int> slot_by_id_;
+    std::unordered_map<std::filesystem::path::string_type, TrackId> id_by_path_;
+    TrackId next_id_ = 1;
+    TrackId current_ = kInvalidTrackId;
+    TrackId selected_ = kInvalidTrackId;
+
+    bool grouping_ = false;
+    std::unordered_map<TrackId, std::shared_ptr<Group>> groups_; // member -> its group
+    std::unordered_map<String, TrackId> by_stem_;                // folder + stem -> a member
+    std::unordered_map<uint64_t, TrackId> by_content_;           // hash and size -> a member
+    std::vector<TrackId> hashed_; // given a hash since the last CollapseDuplicates()
+    size_t folded_ = 0;
+
+    // background sort/merge, newest request wins
+    std::thread sort_thread_;
+    mutable std::mutex sort_mtx_;
+    std::condition_variable sort_cv_;
+    std::optional<SortJob> sort_request_;
+    std::optional<SortResult> sort_result_;
+    bool sort_stop_ = false;
+    bool sort_busy_ = false;
+    uint64_t sort_generation_ = 0;
+    PerfTimer sort_time_;
 };
+
+// calls fn(index, entry) in display order, merging both runs in one pass
+template <typename Fn> void Playlist::ForEach(Fn &&fn) const
+{
+    auto &main = *main_;
+    size_t i = 0, j = 0;
+    int index = 0;
+
+    while (i < main.size() || j < tail_.size())
+    {
+        bool take_tail = j < tail_.size() && (size_t)tail_at_[j] <= i;
+        int slot = take_tail ? tail_[j++] : main[i++];
+        fn(index++, store_[slot]);
+    }
+}
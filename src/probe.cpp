@@ -0,0 +1,176 @@
+#include "probe.h"
+#include "hash.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+
+// files a worker takes per trip to the queue
+constexpr size_t kChunk = 32;
+
+} // namespace
+
+MetadataProbe::MetadataProbe()
+{
+    // parsing is cheap, reading small files is mostly syscalls, one worker per core
+    SetThreadCount((int)std::max(1u, std::thread::hardware_concurrency()));
+}
+
+MetadataProbe::~MetadataProbe()
+{
+    {
+        std::lock_guard lk(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_)
+        t.join();
+}
+
+void MetadataProbe::Submit(std::vector<ProbeRequest> files)
+{
+    if (files.empty())
+        return;
+
+    {
+        std::lock_guard lk(mtx_);
+        if (threads_.empty())
+        {
+            for (int i = 0; i < thread_count_; i++)
+                threads_.emplace_back(&MetadataProbe::Worker, this);
+        }
+        if (queue_.empty() && busy_ == 0)
+            busy_since_ = std::chrono::steady_clock::now();
+        std::move(files.begin(), files.end(), std::back_inserter(queue_));
+    }
+    cv_.notify_all();
+}
+
+void MetadataProbe::Submit(const std::vector<TrackEntry> &entries)
+{
+    std::vector<ProbeRequest> files;
+    files.reserve(entries.size());
+    for (auto &e : entries)
+        files.push_back({e.path, e.size, e.modified});
+    Submit(std::move(files));
+}
+
+void MetadataProbe::Clear()
+{
+    std::lock_guard lk(mtx_);
+    if (!queue_.empty() && busy_ == 0)
+        busy_time_ += std::chrono::steady_clock::now() - busy_since_;
+    queue_.clear();
+    results_.clear();
+}
+
+bool MetadataProbe::ConsumeResults(std::vector<ProbeResult> &out)
+{
+    std::lock_guard lk(mtx_);
+    if (results_.empty())
+        return false;
+    out.swap(results_);
+    results_.clear();
+    return true;
+}
+
+bool MetadataProbe::Idle() const
+{
+    std::lock_guard lk(mtx_);
+    return queue_.empty() && busy_ == 0;
+}
+
+ProbeStats MetadataProbe::Stats() const
+{
+    ProbeStats stats;
+    stats.parsed = parsed_.load();
+    stats.cached = cached_.load();
+    stats.failed = failed_.load();
+    stats.bytes_read = bytes_read_.load();
+
+    std::lock_guard lk(mtx_);
+    auto busy = busy_time_;
+    if (!queue_.empty() || busy_ > 0)
+        busy += std::chrono::steady_clock::now() - busy_since_;
+    stats.busy_seconds = std::chrono::duration<double>(busy).count();
+    return stats;
+}
+
+void MetadataProbe::SetThreadCount(int count)
+{
+    thread_count_ = std::max(1, count);
+}
+
+int MetadataProbe::ThreadCount() const
+{
+    return thread_count_;
+}
+
+void MetadataProbe::Worker()
+{
+    std::vector<ProbeRequest> files;
+    std::vector<ProbeResult> done;
+
+    std::unique_lock lk(mtx_);
+    while (true)
+    {
+        cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+        if (stop_)
+            return;
+
+        // small bites while the queue is short, so every worker gets some
+        size_t take = std::clamp(queue_.size() / threads_.size(), (size_t)1, kChunk);
+        files.assign(std::make_move_iterator(queue_.begin()),
+                     std::make_move_iterator(queue_.begin() + (std::ptrdiff_t)take));
+        queue_.erase(queue_.begin(), queue_.begin() + (std::ptrdiff_t)take);
+        busy_++;
+        lk.unlock();
+
+        done.clear();
+        for (auto &file : files)
+        {
+            auto info = Probe(file);
+            done.push_back({std::move(file), std::move(info)});
+        }
+
+        lk.lock();
+        std::move(done.begin(), done.end(), std::back_inserter(results_));
+        busy_--;
+        if (queue_.empty() && busy_ == 0)
+            busy_time_ += std::chrono::steady_clock::now() - busy_since_;
+    }
+}
+
+std::shared_ptr<const SongInfo> MetadataProbe::Probe(const ProbeRequest &file)
+{
+    if (auto info = cache_.Find(file.path, file.size, file.modified))
+    {
+        cached_.fetch_add(1);
+        return info;
+    }
+
+    // unreadable files aren't cached, they may be back on the next scan
+    std::ifstream f(file.path, std::ios::binary);
+    if (!f)
+    {
+        failed_.fetch_add(1);
+        return nullptr;
+    }
+
+    thread_local std::vector<uint8_t> buf(kMaxPmdSize);
+    f.read(reinterpret_cast<char *>(buf.data()), (std::streamsize)buf.size());
+    auto n = (size_t)f.gcount();
+    bytes_read_.fetch_add(n);
+
+    auto info = std::make_shared<SongInfo>();
+    if (ParsePmdInfo(buf.data(), n, *info))
+        parsed_.fetch_add(1);
+    else
+        failed_.fetch_add(1);
+    info->hash = hash::Xxh64(buf.data(), n);
+
+    cache_.Insert(file.path, file.size, file.modified, info);
+    return info;
+}
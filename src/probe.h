@@ -0,0 +1,88 @@
+#pragma once
+
+#include "scanner.h"
+#include "song_info.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ProbeRequest
+{
+    std::filesystem::path path;
+    uintmax_t size = 0;
+    std::filesystem::file_time_type modified;
+};
+
+struct ProbeResult
+{
+    ProbeRequest file;
+    std::shared_ptr<const SongInfo> info;
+};
+
+struct ProbeStats
+{
+    size_t parsed = 0; // read from disk
+    size_t cached = 0; // answered by the cache
+    size_t failed = 0; // unreadable or not PMD data
+    uint64_t bytes_read = 0;
+    double busy_seconds = 0; // wall time with work queued or in flight
+
+    double FilesPerSecond() const
+    {
+        return busy_seconds > 0 ? (double)(parsed + cached + failed) / busy_seconds : 0.0;
+    }
+};
+
+// reads the memo tables of scanned files on a pool of worker threads. only the song
+// header is read, the driver is never involved. files are answered from the cache
+// while their size and mtime match
+class MetadataProbe
+{
+  public:
+    MetadataProbe();
+    ~MetadataProbe();
+
+    void Submit(std::vector<ProbeRequest> files);
+    void Submit(const std::vector<TrackEntry> &entries);
+    // drops queued files, the ones being read still come back
+    void Clear();
+
+    bool ConsumeResults(std::vector<ProbeResult> &out);
+    // nothing queued or being read
+    bool Idle() const;
+    ProbeStats Stats() const;
+
+    SongInfoCache &Cache() { return cache_; }
+
+    // workers are started by the first Submit(), later calls have no effect
+    void SetThreadCount(int count);
+    int ThreadCount() const;
+
+  private:
+    void Worker();
+    std::shared_ptr<const SongInfo> Probe(const ProbeRequest &file);
+
+    SongInfoCache cache_;
+    int thread_count_ = 1;
+    std::vector<std::thread> threads_;
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<ProbeRequest> queue_;
+    std::vector<ProbeResult> results_;
+    size_t busy_ = 0; // workers with files in hand
+    bool stop_ = false;
+    std::chrono::steady_clock::time_point busy_since_{};
+    std::chrono::steady_clock::duration busy_time_{};
+
+    std::atomic<size_t> parsed_{0};
+    std::atomic<size_t> cached_{0};
+    std::atomic<size_t> failed_{0};
+    std::atomic<uint64_t> bytes_read_{0};
+};
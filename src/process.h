@@ -0,0 +1,7 @@
+#pragma once
+
+#include <filesystem>
+
+// path of the running executable, empty if it can't be found. worker processes are
+// started from it
+std::filesystem::path CurrentExecutable();
@@ -0,0 +1,518 @@
+#include "render_host.h"
+#include "engine.h"
+#include "logger.h"
+#include "process.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+// mapped by the player and its host. each side only writes its own counter
+struct RenderRing
+{
+    std::atomic<uint64_t> head;             // frames published by the host
+    alignas(64) std::atomic<uint64_t> tail; // frames taken by the player
+    alignas(64) int16_t pcm[RenderHost::kRingFrames * 2];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring is shared between processes");
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// starting a host, loading the rhythm samples or a song
+constexpr int kCommandTimeoutMs = 2000;
+// fast forward is at least this many times real time, for the timeout of a resumed song
+constexpr int kSeekSpeed = 10;
+// a host with a full ring looks for commands this often
+constexpr int kIdlePollMs = 5;
+
+enum HostOp : uint32_t
+{
+    kOpInit,  // arg: rate, a: pcm dir
+    kOpPlay,  // arg: frames to skip, a: song, b: pcm dir
+    kOpStop,
+    kOpStats,
+};
+
+struct HostCommand
+{
+    uint32_t op;
+    uint32_t a_len;
+    uint32_t b_len;
+    int64_t arg;
+};
+
+struct HostReply
+{
+    int32_t ok;
+    int32_t length_sec;
+    int32_t loop_sec;
+    double cpu_seconds;
+};
+
+#ifndef _WIN32
+
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0; // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+bool SendAll(int fd, const void *data, size_t size)
+{
+    auto *p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        auto n = send(fd, p, size, kSendFlags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+bool RecvAll(int fd, void *data, size_t size, Clock::time_point deadline)
+{
+    auto *p = static_cast<char *>(data);
+    while (size > 0)
+    {
+        int wait = -1;
+        if (deadline != Clock::time_point::max())
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+            if (left.count() <= 0)
+                return false;
+            wait = (int)left.count();
+        }
+        pollfd pfd{fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return false;
+
+        auto n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+double CpuSeconds()
+{
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+           (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+#endif
+
+} // namespace
+
+RenderHost::RenderHost() : exe_(CurrentExecutable())
+{
+}
+
+RenderHost::~RenderHost()
+{
+    Kill();
+#ifndef _WIN32
+    if (ring_)
+        munmap(ring_, sizeof(RenderRing));
+    if (shm_fd_ >= 0)
+        close(shm_fd_);
+#endif
+}
+
+bool RenderHost::Supported()
+{
+#ifdef _WIN32
+    return false;
+#else
+    return true;
+#endif
+}
+
+void RenderHost::SetExecutable(std::filesystem::path exe)
+{
+    exe_ = std::move(exe);
+}
+
+bool RenderHost::Init(const std::string &pcm_dir, int sample_rate)
+{
+    Stop();
+    pcm_dir_ = pcm_dir;
+    sample_rate_ = sample_rate;
+    if (pid_ < 0 && !Spawn())
+    {
+        Logger::Warn("Failed to start the render host " + exe_.string());
+        ready_ = false;
+        return false;
+    }
+    ready_ = Call(kOpInit, sample_rate, pcm_dir, {}, kCommandTimeoutMs);
+    return ready_;
+}
+
+bool RenderHost::Play(const std::filesystem::path &song, const std::string &pcm_dir)
+{
+    Stop();
+    if (!ready_)
+        return false;
+
+    song_ = song;
+    song_dir_ = pcm_dir;
+    delivered_ = 0;
+    discard_ = 0;
+    stalled_ = 0;
+    playing_ = Call(kOpPlay, 0, song.string(), pcm_dir, kCommandTimeoutMs);
+    return playing_;
+}
+
+void RenderHost::Render(int16_t *out, int frames)
+{
+#ifndef _WIN32
+    size_t want = frames > 0 ? (size_t)frames : 0;
+    size_t done = 0;
+    // the host renders a block in a fraction of its play time, waiting longer than all of
+    // it means it hangs
+    auto period = std::chrono::microseconds((int64_t)kBlockFrames * 1000000 /
+                                            std::max(1, sample_rate_));
+    auto last_progress = Clock::now();
+
+    while (playing_ && done < want)
+    {
+        uint64_t tail = ring_->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring_->head.load(std::memory_order_acquire);
+        if (head != tail)
+        {
+            size_t n = (size_t)(head - tail);
+            if (discard_ > 0)
+            {
+                // a replacement starts on a block boundary, before the frame that was next
+                n = std::min<size_t>(n, (size_t)discard_);
+                discard_ -= (int64_t)n;
+            }
+            else
+            {
+                n = std::min(n, want - done);
+                size_t pos = (size_t)(tail % kRingFrames);
+                size_t first = std::min(n, (size_t)kRingFrames - pos);
+                std::memcpy(out + done * 2, ring_->pcm + pos * 2, first * 2 * sizeof(int16_t));
+                std::memcpy(out + (done + first) * 2, ring_->pcm,
+                            (n - first) * 2 * sizeof(int16_t));
+                done += n;
+                delivered_ += (int64_t)n;
+                stalled_ = 0;
+            }
+            ring_->tail.store(tail + n, std::memory_order_release);
+            last_progress = Clock::now();
+            continue;
+        }
+
+        if (pid_ < 0 || waitpid(pid_, nullptr, WNOHANG) == pid_)
+            pid_ = -1; // reaped, the pid is no longer ours to kill
+        else if (Clock::now() - last_progress < period)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        if (!Restart())
+            playing_ = false;
+        last_progress = Clock::now();
+    }
+
+    if (done < want)
+        std::memset(out + done * 2, 0, (want - done) * 2 * sizeof(int16_t));
+#else
+    std::memset(out, 0, (size_t)std::max(0, frames) * 2 * sizeof(int16_t));
+#endif
+}
+
+void RenderHost::Stop()
+{
+    if (!playing_)
+        return;
+    playing_ = false;
+    Call(kOpStop, 0, {}, {}, kCommandTimeoutMs);
+}
+
+RenderHostStats RenderHost::Stats()
+{
+    if (ready_)
+        Call(kOpStats, 0, {}, {}, kCommandTimeoutMs);
+    RenderHostStats stats;
+    stats.restarts = restarts_;
+    stats.host_cpu_seconds = host_cpu_;
+    return stats;
+}
+
+bool RenderHost::Spawn()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if (!ring_)
+    {
+#ifdef __linux__
+        int fd = memfd_create("pmdmini-gui-ring", MFD_CLOEXEC);
+#else
+        auto name = "/pmdmini-gui-" + std::to_string(getpid()) + "-" +
+                    std::to_string((uintptr_t)this);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+            shm_unlink(name.c_str());
+#endif
+        if (fd < 0)
+            return false;
+        // clear of the standard descriptors, so its dup to fd 3 in the host drops
+        // close on exec
+        shm_fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        close(fd);
+        if (shm_fd_ < 0 || ftruncate(shm_fd_, sizeof(RenderRing)) != 0)
+            return false;
+        void *p = mmap(nullptr, sizeof(RenderRing), PROT_READ | PROT_WRITE, MAP_SHARED,
+                       shm_fd_, 0);
+        if (p == MAP_FAILED)
+            return false;
+        ring_ = new (p) RenderRing;
+    }
+    ring_->head.store(0);
+    ring_->tail.store(0);
+
+    int type = SOCK_STREAM;
+#ifdef SOCK_CLOEXEC
+    type |= SOCK_CLOEXEC;
+#endif
+    int fds[2];
+    if (socketpair(AF_UNIX, type, 0, fds) != 0)
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    std::string exe = exe_.string();
+    char *argv[] = {exe.data(), (char *)kRenderHostArg, nullptr};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, shm_fd_, 3);
+    pid_t pid = -1;
+    int rc = posix_spawn(&pid, exe.c_str(), &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0)
+    {
+        close(fds[0]);
+        return false;
+    }
+    sock_ = fds[0];
+    pid_ = pid;
+    return true;
+#endif
+}
+
+void RenderHost::Kill()
+{
+#ifndef _WIN32
+    if (pid_ > 0)
+    {
+        kill(pid_, SIGKILL);
+        while (waitpid(pid_, nullptr, 0) < 0 && errno == EINTR)
+        {
+        }
+    }
+    if (sock_ >= 0)
+        close(sock_);
+#endif
+    pid_ = -1;
+    sock_ = -1;
+}
+
+// one command and its reply. a host that doesn't answer in time is killed, the next
+// Init() starts another
+bool RenderHost::Call(uint32_t op, int64_t arg, const std::string &a, const std::string &b,
+                      int timeout_ms)
+{
+#ifdef _WIN32
+    (void)op, (void)arg, (void)a, (void)b, (void)timeout_ms;
+    return false;
+#else
+    if (pid_ < 0)
+        return false;
+
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    HostCommand cmd{op, (uint32_t)a.size(), (uint32_t)b.size(), arg};
+    HostReply reply{};
+    if (!SendAll(sock_, &cmd, sizeof(cmd)) || !SendAll(sock_, a.data(), a.size()) ||
+        !SendAll(sock_, b.data(), b.size()) || !RecvAll(sock_, &reply, sizeof(reply), deadline))
+    {
+        Kill();
+        ready_ = false;
+        playing_ = false;
+        return false;
+    }
+    length_sec_ = reply.length_sec;
+    loop_sec_ = reply.loop_sec;
+    host_cpu_ = reply.cpu_seconds;
+    return reply.ok != 0;
+#endif
+}
+
+// a new host, fast forwarded to the block the old one stopped in
+bool RenderHost::Restart()
+{
+    auto at = std::to_string((double)delivered_ / std::max(1, sample_rate_)) + " s";
+    if (++stalled_ > kMaxRestarts)
+    {
+        Logger::Error("Render host keeps failing on " + song_.filename().string() + " at " + at +
+                      ", giving up");
+        Kill();
+        ready_ = false;
+        return false;
+    }
+    Logger::Warn(std::string(pid_ < 0 ? "Render host crashed" : "Render host hung") + " on " +
+                 song_.filename().string() + " at " + at + ", restarting");
+    Kill();
+    restarts_++;
+
+    int64_t skip = delivered_ / kBlockFrames * kBlockFrames;
+    ready_ = Spawn() && Call(kOpInit, sample_rate_, pcm_dir_, {}, kCommandTimeoutMs);
+    int timeout = kCommandTimeoutMs + (int)(skip * 1000 / std::max(1, sample_rate_) / kSeekSpeed);
+    if (!ready_ || !Call(kOpPlay, skip, song_.string(), song_dir_, timeout))
+        return false;
+    discard_ = delivered_ - skip;
+    return true;
+}
+
+int RunRenderHost(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+#ifdef _WIN32
+    return 2;
+#else
+    const int sock = STDIN_FILENO;
+    const int shm = 3;
+    struct stat st{};
+    if (fstat(shm, &st) != 0 || (size_t)st.st_size < sizeof(RenderRing))
+        return 2;
+    void *p = mmap(nullptr, sizeof(RenderRing), PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+    if (p == MAP_FAILED)
+        return 2;
+    auto *ring = static_cast<RenderRing *>(p);
+
+    constexpr int kBlock = RenderHost::kBlockFrames;
+    constexpr uint64_t kRing = RenderHost::kRingFrames;
+    Engine engine;
+    bool playing = false;
+    std::vector<int16_t> block(kBlock * 2);
+    std::string a, b;
+    while (true)
+    {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        bool room = playing && head - tail + kBlock <= kRing;
+
+        pollfd pfd{sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, room ? 0 : kIdlePollMs);
+        if (ready < 0 && errno != EINTR)
+            return 1;
+        if (ready > 0)
+        {
+            // end of file means the player is gone
+            HostCommand cmd{};
+            if (!RecvAll(sock, &cmd, sizeof(cmd), Clock::time_point::max()))
+                return 0;
+            a.resize(cmd.a_len);
+            b.resize(cmd.b_len);
+            if (!RecvAll(sock, a.data(), a.size(), Clock::time_point::max()) ||
+                !RecvAll(sock, b.data(), b.size(), Clock::time_point::max()))
+                return 0;
+
+            HostReply reply{};
+            switch (cmd.op)
+            {
+            case kOpInit:
+                playing = false;
+                reply.ok = engine.Init(a, (int)cmd.arg);
+                break;
+            case kOpPlay:
+                playing = engine.Play(a, b);
+                for (int64_t done = 0; playing && done < cmd.arg; done += kBlock)
+                    engine.Render(block.data(), kBlock);
+                reply.ok = playing;
+                break;
+            case kOpStop:
+                engine.Stop();
+                playing = false;
+                reply.ok = 1;
+                break;
+            default:
+                reply.ok = 1;
+                break;
+            }
+            // what was rendered ahead belongs to the old state
+            if (cmd.op != kOpStats)
+                ring->head.store(ring->tail.load(std::memory_order_acquire),
+                                 std::memory_order_release);
+            reply.length_sec = engine.LengthSec();
+            reply.loop_sec = engine.LoopSec();
+            reply.cpu_seconds = CpuSeconds();
+            if (!SendAll(sock, &reply, sizeof(reply)))
+                return 0;
+            continue;
+        }
+
+        if (room)
+        {
+            // straight into the ring, unless the block wraps around its end
+            size_t pos = (size_t)(head % kRing);
+            size_t first = std::min<size_t>(kBlock, kRing - pos);
+            if (first == kBlock)
+                engine.Render(ring->pcm + pos * 2, kBlock);
+            else
+            {
+                engine.Render(block.data(), kBlock);
+                std::memcpy(ring->pcm + pos * 2, block.data(), first * 2 * sizeof(int16_t));
+                std::memcpy(ring->pcm, block.data() + first * 2,
+                            (kBlock - first) * 2 * sizeof(int16_t));
+            }
+            ring->head.store(head + kBlock, std::memory_order_release);
+        }
+    }
+#endif
+}
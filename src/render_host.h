@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+// first argument that turns the executable into a render host
+constexpr const char *kRenderHostArg = "--render-host";
+
+struct RenderRing;
+
+struct RenderHostStats
+{
+    size_t restarts = 0;         // hosts replaced after a crash or a hang
+    double host_cpu_seconds = 0; // user and system time of the running host
+};
+
+// an Engine in a child process, so a song that crashes or hangs the driver only takes the
+// host down. the host renders ahead into a ring in shared memory and Render() copies out
+// of it. a host that dies, or leaves Render() waiting for a block's worth of time, is
+// replaced and fast forwarded to where the old one was. POSIX only
+class RenderHost
+{
+  public:
+    // the host renders in blocks of this many frames, like the decoder
+    static constexpr int kBlockFrames = 1024;
+    static constexpr int kRingFrames = 16 * kBlockFrames;
+    // replacements in a row that produced nothing before the song is given up
+    static constexpr int kMaxRestarts = 3;
+
+    RenderHost();
+    ~RenderHost();
+    RenderHost(const RenderHost &) = delete;
+    RenderHost &operator=(const RenderHost &) = delete;
+
+    static bool Supported();
+    // the executable run with kRenderHostArg, the app itself by default
+    void SetExecutable(std::filesystem::path exe);
+
+    // starts a host if none runs. false if it couldn't be started
+    bool Init(const std::string &pcm_dir, int sample_rate);
+    bool Play(const std::filesystem::path &song, const std::string &pcm_dir);
+    // interleaved stereo, silence unless a song plays
+    void Render(int16_t *out, int frames);
+    void Stop();
+
+    int LengthSec() const { return length_sec_; }
+    int LoopSec() const { return loop_sec_; }
+    RenderHostStats Stats();
+    // -1 without a host
+    int HostPid() const { return pid_; }
+
+  private:
+    bool Spawn();
+    void Kill();
+    bool Call(uint32_t op, int64_t arg, const std::string &a, const std::string &b,
+              int timeout_ms);
+    bool Restart();
+
+    std::filesystem::path exe_;
+    int shm_fd_ = -1;
+    RenderRing *ring_ = nullptr;
+    int sock_ = -1;
+    int pid_ = -1;
+
+    // what a replacement host has to be brought back to
+    std::string pcm_dir_;
+    int sample_rate_ = 0;
+    std::filesystem::path song_;
+    std::string song_dir_;
+    bool ready_ = false;
+    bool playing_ = false;
+    int64_t delivered_ = 0; // frames Render() handed out since Play()
+    int64_t discard_ = 0;   // frames a replacement renders again before the ones wanted
+
+    int length_sec_ = 0;
+    int loop_sec_ = 0;
+    double host_cpu_ = 0;
+    size_t restarts_ = 0;
+    int stalled_ = 0; // restarts since the last progress
+};
+
+// entry point of a host process: commands on stdin, the ring on fd 3. returns the exit code
+int RunRenderHost(int argc, char **argv);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "trace.h"
 #include <atomic>
 #include <vector>
 
@@ -12,6 +13,7 @@ class RingBuffer
     // write samples, drop if full (non-blocking)
     size_t Write(const float *data, size_t count)
     {
+        TRACE_SCOPE("RingBuffer::Write");
         size_t written = 0;
         size_t h = head_.load(std::memory_order_relaxed);
         size_t t = tail_.load(std::memory_order_acquire);
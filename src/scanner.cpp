@@ -1,139 +1,632 @@
 #include "scanner.h"
+#include "batch_queue.h"
+#include "parallel_sort.h"
+#include "trace.h"
 #include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <tuple>
 
-bool IsPmdFile(const std::string &name)
+bool IsPmdFile(std::string_view name)
 {
-    std::string lower = utils::to_lower(name);
-    size_t len = lower.size();
+    return ClassifyPmdFile(name) != PmdVariant::None;
+}
 
-    // .mdt appears to be PCM samples, so not playable
-    if (len >= 4 && lower.substr(len - 4) == ".mdt")
-        return false;
+void NameKeys(const std::string &display_name, std::string &name_key, std::string &variant_key)
+{
+    std::filesystem::path name = display_name;
+    name_key = utils::natural_sort_key(name.stem().string());
+    variant_key = utils::natural_sort_key(name.extension().string());
+}
 
-    // .m extension
-    if (len >= 2 && lower[len - 2] == '.' && lower[len - 1] == 'm')
-        return true;
+std::string FolderKey(const std::filesystem::path &dir)
+{
+    // the parent path of a file in dir, which never ends in a separator
+    return utils::natural_sort_key(
+        (dir.has_filename() ? dir : dir.parent_path()).generic_string());
+}
 
-    // .m2 extension
-    if (len >= 3 && lower[len - 3] == '.' && lower[len - 2] == 'm' && lower[len - 1] == '2')
-        return true;
+void BuildSortKeys(TrackEntry &entry)
+{
+    NameKeys(entry.display_name, entry.name_key, entry.variant_key);
+    entry.folder_key = utils::natural_sort_key(entry.path.parent_path().generic_string());
+}
 
-    // .m86 extension (PC-8801)
-    if (len >= 4 && lower.substr(len - 4) == ".m86")
-        return true;
+bool TrackLess(const TrackEntry &a, const TrackEntry &b, SortMode mode, bool descending)
+{
+    if (descending)
+        return TrackLess(b, a, mode, false);
 
-    // .m26 extension (PC-8801 extended)
-    if (len >= 4 && lower.substr(len - 4) == ".m26")
-        return true;
+    switch (mode)
+    {
+    case SortMode::Name:
+        break;
+    case SortMode::Folder:
+        return std::tie(a.folder_key, a.name_key, a.variant_key, a.id) <
+               std::tie(b.folder_key, b.name_key, b.variant_key, b.id);
+    case SortMode::Date:
+        if (a.modified != b.modified)
+            return a.modified < b.modified;
+        break;
+    case SortMode::Size:
+        if (a.size != b.size)
+            return a.size < b.size;
+        break;
+    }
+    return std::tie(a.name_key, a.variant_key, a.folder_key, a.id) <
+           std::tie(b.name_key, b.variant_key, b.folder_key, b.id);
+}
+
+namespace
+{
 
+// directories waiting to be listed by one worker. the owner pops from the back
+// (depth first, warm dentries), idle workers steal from the front
+struct WorkQueue
+{
+    std::mutex mtx;
+    std::deque<std::filesystem::path> dirs;
+};
+
+bool PopOrSteal(std::vector<WorkQueue> &queues, size_t self, std::filesystem::path &out)
+{
+    {
+        auto &own = queues[self];
+        std::lock_guard lk(own.mtx);
+        if (!own.dirs.empty())
+        {
+            out = std::move(own.dirs.back());
+            own.dirs.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        auto &victim = queues[(self + i) % queues.size()];
+        std::lock_guard lk(victim.mtx);
+        if (!victim.dirs.empty())
+        {
+            out = std::move(victim.dirs.front());
+            victim.dirs.pop_front();
+            return true;
+        }
+    }
     return false;
 }
 
-Scanner::Scanner() {}
+} // namespace
+
+TrackEntry MakeTrackEntry(const std::filesystem::path &dir, std::string_view folder_key,
+                          const LibraryIndex::FileView &file)
+{
+    TrackEntry e;
+    e.path = dir / file.name;
+    e.display_name = e.path.filename().string();
+    e.size = file.size;
+    e.modified = file.modified;
+    e.name_key = file.name_key;
+    e.variant_key = file.variant_key;
+    e.folder_key = folder_key;
+    return e;
+}
+
+TrackEntry MakeTrackEntry(const std::filesystem::path &dir, std::string_view folder_key,
+                          const LibraryIndex::File &file)
+{
+    LibraryIndex::FileView view{file.name, file.size, file.modified, file.name_key,
+                                file.variant_key};
+    return MakeTrackEntry(dir, folder_key, view);
+}
+
+std::vector<TrackEntry> EntriesFromIndex(const LibraryIndex &index)
+{
+    std::vector<TrackEntry> out;
+    out.reserve(index.FileCount());
+    for (size_t i = 0; i < index.DirCount(); i++)
+    {
+        auto dir = index.DirAt(i);
+        std::filesystem::path dir_path = dir.Path();
+        for (size_t j = 0; j < dir.FileCount(); j++)
+            out.push_back(MakeTrackEntry(dir_path, dir.FolderKey(), dir.FileAt(j)));
+    }
+    return out;
+}
+
+bool ReadDirRecord(const std::filesystem::path &dir, LibraryIndex::Dir &out,
+                   const std::atomic<bool> *stop)
+{
+    // mtime first, a change made while listing shows up on the next check
+    std::error_code ec;
+    out.modified = std::filesystem::last_write_time(dir, ec);
+    out.folder_key = FolderKey(dir);
+    out.files.clear();
+    out.subdirs.clear();
+    if (ec)
+        return false;
+
+    std::filesystem::directory_iterator it(dir, ec);
+    if (ec)
+        return false;
+
+    for (std::filesystem::directory_iterator end; !ec && it != end; it.increment(ec))
+    {
+        if (stop && stop->load())
+            break;
+
+        // same as recursive_directory_iterator: don't follow directory symlinks
+        std::error_code type_ec;
+        auto &p = it->path();
+        if (it->is_directory(type_ec) && !it->is_symlink(type_ec))
+        {
+            out.subdirs.push_back(p.filename().native());
+            continue;
+        }
+
+        if (!it->is_regular_file(type_ec) ||
+            ClassifyPmdFile(std::basic_string_view<std::filesystem::path::value_type>(
+                p.native())) == PmdVariant::None)
+            continue;
+
+        LibraryIndex::File file;
+        file.name = p.filename().native();
+        file.size = it->file_size(type_ec);
+        file.modified = it->last_write_time(type_ec);
+        NameKeys(p.filename().string(), file.name_key, file.variant_key);
+        out.files.push_back(std::move(file));
+    }
+
+    std::sort(out.files.begin(), out.files.end(),
+              [](const LibraryIndex::File &a, const LibraryIndex::File &b)
+              { return a.name < b.name; });
+    return true;
+}
+
+struct Scanner::Totals
+{
+    std::atomic<uint64_t> scans{0};
+    std::atomic<uint64_t> busy_ns{0};
+    std::atomic<uint64_t> dirs_listed{0};
+    std::atomic<uint64_t> dirs_skipped{0};
+    std::atomic<uint64_t> files_probed{0};
+    std::atomic<uint64_t> files_reused{0};
+};
+
+struct Scanner::Job
+{
+    using Queue = BatchQueue<TrackEntry>;
+
+    struct WorkerState
+    {
+        Queue::Block *block = nullptr; // being filled
+        Queue::Block *cache = nullptr; // recycled blocks taken from the pool
+        std::vector<std::pair<LibraryIndex::String, LibraryIndex::Dir>> dirs;
+    };
+
+    void Run();
+    void Walk(const std::filesystem::path &base, std::vector<WorkerState> &states);
+    void ListDir(const std::filesystem::path &dir, WorkerState &state,
+                 std::vector<std::filesystem::path> &subdirs);
+    void AddFile(const std::filesystem::path &dir, std::string_view folder_key,
+                 const LibraryIndex::File &file, WorkerState &state);
+    void Flush(WorkerState &state);
+    void Tally(std::chrono::steady_clock::time_point start);
+    void Wake();
+    bool Less(const TrackEntry &a, const TrackEntry &b) const
+    {
+        return TrackLess(a, b, sort, descending);
+    }
+
+    uint64_t generation = 0;
+    std::filesystem::path root;
+    bool recursive = false;
+    SortMode sort = SortMode::Name;
+    bool descending = false;
+    int thread_count = 1;
+    std::function<void(const std::filesystem::path &)> list_hook;
+    std::shared_ptr<const LibraryIndex> previous;
+    std::shared_ptr<Totals> totals;
+
+    std::atomic<bool> running{true};
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> dirs_listed{0};
+    std::atomic<size_t> dirs_skipped{0};
+    std::atomic<size_t> files_probed{0};
+    std::atomic<size_t> files_reused{0};
+    std::atomic<size_t> files_removed{0};
+
+    // idle walk workers park here until directories are queued, the walk ends or the
+    // job is stopped
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<uint64_t> queued{0}; // times directories were queued
+
+    Queue queue{64}; // each block is one sorted run
+    std::shared_ptr<LibraryIndex> index; // written before running drops
+};
+
+Scanner::Scanner() : totals_(std::make_shared<Totals>())
+{
+    // directory listing is latency bound (network mounts), so oversubscribe a bit
+    SetThreadCount((int)std::max(4u, std::thread::hardware_concurrency() * 2));
+}
 
 Scanner::~Scanner()
 {
+    // a walk stuck on a dead mount must not hold up shutdown, the threads only
+    // touch their own job
     Stop();
+    for (auto &r : retired_)
+        r.thread.detach();
 }
 
-void Scanner::Start(const std::filesystem::path &root, bool recursive, SortMode sort)
+void Scanner::Start(const std::filesystem::path &root, bool recursive, SortMode sort,
+                    bool descending, std::shared_ptr<const LibraryIndex> previous)
 {
-    Stop(); // wait for any running scan
-    stop_.store(false);
-    running_.store(true);
-    thread_ = std::thread(&Scanner::ScanDir, this, root, recursive, sort);
+    Stop();
+
+    auto job = std::make_shared<Job>();
+    job->generation = ++generation_;
+    job->root = root;
+    job->recursive = recursive;
+    job->sort = sort;
+    job->descending = descending;
+    job->thread_count = thread_count_;
+    job->list_hook = list_hook_;
+    job->previous = std::move(previous);
+    job->totals = totals_;
+    job_ = job;
+    thread_ = std::thread([job] { job->Run(); });
 }
 
 void Scanner::Stop()
 {
-    stop_.store(true);
-    if (thread_.joinable())
-        thread_.join();
-    running_.store(false);
+    ReapRetired();
+    if (!thread_.joinable())
+        return;
+
+    // cancelled jobs are joined later, once they've noticed
+    job_->stop.store(true);
+    job_->Wake();
+    retired_.push_back({job_, std::move(thread_)});
 }
 
 bool Scanner::IsRunning() const
 {
-    return running_.load();
+    return job_ && !job_->stop.load() && job_->running.load();
+}
+
+uint64_t Scanner::Generation() const
+{
+    return generation_;
+}
+
+size_t Scanner::PendingCancellations()
+{
+    ReapRetired();
+    return retired_.size();
+}
+
+void Scanner::ReapRetired()
+{
+    auto done = [](Retired &r)
+    {
+        if (r.job->running.load())
+            return false;
+        r.thread.join(); // already past its last store, returns immediately
+        return true;
+    };
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), done), retired_.end());
 }
 
-bool Scanner::ConsumeBatch(std::vector<TrackEntry> &out)
+bool Scanner::ConsumeBatch(std::vector<TrackEntry> &out, std::vector<size_t> *runs)
 {
-    std::lock_guard<std::mutex> lk(mtx_);
-    if (batch_.empty())
+    // a stopped job's leftovers belong to a generation nobody is waiting for
+    if (!job_ || job_->stop.load())
+        return false;
+
+    auto *blocks = job_->queue.TakeAll();
+    if (!blocks)
         return false;
-    out.swap(batch_);
+
+    size_t total = 0;
+    for (auto *b = blocks; b; b = b->next)
+        total += b->items.size();
+
+    out.clear();
+    out.reserve(total);
+    std::vector<size_t> bounds;
+    for (auto *b = blocks; b; b = b->next)
+    {
+        bounds.push_back(out.size());
+        std::move(b->items.begin(), b->items.end(), std::back_inserter(out));
+    }
+    job_->queue.Recycle(blocks);
+
+    if (runs)
+    {
+        runs->swap(bounds);
+        return true;
+    }
+
+    bounds.push_back(out.size());
+    MergeRuns(out.begin(), std::move(bounds), [job = job_.get()](const TrackEntry &a,
+                                                                  const TrackEntry &b)
+              { return job->Less(a, b); });
     return true;
 }
 
-void Scanner::ScanDir(std::filesystem::path root, bool recursive, SortMode)
+ScanStats Scanner::Stats() const
 {
-    std::vector<TrackEntry> local;
+    ScanStats stats;
+    if (!job_)
+        return stats;
+    stats.dirs_listed = job_->dirs_listed.load();
+    stats.dirs_skipped = job_->dirs_skipped.load();
+    stats.files_probed = job_->files_probed.load();
+    stats.files_reused = job_->files_reused.load();
+    stats.files_removed = job_->files_removed.load();
+    return stats;
+}
 
-    auto flush = [&]()
+std::shared_ptr<LibraryIndex> Scanner::TakeIndex()
+{
+    if (!job_ || job_->running.load())
+        return nullptr;
+    return std::move(job_->index);
+}
+
+void Scanner::SetThreadCount(int count)
+{
+    thread_count_ = std::max(1, count);
+}
+
+void Scanner::SetListHook(std::function<void(const std::filesystem::path &)> hook)
+{
+    list_hook_ = std::move(hook);
+}
+
+void Scanner::RegisterMetrics(MetricsRegistry &registry)
+{
+    using R = MetricsRegistry;
+    auto &t = *totals_;
+    registry.AddCounter("pmdmini_scans_total", "Library scans run, cancelled ones included",
+                        R::Value(t.scans));
+    registry.AddCounter("pmdmini_scan_seconds_total", "Time spent scanning",
+                        R::Value(t.busy_ns, 1e-9));
+    registry.AddCounter("pmdmini_scan_dirs_listed_total", "Directories read from disk",
+                        R::Value(t.dirs_listed));
+    registry.AddCounter("pmdmini_scan_dirs_skipped_total",
+                        "Unchanged directories replayed from the library index",
+                        R::Value(t.dirs_skipped));
+    registry.AddCounter("pmdmini_scan_files_probed_total", "New or modified files",
+                        R::Value(t.files_probed));
+    registry.AddCounter("pmdmini_scan_files_reused_total",
+                        "Files taken over from the library index", R::Value(t.files_reused));
+}
+
+int Scanner::ThreadCount() const
+{
+    return thread_count_;
+}
+
+void Scanner::Job::AddFile(const std::filesystem::path &dir, std::string_view folder_key,
+                           const LibraryIndex::File &file, WorkerState &state)
+{
+    if (!state.block)
+        state.block = queue.Acquire(state.cache);
+    state.block->items.push_back(MakeTrackEntry(dir, folder_key, file));
+
+    if (state.block->items.size() >= queue.BlockSize())
+        Flush(state);
+}
+
+// each flush pushes one sorted run, merged by ConsumeBatch() or the playlist
+void Scanner::Job::Flush(WorkerState &state)
+{
+    auto *block = state.block;
+    if (!block)
+        return;
+    state.block = nullptr;
+
+    if (block->items.empty() || stop.load())
     {
-        if (local.empty())
-            return;
-        std::lock_guard<std::mutex> lk(mtx_);
-        batch_.insert(batch_.end(), local.begin(), local.end());
-        local.clear();
-    };
+        block->items.clear();
+        block->next = state.cache;
+        state.cache = block;
+        return;
+    }
 
+    std::sort(block->items.begin(), block->items.end(),
+              [this](const TrackEntry &a, const TrackEntry &b) { return Less(a, b); });
+    queue.Push(block);
+}
+
+void Scanner::Job::Run()
+{
+    TRACE_THREAD("scan");
+    auto start = std::chrono::steady_clock::now();
     std::error_code ec;
     auto base = std::filesystem::weakly_canonical(root, ec);
     if (ec || !std::filesystem::exists(base))
     {
-        running_.store(false);
+        Tally(start);
+        previous.reset();
+        running.store(false);
         return;
     }
 
-    auto process = [&](const std::filesystem::directory_entry &entry)
+    std::vector<WorkerState> states(recursive ? (size_t)thread_count : 1);
+    if (recursive)
     {
-        if (stop_.load())
-            return false;
+        Walk(base, states);
+    }
+    else
+    {
+        std::vector<std::filesystem::path> subdirs;
+        ListDir(base, states[0], subdirs);
+    }
 
-        if (!entry.is_regular_file())
-            return true;
+    for (auto &state : states)
+        Flush(state);
 
-        auto p = entry.path();
-        if (!IsPmdFile(p.filename().string()))
-            return true;
+    if (!stop.load())
+    {
+        std::vector<std::pair<LibraryIndex::String, LibraryIndex::Dir>> dirs;
+        for (auto &state : states)
+            std::move(state.dirs.begin(), state.dirs.end(), std::back_inserter(dirs));
+        auto result = std::make_shared<LibraryIndex>();
+        result->root = base;
+        result->recursive = recursive;
+        result->Build(std::move(dirs));
+        index = std::move(result);
+    }
 
-        TrackEntry e;
-        e.display_name = p.filename().string();
-        e.path = std::filesystem::absolute(p, ec);
-        if (ec)
-        {
-            e.path = p;
-            ec.clear();
-        }
-        e.size = entry.file_size();
-        e.modified = entry.last_write_time();
-        local.push_back(e);
+    Tally(start);
+    previous.reset();
+    running.store(false);
+}
 
-        if (local.size() >= 64)
-            flush();
+void Scanner::Job::Tally(std::chrono::steady_clock::time_point start)
+{
+    auto busy = std::chrono::steady_clock::now() - start;
+    totals->scans.fetch_add(1, std::memory_order_relaxed);
+    totals->busy_ns.fetch_add(
+        (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count(),
+        std::memory_order_relaxed);
+    totals->dirs_listed.fetch_add(dirs_listed.load(), std::memory_order_relaxed);
+    totals->dirs_skipped.fetch_add(dirs_skipped.load(), std::memory_order_relaxed);
+    totals->files_probed.fetch_add(files_probed.load(), std::memory_order_relaxed);
+    totals->files_reused.fetch_add(files_reused.load(), std::memory_order_relaxed);
+}
 
-        return true;
-    };
+// replays dir from the previous index when its mtime is unchanged, lists it otherwise
+void Scanner::Job::ListDir(const std::filesystem::path &dir, WorkerState &state,
+                           std::vector<std::filesystem::path> &subdirs)
+{
+    TRACE_SCOPE("Scanner::ListDir");
+    if (list_hook)
+        list_hook(dir);
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(dir, ec);
+    if (ec || stop.load())
+        return;
 
-    if (recursive)
+    auto old = previous ? previous->Find(dir.native()) : std::nullopt;
+    LibraryIndex::Dir record;
+    if (old && old->Modified() == modified)
     {
-        for (std::filesystem::recursive_directory_iterator it(base), end; it != end; ++it)
-        {
-            if (!process(*it))
-                break;
-        }
+        dirs_skipped.fetch_add(1);
+        files_reused.fetch_add(old->FileCount());
+        record = old->Copy();
     }
     else
     {
-        for (std::filesystem::directory_iterator it(base), end; it != end; ++it)
+        if (!ReadDirRecord(dir, record, &stop))
+            return;
+        dirs_listed.fetch_add(1);
+
+        size_t matched = 0;
+        for (auto &file : record.files)
+        {
+            auto prev = old ? old->FindFile(file.name) : std::nullopt;
+            if (prev)
+                matched++;
+            if (prev && prev->size == file.size && prev->modified == file.modified)
+                files_reused.fetch_add(1);
+            else
+                files_probed.fetch_add(1);
+        }
+        if (old)
         {
-            if (!process(*it))
-                break;
+            files_removed.fetch_add(old->FileCount() - matched);
+            // a folder deleted since takes its files along. only its parent is listed
+            // again, what was under it has to come from the previous index
+            for (size_t i = 0; i < old->SubdirCount(); i++)
+            {
+                auto sub = old->SubdirAt(i);
+                if (std::find(record.subdirs.begin(), record.subdirs.end(), sub) ==
+                    record.subdirs.end())
+                    files_removed.fetch_add(
+                        previous->FileCountUnder((dir / LibraryIndex::String(sub)).native()));
+            }
         }
     }
 
-    flush();
-    running_.store(false);
+    for (auto &file : record.files)
+        AddFile(dir, record.folder_key, file, state);
+    for (auto &sub : record.subdirs)
+        subdirs.push_back(dir / sub);
+    state.dirs.emplace_back(dir.native(), std::move(record));
+}
+
+void Scanner::Job::Wake()
+{
+    // a worker between its check and its wait holds the lock, so it can't miss this
+    {
+        std::lock_guard lk(idle_mtx);
+    }
+    idle_cv.notify_all();
+}
+
+void Scanner::Job::Walk(const std::filesystem::path &base, std::vector<WorkerState> &states)
+{
+    size_t workers = states.size();
+    std::vector<WorkQueue> queues(workers);
+    queues[0].dirs.push_back(base);
+
+    // directories queued or being listed, the walk is done when it drops to zero
+    std::atomic<size_t> pending{1};
+
+    auto worker = [&](size_t self)
+    {
+        TRACE_THREAD("scan");
+        std::vector<std::filesystem::path> subdirs;
+        std::filesystem::path dir;
+
+        while (!stop.load() && pending.load() > 0)
+        {
+            // read before looking, so a push in between isn't slept through
+            uint64_t seen = queued.load();
+            if (!PopOrSteal(queues, self, dir))
+            {
+                std::unique_lock lk(idle_mtx);
+                idle_cv.wait(lk, [&]
+                             {
+                                 return queued.load() != seen || pending.load() == 0 ||
+                                        stop.load();
+                             });
+                continue;
+            }
+
+            ListDir(dir, states[self], subdirs);
+            if (!subdirs.empty())
+            {
+                pending.fetch_add(subdirs.size());
+                {
+                    std::lock_guard lk(queues[self].mtx);
+                    for (auto &sub : subdirs)
+                        queues[self].dirs.push_back(std::move(sub));
+                }
+                queued.fetch_add(1);
+                Wake();
+            }
+            subdirs.clear();
+            if (pending.fetch_sub(1) == 1)
+                Wake();
+        }
+
+        Flush(states[self]);
+    };
+
+    // with a single worker this is a plain depth first walk on the calling thread
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; i++)
+        pool.emplace_back(worker, i);
+    worker(0);
+    for (auto &t : pool)
+        t.join();
 }
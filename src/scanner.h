@@ -1,28 +1,112 @@
 #pragma once
 
+#include "library_index.h"
+#include "metrics.h"
 #include <atomic>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+// stable identity of a playlist entry, survives sorting and filtering
+using TrackId = uint32_t;
+constexpr TrackId kInvalidTrackId = 0;
+
+struct SongInfo;
+
 struct TrackEntry
 {
     std::string display_name;
     std::filesystem::path path;
     uintmax_t size = 0;
     std::filesystem::file_time_type modified;
+    TrackId id = kInvalidTrackId; // assigned by Playlist
+    std::shared_ptr<const SongInfo> info; // filled in later by MetadataProbe
+
+    // collation keys, built once per track (see BuildSortKeys)
+    std::string name_key;
+    std::string variant_key;
+    std::string folder_key;
 };
 
 enum class SortMode
 {
     Name,
     Date,
-    Size
+    Size,
+    Folder
+};
+
+enum class PmdVariant
+{
+    None,
+    M,   // PC-98 OPN/OPNA
+    M2,  // PC-98 OPNA
+    M26, // PC-8801
+    M86  // PC-8801 extended
 };
 
-bool IsPmdFile(const std::string &name);
+// looks only at the extension, so name can be a full path. no allocations
+template <typename Char> PmdVariant ClassifyPmdFile(std::basic_string_view<Char> name)
+{
+    auto dot = name.find_last_of(Char('.'));
+    if (dot == name.npos)
+        return PmdVariant::None;
+
+    auto ext = name.substr(dot + 1);
+    if (ext.empty() || ext.size() > 3 || (ext[0] != Char('m') && ext[0] != Char('M')))
+        return PmdVariant::None;
+
+    // anything else (.mdt PCM samples, .md ...) is not playable
+    if (ext.size() == 1)
+        return PmdVariant::M;
+    if (ext.size() == 2)
+        return ext[1] == Char('2') ? PmdVariant::M2 : PmdVariant::None;
+    if (ext[1] == Char('2') && ext[2] == Char('6'))
+        return PmdVariant::M26;
+    if (ext[1] == Char('8') && ext[2] == Char('6'))
+        return PmdVariant::M86;
+    return PmdVariant::None;
+}
+
+bool IsPmdFile(std::string_view name);
+void BuildSortKeys(TrackEntry &entry);
+// the keys BuildSortKeys() derives from a file name and from the directory of a file
+void NameKeys(const std::string &display_name, std::string &name_key, std::string &variant_key);
+std::string FolderKey(const std::filesystem::path &dir);
+
+// ordering used by the playlist; ties fall through to name, variant, folder and id
+bool TrackLess(const TrackEntry &a, const TrackEntry &b, SortMode mode, bool descending = false);
+
+// an entry with the sort keys saved in the index, nothing is derived again
+TrackEntry MakeTrackEntry(const std::filesystem::path &dir, std::string_view folder_key,
+                          const LibraryIndex::FileView &file);
+TrackEntry MakeTrackEntry(const std::filesystem::path &dir, std::string_view folder_key,
+                          const LibraryIndex::File &file);
+
+// entries of every directory in the index, in no particular order
+std::vector<TrackEntry> EntriesFromIndex(const LibraryIndex &index);
+
+// lists the playable files (sorted by name) and subdirectories of dir, without following
+// directory symlinks. false if dir can't be read
+bool ReadDirRecord(const std::filesystem::path &dir, LibraryIndex::Dir &out,
+                   const std::atomic<bool> *stop = nullptr);
+
+struct ScanStats
+{
+    size_t dirs_listed = 0;  // new or modified directories, read from disk
+    size_t dirs_skipped = 0; // unchanged since the previous index, replayed from it
+    size_t files_probed = 0; // new or modified files
+    size_t files_reused = 0;
+    size_t files_removed = 0;
+
+    size_t Changes() const { return files_probed + files_removed; }
+};
 
 class Scanner
 {
@@ -30,18 +114,61 @@ class Scanner
     Scanner();
     ~Scanner();
 
-    void Start(const std::filesystem::path &root, bool recursive, SortMode sort);
+    // batches come out sorted by (sort, descending). with a previous index, directories
+    // whose mtime is unchanged are not listed again (files edited in place inside them
+    // are not noticed until the directory itself changes).
+    // a scan still running is cancelled, never waited for: it winds down on its own
+    // thread and nothing it produces after this call is handed out
+    void Start(const std::filesystem::path &root, bool recursive, SortMode sort,
+               bool descending = false, std::shared_ptr<const LibraryIndex> previous = nullptr);
     void Stop();
     bool IsRunning() const;
 
-    bool ConsumeBatch(std::vector<TrackEntry> &out);
+    // bumped by every Start(), batches and stats always belong to the latest one
+    uint64_t Generation() const;
+    // cancelled scans whose threads haven't finished yet
+    size_t PendingCancellations();
+
+    // out is one sorted run. with runs set, the scan workers' sorted runs are left as they
+    // are and their start offsets reported instead, for Playlist::AddBatch() to merge
+    bool ConsumeBatch(std::vector<TrackEntry> &out, std::vector<size_t> *runs = nullptr);
+
+    // counters of the current or last scan
+    ScanStats Stats() const;
+    // index built by the last scan, null if it was stopped early
+    std::shared_ptr<LibraryIndex> TakeIndex();
+
+    // 1 walks the tree on a single thread, more spreads subdirectories over a
+    // work-stealing pool. takes effect on the next Start()
+    void SetThreadCount(int count);
+    int ThreadCount() const;
+    // called on a scan thread before each directory is listed, holds a scan at a known
+    // point in tests. takes effect on the next Start()
+    void SetListHook(std::function<void(const std::filesystem::path &)> hook);
+
+    // scans, their time and what they listed and replayed, summed up as each scan ends
+    void RegisterMetrics(MetricsRegistry &registry);
 
   private:
-    void ScanDir(std::filesystem::path root, bool recursive, SortMode sort);
+    struct Totals;
+    // everything one scan touches. the scan thread holds its own reference, so a
+    // cancelled job can outlive its turn as the current one
+    struct Job;
+
+    struct Retired
+    {
+        std::shared_ptr<Job> job;
+        std::thread thread;
+    };
+
+    void ReapRetired();
 
-    std::atomic<bool> running_{false};
-    std::atomic<bool> stop_{false};
+    int thread_count_ = 1;
+    std::function<void(const std::filesystem::path &)> list_hook_;
+    uint64_t generation_ = 0;
+    std::shared_ptr<Job> job_;
     std::thread thread_;
-    std::mutex mtx_;
-    std::vector<TrackEntry> batch_;
+    std::vector<Retired> retired_;
+    // shared with the jobs, a cancelled one may end after the scanner
+    std::shared_ptr<Totals> totals_;
 };
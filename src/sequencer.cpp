@@ -0,0 +1,151 @@
+#include "sequencer.h"
+#include <utility>
+
+bool Sequencer::PlayIndex(int index, bool fade_in)
+{
+    if (index < 0 || index >= (int)playlist_.Size())
+        return false;
+
+    auto *entry = playlist_.ActiveVariant(playlist_.IdAt(index));
+    if (!player_.Load(entry->path))
+    {
+        SetStatus("Failed to load track");
+        return false;
+    }
+
+    playlist_.SetCurrent(index);
+    fading_in_ = fade_in;
+    if (fade_in)
+    {
+        player_.SetPendingFadeIn(crossfade_duration_ms_);
+        SetStatus("Fading in...");
+    }
+
+    player_.Play();
+    if (!fade_in)
+        SetStatus("Playing");
+    PrefetchUpcoming();
+    return true;
+}
+
+// the shuffled pick made by PrefetchUpcoming(), unless that track went away. the
+// sequential next is recomputed, it follows sorting and edits of the list
+int Sequencer::UpcomingIndex()
+{
+    int index = shuffle_ ? playlist_.IndexOf(upcoming_id_) : -1;
+    upcoming_id_ = kInvalidTrackId;
+    return index >= 0 ? index : playlist_.NextIndex(repeat_, shuffle_);
+}
+
+void Sequencer::PrefetchUpcoming()
+{
+    int next = playlist_.NextIndex(repeat_, shuffle_);
+    upcoming_id_ = playlist_.IdAt(next);
+    if (next >= 0 && next != playlist_.CurrentIndex())
+        player_.Prefetch(playlist_.ActiveVariant(upcoming_id_)->path);
+}
+
+// with crossfade on, a playing track fades out first and index fades in after it
+void Sequencer::FadeTo(int index)
+{
+    if (crossfade_enabled_ && player_.GetState() == PlayerState::Playing)
+    {
+        fading_to_next_ = true;
+        pending_next_id_ = playlist_.IdAt(index);
+        player_.StartFadeOut(crossfade_duration_ms_);
+        SetStatus("Fading out...");
+    }
+    else
+    {
+        PlayIndex(index);
+    }
+}
+
+void Sequencer::PlayNext()
+{
+    int next = UpcomingIndex();
+    if (next < 0)
+    {
+        player_.Stop();
+        SetStatus("Playlist ended");
+        return;
+    }
+    FadeTo(next);
+}
+
+void Sequencer::PlayPrev()
+{
+    int prev = playlist_.PrevIndex(repeat_);
+    if (prev >= 0)
+        FadeTo(prev);
+}
+
+void Sequencer::Update()
+{
+    if (fading_in_ && !player_.IsLoading() && !player_.IsFadingIn())
+    {
+        fading_in_ = false;
+        SetStatus("Playing");
+    }
+
+    // crossfade: anticipate track end and start fading out early
+    if (crossfade_enabled_ && !fading_to_next_ && player_.GetState() == PlayerState::Playing)
+    {
+        auto info = player_.GetTrackLength();
+        if (info.duration_known)
+        {
+            float sr = info.sample_rate > 0 ? (float)info.sample_rate : 44100.0f;
+            float pos_sec = player_.GetPositionSamples() / sr;
+            float dur_sec = info.duration_samples / sr;
+            float remaining_ms = (dur_sec - pos_sec) * 1000.0f;
+
+            if (remaining_ms <= crossfade_duration_ms_ && remaining_ms > 0)
+            {
+                int next = UpcomingIndex();
+                if (next >= 0)
+                {
+                    fading_to_next_ = true;
+                    pending_next_id_ = playlist_.IdAt(next);
+                    player_.StartFadeOut((int)remaining_ms);
+                    SetStatus("Fading out...");
+                }
+            }
+        }
+    }
+
+    // fade-out completed: load pending next track with fade in
+    if (fading_to_next_ && player_.IsFadeOutComplete())
+    {
+        fading_to_next_ = false;
+        PlayIndex(playlist_.IndexOf(pending_next_id_), true);
+        pending_next_id_ = kInvalidTrackId;
+    }
+
+    // auto-next on track end (no crossfade, or no next track during fade)
+    if (player_.HasTrackEnded())
+    {
+        if (fading_to_next_)
+        {
+            // fade was in progress but track ended, load the pending track now
+            fading_to_next_ = false;
+            PlayIndex(playlist_.IndexOf(pending_next_id_), true);
+            pending_next_id_ = kInvalidTrackId;
+        }
+        else
+        {
+            int next = UpcomingIndex();
+            if (next >= 0)
+                PlayIndex(next);
+            else
+            {
+                player_.Stop();
+                SetStatus("Playlist ended");
+            }
+        }
+    }
+}
+
+std::string Sequencer::TakeStatus()
+{
+    return std::exchange(status_, {});
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "player.h"
+#include "playlist.h"
+#include <string>
+
+// what plays after what: the next and previous track, the crossfade into the next one ahead
+// of a track's end and the move on once a track has ended. App drives it once a frame, the
+// tests drive it against a simulated clock
+class Sequencer
+{
+  public:
+    Sequencer(Player &player, Playlist &playlist) : player_(player), playlist_(playlist) {}
+
+    bool PlayIndex(int index, bool fade_in = false);
+    void PlayNext();
+    void PlayPrev();
+    // picks the track after the current one again and prefetches it, for a changed order
+    void PrefetchUpcoming();
+    // fades into the next track when the current one is about to end, or goes on to it
+    // once it has ended
+    void Update();
+
+    void SetShuffle(bool shuffle) { shuffle_ = shuffle; }
+    void SetRepeat(RepeatMode repeat) { repeat_ = repeat; }
+    void SetCrossfade(bool enabled, int duration_ms)
+    {
+        crossfade_enabled_ = enabled;
+        crossfade_duration_ms_ = duration_ms;
+    }
+    bool Shuffle() const { return shuffle_; }
+    RepeatMode Repeat() const { return repeat_; }
+    bool CrossfadeEnabled() const { return crossfade_enabled_; }
+    int CrossfadeMs() const { return crossfade_duration_ms_; }
+
+    TrackId UpcomingId() const { return upcoming_id_; }
+    bool IsFadingToNext() const { return fading_to_next_; }
+    // the newest status line since the last call, empty if there is none
+    std::string TakeStatus();
+
+  private:
+    int UpcomingIndex();
+    void FadeTo(int index);
+    void SetStatus(std::string status) { status_ = std::move(status); }
+
+    Player &player_;
+    Playlist &playlist_;
+
+    bool shuffle_ = false;
+    RepeatMode repeat_ = RepeatMode::Off;
+    bool crossfade_enabled_ = false;
+    int crossfade_duration_ms_ = 1000;
+
+    bool fading_to_next_ = false;
+    bool fading_in_ = false;
+    TrackId pending_next_id_ = kInvalidTrackId;
+    // next track picked (and prefetched) as soon as the current one starts, so a
+    // shuffled pick is the same one that plays
+    TrackId upcoming_id_ = kInvalidTrackId;
+
+    std::string status_;
+};
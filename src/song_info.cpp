@@ -0,0 +1,360 @@
+#include "song_info.h"
+#include "sjis_table.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+
+using Char = std::filesystem::path::value_type;
+
+constexpr char kMagic[8] = {'P', 'M', 'D', 'I', 'N', 'F', 'O', 0};
+
+// every string of a SongInfo, in file order
+constexpr std::string SongInfo::*kFields[] = {
+    &SongInfo::title,    &SongInfo::composer, &SongInfo::arranger, &SongInfo::memo,
+    &SongInfo::pcm_file, &SongInfo::pps_file, &SongInfo::ppz_file,
+};
+constexpr size_t kFieldCount = std::size(kFields);
+
+struct DiskHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t char_size;
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t path_pool_size; // native path characters
+    uint64_t text_pool_size; // UTF-8 bytes
+};
+
+struct DiskText
+{
+    uint32_t off;
+    uint32_t len;
+};
+
+struct DiskEntry
+{
+    int64_t modified;
+    uint64_t size;
+    uint64_t hash;
+    DiskText path;
+    DiskText fields[kFieldCount];
+};
+
+static_assert(sizeof(DiskHeader) == 40 && sizeof(DiskEntry) == 88);
+static_assert(std::is_trivially_copyable_v<DiskEntry>);
+
+int64_t TimeToDisk(std::filesystem::file_time_type t)
+{
+    return (int64_t)t.time_since_epoch().count();
+}
+
+std::filesystem::file_time_type TimeFromDisk(int64_t v)
+{
+    using Duration = std::filesystem::file_time_type::duration;
+    return std::filesystem::file_time_type(Duration((Duration::rep)v));
+}
+
+uint16_t ReadU16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+void AppendUtf8(std::string &out, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        out.push_back((char)cp);
+    }
+    else if (cp < 0x800)
+    {
+        out.push_back((char)(0xC0 | cp >> 6));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        out.push_back((char)(0xE0 | cp >> 12));
+        out.push_back((char)(0x80 | (cp >> 6 & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+template <typename T> void WriteArray(std::ofstream &f, const std::vector<T> &v)
+{
+    f.write(reinterpret_cast<const char *>(v.data()), (std::streamsize)(v.size() * sizeof(T)));
+}
+
+} // namespace
+
+std::string SjisToUtf8(std::string_view sjis)
+{
+    std::string out;
+    out.reserve(sjis.size() + sjis.size() / 2);
+
+    for (size_t i = 0; i < sjis.size(); i++)
+    {
+        auto c = (uint8_t)sjis[i];
+        if (c == 0x1B)
+        {
+            // ESC [ ... letter
+            if (i + 1 < sjis.size() && sjis[i + 1] == '[')
+            {
+                i += 2;
+                while (i < sjis.size() && !std::isalpha((unsigned char)sjis[i]))
+                    i++;
+            }
+            continue;
+        }
+        if (c < 0x20 || c == 0x7F)
+            continue;
+        if (c < 0x80)
+        {
+            out.push_back((char)c);
+            continue;
+        }
+
+        // half width katakana
+        if (c >= 0xA1 && c <= 0xDF)
+        {
+            AppendUtf8(out, 0xFF61 + (c - 0xA1));
+            continue;
+        }
+
+        int row = -1;
+        if (c >= 0x81 && c <= 0x9F)
+            row = c - 0x81;
+        else if (c >= 0xE0 && c <= 0xFC)
+            row = c - 0xE0 + 0x1F;
+        uint8_t trail = i + 1 < sjis.size() ? (uint8_t)sjis[i + 1] : 0;
+        if (row < 0 || trail < 0x40 || trail > 0xFC)
+        {
+            AppendUtf8(out, 0xFFFD);
+            continue;
+        }
+
+        i++;
+        uint16_t cp = sjis_table[row * kSjisTrailCount + (trail - 0x40)];
+        AppendUtf8(out, cp ? cp : 0xFFFD);
+    }
+    return out;
+}
+
+// same walk as pmdwin's getmemo(): the word before the voice data points at a table of
+// string offsets, terminated by 0 or a string starting with '/'
+bool ParsePmdInfo(const uint8_t *data, size_t size, SongInfo &out)
+{
+    out = {};
+
+    // byte 0 is the target sound board, offsets count from the byte after it
+    if (size < 2)
+        return false;
+    const uint8_t *mml = data + 1;
+    size_t n = std::min(size, kMaxPmdSize) - 1;
+    if (n < 0x1A)
+        return false;
+
+    // no voice data, so nowhere to find the memo table
+    if (ReadU16(mml) != 0x1A)
+        return true;
+
+    size_t voices = ReadU16(mml + 0x18);
+    if (voices < 4 || voices > n)
+        return false;
+    const uint8_t *head = mml + voices - 4;
+    uint8_t version = head[2];
+    if (version != 0x40 && (head[3] != 0xFE || version < 0x41))
+        return true;
+
+    // newer compilers list PPZ and PPS banks in front of the PCM file. index 0 is the
+    // PCM file, 1-3 title, composer and arranger, anything after is memo
+    int index = -(int)(version >= 0x42) - (int)(version >= 0x48);
+    std::string *named[] = {&out.ppz_file, &out.pps_file, &out.pcm_file,
+                            &out.title,    &out.composer, &out.arranger};
+
+    for (size_t at = ReadU16(head); at + 2 <= n; at += 2, index++)
+    {
+        size_t str = ReadU16(mml + at);
+        if (str == 0 || str >= n || mml[str] == '/')
+            break;
+
+        auto *end = static_cast<const uint8_t *>(std::memchr(mml + str, 0, n - str));
+        size_t len = (end ? (size_t)(end - mml) : n) - str;
+        auto text = SjisToUtf8(std::string_view(reinterpret_cast<const char *>(mml + str), len));
+
+        if (index <= 3)
+        {
+            *named[index + 2] = std::move(text);
+            continue;
+        }
+        if (!out.memo.empty())
+            out.memo.push_back('\n');
+        out.memo += text;
+    }
+    return true;
+}
+
+std::shared_ptr<const SongInfo> SongInfoCache::Find(const std::filesystem::path &path,
+                                                      uintmax_t size,
+                                                      std::filesystem::file_time_type modified)
+{
+    std::lock_guard lk(mtx_);
+    auto it = entries_.find(path.native());
+    if (it == entries_.end() || it->second.size != size || it->second.modified != modified)
+        return nullptr;
+    if (!it->second.used)
+    {
+        it->second.used = true;
+        dirty_ = true;
+    }
+    return it->second.info;
+}
+
+void SongInfoCache::Insert(const std::filesystem::path &path, uintmax_t size,
+                            std::filesystem::file_time_type modified,
+                            std::shared_ptr<const SongInfo> info)
+{
+    std::lock_guard lk(mtx_);
+    auto &e = entries_[path.native()];
+    e.size = size;
+    e.modified = modified;
+    e.info = std::move(info);
+    e.used = true;
+    dirty_ = true;
+}
+
+size_t SongInfoCache::Size() const
+{
+    std::lock_guard lk(mtx_);
+    return entries_.size();
+}
+
+bool SongInfoCache::Dirty() const
+{
+    std::lock_guard lk(mtx_);
+    return dirty_;
+}
+
+bool SongInfoCache::Load(const std::filesystem::path &path)
+{
+    std::lock_guard lk(mtx_);
+    entries_.clear();
+    dirty_ = false;
+
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+        return false;
+
+    std::vector<char> data((size_t)f.tellg());
+    f.seekg(0);
+    if (!f.read(data.data(), (std::streamsize)data.size()))
+        return false;
+
+    DiskHeader h;
+    if (data.size() < sizeof(h))
+        return false;
+    std::memcpy(&h, data.data(), sizeof(h));
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion ||
+        h.char_size != sizeof(Char))
+        return false;
+
+    size_t paths_at = sizeof(h) + (size_t)h.entry_count * sizeof(DiskEntry);
+    size_t text_at = paths_at + h.path_pool_size * sizeof(Char);
+    if (text_at + h.text_pool_size != data.size())
+        return false;
+
+    std::vector<Char> paths(h.path_pool_size);
+    std::memcpy(paths.data(), data.data() + paths_at, paths.size() * sizeof(Char));
+    const char *text = data.data() + text_at;
+    auto fits = [](DiskText t, uint64_t total) { return (uint64_t)t.off + t.len <= total; };
+
+    entries_.reserve(h.entry_count);
+    for (uint32_t i = 0; i < h.entry_count; i++)
+    {
+        DiskEntry d;
+        std::memcpy(&d, data.data() + sizeof(h) + i * sizeof(d), sizeof(d));
+
+        bool ok = fits(d.path, paths.size());
+        for (auto &t : d.fields)
+            ok = ok && fits(t, h.text_pool_size);
+        if (!ok)
+        {
+            entries_.clear();
+            return false;
+        }
+
+        auto info = std::make_shared<SongInfo>();
+        for (size_t k = 0; k < kFieldCount; k++)
+            ((*info).*kFields[k]).assign(text + d.fields[k].off, d.fields[k].len);
+        info->hash = d.hash;
+
+        auto &e = entries_[String(paths.data() + d.path.off, d.path.len)];
+        e.size = d.size;
+        e.modified = TimeFromDisk(d.modified);
+        e.info = std::move(info);
+    }
+    return true;
+}
+
+bool SongInfoCache::Save(const std::filesystem::path &path)
+{
+    std::lock_guard lk(mtx_);
+    std::vector<DiskEntry> records;
+    std::vector<Char> paths;
+    std::vector<char> text;
+
+    for (auto &[file, e] : entries_)
+    {
+        if (!e.used)
+            continue;
+
+        DiskEntry d{};
+        d.modified = TimeToDisk(e.modified);
+        d.size = e.size;
+        d.hash = e.info->hash;
+        d.path = {(uint32_t)paths.size(), (uint32_t)file.size()};
+        paths.insert(paths.end(), file.begin(), file.end());
+        for (size_t k = 0; k < kFieldCount; k++)
+        {
+            auto &s = (*e.info).*kFields[k];
+            d.fields[k] = {(uint32_t)text.size(), (uint32_t)s.size()};
+            text.insert(text.end(), s.begin(), s.end());
+        }
+        records.push_back(d);
+    }
+
+    DiskHeader h{};
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.char_size = sizeof(Char);
+    h.entry_count = (uint32_t)records.size();
+    h.path_pool_size = paths.size();
+    h.text_pool_size = text.size();
+
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f)
+            return false;
+        f.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        WriteArray(f, records);
+        WriteArray(f, paths);
+        WriteArray(f, text);
+        if (!f)
+            return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+        return false;
+    dirty_ = false;
+    return true;
+}
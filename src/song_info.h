@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// memo strings embedded in a PMD file, all UTF-8
+struct SongInfo
+{
+    std::string title;
+    std::string composer;
+    std::string arranger;
+    std::string memo; // remaining memo lines, newline separated
+
+    // PCM banks the song expects next to it
+    std::string pcm_file; // .PPC / .P86
+    std::string pps_file;
+    std::string ppz_file;
+
+    // XXH64 of the file as probed, finds identical copies. 0 if not hashed
+    uint64_t hash = 0;
+};
+
+// decodes Shift-JIS (cp932) text. unmapped bytes become U+FFFD, PC-98 escape sequences
+// (colour codes in memos) and other control characters are dropped
+std::string SjisToUtf8(std::string_view sjis);
+
+// reads the memo table straight from the song data, without initializing the driver.
+// data is the whole file. false if it isn't PMD data, songs without a memo table parse
+// fine and come back empty
+bool ParsePmdInfo(const uint8_t *data, size_t size, SongInfo &out);
+
+// compiled songs address everything with 16 bit offsets, nothing past this is read
+constexpr size_t kMaxPmdSize = 0x10000 + 1;
+
+// probe results of earlier sessions, keyed by path and valid while size and mtime match.
+// thread safe
+class SongInfoCache
+{
+  public:
+    using String = std::filesystem::path::string_type;
+
+    static constexpr uint32_t kVersion = 2;
+
+    // null on a miss or a stale entry
+    std::shared_ptr<const SongInfo> Find(const std::filesystem::path &path, uintmax_t size,
+                                          std::filesystem::file_time_type modified);
+    void Insert(const std::filesystem::path &path, uintmax_t size,
+                std::filesystem::file_time_type modified,
+                std::shared_ptr<const SongInfo> info);
+
+    size_t Size() const;
+    bool Dirty() const;
+
+    // same flat layout as the library index. only entries looked up or inserted since
+    // Load() are saved, so files that went away drop out
+    bool Load(const std::filesystem::path &path);
+    bool Save(const std::filesystem::path &path);
+
+  private:
+    struct Entry
+    {
+        uintmax_t size = 0;
+        std::filesystem::file_time_type modified;
+        std::shared_ptr<const SongInfo> info;
+        bool used = false;
+    };
+
+    mutable std::mutex mtx_;
+    std::unordered_map<String, Entry> entries_;
+    bool dirty_ = false;
+};
@@ -0,0 +1,241 @@
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// atomics, a dump may read a slot its thread is writing. times in Trace::Now() ticks
+struct TraceEvent
+{
+    std::atomic<const char *> name{nullptr};
+    std::atomic<uint64_t> begin{0};
+    std::atomic<uint64_t> end{0};
+};
+
+struct TraceBuffer
+{
+    std::array<TraceEvent, Trace::kThreadEvents> events;
+    // events begun and finished, the newest sits at count - 1. a dump drops what the
+    // writer began to overwrite while it was copying
+    std::atomic<uint64_t> begun{0};
+    std::atomic<uint64_t> count{0};
+
+    // under the registry lock
+    int tid = 0;
+    std::string name;
+    bool in_use = false;
+    uint64_t ended = 0; // when the thread ended, in thread ends so far
+};
+
+namespace
+{
+
+// up to this many buffers, ended threads keep theirs. past it a new thread takes over
+// the buffer of the one that ended first
+constexpr size_t kMaxBuffers = 64;
+
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    int next_tid = 1;
+    uint64_t ends = 0;
+};
+
+// never destroyed, threads may record while statics go away
+Registry &GetRegistry()
+{
+    static auto *registry = new Registry;
+    return *registry;
+}
+
+struct ThreadSlot
+{
+    TraceBuffer *buffer = nullptr;
+
+    ~ThreadSlot()
+    {
+        if (!buffer)
+            return;
+        auto &registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        buffer->in_use = false;
+        buffer->ended = ++registry.ends;
+    }
+};
+
+thread_local ThreadSlot t_slot;
+// the same pointer, without a destructor the compiler has to guard every access for
+thread_local TraceBuffer *t_buffer = nullptr;
+
+TraceBuffer *Register()
+{
+    auto &registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    TraceBuffer *buffer = nullptr;
+    if (registry.buffers.size() >= kMaxBuffers)
+    {
+        for (auto &b : registry.buffers)
+        {
+            if (!b->in_use && (!buffer || b->ended < buffer->ended))
+                buffer = b.get();
+        }
+    }
+    if (buffer)
+    {
+        buffer->begun.store(0);
+        buffer->count.store(0);
+        buffer->name.clear();
+    }
+    else
+    {
+        registry.buffers.push_back(std::make_unique<TraceBuffer>());
+        buffer = registry.buffers.back().get();
+    }
+    buffer->tid = registry.next_tid++;
+    buffer->in_use = true;
+    t_slot.buffer = buffer;
+    t_buffer = buffer;
+    return buffer;
+}
+
+uint64_t SteadyNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Trace::Now() and steady_clock read together, once when the program starts
+struct Anchor
+{
+    uint64_t ticks;
+    uint64_t ns;
+};
+const Anchor g_start = {Trace::Now(), SteadyNs()};
+
+// nanoseconds per tick, measured from the start of the program to the first dump, which
+// waits a little if that was too short to tell
+double NsPerTick()
+{
+#ifdef TRACE_TSC
+    static const double ns_per_tick = []
+    {
+        constexpr uint64_t kMinNs = 20000000;
+        uint64_t ns = SteadyNs();
+        if (ns < g_start.ns + kMinNs)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(g_start.ns + kMinNs - ns));
+        Anchor now = {Trace::Now(), SteadyNs()};
+        uint64_t ticks = std::max<uint64_t>(1, now.ticks - g_start.ticks);
+        return (double)(now.ns - g_start.ns) / (double)ticks;
+    }();
+    return ns_per_tick;
+#else
+    return 1.0;
+#endif
+}
+
+} // namespace
+
+TraceBuffer *Trace::ThisThread()
+{
+    return t_buffer ? t_buffer : Register();
+}
+
+void Trace::Record(TraceBuffer *buffer, const char *name, uint64_t begin, uint64_t end)
+{
+    uint64_t n = buffer->count.load(std::memory_order_relaxed);
+    buffer->begun.store(n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto &event = buffer->events[n % kThreadEvents];
+    event.name.store(name, std::memory_order_relaxed);
+    event.begin.store(begin, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    buffer->count.store(n + 1, std::memory_order_release);
+}
+
+void Trace::SetThreadName(const char *name)
+{
+    auto *buffer = ThisThread();
+    std::lock_guard lock(GetRegistry().mutex);
+    buffer->name = name;
+}
+
+bool Trace::WriteChromeJson(const std::filesystem::path &path)
+{
+    FILE *f = std::fopen(path.string().c_str(), "wb");
+    if (!f)
+        return false;
+
+    double ns_per_tick = NsPerTick();
+    auto &registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first = true;
+    for (auto &b : registry.buffers)
+    {
+        auto &buffer = *b;
+        int tid = buffer.tid;
+        std::string name = buffer.name.empty() ? "thread " + std::to_string(tid) : buffer.name;
+        std::fprintf(f,
+                     "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",", tid, name.c_str());
+        first = false;
+
+        uint64_t count = buffer.count.load(std::memory_order_acquire);
+        uint64_t oldest = count > kThreadEvents ? count - kThreadEvents : 0;
+        struct Copy
+        {
+            const char *name;
+            uint64_t begin;
+            uint64_t end;
+        };
+        std::vector<Copy> copies;
+        copies.reserve(count - oldest);
+        for (uint64_t i = oldest; i < count; i++)
+        {
+            auto &event = buffer.events[i % kThreadEvents];
+            copies.push_back({event.name.load(std::memory_order_relaxed),
+                              event.begin.load(std::memory_order_relaxed),
+                              event.end.load(std::memory_order_relaxed)});
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t begun = buffer.begun.load(std::memory_order_relaxed);
+        // slots the writer has come round to again since
+        uint64_t valid = begun > kThreadEvents ? begun - kThreadEvents : 0;
+
+        for (uint64_t i = std::max(oldest, valid); i < count; i++)
+        {
+            auto &e = copies[i - oldest];
+            // signed, a tick count taken before the anchor comes out before it
+            double begin_ns =
+                (double)g_start.ns + (double)(int64_t)(e.begin - g_start.ticks) * ns_per_tick;
+            double dur_ns = (double)(e.end - e.begin) * ns_per_tick;
+            std::fprintf(f,
+                         ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                         "\"dur\":%.3f}",
+                         e.name, tid, begin_ns / 1000.0, dur_ns / 1000.0);
+        }
+    }
+    std::fprintf(f, "\n]}\n");
+    return std::fclose(f) == 0;
+}
+
+void Trace::Clear()
+{
+    auto &registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    for (auto &buffer : registry.buffers)
+    {
+        buffer->begun.store(0);
+        buffer->count.store(0);
+    }
+}
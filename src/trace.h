@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_TSC 1
+#endif
+
+struct TraceBuffer;
+
+// timeline of what every thread did, for chrome://tracing or Perfetto. each thread records
+// into a buffer of its own without locks, keeping its newest kThreadEvents events, which
+// stay after the thread ends. events are stamped with the CPU's time stamp counter where
+// there is one, turned into time when written out. only the TRACE_SCOPE() points record,
+// and only in builds configured with PMDMINI_GUI_TRACE
+class Trace
+{
+  public:
+    static constexpr size_t kThreadEvents = 16384;
+#ifdef PMDMINI_GUI_TRACE
+    static constexpr bool kCompiledIn = true;
+#else
+    static constexpr bool kCompiledIn = false;
+#endif
+
+    // ticks of the time stamp counter, or steady_clock nanoseconds without one
+    static uint64_t Now()
+    {
+#ifdef TRACE_TSC
+        return __rdtsc();
+#else
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+    // the calling thread's buffer, set up on its first event
+    static TraceBuffer *ThisThread();
+    // name is kept as a pointer, it must be a string literal. times are Now() ticks
+    static void Record(TraceBuffer *buffer, const char *name, uint64_t begin, uint64_t end);
+    static void Record(const char *name, uint64_t begin, uint64_t end)
+    {
+        Record(ThisThread(), name, begin, end);
+    }
+    // how the calling thread shows up in the trace
+    static void SetThreadName(const char *name);
+    // the events recorded so far as Chrome trace event JSON. recording goes on meanwhile,
+    // events overwritten during the copy are left out
+    static bool WriteChromeJson(const std::filesystem::path &path);
+    // forgets every event, for tests
+    static void Clear();
+};
+
+class TraceScope
+{
+  public:
+    explicit TraceScope(const char *name)
+        : buffer_(Trace::ThisThread()), name_(name), begin_(Trace::Now())
+    {
+    }
+    ~TraceScope() { Trace::Record(buffer_, name_, begin_, Trace::Now()); }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+  private:
+    TraceBuffer *buffer_;
+    const char *name_;
+    uint64_t begin_;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef PMDMINI_GUI_TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD(name) Trace::SetThreadName(name)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#endif
@@ -1,5 +1,9 @@
 #include "ui.h"
+#include "alloc_counter.h"
+#include "song_info.h"
+#include "trace.h"
 #include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <cstdio>
 #include <imgui.h>
@@ -48,6 +52,7 @@ void UI::SyncTextBuffers(const UIState &state)
 
 void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, size_t waveform_len)
 {
+    TRACE_SCOPE("UI::Draw");
     SyncTextBuffers(state);
 
     ImGuiIO &io = ImGui::GetIO();
@@ -112,36 +117,75 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
         actions.search = search_buf_;
     }
 
-    const char *sort_opts[] = {"Name", "Date", "Size"};
+    const char *sort_opts[] = {"Name", "Date", "Size", "Folder"};
     int sort_idx = (int)state.sort;
-    if (ImGui::Combo("Sort", &sort_idx, sort_opts, 3))
+    bool desc = state.sort_descending;
+    ImGui::SetNextItemWidth(left_w - 230.0f);
+    if (ImGui::Combo("Sort", &sort_idx, sort_opts, 4))
     {
         actions.sort_changed = true;
         actions.sort = (SortMode)sort_idx;
+        actions.sort_descending = desc;
+    }
+
+    ImGui::SameLine();
+    if (ImGui::Checkbox("Desc", &desc))
+    {
+        actions.sort_changed = true;
+        actions.sort = state.sort;
+        actions.sort_descending = desc;
+    }
+
+    ImGui::SameLine();
+    bool group = state.group_variants;
+    if (ImGui::Checkbox("Group", &group))
+    {
+        actions.group_variants_toggled = true;
+        actions.group_variants = group;
     }
 
     ImGui::Separator();
 
     ImGui::BeginChild("tracks", ImVec2(0, 0), true);
-    for (int i = 0; i < (int)state.tracks.size(); i++)
+    // only the rows in view are laid out, a frame costs the same for any size of list
+    int rows = state.playlist ? (int)state.playlist->RowCount() : 0;
+    ImGuiListClipper clipper;
+    clipper.Begin(rows);
+    while (clipper.Step())
     {
-        const auto &track = state.tracks[i];
-        bool selected = (i == state.selected_index);
-        bool is_current = (i == state.current_index);
+        for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+        {
+            const auto &track = state.playlist->At(state.playlist->RowIndex(i));
+            bool selected = (i == state.selected_index);
+            bool is_current = (i == state.current_index);
 
-        if (is_current)
-            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.9f, 0.4f, 1.0f));
+            if (is_current)
+                ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.9f, 0.4f, 1.0f));
 
-        if (ImGui::Selectable(track.display_name.c_str(), selected))
-        {
-            actions.select_index = i;
-            if (ImGui::IsMouseDoubleClicked(0))
-                actions.play_selected = true;
-        }
+            if (ImGui::Selectable(track.display_name.c_str(), selected))
+            {
+                actions.select_index = i;
+                if (ImGui::IsMouseDoubleClicked(0))
+                    actions.play_selected = true;
+            }
+            if (ImGui::IsItemVisible())
+            {
+                if (actions.visible_first < 0)
+                    actions.visible_first = i;
+                actions.visible_last = i;
+            }
+            if (ImGui::IsItemHovered())
+            {
+                actions.hover_index = i;
+                if (track.info)
+                    DrawSongInfoTooltip(*track.info);
+            }
 
-        if (is_current)
-            ImGui::PopStyleColor();
+            if (is_current)
+                ImGui::PopStyleColor();
+        }
     }
+    clipper.End();
     ImGui::EndChild();
 
     ImGui::EndChild();
@@ -151,10 +195,20 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
     ImGui::BeginChild("right", ImVec2(0, center_h), true);
 
     const char *track_name = "None";
-    if (state.current_index >= 0 && state.current_index < (int)state.tracks.size())
-        track_name = state.tracks[state.current_index].display_name.c_str();
+    if (state.current_track)
+        track_name = state.current_track->display_name.c_str();
 
     ImGui::Text("Now Playing: %s", track_name);
+    if (state.current_track)
+    {
+        if (auto &info = state.current_track->info)
+        {
+            if (!info->title.empty())
+                ImGui::TextWrapped("Title: %s", info->title.c_str());
+            if (!info->composer.empty())
+                ImGui::TextWrapped("Composer: %s", info->composer.c_str());
+        }
+    }
 
     const char *state_str = "Stopped";
     if (state.player_state == PlayerState::Playing)
@@ -163,6 +217,20 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
         state_str = "Paused";
     ImGui::Text("State: %s", state_str);
 
+    if (state.variants.size() > 1)
+    {
+        ImGui::TextUnformatted("Variant:");
+        for (int i = 0; i < (int)state.variants.size(); i++)
+        {
+            ImGui::SameLine();
+            ImGui::PushID(i);
+            if (ImGui::RadioButton(state.variants[i]->display_name.c_str(),
+                                   i == state.variant_index))
+                actions.select_variant = i;
+            ImGui::PopID();
+        }
+    }
+
     // waveform
     ImVec2 region = ImGui::GetContentRegionAvail();
     float wave_h = std::max(80.0f, region.y - 40.0f);
@@ -215,14 +283,14 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
     {
         ImGui::SameLine();
 
-        std::vector<const char *> dev_names;
+        dev_names_.clear();
         for (auto &d : state.audio_devices)
-            dev_names.push_back(d.c_str());
+            dev_names_.push_back(d.c_str());
 
         int dev_idx = state.audio_device_index;
         ImGui::SetNextItemWidth(220.0f);
 
-        if (ImGui::Combo("Output", &dev_idx, dev_names.data(), (int)dev_names.size()))
+        if (ImGui::Combo("Output", &dev_idx, dev_names_.data(), (int)dev_names_.size()))
         {
             actions.audio_device_changed = true;
             actions.audio_device_index = dev_idx;
@@ -259,6 +327,14 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
         }
     }
 
+    ImGui::SameLine();
+    bool hp = state.hover_preview;
+    if (ImGui::Checkbox("Preview on hover", &hp))
+    {
+        actions.hover_preview_toggled = true;
+        actions.hover_preview = hp;
+    }
+
     char dur_str[32];
     if (state.duration_known)
         snprintf(dur_str, sizeof(dur_str), "%.1fs", state.duration_sec);
@@ -273,6 +349,32 @@ void UI::Draw(const UIState &state, UIActions &actions, const float *waveform, s
     ImGui::EndChild();
 
     ImGui::End();
+
+    if (state.perf_overlay)
+        DrawPerfOverlay(state.perf);
+}
+
+void UI::DrawSongInfoTooltip(const SongInfo &info)
+{
+    auto line = [](const char *label, const std::string &value)
+    {
+        if (!value.empty())
+            ImGui::Text("%s: %s", label, value.c_str());
+    };
+
+    ImGui::BeginTooltip();
+    line("Title", info.title);
+    line("Composer", info.composer);
+    line("Arranger", info.arranger);
+    line("PCM", info.pcm_file);
+    line("PPS", info.pps_file);
+    line("PPZ", info.ppz_file);
+    if (!info.memo.empty())
+    {
+        ImGui::Separator();
+        ImGui::TextUnformatted(info.memo.c_str());
+    }
+    ImGui::EndTooltip();
 }
 
 void UI::DrawWaveform(const float *waveform, size_t waveform_len, float width, float height)
@@ -394,3 +496,61 @@ void UI::DrawWaveform(const float *waveform, size_t waveform_len, float width, f
                     IM_COL32(100, 180, 255, glow_alpha), 2.0f);
     }
 }
+
+static void DrawTimerHistogram(const char *label, const PerfTimer::Snapshot &timer)
+{
+    // buckets up to the last one used, at least up to 1 ms
+    float counts[PerfTimer::kBuckets];
+    int used = 11;
+    for (int i = 0; i < PerfTimer::kBuckets; i++)
+    {
+        counts[i] = (float)timer.buckets[i];
+        if (timer.buckets[i] > 0)
+            used = std::max(used, i + 1);
+    }
+
+    char overlay[64];
+    snprintf(overlay, sizeof(overlay), "%llu, mean %.0f us, up to %llu us",
+             (unsigned long long)timer.count, timer.MeanUs(),
+             (unsigned long long)PerfTimer::BucketLimitUs(used - 1));
+    ImGui::PlotHistogram(label, counts, used, 0, overlay, 0.0f, FLT_MAX, ImVec2(260, 40));
+}
+
+void UI::DrawPerfOverlay(const PerfView &perf)
+{
+    ImGui::SetNextWindowPos(ImVec2(ImGui::GetIO().DisplaySize.x - 10, 10), ImGuiCond_Always,
+                            ImVec2(1, 0));
+    ImGui::SetNextWindowBgAlpha(0.85f);
+    ImGui::Begin("Performance", nullptr,
+                 ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize |
+                     ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing |
+                     ImGuiWindowFlags_NoNav);
+
+    char fill[32];
+    snprintf(fill, sizeof(fill), "%.0f%%",
+             perf.buffer_fill.empty() ? 0.0f : perf.buffer_fill.back() * 100.0f);
+    ImGui::PlotLines("Buffer", perf.buffer_fill.data(), (int)perf.buffer_fill.size(), 0, fill,
+                     0.0f, 1.0f, ImVec2(260, 40));
+    ImGui::Text("Underruns: %llu", (unsigned long long)perf.underruns);
+
+    ImGui::Separator();
+    DrawTimerHistogram("Decode", perf.decode);
+    ImGui::Text("Decode load: %.1f%% of real time", perf.decode_load * 100.0);
+    DrawTimerHistogram("Callback", perf.callback);
+    DrawTimerHistogram("Jitter", perf.jitter);
+
+    ImGui::Separator();
+    DrawTimerHistogram("Frame", perf.frame_build);
+    DrawTimerHistogram("Swap", perf.frame_swap);
+
+    ImGui::Separator();
+    ImGui::Text("Scan: %.0f files/s", perf.scan_files_per_sec);
+    ImGui::Text("Metadata: %.0f files/s", perf.probe_files_per_sec);
+    if (AllocCounter::kCompiledIn)
+    {
+        ImGui::Text("Allocations: %.1f a frame, %.2f a callback", perf.frame_allocs,
+                    perf.callback_allocs);
+    }
+
+    ImGui::End();
+}
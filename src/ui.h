@@ -1,21 +1,46 @@
 #pragma once
 
 #include "config.h"
+#include "perf_stats.h"
 #include "player.h"
+#include "playlist.h"
 #include "scanner.h"
 #include <string>
 #include <vector>
 
+// what the performance overlay shows. timings and rates cover the last second
+struct PerfView
+{
+    std::vector<float> buffer_fill; // audio ring, once a frame, oldest first
+    uint64_t underruns = 0;
+    PerfTimer::Snapshot decode;
+    double decode_load = 0; // render time over the length of the audio rendered
+    PerfTimer::Snapshot callback;
+    PerfTimer::Snapshot jitter;
+    PerfTimer::Snapshot frame_build;
+    PerfTimer::Snapshot frame_swap;
+    double scan_files_per_sec = 0;
+    double probe_files_per_sec = 0;
+    // heap allocations, with PMDMINI_GUI_COUNT_ALLOCS
+    double frame_allocs = 0;
+    double callback_allocs = 0;
+};
+
+// the app keeps one from frame to frame, updating it in place reuses the buffers of the
+// strings and vectors. the entries point into the playlist and hold for one frame
 struct UIState
 {
     std::string directory;
     bool recursive = false;
     std::string search;
     SortMode sort = SortMode::Name;
+    bool sort_descending = false;
 
-    std::vector<TrackEntry> tracks;
-    int selected_index = -1;
+    // the rows are the playlist's search rows, only the ones on screen are looked at
+    const Playlist *playlist = nullptr;
+    int selected_index = -1; // rows
     int current_index = -1;
+    const TrackEntry *current_track = nullptr;
 
     bool shuffle = false;
     RepeatMode repeat = RepeatMode::Off;
@@ -35,6 +60,16 @@ struct UIState
 
     bool crossfade_enabled = false;
     int crossfade_duration_ms = 1000;
+
+    bool hover_preview = false;
+    bool group_variants = true;
+
+    // files of the selected song, .M / .M2 / .M26 / .M86
+    std::vector<const TrackEntry *> variants;
+    int variant_index = -1;
+
+    bool perf_overlay = false;
+    PerfView perf;
 };
 
 struct UIActions
@@ -67,12 +102,24 @@ struct UIActions
 
     bool sort_changed = false;
     SortMode sort = SortMode::Name;
+    bool sort_descending = false;
     int select_index = -1;
+    int hover_index = -1;
+    // rows drawn on screen this frame
+    int visible_first = -1;
+    int visible_last = -1;
 
     bool crossfade_toggled = false;
     bool crossfade_enabled = false;
     bool crossfade_duration_changed = false;
     int crossfade_duration_ms = 1000;
+
+    bool hover_preview_toggled = false;
+    bool hover_preview = false;
+
+    bool group_variants_toggled = false;
+    bool group_variants = true;
+    int select_variant = -1;
 };
 
 class UI
@@ -85,7 +132,10 @@ class UI
   private:
     void SyncTextBuffers(const UIState &state);
     void DrawWaveform(const float *waveform, size_t waveform_len, float width, float height);
+    void DrawSongInfoTooltip(const SongInfo &info);
+    void DrawPerfOverlay(const PerfView &perf);
 
+    std::vector<const char *> dev_names_; // kept, filled each frame
     std::string dir_cache_;
     std::string search_cache_;
     char dir_buf_[512] = {};
@@ -0,0 +1,280 @@
+#include "underrun_recorder.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <system_error>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+uint64_t Ns(std::chrono::steady_clock::time_point t)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch())
+        .count();
+}
+
+uint64_t Ns(std::chrono::steady_clock::duration d)
+{
+    return (uint64_t)std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+// the kernel's id of the calling thread, the one /proc/self/task lists. 0 elsewhere
+long ThreadId()
+{
+#ifdef __linux__
+    return (long)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+// ms from the underrun, negative before it
+double RelativeMs(uint64_t ns, uint64_t at_ns)
+{
+    return ((double)ns - (double)at_ns) / 1e6;
+}
+
+std::string FirstLine(const std::filesystem::path &path)
+{
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+} // namespace
+
+UnderrunRecorder::~UnderrunRecorder()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void UnderrunRecorder::Ring::Push(const Event &event)
+{
+    if (tid_.load(std::memory_order_relaxed) == 0)
+        tid_.store(ThreadId(), std::memory_order_relaxed);
+
+    uint64_t n = count_.load(std::memory_order_relaxed);
+    begun_.store(n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto &slot = slots_[n % kEvents];
+    for (int i = 0; i < kFields; i++)
+        slot[i].store(event[i], std::memory_order_relaxed);
+    count_.store(n + 1, std::memory_order_release);
+}
+
+std::vector<UnderrunRecorder::Event> UnderrunRecorder::Ring::Copy() const
+{
+    uint64_t count = count_.load(std::memory_order_acquire);
+    uint64_t oldest = count > kEvents ? count - kEvents : 0;
+    std::vector<Event> events;
+    events.reserve(count - oldest);
+    for (uint64_t i = oldest; i < count; i++)
+    {
+        auto &slot = slots_[i % kEvents];
+        Event event;
+        for (int f = 0; f < kFields; f++)
+            event[f] = slot[f].load(std::memory_order_relaxed);
+        events.push_back(event);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t begun = begun_.load(std::memory_order_relaxed);
+    // slots the writer has come round to again since
+    uint64_t valid = begun > kEvents ? begun - kEvents : 0;
+    if (valid > oldest)
+        events.erase(events.begin(), events.begin() + (std::ptrdiff_t)(valid - oldest));
+    return events;
+}
+
+void UnderrunRecorder::SetDirectory(std::filesystem::path dir)
+{
+    std::lock_guard lock(mutex_);
+    dir_ = std::move(dir);
+    if (dir_.empty() || thread_.joinable())
+        return;
+
+    decode_ = std::make_unique<Ring>();
+    callback_ = std::make_unique<Ring>();
+    frame_ = std::make_unique<Ring>();
+    thread_ = std::thread(&UnderrunRecorder::Run, this);
+    active_.store(true, std::memory_order_release);
+}
+
+void UnderrunRecorder::SetTrack(std::string description)
+{
+    std::lock_guard lock(mutex_);
+    track_ = std::move(description);
+}
+
+void UnderrunRecorder::Decode(TimePoint start, Duration took, int frames, size_t fill)
+{
+    decode_->Push({Ns(start), Ns(took), (uint64_t)frames, fill, 0});
+}
+
+void UnderrunRecorder::Callback(TimePoint start, Duration took, size_t samples, size_t fill,
+                                bool dry)
+{
+    callback_->Push({Ns(start), Ns(took), samples, fill, dry});
+}
+
+void UnderrunRecorder::Frame(TimePoint start, Duration build, Duration swap)
+{
+    frame_->Push({Ns(start), Ns(build), Ns(swap), 0, 0});
+}
+
+void UnderrunRecorder::Underrun(TimePoint at)
+{
+    // the first one waiting is the one reported, the ones after it are in its window
+    uint64_t none = 0;
+    underrun_at_ns_.compare_exchange_strong(none, Ns(at), std::memory_order_relaxed);
+}
+
+std::vector<std::filesystem::path> UnderrunRecorder::Reports() const
+{
+    std::lock_guard lock(mutex_);
+    return reports_;
+}
+
+void UnderrunRecorder::Run()
+{
+    std::unique_lock lock(mutex_);
+    while (!stop_)
+    {
+        cv_.wait_for(lock, kPoll, [this] { return stop_; });
+        uint64_t at_ns = underrun_at_ns_.exchange(0, std::memory_order_relaxed);
+        if (at_ns == 0 || stop_)
+            continue;
+
+        // a device that keeps running dry would fill the disk
+        auto now = std::chrono::steady_clock::now();
+        if (reports_.size() >= (size_t)kMaxReports ||
+            (!reports_.empty() && now - last_report_ < kReportInterval))
+            continue;
+        last_report_ = now;
+
+        lock.unlock();
+        WriteReport(at_ns);
+        lock.lock();
+    }
+}
+
+void UnderrunRecorder::WriteReport(uint64_t at_ns)
+{
+    std::filesystem::path dir;
+    std::string track;
+    size_t number;
+    {
+        std::lock_guard lock(mutex_);
+        dir = dir_;
+        track = track_;
+        number = reports_.size() + 1;
+    }
+
+    char stamp[32] = "unknown";
+    std::time_t wall = std::time(nullptr);
+    std::tm tm{};
+#ifdef _WIN32
+    if (localtime_s(&tm, &wall) == 0)
+#else
+    if (localtime_r(&wall, &tm))
+#endif
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    auto path = dir / ("underrun-" + std::string(stamp) + "-" + std::to_string(number) + ".txt");
+    FILE *f = std::fopen(path.string().c_str(), "wb");
+    if (!f)
+    {
+        Logger::Warn("Underrun report: can't write " + path.string());
+        return;
+    }
+
+    uint64_t from_ns = at_ns - std::min<uint64_t>(at_ns, Ns(kWindow));
+    auto window = [&](const Ring &ring)
+    {
+        auto events = ring.Copy();
+        events.erase(std::remove_if(events.begin(), events.end(),
+                                    [&](const Event &e) { return e[0] < from_ns; }),
+                     events.end());
+        return events;
+    };
+    auto longest = [](const std::vector<Event> &events, int field)
+    {
+        uint64_t ns = 0;
+        for (auto &e : events)
+            ns = std::max(ns, e[field]);
+        return ns / 1e6;
+    };
+    auto decode = window(*decode_);
+    auto callback = window(*callback_);
+    auto frame = window(*frame_);
+
+    std::fprintf(f, "underrun %s, %s\n", stamp, track.empty() ? "no track" : track.c_str());
+    std::fprintf(f, "times in ms from the underrun, fill in samples in the audio ring\n\n");
+    std::fprintf(f, "threads: decode %ld, callback %ld, ui %ld\n\n",
+                 decode_->tid_.load(std::memory_order_relaxed),
+                 callback_->tid_.load(std::memory_order_relaxed),
+                 frame_->tid_.load(std::memory_order_relaxed));
+
+    std::fprintf(f, "decode blocks: %zu, longest %.3f\n", decode.size(), longest(decode, 1));
+    std::fprintf(f, "# start took frames fill\n");
+    for (auto &e : decode)
+    {
+        std::fprintf(f, "%.3f %.3f %llu %llu\n", RelativeMs(e[0], at_ns), e[1] / 1e6,
+                     (unsigned long long)e[2], (unsigned long long)e[3]);
+    }
+
+    std::fprintf(f, "\ncallbacks: %zu, longest %.3f\n", callback.size(), longest(callback, 1));
+    std::fprintf(f, "# start took samples fill dry\n");
+    for (auto &e : callback)
+    {
+        std::fprintf(f, "%.3f %.3f %llu %llu %s\n", RelativeMs(e[0], at_ns), e[1] / 1e6,
+                     (unsigned long long)e[2], (unsigned long long)e[3], e[4] ? "dry" : "-");
+    }
+
+    std::fprintf(f, "\nframes: %zu, longest swap %.3f\n", frame.size(), longest(frame, 2));
+    std::fprintf(f, "# start build swap\n");
+    for (auto &e : frame)
+        std::fprintf(f, "%.3f %.3f %.3f\n", RelativeMs(e[0], at_ns), e[1] / 1e6, e[2] / 1e6);
+
+#ifdef __linux__
+    // state, cpu times, priority and last cpu of each thread, then its time run and
+    // waited on a run queue (schedstat), read some ms after the underrun
+    std::fprintf(f, "\nscheduling: /proc/self/task/<tid>/stat and schedstat\n");
+    for (auto &task : std::filesystem::directory_iterator("/proc/self/task", ec))
+    {
+        std::fprintf(f, "%s\n", FirstLine(task.path() / "stat").c_str());
+        auto schedstat = FirstLine(task.path() / "schedstat");
+        if (!schedstat.empty())
+        {
+            std::fprintf(f, "%s schedstat %s\n", task.path().filename().string().c_str(),
+                         schedstat.c_str());
+        }
+    }
+#endif
+
+    if (std::fclose(f) != 0)
+    {
+        Logger::Warn("Underrun report: can't write " + path.string());
+        return;
+    }
+    Logger::Info("Underrun report: " + path.string());
+    std::lock_guard lock(mutex_);
+    reports_.push_back(path);
+}
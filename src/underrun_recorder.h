@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the last seconds of the player's timing: decode blocks, audio callbacks and UI frames
+// with the ring fill after each. the decode thread, the callback and the UI thread record
+// into rings of their own without locks. when a callback runs dry, a thread of the recorder
+// writes that window to a report with the scheduling state of every thread of the process
+// (/proc/self/task, Linux only), off the audio path
+class UnderrunRecorder
+{
+  public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+    using Duration = std::chrono::steady_clock::duration;
+
+    static constexpr auto kWindow = std::chrono::seconds(5);
+    static constexpr size_t kEvents = 2048; // per ring, more than a window of callbacks
+    static constexpr int kMaxReports = 16;  // per run
+    static constexpr auto kReportInterval = std::chrono::seconds(10);
+
+    UnderrunRecorder() = default;
+    ~UnderrunRecorder();
+
+    // reports go to dir, nothing is recorded until one is set
+    void SetDirectory(std::filesystem::path dir);
+    bool Active() const { return active_.load(std::memory_order_acquire); }
+    // what was playing, named in the report
+    void SetTrack(std::string description);
+
+    void Decode(TimePoint start, Duration took, int frames, size_t fill);
+    void Callback(TimePoint start, Duration took, size_t samples, size_t fill, bool dry);
+    void Frame(TimePoint start, Duration build, Duration swap);
+    // from the callback that ran dry, the report follows within kPoll
+    void Underrun(TimePoint at);
+
+    // reports written so far, oldest first
+    std::vector<std::filesystem::path> Reports() const;
+
+  private:
+    static constexpr auto kPoll = std::chrono::milliseconds(100);
+    static constexpr int kFields = 5;
+
+    using Event = std::array<uint64_t, kFields>;
+
+    // single writer. a copy drops what the writer came round to again meanwhile
+    class Ring
+    {
+      public:
+        void Push(const Event &event);
+        std::vector<Event> Copy() const;
+
+      private:
+        std::array<std::array<std::atomic<uint64_t>, kFields>, kEvents> slots_{};
+        std::atomic<uint64_t> begun_{0};
+        std::atomic<uint64_t> count_{0};
+        // the recording thread, found on its first event
+        std::atomic<long> tid_{0};
+
+        friend class UnderrunRecorder;
+    };
+
+    void Run();
+    void WriteReport(uint64_t at_ns);
+
+    std::atomic<bool> active_{false};
+    std::atomic<uint64_t> underrun_at_ns_{0}; // 0 while none waits for its report
+
+    // allocated by the first SetDirectory()
+    std::unique_ptr<Ring> decode_;
+    std::unique_ptr<Ring> callback_;
+    std::unique_ptr<Ring> frame_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::filesystem::path dir_;
+    std::string track_;
+    std::vector<std::filesystem::path> reports_;
+    std::chrono::steady_clock::time_point last_report_{};
+    std::thread thread_;
+};
@@ -19,7 +19,43 @@ inline bool contains_ignore_case(const std::string &haystack, const std::string
 {
     if (needle.empty())
         return true;
-    return to_lower(haystack).find(to_lower(needle)) != std::string::npos;
+    // without lowered copies, the search box runs this on every row each frame
+    auto same = [](unsigned char a, unsigned char b) { return std::tolower(a) == std::tolower(b); };
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), same) !=
+           haystack.end();
+}
+
+// collation key that orders digit runs by value, so "r_2.m" < "r_10.m"
+// keys are compared with plain operator<
+inline std::string natural_sort_key(const std::string &str)
+{
+    std::string key;
+    key.reserve(str.size() + 8);
+
+    size_t i = 0;
+    while (i < str.size())
+    {
+        unsigned char c = str[i];
+        if (!std::isdigit(c))
+        {
+            key.push_back((char)std::tolower(c));
+            i++;
+            continue;
+        }
+
+        // skip leading zeros, then emit '0' + run length + digits
+        while (i < str.size() && str[i] == '0')
+            i++;
+        size_t start = i;
+        while (i < str.size() && std::isdigit((unsigned char)str[i]))
+            i++;
+
+        size_t len = std::min<size_t>(i - start, 79);
+        key.push_back('0');
+        key.push_back((char)('0' + len));
+        key.append(str, start, len);
+    }
+    return key;
 }
 
 } // namespace utils
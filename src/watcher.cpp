@@ -0,0 +1,409 @@
+#include "watcher.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// a burst of events is applied once it has been quiet for the coalesce delay, but a long
+// copy still shows progress at least this often
+constexpr std::chrono::seconds kMaxDelay{1};
+
+#ifdef __linux__
+constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// inotify only sees local changes on these
+bool IsNetworkFs(const std::filesystem::path &path)
+{
+    struct statfs fs;
+    if (statfs(path.c_str(), &fs) != 0)
+        return false;
+
+    switch ((unsigned long)fs.f_type)
+    {
+    case 0x6969:     // nfs
+    case 0x517B:     // smb
+    case 0xFF534D42: // cifs
+    case 0xFE534D42: // smb2
+    case 0x65735546: // fuse (sshfs, ...)
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
+} // namespace
+
+DirectoryWatcher::DirectoryWatcher() = default;
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    Stop();
+}
+
+void DirectoryWatcher::Start(std::shared_ptr<const LibraryIndex> index)
+{
+    Stop();
+    if (!index)
+        return;
+
+    // inotify is set up here, so IsPolling() is settled once Start() returns
+    root_ = index->root;
+    recursive_ = index->recursive;
+    index_ = std::move(index);
+    dirty_.clear();
+    polling_.store(force_polling_ || !OpenNotify());
+    stop_.store(false);
+    running_.store(true);
+    thread_ = std::thread(&DirectoryWatcher::Run, this);
+}
+
+void DirectoryWatcher::Stop()
+{
+    stop_.store(true);
+    if (thread_.joinable())
+        thread_.join();
+    running_.store(false);
+
+    std::lock_guard lk(mtx_);
+    pending_ = {};
+}
+
+bool DirectoryWatcher::IsRunning() const
+{
+    return running_.load();
+}
+
+bool DirectoryWatcher::IsPolling() const
+{
+    return polling_.load();
+}
+
+bool DirectoryWatcher::ConsumeChanges(WatchChanges &out)
+{
+    std::lock_guard lk(mtx_);
+    if (pending_.Empty())
+        return false;
+    out = std::move(pending_);
+    pending_ = {};
+    return true;
+}
+
+void DirectoryWatcher::SetForcePolling(bool force)
+{
+    force_polling_ = force;
+}
+
+void DirectoryWatcher::SetPollInterval(std::chrono::milliseconds interval)
+{
+    poll_interval_ = interval;
+}
+
+void DirectoryWatcher::SetCoalesceDelay(std::chrono::milliseconds delay)
+{
+    coalesce_delay_ = delay;
+}
+
+void DirectoryWatcher::Run()
+{
+    dirs_.clear();
+    sweep_next_ = 0;
+    dirs_.reserve(index_->DirCount());
+    for (size_t i = 0; i < index_->DirCount(); i++)
+    {
+        auto dir = index_->DirAt(i);
+        dirs_.emplace(LibraryIndex::String(dir.Path()), dir.Copy());
+    }
+    index_.reset();
+
+    for (auto &[dir, record] : dirs_)
+    {
+        if (polling_.load())
+            break;
+        AddWatch(dir);
+    }
+
+    // anything that changed between the scan and the watches being set up
+    CheckMtimes();
+    auto last_poll = std::chrono::steady_clock::now();
+
+    while (!stop_.load())
+    {
+        if (notify_fd_ >= 0)
+        {
+            ReadEvents();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (std::chrono::steady_clock::now() - last_poll >= poll_interval_)
+            {
+                CheckMtimes();
+                last_poll = std::chrono::steady_clock::now();
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (dirty_.empty() ||
+            (now - last_event_ < coalesce_delay_ && now - first_dirty_ < kMaxDelay))
+            continue;
+
+        WatchChanges changes;
+        auto dirs = std::move(dirty_);
+        dirty_.clear();
+        for (auto &dir : dirs)
+        {
+            if (dirs_.count(dir))
+                RescanDir(dir, changes);
+        }
+
+        if (!changes.Empty())
+        {
+            std::lock_guard lk(mtx_);
+            std::move(changes.upserts.begin(), changes.upserts.end(),
+                      std::back_inserter(pending_.upserts));
+            std::move(changes.removed.begin(), changes.removed.end(),
+                      std::back_inserter(pending_.removed));
+        }
+    }
+
+    CloseNotify();
+    running_.store(false);
+}
+
+bool DirectoryWatcher::OpenNotify()
+{
+#ifdef __linux__
+    if (IsNetworkFs(root_))
+        return false;
+    notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return notify_fd_ >= 0;
+#else
+    return false;
+#endif
+}
+
+void DirectoryWatcher::CloseNotify()
+{
+#ifdef __linux__
+    if (notify_fd_ >= 0)
+        close(notify_fd_);
+#endif
+    notify_fd_ = -1;
+    dir_by_wd_.clear();
+    wd_by_dir_.clear();
+}
+
+bool DirectoryWatcher::AddWatch(const LibraryIndex::String &dir)
+{
+#ifdef __linux__
+    if (notify_fd_ < 0)
+        return false;
+
+    int wd = inotify_add_watch(notify_fd_, dir.c_str(), kWatchMask);
+    if (wd < 0)
+    {
+        // out of watches (fs.inotify.max_user_watches), poll everything instead
+        if (errno == ENOSPC)
+        {
+            Logger::Warn("inotify watch limit reached, polling the library instead");
+            CloseNotify();
+            polling_.store(true);
+        }
+        return false;
+    }
+
+    dir_by_wd_[wd] = dir;
+    wd_by_dir_[dir] = wd;
+    return true;
+#else
+    (void)dir;
+    return false;
+#endif
+}
+
+void DirectoryWatcher::RemoveWatch(const LibraryIndex::String &dir)
+{
+    auto it = wd_by_dir_.find(dir);
+    if (it == wd_by_dir_.end())
+        return;
+
+#ifdef __linux__
+    inotify_rm_watch(notify_fd_, it->second);
+#endif
+    dir_by_wd_.erase(it->second);
+    wd_by_dir_.erase(it);
+}
+
+void DirectoryWatcher::ReadEvents()
+{
+#ifdef __linux__
+    pollfd pfd{notify_fd_, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0)
+        return;
+
+    alignas(inotify_event) char buf[16384];
+    while (notify_fd_ >= 0)
+    {
+        ssize_t n = read(notify_fd_, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+
+        auto now = std::chrono::steady_clock::now();
+        for (char *p = buf; p < buf + n;)
+        {
+            auto *ev = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(inotify_event) + ev->len;
+
+            // the kernel dropped events, find the directories that changed by mtime
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                CheckMtimes();
+                continue;
+            }
+
+            auto it = dir_by_wd_.find(ev->wd);
+            if (it == dir_by_wd_.end())
+                continue;
+            if (ev->mask & IN_IGNORED)
+            {
+                wd_by_dir_.erase(it->second);
+                dir_by_wd_.erase(it);
+                continue;
+            }
+
+            if (dirty_.empty())
+                first_dirty_ = now;
+            dirty_.insert(it->second);
+            last_event_ = now;
+        }
+    }
+#endif
+}
+
+// every directory's mtime, and the files of the next directories in line up to kSweepFiles.
+// a network mount pays for a stat per directory a poll, not one per file
+void DirectoryWatcher::CheckMtimes()
+{
+    auto now = std::chrono::steady_clock::now();
+    size_t budget = kSweepFiles;
+    size_t swept = dirs_.size();
+    size_t i = 0;
+    for (auto &[dir, record] : dirs_)
+    {
+        std::filesystem::path dir_path = dir;
+        std::error_code ec;
+        auto modified = std::filesystem::last_write_time(dir_path, ec);
+        bool changed = ec || modified != record.modified;
+        // a file rewritten in place leaves the directory mtime alone
+        if (i++ >= sweep_next_ && budget > 0)
+        {
+            swept = i;
+            budget -= std::min(budget, record.files.size());
+            for (size_t f = 0; !changed && f < record.files.size(); f++)
+            {
+                auto &file = record.files[f];
+                auto path = dir_path / file.name;
+                auto size = std::filesystem::file_size(path, ec);
+                if (!ec)
+                    modified = std::filesystem::last_write_time(path, ec);
+                changed = ec || size != file.size || modified != file.modified;
+            }
+        }
+        if (!changed)
+            continue;
+
+        if (dirty_.empty())
+            first_dirty_ = now;
+        dirty_.insert(dir);
+    }
+    sweep_next_ = swept < dirs_.size() ? swept : 0;
+}
+
+// re-lists one directory and diffs it against the last listing
+void DirectoryWatcher::RescanDir(const LibraryIndex::String &dir, WatchChanges &changes)
+{
+    std::filesystem::path dir_path = dir;
+    LibraryIndex::Dir fresh;
+    if (!ReadDirRecord(dir_path, fresh))
+    {
+        RemoveTree(dir, changes);
+        return;
+    }
+
+    std::vector<LibraryIndex::String> old_subdirs;
+    auto found = dirs_.find(dir);
+    if (found != dirs_.end())
+    {
+        auto *old = &found->second;
+        for (auto &file : old->files)
+        {
+            if (!fresh.FindFile(file.name))
+                changes.removed.push_back(dir_path / file.name);
+        }
+        for (auto &file : fresh.files)
+        {
+            auto *prev = old->FindFile(file.name);
+            if (!prev || prev->size != file.size || prev->modified != file.modified)
+                changes.upserts.push_back(MakeTrackEntry(dir_path, fresh.folder_key, file));
+        }
+        old_subdirs = old->subdirs;
+    }
+    else
+    {
+        for (auto &file : fresh.files)
+            changes.upserts.push_back(MakeTrackEntry(dir_path, fresh.folder_key, file));
+    }
+
+    auto subdirs = fresh.subdirs;
+    dirs_[dir] = std::move(fresh);
+    if (!recursive_)
+        return;
+
+    auto has = [](const std::vector<LibraryIndex::String> &v, const LibraryIndex::String &s)
+    { return std::find(v.begin(), v.end(), s) != v.end(); };
+
+    for (auto &sub : old_subdirs)
+    {
+        if (!has(subdirs, sub))
+            RemoveTree((dir_path / sub).native(), changes);
+    }
+
+    // a new subtree can fill up before its watch exists, so it is listed right away
+    for (auto &sub : subdirs)
+    {
+        auto child = (dir_path / sub).native();
+        if (has(old_subdirs, sub) || dirs_.count(child))
+            continue;
+        AddWatch(child);
+        RescanDir(child, changes);
+    }
+}
+
+void DirectoryWatcher::RemoveTree(const LibraryIndex::String &dir, WatchChanges &changes)
+{
+    auto it = dirs_.find(dir);
+    if (it == dirs_.end())
+        return;
+
+    std::filesystem::path dir_path = dir;
+    for (auto &file : it->second.files)
+        changes.removed.push_back(dir_path / file.name);
+    auto subdirs = std::move(it->second.subdirs);
+
+    dirs_.erase(it);
+    RemoveWatch(dir);
+    for (auto &sub : subdirs)
+        RemoveTree((dir_path / sub).native(), changes);
+}
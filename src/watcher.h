@@ -0,0 +1,85 @@
+#pragma once
+
+#include "library_index.h"
+#include "scanner.h"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct WatchChanges
+{
+    std::vector<TrackEntry> upserts; // new or modified files
+    std::vector<std::filesystem::path> removed;
+
+    bool Empty() const { return upserts.empty() && removed.empty(); }
+};
+
+// keeps a scanned library up to date. on Linux directories are watched with inotify,
+// elsewhere (or on network mounts, or when out of watches) their mtimes are polled, with
+// the size and mtime of kSweepFiles listed files a poll, a slice of the library at a time.
+// events are coalesced per directory and a changed directory is re-listed and diffed
+// against the last known listing, so renames and bursts of writes become one diff
+class DirectoryWatcher
+{
+  public:
+    // files one poll checks for rewrites in place, which leave the directory mtime alone
+    static constexpr size_t kSweepFiles = 256;
+
+    DirectoryWatcher();
+    ~DirectoryWatcher();
+
+    // watches the directories of a finished scan, root and recursion come from the index
+    void Start(std::shared_ptr<const LibraryIndex> index);
+    void Stop();
+    bool IsRunning() const;
+    bool IsPolling() const;
+
+    bool ConsumeChanges(WatchChanges &out);
+
+    // take effect on the next Start()
+    void SetForcePolling(bool force);
+    void SetPollInterval(std::chrono::milliseconds interval);
+    void SetCoalesceDelay(std::chrono::milliseconds delay);
+
+  private:
+    void Run();
+    bool OpenNotify();
+    void CloseNotify();
+    bool AddWatch(const LibraryIndex::String &dir);
+    void RemoveWatch(const LibraryIndex::String &dir);
+    void ReadEvents();
+    void CheckMtimes();
+    void RescanDir(const LibraryIndex::String &dir, WatchChanges &changes);
+    void RemoveTree(const LibraryIndex::String &dir, WatchChanges &changes);
+
+    std::shared_ptr<const LibraryIndex> index_; // copied into dirs_ by the watch thread
+
+    // owned by the watch thread, the last listing of every directory
+    std::filesystem::path root_;
+    bool recursive_ = false;
+    std::unordered_map<LibraryIndex::String, LibraryIndex::Dir> dirs_;
+    size_t sweep_next_ = 0; // where in dirs_ the next poll's file checks start
+    std::set<LibraryIndex::String> dirty_;
+    std::chrono::steady_clock::time_point first_dirty_{};
+    std::chrono::steady_clock::time_point last_event_{};
+    int notify_fd_ = -1;
+    std::unordered_map<int, LibraryIndex::String> dir_by_wd_;
+    std::unordered_map<LibraryIndex::String, int> wd_by_dir_;
+
+    bool force_polling_ = false;
+    std::chrono::milliseconds poll_interval_{2000};
+    std::chrono::milliseconds coalesce_delay_{250};
+
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> polling_{false};
+    std::thread thread_;
+    std::mutex mtx_;
+    WatchChanges pending_;
+};
@@ -0,0 +1,10 @@
+#include "render_host.h"
+#include <cstring>
+
+// the app's render host entry point on its own, for the tests to start
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::strcmp(argv[1], kRenderHostArg) == 0)
+        return RunRenderHost(argc, argv);
+    return 2;
+}
@@ -0,0 +1,144 @@
+#include "alloc_counter.h"
+#include "app.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <imgui.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("AllocCounter counts the allocations of the calling thread")
+{
+    REQUIRE(AllocCounter::kCompiledIn);
+
+    auto before = AllocCounter::ThisThread();
+    auto one = std::make_unique<int>(1);
+    std::vector<int> many(100);
+    CHECK(AllocCounter::ThisThread() - before == 2);
+
+    uint64_t other = 0;
+    std::thread thread(
+        [&]
+        {
+            auto start = AllocCounter::ThisThread();
+            auto two = std::make_unique<int>(2);
+            other = AllocCounter::ThisThread() - start;
+        });
+    thread.join();
+    CHECK(other == 1);
+}
+
+namespace
+{
+
+// ImGui without a window: a display to lay out on and a font atlas to draw with. the window
+// and GL backends only add input and the drawing of what is built here
+class HeadlessImGui
+{
+  public:
+    HeadlessImGui()
+    {
+        ImGui::CreateContext();
+        auto &io = ImGui::GetIO();
+        io.IniFilename = nullptr;
+        io.DisplaySize = ImVec2(1280, 720);
+        unsigned char *pixels = nullptr;
+        int width = 0, height = 0;
+        io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+    }
+    ~HeadlessImGui() { ImGui::DestroyContext(); }
+
+    HeadlessImGui(const HeadlessImGui &) = delete;
+    HeadlessImGui &operator=(const HeadlessImGui &) = delete;
+
+    // what App::Run() does between the window's events and the swap. allocations of the
+    // thread during it
+    uint64_t Frame(App &app, UIActions &actions)
+    {
+        auto before = AllocCounter::ThisThread();
+        ImGui::GetIO().DeltaTime = 1.0f / 60.0f;
+        ImGui::NewFrame();
+        app.Frame(std::chrono::steady_clock::now(), actions);
+        ImGui::Render();
+        return AllocCounter::ThisThread() - before;
+    }
+    uint64_t Frame(App &app)
+    {
+        UIActions actions{};
+        return Frame(app, actions);
+    }
+    // frames until done, a few seconds of them at most
+    template <typename F> bool FramesUntil(App &app, F done)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            Frame(app);
+            if (done())
+                return true;
+            std::this_thread::sleep_for(5ms);
+        }
+        return false;
+    }
+};
+
+} // namespace
+
+// the app's own frame with the UI drawn, once a scanned folder plays: status line, devices,
+// variants, intros of the rows on screen and all
+TEST_CASE("A steady frame allocates nothing")
+{
+    REQUIRE(AllocCounter::kCompiledIn);
+    auto songs = std::filesystem::path(PMDMINI_GUI_MUSIC_DIR) / "Th1_Highly_Resposive_to_Prayers";
+    if (!std::filesystem::exists(songs / "R_00.M"))
+        SKIP("test songs not found");
+    auto data_dir = std::filesystem::temp_directory_path() / "pmdmini_gui_test_frame";
+    std::filesystem::remove_all(data_dir);
+
+    {
+        HeadlessImGui imgui;
+        App app(std::make_unique<NullSink>(1.0), data_dir);
+        app.Start();
+        auto &state = app.GetUIState();
+
+        UIActions open{};
+        open.directory_changed = true;
+        open.directory = songs.string();
+        open.request_scan = true;
+        open.search_changed = true;
+        open.search = "r_0";
+        open.crossfade_toggled = true;
+        open.crossfade_enabled = true;
+        imgui.Frame(app, open);
+        REQUIRE(imgui.FramesUntil(app, [&] { return !state.scanning; }));
+
+        UIActions play{};
+        play.select_index = 0;
+        play.play_selected = true;
+        imgui.Frame(app, play);
+        REQUIRE(imgui.FramesUntil(app, [&] { return state.position_sec > 0; }));
+        CHECK(state.player_state == PlayerState::Playing);
+
+        // metadata and intros come in from other threads for a while, each allocates in the
+        // frame it lands in. steady is once a run of frames went by without any
+        int quiet = 0;
+        for (int i = 0; i < 1000 && quiet < 10; i++)
+        {
+            quiet = imgui.Frame(app) == 0 ? quiet + 1 : 0;
+            std::this_thread::sleep_for(5ms);
+        }
+        REQUIRE(quiet == 10);
+
+        uint64_t allocs = 0;
+        for (int i = 0; i < 50; i++)
+            allocs += imgui.Frame(app);
+        CHECK(allocs == 0);
+        CHECK(state.playlist->RowCount() == 10);
+        CHECK(state.variants.size() == 2);
+        CHECK(!state.status.empty());
+        CHECK(state.audio_devices.size() >= 1);
+    }
+    std::filesystem::remove_all(data_dir);
+}
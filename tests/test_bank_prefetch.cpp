@@ -0,0 +1,90 @@
+#include "bank_prefetch.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace fs = std::filesystem;
+
+TEST_CASE("Sample banks stay mapped until they change on disk")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-banks";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    auto bank = dir / "SONG.PPC";
+    std::ofstream(bank, std::ios::binary) << "ADPCM-1";
+
+    auto &cache = BankPrefetch::Instance();
+    cache.Clear();
+
+    bool hit = true;
+    auto first = cache.Acquire(bank, &hit);
+    REQUIRE(first != nullptr);
+    REQUIRE_FALSE(hit);
+    REQUIRE(first->Size() == 7);
+    REQUIRE(std::memcmp(first->Data(), "ADPCM-1", 7) == 0);
+
+    // a relative spelling of the same file is the same entry
+    auto again = cache.Acquire(dir / "." / "SONG.PPC", &hit);
+    REQUIRE(hit);
+    REQUIRE(again == first);
+
+    std::ofstream(bank, std::ios::binary | std::ios::trunc) << "ADPCM-22";
+    fs::last_write_time(bank, fs::last_write_time(bank) + std::chrono::seconds(5));
+    auto changed = cache.Acquire(bank, &hit);
+    REQUIRE_FALSE(hit);
+    REQUIRE(changed->Size() == 8);
+    REQUIRE(std::memcmp(changed->Data(), "ADPCM-22", 8) == 0);
+
+    REQUIRE(cache.Acquire(dir / "MISSING.P86") == nullptr);
+
+    auto stats = cache.Stats();
+    REQUIRE(stats.hits == 1);
+    REQUIRE(stats.files == 1);
+    REQUIRE(stats.bytes == 8);
+
+    cache.Clear();
+    fs::remove_all(dir);
+}
+
+TEST_CASE("Sample banks over the budget are dropped least recently used first")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-banks-lru";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    for (const char *name : {"A.PPC", "B.PPC", "C.PPC"})
+        std::ofstream(dir / name, std::ios::binary) << std::string(100, 'x');
+
+    auto &cache = BankPrefetch::Instance();
+    cache.Clear();
+    cache.SetBudget(250);
+
+    REQUIRE(cache.Acquire(dir / "A.PPC"));
+    REQUIRE(cache.Acquire(dir / "B.PPC"));
+    bool hit = false;
+    REQUIRE(cache.Acquire(dir / "A.PPC", &hit));
+    REQUIRE(hit);
+    // B is the oldest now
+    auto c = cache.Acquire(dir / "C.PPC");
+    REQUIRE(c);
+    auto stats = cache.Stats();
+    REQUIRE(stats.files == 2);
+    REQUIRE(stats.bytes == 200);
+    REQUIRE(stats.evicted == 1);
+    cache.Acquire(dir / "A.PPC", &hit);
+    REQUIRE(hit);
+    cache.Acquire(dir / "B.PPC", &hit);
+    REQUIRE_FALSE(hit);
+
+    // a dropped mapping stays readable for whoever still holds it
+    cache.SetBudget(0);
+    REQUIRE(cache.Stats().files == 0);
+    REQUIRE(c->Size() == 100);
+    REQUIRE(c->Data()[99] == 'x');
+
+    cache.SetBudget(BankPrefetch::kDefaultBudget);
+    cache.Clear();
+    fs::remove_all(dir);
+}
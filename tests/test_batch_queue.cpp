@@ -0,0 +1,85 @@
+#include "batch_queue.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Batch queue hands blocks over in push order")
+{
+    BatchQueue<int> queue(4);
+    BatchQueue<int>::Block *cache = nullptr;
+
+    for (int i = 0; i < 3; i++)
+    {
+        auto *block = queue.Acquire(cache);
+        REQUIRE(block->items.capacity() >= 4);
+        block->items.push_back(i);
+        queue.Push(block);
+    }
+
+    auto *blocks = queue.TakeAll();
+    std::vector<int> seen;
+    for (auto *b = blocks; b; b = b->next)
+        seen.push_back(b->items[0]);
+    REQUIRE(seen == std::vector<int>{0, 1, 2});
+    REQUIRE(queue.TakeAll() == nullptr);
+
+    // recycled blocks come back empty and no new ones are allocated
+    queue.Recycle(blocks);
+    for (int i = 0; i < 3; i++)
+        REQUIRE(queue.Acquire(cache)->items.empty());
+    REQUIRE(queue.Allocated() == 3);
+}
+
+TEST_CASE("Batch queue with concurrent producers")
+{
+    constexpr int kProducers = 4;
+    constexpr int kPerProducer = 20000;
+    BatchQueue<int> queue(64);
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++)
+    {
+        producers.emplace_back(
+            [&, p]
+            {
+                BatchQueue<int>::Block *cache = nullptr;
+                BatchQueue<int>::Block *block = nullptr;
+                for (int i = 0; i < kPerProducer; i++)
+                {
+                    if (!block)
+                        block = queue.Acquire(cache);
+                    block->items.push_back(p * kPerProducer + i);
+                    if (block->items.size() == queue.BlockSize())
+                    {
+                        queue.Push(block);
+                        block = nullptr;
+                    }
+                }
+                if (block)
+                    queue.Push(block);
+            });
+    }
+
+    std::vector<int> all;
+    auto drain = [&]
+    {
+        auto *blocks = queue.TakeAll();
+        for (auto *b = blocks; b; b = b->next)
+            all.insert(all.end(), b->items.begin(), b->items.end());
+        queue.Recycle(blocks);
+    };
+    while (all.size() < (size_t)(kProducers * kPerProducer))
+    {
+        drain();
+        std::this_thread::yield();
+    }
+    for (auto &t : producers)
+        t.join();
+    drain();
+
+    std::sort(all.begin(), all.end());
+    REQUIRE(all.size() == (size_t)(kProducers * kPerProducer));
+    REQUIRE(std::adjacent_find(all.begin(), all.end()) == all.end());
+    REQUIRE(all.back() == kProducers * kPerProducer - 1);
+}
@@ -0,0 +1,87 @@
+#include "clock.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("SimClock jumps to the next wake up at once")
+{
+    SimClock clock;
+    auto start = clock.Now();
+    auto wall = std::chrono::steady_clock::now();
+    clock.SleepFor(std::chrono::hours(1));
+
+    REQUIRE(clock.Now() - start == std::chrono::hours(1));
+    CHECK(std::chrono::steady_clock::now() - wall < 10s);
+    CHECK(clock.Steps() == 1);
+}
+
+TEST_CASE("SimClock only moves once every thread on it waits")
+{
+    SimClock clock;
+    auto start = clock.Now();
+    std::mutex mutex;
+    std::vector<int> ticks; // ms of each tick of the worker
+
+    clock.AddThread();
+    std::thread worker(
+        [&]
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                clock.SleepFor(10ms);
+                std::lock_guard lock(mutex);
+                ticks.push_back((int)((clock.Now() - start) / 1ms));
+            }
+            clock.RemoveThread();
+        });
+
+    // the worker can't get ahead while this thread works, however long that takes
+    std::this_thread::sleep_for(20ms);
+    REQUIRE(clock.Now() == start);
+
+    clock.SleepFor(45ms);
+    {
+        std::lock_guard lock(mutex);
+        REQUIRE(ticks == std::vector<int>{10, 20, 30, 40});
+    }
+    clock.SleepFor(1s);
+    worker.join();
+    REQUIRE(ticks.size() == 10);
+    CHECK(ticks.back() == 100);
+    CHECK(clock.Now() - start == 1045ms);
+}
+
+TEST_CASE("SimClock wakes a waiter on notify without moving")
+{
+    SimClock clock;
+    auto start = clock.Now();
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ready = false;
+    bool woken = false;
+
+    clock.AddThread();
+    std::thread waiter(
+        [&]
+        {
+            std::unique_lock lock(mutex);
+            woken = clock.WaitFor(lock, cv, 1h, [&] { return ready; });
+            lock.unlock();
+            clock.RemoveThread();
+        });
+
+    clock.SleepFor(5ms);
+    {
+        std::lock_guard lock(mutex);
+        ready = true;
+    }
+    clock.Notify(cv);
+    waiter.join();
+
+    CHECK(woken);
+    CHECK(clock.Now() - start == 5ms);
+}
@@ -0,0 +1,81 @@
+#include "engine.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// a build without the reentrant driver has to ask for it, PMDMINI_GUI_SHARED_DRIVER, and is
+// then tested for engines taking turns instead
+#ifndef PMDMINI_GUI_SHARED_DRIVER
+static std::vector<int16_t> RenderSong(Engine &engine, const fs::path &song, size_t frames)
+{
+    constexpr size_t kBlock = 1024;
+    auto dir = song.parent_path().string();
+    if (!engine.Init(dir, 44100) || !engine.Play(song, dir))
+        return {};
+
+    std::vector<int16_t> pcm(frames * 2);
+    for (size_t done = 0; done < frames; done += kBlock)
+        engine.Render(pcm.data() + done * 2, (int)std::min(kBlock, frames - done));
+    return pcm;
+}
+
+TEST_CASE("Engines render different songs at once, each as it would alone")
+{
+    REQUIRE(Engine::Reentrant());
+
+    auto dir = fs::path(PMDMINI_GUI_MUSIC_DIR) / "Th1_Highly_Resposive_to_Prayers";
+    std::vector<fs::path> songs;
+    for (const char *name : {"R_00.M", "R_01.M", "R_02.M", "R_03.M", "R_00.M2", "R_01.M2"})
+        songs.push_back(dir / name);
+    if (!std::all_of(songs.begin(), songs.end(), [](auto &p) { return fs::exists(p); }))
+        SKIP("test songs not found");
+
+    constexpr size_t kFrames = 44100 * 3;
+    std::vector<std::vector<int16_t>> alone;
+    for (auto &song : songs)
+    {
+        Engine engine;
+        alone.push_back(RenderSong(engine, song, kFrames));
+        REQUIRE(alone.back().size() == kFrames * 2);
+    }
+
+    std::vector<std::vector<int16_t>> together(songs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < songs.size(); i++)
+    {
+        threads.emplace_back(
+            [&, i]
+            {
+                Engine engine;
+                together[i] = RenderSong(engine, songs[i], kFrames);
+            });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    for (size_t i = 0; i < songs.size(); i++)
+        REQUIRE(together[i] == alone[i]);
+    // the songs differ, engines sharing state would have mixed them up
+    REQUIRE(alone[0] != alone[1]);
+}
+#else
+TEST_CASE("Engines take turns on pmdmini's shared driver")
+{
+    REQUIRE_FALSE(Engine::Reentrant());
+
+    {
+        Engine first;
+        REQUIRE(first.Init(".", 44100));
+        Engine second;
+        REQUIRE_FALSE(second.Init(".", 44100));
+        REQUIRE_FALSE(second.Play("R_00.M", "."));
+    }
+    // the driver is free again once its owner is gone
+    Engine third;
+    REQUIRE(third.Init(".", 44100));
+}
+#endif
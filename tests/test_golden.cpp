@@ -0,0 +1,320 @@
+#include "engine.h"
+#include "scanner.h"
+#include <catch2/catch_test_macros.hpp>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// renders the opening seconds of every song in music_files at the rates the player is used
+// with, and compares them with the manifests in tests/golden. an exact hash match passes,
+// a changed hash passes as long as the spectrum stays within tolerance. render time is
+// compared too, scaled by a fixed workload timed on both machines. a missing manifest, or a
+// song missing from one, fails: there is nothing to compare with.
+//
+// PMDMINI_GUI_UPDATE_GOLDEN=1 records the manifests instead,
+// PMDMINI_GUI_GOLDEN_SLOWDOWN=2.0 allows renders twice as slow as recorded
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+constexpr int kRates[] = {44100, 48000, 55466};
+constexpr int kSeconds = 4;
+constexpr int kBlock = 1024;
+constexpr size_t kWindow = 4096;
+constexpr int kBands = 24;
+constexpr double kBandToleranceDb = 2.0;
+constexpr double kSilenceDb = -90.0; // bands quieter than this on both sides are ignored
+constexpr double kDefaultSlowdown = 1.5;
+constexpr double kPi = 3.14159265358979323846;
+
+double Ms(Clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+double Round2(double v)
+{
+    return std::round(v * 100.0) / 100.0;
+}
+
+std::string Hash(const std::vector<int16_t> &pcm)
+{
+    uint64_t h = 1469598103934665603ull; // fnv-1a over the samples, little endian
+    for (int16_t s : pcm)
+    {
+        for (int shift : {0, 8})
+        {
+            h ^= ((uint16_t)s >> shift) & 0xff;
+            h *= 1099511628211ull;
+        }
+    }
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)h);
+    return text;
+}
+
+void Fft(std::vector<std::complex<double>> &a)
+{
+    size_t n = a.size();
+    for (size_t i = 1, j = 0; i < n; i++)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(a[i], a[j]);
+    }
+    for (size_t len = 2; len <= n; len <<= 1)
+    {
+        double angle = -2.0 * kPi / (double)len;
+        std::complex<double> step(std::cos(angle), std::sin(angle));
+        for (size_t i = 0; i < n; i += len)
+        {
+            std::complex<double> w(1.0);
+            for (size_t k = 0; k < len / 2; k++)
+            {
+                auto u = a[i + k];
+                auto v = a[i + k + len / 2] * w;
+                a[i + k] = u + v;
+                a[i + k + len / 2] = u - v;
+                w *= step;
+            }
+        }
+    }
+}
+
+// average power of the mono mix in log spaced bands from 40 Hz to 16 kHz, dB full scale
+std::vector<double> Spectrum(const std::vector<int16_t> &pcm, int rate)
+{
+    std::vector<double> power(kBands, 0.0);
+    std::vector<std::complex<double>> buf(kWindow);
+    size_t frames = pcm.size() / 2;
+    size_t windows = 0;
+    double top = std::min(16000.0, rate / 2.0);
+    for (size_t start = 0; start + kWindow <= frames; start += kWindow, windows++)
+    {
+        for (size_t i = 0; i < kWindow; i++)
+        {
+            double hann = 0.5 - 0.5 * std::cos(2.0 * kPi * (double)i / (double)(kWindow - 1));
+            double mono = (pcm[(start + i) * 2] + pcm[(start + i) * 2 + 1]) / 65536.0;
+            buf[i] = mono * hann;
+        }
+        Fft(buf);
+        for (size_t bin = 1; bin < kWindow / 2; bin++)
+        {
+            double hz = (double)bin * rate / (double)kWindow;
+            if (hz < 40.0 || hz >= top)
+                continue;
+            int band = (int)(std::log(hz / 40.0) / std::log(top / 40.0) * kBands);
+            power[std::min(band, kBands - 1)] += std::norm(buf[bin]);
+        }
+    }
+    // a full scale sine peaks at a quarter of the window with the hann window on
+    double peak = (double)(kWindow / 4);
+    double full = peak * peak * (double)std::max<size_t>(windows, 1);
+    for (auto &p : power)
+        p = Round2(10.0 * std::log10(p / full + 1e-12));
+    return power;
+}
+
+// a fixed amount of the same kind of work, to compare render times across machines
+double CalibrationMs()
+{
+    std::vector<int16_t> noise(kWindow * 2 * 256);
+    uint32_t x = 1;
+    for (auto &s : noise)
+    {
+        x = x * 1664525u + 1013904223u;
+        s = (int16_t)(x >> 16);
+    }
+    double best = 1e9;
+    for (int run = 0; run < 5; run++)
+    {
+        auto t0 = Clock::now();
+        volatile double sink = Spectrum(noise, 44100)[0];
+        (void)sink;
+        best = std::min(best, Ms(t0));
+    }
+    return best;
+}
+
+struct Render
+{
+    bool ok = false;
+    std::vector<int16_t> pcm;
+    double ms = 0;
+};
+
+Render RenderOpening(const fs::path &song, int rate, int seconds)
+{
+    Render r;
+    auto dir = song.parent_path().string();
+    Engine engine;
+    if (!engine.Init(dir, rate) || !engine.Play(song, dir))
+        return r;
+
+    size_t frames = (size_t)rate * seconds;
+    r.pcm.resize(frames * 2);
+    auto t0 = Clock::now();
+    for (size_t done = 0; done < frames; done += kBlock)
+        engine.Render(r.pcm.data() + done * 2, (int)std::min<size_t>(kBlock, frames - done));
+    r.ms = Ms(t0);
+    r.ok = true;
+    return r;
+}
+
+std::vector<fs::path> Songs(const fs::path &root)
+{
+    std::vector<fs::path> songs;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(root, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        if (it->is_regular_file(ec) && IsPmdFile(it->path().filename().string()))
+            songs.push_back(it->path());
+    }
+    std::sort(songs.begin(), songs.end());
+    return songs;
+}
+
+fs::path ManifestPath(int rate)
+{
+    return fs::path(PMDMINI_GUI_GOLDEN_DIR) / ("render_" + std::to_string(rate) + ".json");
+}
+
+void Record(const std::vector<fs::path> &songs, const fs::path &root, int rate,
+            double calibration)
+{
+    json manifest;
+    manifest["rate"] = rate;
+    manifest["seconds"] = kSeconds;
+    manifest["calibration_ms"] = Round2(calibration);
+    json &tracks = manifest["tracks"];
+    tracks = json::object();
+    for (auto &song : songs)
+    {
+        auto name = song.lexically_relative(root).generic_string();
+        Render r = RenderOpening(song, rate, kSeconds);
+        if (!r.ok)
+        {
+            tracks[name] = {{"ok", false}};
+            continue;
+        }
+        tracks[name] = {{"ok", true},
+                        {"hash", Hash(r.pcm)},
+                        {"bands", Spectrum(r.pcm, rate)},
+                        {"render_ms", Round2(r.ms)}};
+    }
+    fs::create_directories(ManifestPath(rate).parent_path());
+    std::ofstream f(ManifestPath(rate));
+    f << manifest.dump(1) << '\n';
+    REQUIRE(f.good());
+}
+
+} // namespace
+
+// opt in until manifests recorded on a Release build against the real pmdmini are committed
+TEST_CASE("Songs render as recorded in the golden manifests", "[.][golden]")
+{
+    fs::path root = PMDMINI_GUI_MUSIC_DIR;
+    auto songs = Songs(root);
+    REQUIRE(!songs.empty());
+
+    const char *update = std::getenv("PMDMINI_GUI_UPDATE_GOLDEN");
+    if (update && *update && std::string(update) != "0")
+    {
+        double calibration = CalibrationMs();
+        for (int rate : kRates)
+            Record(songs, root, rate, calibration);
+        SUCCEED("recorded golden manifests in " << PMDMINI_GUI_GOLDEN_DIR);
+        return;
+    }
+    for (int rate : kRates)
+    {
+        if (!fs::exists(ManifestPath(rate)))
+            FAIL("no golden manifest " << ManifestPath(rate).string()
+                                       << ", record them with PMDMINI_GUI_UPDATE_GOLDEN=1");
+    }
+
+    double slowdown = kDefaultSlowdown;
+    if (const char *env = std::getenv("PMDMINI_GUI_GOLDEN_SLOWDOWN"))
+        slowdown = std::max(1.0, std::atof(env));
+    double calibration = CalibrationMs();
+
+    for (int rate : kRates)
+    {
+        std::ifstream f(ManifestPath(rate));
+        json manifest = json::parse(f, nullptr, false);
+        REQUIRE_FALSE(manifest.is_discarded());
+        int seconds = manifest.value("seconds", kSeconds);
+        const json &tracks = manifest["tracks"];
+
+        std::map<std::string, fs::path> present;
+        for (auto &song : songs)
+            present[song.lexically_relative(root).generic_string()] = song;
+        for (auto &[name, golden] : tracks.items())
+        {
+            INFO(name << " @ " << rate);
+            CHECK(present.count(name) == 1);
+        }
+
+        double golden_ms = 0;
+        double render_ms = 0;
+        for (auto &[name, song] : present)
+        {
+            INFO(name << " @ " << rate);
+            if (!tracks.contains(name))
+            {
+                FAIL_CHECK(name << " has no golden render, record it with "
+                                   "PMDMINI_GUI_UPDATE_GOLDEN=1");
+                continue;
+            }
+            const json &golden = tracks[name];
+            Render r = RenderOpening(song, rate, seconds);
+            REQUIRE(r.ok == golden.value("ok", false));
+            if (!r.ok)
+                continue;
+
+            golden_ms += golden.value("render_ms", 0.0);
+            render_ms += r.ms;
+            if (Hash(r.pcm) == golden.value("hash", ""))
+                continue;
+
+            // not bit exact, a rounding change is fine as long as it sounds the same
+            auto bands = Spectrum(r.pcm, rate);
+            auto expected = golden["bands"].get<std::vector<double>>();
+            REQUIRE(expected.size() == bands.size());
+            double worst = 0;
+            for (size_t b = 0; b < bands.size(); b++)
+            {
+                if (bands[b] < kSilenceDb && expected[b] < kSilenceDb)
+                    continue;
+                worst = std::max(worst, std::abs(bands[b] - expected[b]));
+            }
+            INFO("changed, worst band off by " << worst << " dB");
+            CHECK(worst <= kBandToleranceDb);
+        }
+
+        // per track times of a few ms are noise, the sum over the corpus is not
+        double scale = calibration / std::max(manifest.value("calibration_ms", calibration), 1e-3);
+        double allowed = golden_ms * scale * slowdown;
+        INFO(rate << " Hz: rendered in " << render_ms << " ms, recorded " << golden_ms
+                  << " ms, machine factor " << scale);
+        INFO("rendering at " << rate << " Hz is slower than recorded by more than " << slowdown);
+        CHECK(render_ms <= allowed);
+    }
+}
@@ -0,0 +1,97 @@
+#include "intro_cache.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static std::shared_ptr<IntroBuffer> MakeIntro(size_t frames)
+{
+    auto intro = std::make_shared<IntroBuffer>();
+    intro->sample_rate = 44100;
+    intro->pcm.assign(frames * 2, 100);
+    return intro;
+}
+
+TEST_CASE("Intro cache keeps recently used intros within its budget")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-intros";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    fs::path a = dir / "A.M", b = dir / "B.M", c = dir / "C.M";
+    for (auto &p : {a, b, c})
+        std::ofstream(p) << "song";
+
+    // room for two intros of 1024 frames
+    IntroCache cache(2 * 1024 * 4);
+    cache.SetFormat(44100, 1024);
+    cache.Insert(a, fs::last_write_time(a), MakeIntro(1024));
+    cache.Insert(b, fs::last_write_time(b), MakeIntro(1024));
+    REQUIRE(cache.Find(a) != nullptr); // a is now newer than b
+
+    cache.Insert(c, fs::last_write_time(c), MakeIntro(1024));
+    REQUIRE(cache.Find(b) == nullptr);
+    REQUIRE(cache.Find(a) != nullptr);
+    REQUIRE(cache.Find(c) != nullptr);
+    REQUIRE(cache.Stats().bytes == 2 * 1024 * 4);
+
+    // changed on disk
+    fs::last_write_time(a, fs::last_write_time(a) + std::chrono::seconds(5));
+    REQUIRE(cache.Find(a) == nullptr);
+    REQUIRE(cache.Stats().entries == 1);
+
+    // another rate makes the rest useless
+    cache.SetFormat(48000, 1024);
+    REQUIRE(cache.Find(c) == nullptr);
+
+    fs::remove_all(dir);
+}
+
+#ifndef _WIN32
+TEST_CASE("Intro cache renders in worker processes")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-intro-workers";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    // stands in for the app: silence for good songs, an error for broken ones
+    auto renderer = dir / "render.sh";
+    std::ofstream(renderer) << "#!/bin/sh\n"
+                               "[ \"$1\" = --render-intro ] || exit 2\n"
+                               "case \"$2\" in *BAD*) exit 1;; esac\n"
+                               "head -c $(( $4 * 4 )) /dev/zero\n";
+    fs::permissions(renderer, fs::perms::owner_all);
+
+    std::vector<fs::path> songs = {dir / "A.M", dir / "B.M", dir / "BAD.M"};
+    for (auto &p : songs)
+        std::ofstream(p) << "song";
+
+    IntroCache cache;
+    cache.SetRenderer(renderer);
+    cache.SetFormat(44100, 2048);
+    cache.Request(songs);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (cache.Stats().rendered + cache.Stats().failed < 3 &&
+           std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    auto stats = cache.Stats();
+    REQUIRE(stats.rendered == 2);
+    REQUIRE(stats.failed == 1);
+    auto intro = cache.Find(songs[0]);
+    REQUIRE(intro != nullptr);
+    REQUIRE(intro->Frames() == 2048);
+    REQUIRE(intro->sample_rate == 44100);
+    REQUIRE(cache.Find(songs[2]) == nullptr);
+
+    // a failed render isn't retried until the file changes
+    cache.Request(songs);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(cache.Stats().failed == 1);
+
+    fs::remove_all(dir);
+}
+#endif
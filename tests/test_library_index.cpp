@@ -0,0 +1,164 @@
+#include "library_index.h"
+#include "scanner.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static size_t ScanCount(Scanner &scanner, const fs::path &dir,
+                        std::shared_ptr<const LibraryIndex> previous)
+{
+    scanner.Start(dir, true, SortMode::Name, false, std::move(previous));
+    while (scanner.IsRunning())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    size_t count = 0;
+    std::vector<TrackEntry> batch;
+    while (scanner.ConsumeBatch(batch))
+        count += batch.size();
+    return count;
+}
+
+TEST_CASE("Library index round trip")
+{
+    LibraryIndex index;
+    index.root = "/music";
+    index.recursive = true;
+
+    LibraryIndex::Dir dir;
+    dir.modified = fs::file_time_type(std::chrono::seconds(1234));
+    dir.folder_key = FolderKey("/music");
+    for (auto [name, size] : {std::pair{"A.M", 100}, std::pair{"B.M2", 200}})
+    {
+        LibraryIndex::File file;
+        file.name = fs::path(name).native();
+        file.size = size;
+        file.modified = fs::file_time_type(std::chrono::seconds(size));
+        NameKeys(name, file.name_key, file.variant_key);
+        dir.files.push_back(std::move(file));
+    }
+    dir.subdirs = {"sub"};
+    // the later of two listings of a directory wins
+    index.Build({{fs::path("/music/sub").native(), {}},
+                 {fs::path("/music").native(), {}},
+                 {fs::path("/music").native(), dir}});
+
+    fs::path path = fs::temp_directory_path() / "pmdmini-gui-index-test.bin";
+    REQUIRE(index.Save(path));
+
+    LibraryIndex loaded;
+    REQUIRE(loaded.Load(path));
+    REQUIRE(loaded.root == index.root);
+    REQUIRE(loaded.recursive);
+    REQUIRE(loaded.DirCount() == 2);
+    REQUIRE(loaded.FileCount() == 2);
+
+    auto music = loaded.Find(fs::path("/music").native());
+    REQUIRE(music);
+    REQUIRE(music->Modified() == dir.modified);
+    REQUIRE(music->SubdirCount() == 1);
+    REQUIRE(music->SubdirAt(0) == fs::path("sub").native());
+    auto b = music->FindFile(fs::path("B.M2").native());
+    REQUIRE(b);
+    REQUIRE(b->size == 200);
+    REQUIRE_FALSE(music->FindFile(fs::path("C.M").native()));
+
+    // entries come back with the keys a fresh listing builds
+    auto entries = EntriesFromIndex(loaded);
+    REQUIRE(entries.size() == 2);
+    for (auto &entry : entries)
+    {
+        auto keys = entry;
+        BuildSortKeys(keys);
+        CHECK(entry.name_key == keys.name_key);
+        CHECK(entry.variant_key == keys.variant_key);
+        CHECK(entry.folder_key == keys.folder_key);
+    }
+
+    // a truncated file is rejected instead of half loaded
+    fs::resize_file(path, fs::file_size(path) - 1);
+    REQUIRE_FALSE(loaded.Load(path));
+    REQUIRE(loaded.DirCount() == 0);
+    fs::remove(path);
+}
+
+TEST_CASE("Rescan only lists changed directories")
+{
+    auto root = fs::temp_directory_path() / "pmdmini-gui-index-scan";
+    fs::remove_all(root);
+    for (int d = 0; d < 4; d++)
+    {
+        fs::create_directories(root / ("d" + std::to_string(d)));
+        for (int f = 0; f < 3; f++)
+            std::ofstream(root / ("d" + std::to_string(d)) / ("T" + std::to_string(f) + ".M"));
+    }
+
+    Scanner scanner;
+    REQUIRE(ScanCount(scanner, root, nullptr) == 12);
+    REQUIRE(scanner.Stats().dirs_listed == 5);
+    std::shared_ptr<const LibraryIndex> index = scanner.TakeIndex();
+    REQUIRE(index != nullptr);
+    REQUIRE(index->FileCount() == 12);
+
+    REQUIRE(ScanCount(scanner, root, index) == 12);
+    REQUIRE(scanner.Stats().dirs_listed == 0);
+    REQUIRE(scanner.Stats().dirs_skipped == 5);
+    REQUIRE(scanner.Stats().Changes() == 0);
+
+    // one added and one removed file, mtime pushed forward for coarse filesystems
+    auto d1 = root / "d1";
+    std::ofstream(d1 / "NEW.M");
+    fs::remove(d1 / "T0.M");
+    fs::last_write_time(d1, fs::last_write_time(d1) + std::chrono::seconds(2));
+
+    REQUIRE(ScanCount(scanner, root, index) == 12);
+    auto stats = scanner.Stats();
+    REQUIRE(stats.dirs_listed == 1);
+    REQUIRE(stats.dirs_skipped == 4);
+    REQUIRE(stats.files_probed == 1);
+    REQUIRE(stats.files_removed == 1);
+    REQUIRE(stats.files_reused == 11);
+
+    fs::remove_all(root);
+}
+
+TEST_CASE("Rescan counts the files of a deleted folder as removed")
+{
+    auto root = fs::temp_directory_path() / "pmdmini-gui-index-delete";
+    fs::remove_all(root);
+    auto touch = [](const fs::path &dir, int files)
+    {
+        fs::create_directories(dir);
+        for (int f = 0; f < files; f++)
+            std::ofstream(dir / ("T" + std::to_string(f) + ".M"));
+    };
+    // "x 2" sorts between "x" and what is under it, it must not be counted with them
+    touch(root / "a" / "x", 3);
+    touch(root / "a" / "x" / "y", 2);
+    touch(root / "a" / "x 2", 4);
+    touch(root / "a" / "keep", 1);
+
+    Scanner scanner;
+    REQUIRE(ScanCount(scanner, root, nullptr) == 10);
+    std::shared_ptr<const LibraryIndex> index = scanner.TakeIndex();
+    REQUIRE(index != nullptr);
+    CHECK(index->FileCountUnder((root / "a" / "x").native()) == 5);
+    CHECK(index->FileCountUnder((root / "a").native()) == 10);
+
+    // the parent has no files of its own, only its listing of folders changed
+    auto a = root / "a";
+    fs::remove_all(a / "x");
+    fs::last_write_time(a, fs::last_write_time(a) + std::chrono::seconds(2));
+
+    REQUIRE(ScanCount(scanner, root, index) == 5);
+    auto stats = scanner.Stats();
+    CHECK(stats.dirs_listed == 1);
+    CHECK(stats.files_probed == 0);
+    CHECK(stats.files_removed == 5);
+    CHECK(stats.Changes() == 5);
+
+    fs::remove_all(root);
+}
@@ -0,0 +1,123 @@
+#include "metrics.h"
+#include "metrics_server.h"
+#include "player.h"
+#include <catch2/catch_test_macros.hpp>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+bool Has(const std::string &text, const std::string &line)
+{
+    return text.find(line + "\n") != std::string::npos;
+}
+
+} // namespace
+
+TEST_CASE("MetricsRegistry renders the Prometheus text format")
+{
+    std::atomic<uint64_t> events{0};
+    PerfTimer timer;
+    MetricsRegistry registry;
+    registry.AddCounter("test_events_total", "Events", MetricsRegistry::Value(events));
+    registry.AddGauge("test_level", "Level", [] { return 0.5; });
+    registry.AddHistogram("test_seconds", "Durations", timer);
+
+    events += 3;
+    timer.Add(3us);
+    timer.Add(3us);
+    timer.Add(1500us);
+    auto text = registry.Render();
+
+    CHECK(Has(text, "# TYPE test_events_total counter"));
+    CHECK(Has(text, "test_events_total 3"));
+    CHECK(Has(text, "# TYPE test_level gauge"));
+    CHECK(Has(text, "test_level 0.5"));
+    CHECK(Has(text, "# TYPE test_seconds histogram"));
+    // cumulative
+    CHECK(Has(text, "test_seconds_bucket{le=\"2e-06\"} 0"));
+    CHECK(Has(text, "test_seconds_bucket{le=\"4e-06\"} 2"));
+    CHECK(Has(text, "test_seconds_bucket{le=\"0.001024\"} 2"));
+    CHECK(Has(text, "test_seconds_bucket{le=\"0.002048\"} 3"));
+    CHECK(Has(text, "test_seconds_bucket{le=\"+Inf\"} 3"));
+    CHECK(Has(text, "test_seconds_count 3"));
+    CHECK(Has(text, "test_seconds_sum 0.001506"));
+}
+
+TEST_CASE("Player counts loads into its metrics")
+{
+    auto song = std::filesystem::path(PMDMINI_GUI_MUSIC_DIR) /
+                "Th1_Highly_Resposive_to_Prayers" / "R_00.M";
+    if (!std::filesystem::exists(song))
+        SKIP("test song not found");
+
+    MetricsRegistry registry;
+    Player player{std::make_unique<NullSink>(8.0)};
+    player.RegisterMetrics(registry);
+    REQUIRE(player.Load(song));
+    player.Play();
+    for (int i = 0; i < 200 && !Has(registry.Render(), "pmdmini_track_load_seconds_count 1");
+         i++)
+        std::this_thread::sleep_for(10ms);
+    player.Stop();
+
+    auto text = registry.Render();
+    CHECK(Has(text, "pmdmini_track_loads_total 1"));
+    CHECK(Has(text, "pmdmini_track_load_failures_total 0"));
+    CHECK(Has(text, "pmdmini_track_load_seconds_count 1"));
+    CHECK(Has(text, "pmdmini_underruns_total 0"));
+}
+
+#ifndef _WIN32
+TEST_CASE("MetricsServer answers a scrape on loopback")
+{
+    MetricsRegistry registry;
+    registry.AddGauge("test_up", "Up", [] { return 1.0; });
+    MetricsServer server(registry);
+    REQUIRE(server.Start(0));
+    REQUIRE(server.Port() > 0);
+
+    auto scrape = [&](const std::string &path)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)server.Port());
+        std::string response;
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+            send(fd, request.data(), request.size(), 0);
+            char buf[1024];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+                response.append(buf, (size_t)n);
+        }
+        close(fd);
+        return response;
+    };
+
+    auto ok = scrape("/metrics");
+    CHECK(ok.rfind("HTTP/1.0 200 OK\r\n", 0) == 0);
+    CHECK(ok.find("text/plain; version=0.0.4") != std::string::npos);
+    CHECK(Has(ok, "test_up 1"));
+    CHECK(scrape("/other").rfind("HTTP/1.0 404", 0) == 0);
+
+    server.Stop();
+    CHECK_FALSE(server.IsRunning());
+}
+#endif
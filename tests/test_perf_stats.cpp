@@ -0,0 +1,40 @@
+#include "perf_stats.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("PerfTimer sorts durations into power of two buckets")
+{
+    PerfTimer timer;
+    timer.Add(500ns);
+    timer.Add(1us);
+    timer.Add(3us);
+    timer.Add(1500us);
+    timer.Add(10s);
+
+    auto s = timer.Take();
+    REQUIRE(s.count == 5);
+    CHECK(s.total_ns == 500 + 1000 + 3000 + 1500000 + 10000000000ull);
+    CHECK(s.buckets[0] == 1);  // under 1 us
+    CHECK(s.buckets[1] == 1);  // under 2 us
+    CHECK(s.buckets[2] == 1);  // under 4 us
+    CHECK(s.buckets[11] == 1); // under 2048 us
+    CHECK(s.buckets[PerfTimer::kBuckets - 1] == 1);
+}
+
+TEST_CASE("PerfTimer snapshots give what happened between them")
+{
+    PerfTimer timer;
+    timer.Add(10us);
+    auto before = timer.Take();
+    timer.Add(20us);
+    timer.Add(20us);
+
+    auto since = timer.Take().Since(before);
+    REQUIRE(since.count == 2);
+    CHECK(since.total_ns == 40000);
+    CHECK(since.buckets[5] == 2); // under 32 us
+    CHECK(since.buckets[4] == 0); // the one before
+    CHECK(since.MeanUs() == 20.0);
+}
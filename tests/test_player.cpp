@@ -0,0 +1,320 @@
+#include "engine.h"
+#include "player.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// end to end: the player loads real songs and plays them into a null sink faster than real
+// time, the captured output is checked against the songs rendered directly
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr int kRate = 44100;
+
+// keeps everything played
+class CaptureSink : public NullSink
+{
+  public:
+    using NullSink::NullSink;
+
+    std::vector<float> Take()
+    {
+        std::lock_guard lock(mutex_);
+        return pcm_;
+    }
+    size_t Size()
+    {
+        std::lock_guard lock(mutex_);
+        return pcm_.size();
+    }
+
+  protected:
+    void Consume(const float *pcm, size_t samples, bool paused, bool resumed) override
+    {
+        (void)paused;
+        (void)resumed;
+        std::lock_guard lock(mutex_);
+        pcm_.insert(pcm_.end(), pcm, pcm + samples);
+    }
+
+  private:
+    std::mutex mutex_;
+    std::vector<float> pcm_;
+};
+
+fs::path Song(const char *name)
+{
+    return fs::path(PMDMINI_GUI_MUSIC_DIR) / "Th1_Highly_Resposive_to_Prayers" / name;
+}
+
+// the song as the player should play it, seconds of it or all of it if 0
+std::vector<float> Reference(const fs::path &song, int seconds = 0)
+{
+    Engine engine;
+    auto dir = song.parent_path().string();
+    if (!engine.Init(dir, kRate) || !engine.Play(song, dir))
+        return {};
+    size_t frames = (size_t)kRate * (seconds > 0 ? seconds : engine.LengthSec());
+    std::vector<int16_t> pcm(frames * 2);
+    for (size_t done = 0; done < frames; done += 1024)
+        engine.Render(pcm.data() + done * 2, (int)std::min<size_t>(1024, frames - done));
+    std::vector<float> out(pcm.size());
+    for (size_t i = 0; i < pcm.size(); i++)
+        out[i] = (float)pcm[i] / 32768.0f;
+    return out;
+}
+
+template <typename F> bool WaitFor(F done, double seconds)
+{
+    auto until = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > until)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    return true;
+}
+
+// the same in the time of clock, from a thread that is on it
+template <typename F> bool WaitFor(SimClock &clock, F done, double seconds)
+{
+    auto until = clock.Now() + std::chrono::duration_cast<Clock::duration>(
+                                   std::chrono::duration<double>(seconds));
+    while (!done())
+    {
+        if (clock.Now() > until)
+            return false;
+        clock.SleepFor(std::chrono::milliseconds(2));
+    }
+    return true;
+}
+
+// where ref starts in out, by a match of ref past skip, looking from from on. npos if nowhere
+size_t Find(const std::vector<float> &out, const std::vector<float> &ref, size_t skip,
+            size_t from = 0)
+{
+    constexpr size_t kMatch = 512;
+    // silence matches anywhere, the first sound past skip is what gets looked for
+    auto silent = [&](size_t at)
+    {
+        return std::all_of(ref.begin() + (std::ptrdiff_t)at,
+                           ref.begin() + (std::ptrdiff_t)(at + kMatch),
+                           [](float s) { return s == 0.0f; });
+    };
+    while (skip + kMatch <= ref.size() && silent(skip))
+        skip += kMatch;
+    if (ref.size() < skip + kMatch)
+        return std::string::npos;
+    for (size_t at = from + skip; at + kMatch <= out.size(); at += 2)
+    {
+        if (std::equal(ref.begin() + (std::ptrdiff_t)skip,
+                       ref.begin() + (std::ptrdiff_t)(skip + kMatch),
+                       out.begin() + (std::ptrdiff_t)at))
+            return at - skip;
+    }
+    return std::string::npos;
+}
+
+// how many samples of out from at on are ref from its start
+size_t Matching(const std::vector<float> &out, size_t at, const std::vector<float> &ref)
+{
+    size_t n = 0;
+    while (at + n < out.size() && n < ref.size() && out[at + n] == ref[n])
+        n++;
+    return n;
+}
+
+} // namespace
+
+TEST_CASE("Player plays a song to its end, every frame once and without a gap")
+{
+    auto song = Song("R_00.M");
+    if (!fs::exists(song))
+        SKIP("test songs not found");
+    auto ref = Reference(song);
+    REQUIRE(!ref.empty());
+
+    constexpr double kSpeed = 16.0;
+    auto *sink = new CaptureSink(kSpeed);
+    Player player{std::unique_ptr<AudioSink>(sink)};
+    player.Load(song);
+    player.Play();
+
+    double seconds = (double)ref.size() / 2 / kRate;
+    REQUIRE(WaitFor([&] { return player.HasTrackEnded(); }, seconds / kSpeed * 3 + 10));
+    size_t heard = sink->Size();
+    CHECK(player.GetState() == PlayerState::Stopped);
+    REQUIRE(WaitFor([&] { return sink->Size() > heard + 16384; }, 10));
+
+    auto out = sink->Take();
+    size_t start = Find(out, ref, 0);
+    REQUIRE(start != std::string::npos);
+    // nothing but the song from its first frame to its last, then silence
+    CHECK(Matching(out, start, ref) == ref.size());
+    CHECK(std::all_of(out.begin() + (std::ptrdiff_t)(start + ref.size()), out.end(),
+                      [](float s) { return s == 0.0f; }));
+    // and the end was only reported once all of it had been heard
+    CHECK(heard + NullSink::kBlockFrames * 2 >= start + ref.size());
+    CHECK(player.GetUnderruns() == 0);
+}
+
+TEST_CASE("Player fades in and out over the requested time")
+{
+    auto song = Song("R_01.M");
+    if (!fs::exists(song))
+        SKIP("test songs not found");
+    auto ref = Reference(song, 3);
+    REQUIRE(!ref.empty());
+
+    constexpr int kFadeMs = 100;
+    constexpr size_t kFadeSamples = kRate * kFadeMs / 1000 * 2;
+    constexpr size_t kSlack = 64; // the gain steps add up to 1 give or take a sample
+    auto *sink = new CaptureSink(4.0);
+    Player player{std::unique_ptr<AudioSink>(sink)};
+    player.SetPendingFadeIn(kFadeMs);
+    player.Load(song);
+    player.Play();
+
+    REQUIRE(WaitFor([&] { return player.GetPositionSamples() > kRate; }, 10));
+    CHECK(!player.IsFadingIn());
+    player.StartFadeOut(kFadeMs);
+    REQUIRE(WaitFor([&] { return player.IsFadeOutComplete(); }, 10));
+    size_t faded = sink->Size();
+    REQUIRE(WaitFor([&] { return sink->Size() > faded + 8192; }, 10));
+    player.Stop();
+
+    auto out = sink->Take();
+    // the fade in is done by the time the output is the song itself
+    size_t start = Find(out, ref, kFadeSamples + kSlack);
+    REQUIRE(start != std::string::npos);
+    for (size_t i = 0; i < kFadeSamples; i++)
+    {
+        float gain = (float)i / kFadeSamples;
+        REQUIRE(std::abs(out[start + i] - ref[i] * gain) <= 2e-3f);
+    }
+
+    // the fade out starts where the song stops matching and falls to silence in 100 ms
+    size_t skip = kFadeSamples + kSlack;
+    size_t fade = start + skip +
+                  Matching(out, start + skip, std::vector<float>(ref.begin() + skip, ref.end()));
+    REQUIRE(fade < out.size());
+    size_t last = out.size();
+    while (last > fade && out[last - 1] == 0.0f)
+        last--;
+    // a few quiet samples at either end can't tell a fading song from silence
+    CHECK(last - fade <= kFadeSamples + 4);
+    CHECK(last - fade + 256 >= kFadeSamples);
+    float prev = 1.0f;
+    for (size_t i = fade; i < last; i++)
+    {
+        float r = ref[i - start];
+        if (std::abs(r) < 0.01f)
+            continue;
+        float gain = out[i] / r;
+        REQUIRE(gain <= prev + 1e-3f);
+        prev = gain;
+    }
+}
+
+TEST_CASE("Player goes from one song to the next with a block of silence at most")
+{
+    auto first = Song("R_02.M");
+    auto second = Song("R_03.M");
+    if (!fs::exists(first) || !fs::exists(second))
+        SKIP("test songs not found");
+    auto ref_first = Reference(first, 3);
+    auto ref_second = Reference(second, 3);
+    REQUIRE((!ref_first.empty() && !ref_second.empty()));
+
+    // on a SimClock the sink doesn't move on while the decoder loads, so the time loading
+    // takes isn't in the output. what gap there is comes from the handover to the new song
+    SimClock clock;
+    auto *sink = new CaptureSink(1.0, clock);
+    Player player{std::unique_ptr<AudioSink>(sink), clock};
+    player.Load(first);
+    player.Play();
+    REQUIRE(WaitFor(clock, [&] { return player.GetPositionSamples() > kRate / 2; }, 10));
+    player.Load(second);
+    player.Play();
+    REQUIRE(WaitFor(
+        clock, [&] { return !player.IsLoading() && player.GetPositionSamples() > kRate / 2; },
+        10));
+    player.Stop();
+
+    auto out = sink->Take();
+    size_t a = Find(out, ref_first, 0);
+    REQUIRE(a != std::string::npos);
+    size_t a_end = a + Matching(out, a, ref_first);
+    size_t b = Find(out, ref_second, 0, a_end);
+    REQUIRE(b != std::string::npos);
+    // the second song from its very start, after one block of silence at most
+    CHECK(Matching(out, b, ref_second) >= (size_t)kRate);
+    CHECK(b - a_end <= (size_t)NullSink::kBlockFrames * 2);
+    CHECK(std::all_of(out.begin() + (std::ptrdiff_t)a_end, out.begin() + (std::ptrdiff_t)b,
+                      [](float s) { return s == 0.0f; }));
+    CHECK(player.GetUnderruns() == 0);
+}
+
+TEST_CASE("Player switches variants where playback is, with a short crossfade")
+{
+    auto first = Song("R_00.M");
+    auto second = Song("R_00.M2");
+    if (!fs::exists(first) || !fs::exists(second))
+        SKIP("test songs not found");
+    auto ref_first = Reference(first, 8);
+    auto ref_second = Reference(second, 8);
+    REQUIRE((!ref_first.empty() && !ref_second.empty()));
+
+    auto *sink = new CaptureSink(2.0);
+    Player player{std::unique_ptr<AudioSink>(sink)};
+    player.Load(first);
+    player.Play();
+    REQUIRE(WaitFor([&] { return player.GetPositionSamples() > kRate; }, 10));
+    int64_t requested = player.GetPositionSamples();
+    REQUIRE(player.SwitchVariant(second));
+    REQUIRE(WaitFor([&] { return player.GetSwitchTiming().spliced_at >= 0; }, 10));
+    auto timing = player.GetSwitchTiming();
+    REQUIRE(WaitFor([&] { return player.GetPositionSamples() > timing.spliced_at + kRate; }, 10));
+    player.Stop();
+
+    // the new file takes over no earlier than it was asked to, from the frame it was
+    // pre-rolled to or a later one if the callback got there late
+    CHECK(timing.spliced_at >= requested);
+    CHECK(timing.spliced_at >= timing.rendered_from);
+    size_t splice = (size_t)timing.spliced_at;
+    size_t fade = timing.fade_frames;
+    CHECK(fade == (size_t)kRate * 20 / 1000);
+    REQUIRE((splice + fade) * 2 + kRate <= ref_first.size());
+
+    auto out = sink->Take();
+    size_t a = Find(out, ref_first, 0);
+    REQUIRE(a != std::string::npos);
+    REQUIRE(a + (splice + fade) * 2 + kRate <= out.size());
+    // the old file up to the splice, every frame of it once
+    CHECK(Matching(out, a, ref_first) >= splice * 2);
+    // then the two mixed on the same timeline
+    for (size_t f = 0; f < fade; f++)
+    {
+        float t = (float)(f + 1) / (float)(fade + 1);
+        for (size_t c = 0; c < 2; c++)
+        {
+            size_t k = (splice + f) * 2 + c;
+            REQUIRE(std::abs(out[a + k] - (ref_first[k] * (1.0f - t) + ref_second[k] * t)) <=
+                    1e-6f);
+        }
+    }
+    // and the new file on its own from there
+    size_t b = (splice + fade) * 2;
+    CHECK(Matching(out, a + b, std::vector<float>(ref_second.begin() + (std::ptrdiff_t)b,
+                                                  ref_second.end())) >= (size_t)kRate);
+    CHECK(player.GetUnderruns() == 0);
+}
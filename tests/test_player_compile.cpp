@@ -15,6 +15,12 @@ TEST_CASE("Player loading state default")
     REQUIRE(player.IsLoading() == false);
 }
 
+TEST_CASE("Variant switch needs a loaded track")
+{
+    Player player;
+    REQUIRE_FALSE(player.SwitchVariant("R_00.M2"));
+}
+
 TEST_CASE("Frame duration helper returns positive")
 {
     REQUIRE(Player::FrameDurationMs(1024, 48000) > 0);
@@ -1,5 +1,38 @@
 #include "playlist.h"
+#include "song_info.h"
+#include "utils.h"
 #include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static bool WaitForSort(Playlist &pl)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        if (pl.ApplyPendingSort())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+static std::vector<std::string> Names(const Playlist &pl)
+{
+    std::vector<std::string> out;
+    for (int i = 0; i < (int)pl.Size(); i++)
+        out.push_back(pl.At(i).display_name);
+    return out;
+}
+
+static std::string FileName(const char *path)
+{
+    return std::filesystem::path(path).filename().string();
+}
 
 TEST_CASE("Playlist next/prev wrap")
 {
@@ -11,3 +44,346 @@ TEST_CASE("Playlist next/prev wrap")
     REQUIRE(pl.NextIndex(RepeatMode::All) == 1);
     REQUIRE(pl.PrevIndex(RepeatMode::All) == 1); // wraps around
 }
+
+TEST_CASE("Playlist lookups by id and path")
+{
+    Playlist pl;
+    auto a = pl.Add({"a", "/music/a.M", 0, {}});
+    auto b = pl.Add({"b", "/music/b.M", 0, {}});
+
+    REQUIRE(a != b);
+    REQUIRE(pl.Add({"a", "/music/a.M", 0, {}}) == a); // duplicate path
+    REQUIRE(pl.Size() == 2);
+    REQUIRE(pl.FindIndexByPath("/music/b.M") == 1);
+    REQUIRE(pl.Find(b)->display_name == "b");
+    REQUIRE(pl.IndexOf(kInvalidTrackId) == -1);
+}
+
+TEST_CASE("Playlist selection survives sort of 1M items")
+{
+    const int count = 1000000;
+
+    std::vector<TrackEntry> items(count);
+    for (int i = 0; i < count; i++)
+    {
+        // reverse order so the sort moves every entry
+        items[i].display_name = std::to_string(count - i);
+        items[i].path = "/music/" + std::to_string(i) + ".M";
+        items[i].size = (uintmax_t)(count - i);
+    }
+
+    Playlist pl;
+    pl.SetItems(std::move(items));
+
+    pl.SetSelected(10);
+    pl.SetCurrent(count - 1);
+    auto selected = pl.SelectedId();
+    auto current = pl.CurrentId();
+
+    pl.Sort(SortMode::Size);
+    REQUIRE(WaitForSort(pl));
+
+    REQUIRE(pl.SelectedId() == selected);
+    REQUIRE(pl.CurrentId() == current);
+    REQUIRE(pl.SelectedIndex() == count - 11);
+    REQUIRE(pl.CurrentIndex() == 0);
+    REQUIRE(pl.At(pl.SelectedIndex()).path == "/music/10.M");
+    REQUIRE(pl.FindIndexByPath("/music/10.M") == pl.SelectedIndex());
+}
+
+TEST_CASE("Natural sort key orders numbers by value")
+{
+    using utils::natural_sort_key;
+    REQUIRE(natural_sort_key("R_2.M") < natural_sort_key("R_10.M"));
+    REQUIRE(natural_sort_key("r_02") < natural_sort_key("R_10"));
+    REQUIRE(natural_sort_key("ST9") < natural_sort_key("ST10"));
+    REQUIRE(natural_sort_key("a1") < natural_sort_key("ab"));
+    REQUIRE(natural_sort_key("Boss") == natural_sort_key("BOSS"));
+}
+
+TEST_CASE("Playlist multi-key natural sort")
+{
+    Playlist pl;
+    pl.Add({"R_10.M", "/th2/R_10.M", 0, {}});
+    pl.Add({"R_2.M2", "/th1/R_2.M2", 0, {}});
+    pl.Add({"R_2.M", "/th1/R_2.M", 0, {}});
+    pl.Add({"R_1.M", "/th2/R_1.M", 0, {}});
+
+    pl.Sort(SortMode::Name);
+    REQUIRE(Names(pl) == std::vector<std::string>{"R_1.M", "R_2.M", "R_2.M2", "R_10.M"});
+
+    pl.Sort(SortMode::Folder);
+    REQUIRE(Names(pl) == std::vector<std::string>{"R_2.M", "R_2.M2", "R_1.M", "R_10.M"});
+
+    pl.Sort(SortMode::Name, true);
+    REQUIRE(Names(pl) == std::vector<std::string>{"R_10.M", "R_2.M2", "R_2.M", "R_1.M"});
+}
+
+TEST_CASE("Playlist background sort keeps entries added meanwhile")
+{
+    const int count = (int)Playlist::kAsyncSortThreshold * 2;
+
+    std::vector<TrackEntry> items(count);
+    for (int i = 0; i < count; i++)
+    {
+        items[i].display_name = "T_" + std::to_string(count - i) + ".M";
+        items[i].path = "/music/" + items[i].display_name;
+    }
+
+    Playlist pl;
+    pl.SetItems(std::move(items));
+    pl.Sort(SortMode::Name, true);
+    pl.Add({"late.M", "/music/late.M", 0, {}});
+
+    // still in the order given until the job is published
+    REQUIRE(pl.At(0).display_name == "T_" + std::to_string(count) + ".M");
+    REQUIRE(pl.At(count).display_name == "late.M");
+
+    REQUIRE(WaitForSort(pl));
+    REQUIRE_FALSE(pl.IsSorting());
+    REQUIRE(pl.Size() == (size_t)count + 1);
+    REQUIRE(pl.At(0).display_name == "T_" + std::to_string(count) + ".M");
+    REQUIRE(pl.At(count - 1).display_name == "T_1.M");
+    REQUIRE(pl.At(count).display_name == "late.M");
+}
+
+TEST_CASE("Playlist stays ordered while merging sorted batches")
+{
+    Playlist pl;
+    std::mt19937 rng(1234);
+    const int batches = 200;
+
+    for (int b = 0; b < batches; b++)
+    {
+        std::vector<TrackEntry> batch(64);
+        for (int i = 0; i < (int)batch.size(); i++)
+        {
+            auto &e = batch[i];
+            e.display_name = "R_" + std::to_string(rng() % 100000) + ".M";
+            e.path = "/music/" + std::to_string(b * 64 + i) + "/" + e.display_name;
+            BuildSortKeys(e);
+        }
+        std::sort(batch.begin(), batch.end(),
+                  [](auto &x, auto &y) { return TrackLess(x, y, SortMode::Name); });
+
+        pl.AddBatch(std::move(batch));
+        pl.ApplyPendingSort();
+
+        // what the UI sees this frame
+        bool ordered = true;
+        const TrackEntry *prev = nullptr;
+        pl.ForEach(
+            [&](int, const TrackEntry &e)
+            {
+                if (prev && TrackLess(e, *prev, SortMode::Name))
+                    ordered = false;
+                prev = &e;
+            });
+        REQUIRE(ordered);
+    }
+
+    REQUIRE(pl.Size() == (size_t)batches * 64);
+    for (int i = 0; i < (int)pl.Size(); i += 97)
+    {
+        REQUIRE(pl.IndexOf(pl.At(i).id) == i);
+        REQUIRE(pl.FindIndexByPath(pl.At(i).path) == i);
+    }
+}
+
+TEST_CASE("Playlist keeps the search rows through merges, info and removals")
+{
+    Playlist pl;
+    pl.SetFilter("kaja");
+    std::mt19937 rng(99);
+    std::vector<std::string> paths;
+
+    auto check = [&]
+    {
+        std::vector<int> expected;
+        pl.ForEach(
+            [&](int i, const TrackEntry &e)
+            {
+                if (Playlist::MatchesSearch(e, "kaja"))
+                    expected.push_back(i);
+            });
+        REQUIRE(pl.RowCount() == expected.size());
+        for (int r = 0; r < (int)expected.size(); r++)
+        {
+            REQUIRE(pl.RowIndex(r) == expected[r]);
+            REQUIRE(pl.RowOf(expected[r]) == r);
+        }
+    };
+
+    // enough batches for the tail to be folded into the main run on the way
+    for (int b = 0; b < 100; b++)
+    {
+        std::vector<TrackEntry> batch(64);
+        for (int i = 0; i < (int)batch.size(); i++)
+        {
+            auto &e = batch[i];
+            e.display_name = (rng() % 4 == 0 ? "Kaja_" : "R_") + std::to_string(rng() % 1000) +
+                             ".M";
+            e.path = "/music/" + std::to_string(b * 64 + i) + "/" + e.display_name;
+            e.size = 1;
+            paths.push_back(e.path.string());
+        }
+        pl.AddBatch(std::move(batch));
+        pl.ApplyPendingSort();
+        if (b % 10 == 0)
+            check();
+    }
+    while (pl.IsSorting())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    pl.ApplyPendingSort();
+    check();
+
+    // probed composers match too
+    auto info = std::make_shared<SongInfo>();
+    info->composer = "KAJA";
+    for (size_t i = 0; i < paths.size(); i += 7)
+        REQUIRE(pl.SetInfo(paths[i], 1, {}, info));
+    check();
+
+    std::vector<std::filesystem::path> removed;
+    for (size_t i = 3; i < paths.size(); i += 11)
+        removed.push_back(paths[i]);
+    pl.ApplyChanges({}, removed);
+    check();
+
+    pl.SetFilter("");
+    REQUIRE(pl.RowCount() == pl.Size());
+    REQUIRE(pl.RowIndex(5) == 5);
+    REQUIRE(pl.RowOf(5) == 5);
+}
+
+TEST_CASE("Playlist applies watcher changes in place")
+{
+    Playlist pl;
+    std::vector<TrackEntry> items;
+    for (const char *name : {"a.M", "b.M", "c.M", "d.M"})
+        items.push_back({name, std::string("/m/") + name, 1, {}});
+    pl.SetItems(items);
+
+    TrackId b = pl.IdAt(1);
+    pl.SetCurrentId(pl.IdAt(2));
+
+    // b.M changed on disk, c.M (the current track) deleted, e.M new
+    TrackEntry changed{"b.M", "/m/b.M", 2, {}};
+    TrackEntry added{"e.M", "/m/e.M", 1, {}};
+    pl.ApplyChanges({changed, added}, {"/m/c.M", "/m/missing.M"});
+
+    REQUIRE(Names(pl) == std::vector<std::string>{"a.M", "b.M", "d.M", "e.M"});
+    REQUIRE(pl.IdAt(1) == b);
+    REQUIRE(pl.Find(b)->size == 2);
+    REQUIRE(pl.CurrentId() == kInvalidTrackId);
+    REQUIRE(pl.FindIndexByPath("/m/c.M") == -1);
+    REQUIRE(pl.IndexOf(pl.IdAt(3)) == 3);
+}
+
+TEST_CASE("Playlist keeps ids through a revalidating scan")
+{
+    Playlist pl;
+    std::vector<TrackEntry> items;
+    for (const char *name : {"a.M", "b.M", "c.M"})
+        items.push_back({name, std::string("/m/") + name, 1, {}});
+    pl.SetItems(items);
+    TrackId a = pl.IdAt(0), b = pl.IdAt(1);
+    pl.SetCurrentId(a);
+    pl.SetSelectedId(b);
+
+    // b.M grew, c.M is gone, d.M is new
+    auto listing = items;
+    listing[1].size = 2;
+    listing[2] = {"d.M", "/m/d.M", 1, {}};
+    pl.Revalidate(listing);
+
+    REQUIRE(Names(pl) == std::vector<std::string>{"a.M", "b.M", "d.M"});
+    REQUIRE(pl.IdAt(0) == a);
+    REQUIRE(pl.IdAt(1) == b);
+    REQUIRE(pl.Find(b)->size == 2);
+    REQUIRE(pl.CurrentId() == a);
+    REQUIRE(pl.SelectedId() == b);
+
+    // nothing changed, nothing moves
+    pl.Revalidate(listing);
+    REQUIRE(pl.IdAt(0) == a);
+    REQUIRE(pl.Size() == 3);
+}
+
+TEST_CASE("Playlist lists variants of a song once")
+{
+    Playlist pl;
+    pl.SetGrouping(true);
+    std::vector<TrackEntry> items;
+    for (const char *path : {"/th1/R_2.M", "/th1/R_2.M2", "/th1/r_2.m86", "/th1/R_3.M",
+                             "/th2/R_2.M"})
+        items.push_back({FileName(path), path, 1, {}});
+    pl.SetItems(items);
+    pl.Sort(SortMode::Name);
+
+    REQUIRE(Names(pl) == std::vector<std::string>{"R_2.M", "R_2.M", "R_3.M"});
+    REQUIRE(pl.FoldedCount() == 2);
+
+    TrackId song = pl.IdAt(0);
+    auto variants = pl.Variants(song);
+    REQUIRE(variants.size() == 3);
+    REQUIRE(variants[0]->display_name == "R_2.M");
+    REQUIRE(variants[1]->display_name == "R_2.M2");
+    REQUIRE(pl.ActiveVariant(song)->id == song);
+
+    // a variant stands for its song in lookups
+    TrackId m2 = variants[1]->id;
+    REQUIRE(pl.SetActiveVariant(song, m2));
+    REQUIRE(pl.ActiveVariant(song)->path == "/th1/R_2.M2");
+    REQUIRE(pl.IndexOf(m2) == 0);
+    REQUIRE(pl.FindIndexByPath("/th1/r_2.m86") == 0);
+    pl.SetCurrentId(m2);
+    REQUIRE(pl.CurrentId() == song);
+    REQUIRE_FALSE(pl.SetActiveVariant(song, pl.IdAt(1)));
+
+    // the listed file goes away, the active variant takes its place
+    pl.ApplyChanges({}, {"/th1/R_2.M"});
+    REQUIRE(Names(pl) == std::vector<std::string>{"R_2.M", "R_2.M2", "R_3.M"});
+    REQUIRE(pl.CurrentId() == m2);
+    REQUIRE(pl.Variants(m2).size() == 2);
+
+    pl.SetGrouping(false);
+    REQUIRE(pl.Size() == 4);
+    REQUIRE(pl.FoldedCount() == 0);
+    REQUIRE(pl.CurrentId() == m2);
+}
+
+TEST_CASE("Playlist folds identical copies once hashed")
+{
+    Playlist pl;
+    pl.SetGrouping(true);
+    std::vector<TrackEntry> items;
+    for (const char *path : {"/a/X.M", "/b/Y.M", "/b/Y.M2", "/c/Z.M"})
+        items.push_back({FileName(path), path, 100, {}});
+    pl.SetItems(items);
+    pl.SetSelected(1); // Y.M
+
+    auto hashed = [](uint64_t hash)
+    {
+        auto info = std::make_shared<SongInfo>();
+        info->hash = hash;
+        return info;
+    };
+    // X.M and Y.M are the same song, Z.M differs
+    REQUIRE(pl.SetInfo("/a/X.M", 100, {}, hashed(7)));
+    REQUIRE(pl.SetInfo("/b/Y.M", 100, {}, hashed(7)));
+    REQUIRE(pl.SetInfo("/c/Z.M", 100, {}, hashed(8)));
+    REQUIRE(pl.CollapseDuplicates() == 1);
+
+    REQUIRE(Names(pl) == std::vector<std::string>{"X.M", "Z.M"});
+    REQUIRE(pl.SelectedIndex() == 0);
+    // the copy adds nothing, its folder's other variant does
+    auto variants = pl.Variants(pl.IdAt(0));
+    REQUIRE(variants.size() == 2);
+    REQUIRE(variants[0]->display_name == "X.M");
+    REQUIRE(variants[1]->display_name == "Y.M2");
+
+    pl.ApplyChanges({}, {"/a/X.M"});
+    REQUIRE(Names(pl) == std::vector<std::string>{"Y.M", "Z.M"});
+    REQUIRE(pl.CollapseDuplicates() == 0);
+}
@@ -0,0 +1,255 @@
+#include "hash.h"
+#include "probe.h"
+#include "song_info.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// a compiled song reduced to its header and memo table
+static std::vector<uint8_t> MakeSong(uint8_t version, const std::vector<std::string> &memo)
+{
+    std::vector<uint8_t> mml(0x40, 0);
+    auto put16 = [&](size_t at, size_t v)
+    {
+        mml[at] = (uint8_t)(v & 0xFF);
+        mml[at + 1] = (uint8_t)(v >> 8);
+    };
+    put16(0x00, 0x1A); // first part right after the header
+    put16(0x18, 0x20); // voice data, the memo table pointer sits in front of it
+    put16(0x1C, 0x40);
+    mml[0x1E] = version;
+    mml[0x1F] = 0xFE;
+
+    mml.resize(0x40 + 2 * (memo.size() + 1), 0);
+    for (size_t i = 0; i < memo.size(); i++)
+    {
+        put16(0x40 + 2 * i, mml.size());
+        mml.insert(mml.end(), memo[i].begin(), memo[i].end());
+        mml.push_back(0);
+    }
+    mml.insert(mml.begin(), 0); // sound board
+    return mml;
+}
+
+static void WriteFile(const fs::path &path, const std::vector<uint8_t> &data)
+{
+    std::ofstream f(path, std::ios::binary);
+    f.write(reinterpret_cast<const char *>(data.data()), (std::streamsize)data.size());
+}
+
+static std::vector<ProbeResult> WaitForResults(MetadataProbe &probe)
+{
+    std::vector<ProbeResult> all, results;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!probe.Idle() && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    while (probe.ConsumeResults(results))
+    {
+        for (auto &r : results)
+            all.push_back(std::move(r));
+    }
+    return all;
+}
+
+TEST_CASE("Shift-JIS memo text decodes to UTF-8")
+{
+    REQUIRE(SjisToUtf8("Song 01") == "Song 01");
+    REQUIRE(SjisToUtf8("\x89\xb9\x8a\x79") == "\xe9\x9f\xb3\xe6\xa5\xbd"); // kanji
+    REQUIRE(SjisToUtf8("\xb1") == "\xef\xbd\xb1");                       // half width kana
+    REQUIRE(SjisToUtf8("\x87\x40") == "\xe2\x91\xa0");                   // NEC row 13
+    REQUIRE(SjisToUtf8("A\x89") == "A\xef\xbf\xbd");                     // cut off pair
+
+    // PC-98 colour codes and line breaks in memos
+    REQUIRE(SjisToUtf8("\x1b[31mRed\x1b[m\r\n") == "Red");
+}
+
+TEST_CASE("Memo table is read from the song header")
+{
+    SECTION("PPZ and PPS banks come first on newer compilers")
+    {
+        auto song = MakeSong(0x48, {"VOICE.PZI", "DRUMS.PPS", "SONG.PPC",
+                                    "\x83\x5e\x83\x43\x83\x67\x83\x8b", "Composer", "Arranger",
+                                    "memo 1", "memo 2"});
+        SongInfo info;
+        REQUIRE(ParsePmdInfo(song.data(), song.size(), info));
+        REQUIRE(info.ppz_file == "VOICE.PZI");
+        REQUIRE(info.pps_file == "DRUMS.PPS");
+        REQUIRE(info.pcm_file == "SONG.PPC");
+        REQUIRE(info.title == "\xe3\x82\xbf\xe3\x82\xa4\xe3\x83\x88\xe3\x83\xab");
+        REQUIRE(info.composer == "Composer");
+        REQUIRE(info.arranger == "Arranger");
+        REQUIRE(info.memo == "memo 1\nmemo 2");
+    }
+
+    SECTION("Old songs start with the PCM file, '/' ends the table")
+    {
+        auto song = MakeSong(0x40, {"BANK.P86", "Title", "Composer", "Arranger", "/", "hidden"});
+        SongInfo info;
+        REQUIRE(ParsePmdInfo(song.data(), song.size(), info));
+        REQUIRE(info.pcm_file == "BANK.P86");
+        REQUIRE(info.title == "Title");
+        REQUIRE(info.pps_file.empty());
+        REQUIRE(info.memo.empty());
+    }
+
+    SECTION("Broken data is rejected")
+    {
+        auto song = MakeSong(0x48, {"A", "B", "C", "Title"});
+        SongInfo info;
+        REQUIRE_FALSE(ParsePmdInfo(song.data(), 0x10, info));
+
+        // voice data pointer past the end of the file
+        song[1 + 0x18] = 0xFF;
+        song[1 + 0x19] = 0xFF;
+        REQUIRE_FALSE(ParsePmdInfo(song.data(), song.size(), info));
+    }
+}
+
+TEST_CASE("XXH64 matches the reference hash")
+{
+    REQUIRE(hash::Xxh64("", 0) == 0xef46db3751d8e999ull);
+    REQUIRE(hash::Xxh64("abc", 3) == 0x44bc2cf5ad770999ull);
+
+    // long enough for the four lane loop and every tail step
+    std::vector<uint8_t> bytes(100);
+    for (size_t i = 0; i < bytes.size(); i++)
+        bytes[i] = (uint8_t)i;
+    REQUIRE(hash::Xxh64(bytes.data(), bytes.size()) == 0x6ac1e58032166597ull);
+}
+
+TEST_CASE("Metadata cache round trip drops stale and unused entries")
+{
+    auto t1 = fs::file_time_type(std::chrono::seconds(100));
+    auto t2 = fs::file_time_type(std::chrono::seconds(200));
+    auto info = std::make_shared<SongInfo>();
+    info->title = "\xe9\x9f\xb3";
+    info->pcm_file = "A.PPC";
+    info->hash = 0x0123456789abcdefull;
+
+    SongInfoCache cache;
+    cache.Insert("/music/a.m", 10, t1, info);
+    cache.Insert("/music/b.m", 20, t1, std::make_shared<SongInfo>());
+    REQUIRE(cache.Dirty());
+
+    fs::path path = fs::temp_directory_path() / "pmdmini-gui-metadata-test.bin";
+    REQUIRE(cache.Save(path));
+    REQUIRE_FALSE(cache.Dirty());
+
+    SongInfoCache loaded;
+    REQUIRE(loaded.Load(path));
+    REQUIRE(loaded.Size() == 2);
+    REQUIRE(loaded.Find("/music/a.m", 10, t2) == nullptr); // modified since
+    auto hit = loaded.Find("/music/a.m", 10, t1);
+    REQUIRE(hit != nullptr);
+    REQUIRE(hit->title == info->title);
+    REQUIRE(hit->pcm_file == "A.PPC");
+    REQUIRE(hit->hash == info->hash);
+
+    // b.m wasn't looked up this session
+    REQUIRE(loaded.Save(path));
+    REQUIRE(loaded.Load(path));
+    REQUIRE(loaded.Size() == 1);
+
+    fs::resize_file(path, fs::file_size(path) - 1);
+    REQUIRE_FALSE(loaded.Load(path));
+    REQUIRE(loaded.Size() == 0);
+    fs::remove(path);
+}
+
+TEST_CASE("Probe reads scanned files in parallel and answers repeats from the cache")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-probe";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    for (int i = 0; i < 40; i++)
+        WriteFile(dir / ("S" + std::to_string(i) + ".M"),
+                  MakeSong(0x48, {"", "", "S.PPC", "Song " + std::to_string(i)}));
+    WriteFile(dir / "BROKEN.M", {1, 2, 3});
+    WriteFile(dir / "COPY.M", MakeSong(0x48, {"", "", "S.PPC", "Song 7"}));
+
+    Scanner scanner;
+    scanner.Start(dir, false, SortMode::Name);
+    while (scanner.IsRunning())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::vector<TrackEntry> entries;
+    REQUIRE(scanner.ConsumeBatch(entries));
+    REQUIRE(entries.size() == 42);
+
+    MetadataProbe probe;
+    probe.SetThreadCount(4);
+    probe.Submit(entries);
+    auto results = WaitForResults(probe);
+    REQUIRE(results.size() == 42);
+    uint64_t song7 = 0, copy = 0, song8 = 0;
+    for (auto &r : results)
+    {
+        REQUIRE(r.info != nullptr);
+        REQUIRE(r.info->hash != 0);
+        auto name = r.file.path.filename();
+        if (name == "S7.M")
+        {
+            REQUIRE(r.info->title == "Song 7");
+            song7 = r.info->hash;
+        }
+        if (name == "COPY.M")
+            copy = r.info->hash;
+        if (name == "S8.M")
+            song8 = r.info->hash;
+    }
+    REQUIRE(song7 == copy);
+    REQUIRE(song7 != song8);
+
+    auto stats = probe.Stats();
+    REQUIRE(stats.parsed == 41);
+    REQUIRE(stats.failed == 1);
+    REQUIRE(stats.cached == 0);
+
+    probe.Submit(entries);
+    REQUIRE(WaitForResults(probe).size() == 42);
+    REQUIRE(probe.Stats().cached == 42);
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("Probe throughput", "[.][benchmark]")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-probe-bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    // songs are mostly a few KB of sequence data behind the header
+    std::vector<TrackEntry> entries;
+    for (int i = 0; i < 5000; i++)
+    {
+        auto song = MakeSong(0x48, {"", "", "BANK.PPC", "Song " + std::to_string(i),
+                                    "\x89\xb9\x8a\x79", "", "memo"});
+        song.resize(song.size() + 4096, 0x80);
+        TrackEntry e;
+        e.path = dir / ("S" + std::to_string(i) + ".M");
+        WriteFile(e.path, song);
+        e.size = fs::file_size(e.path);
+        e.modified = fs::last_write_time(e.path);
+        entries.push_back(std::move(e));
+    }
+
+    MetadataProbe probe;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        auto before = probe.Stats();
+        probe.Submit(entries);
+        REQUIRE(WaitForResults(probe).size() == entries.size());
+        auto after = probe.Stats();
+
+        double secs = after.busy_seconds - before.busy_seconds;
+        WARN((pass == 0 ? "cold: " : "cached: ")
+             << entries.size() / secs << " files/s, "
+             << (after.bytes_read - before.bytes_read) / secs / 1e6 << " MB/s, "
+             << probe.ThreadCount() << " threads");
+    }
+
+    fs::remove_all(dir);
+}
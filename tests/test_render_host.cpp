@@ -0,0 +1,184 @@
+#include "engine.h"
+#include "render_host.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <ctime>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr int kRate = 44100;
+
+fs::path TestSong()
+{
+    return fs::path(PMDMINI_GUI_MUSIC_DIR) / "Th1_Highly_Resposive_to_Prayers" / "R_01.M";
+}
+
+// the reference, rendered here in the host's blocks
+std::vector<int16_t> RenderInProcess(const fs::path &song, size_t frames, int *length_sec)
+{
+    auto dir = song.parent_path().string();
+    Engine engine;
+    std::vector<int16_t> pcm(frames * 2);
+    if (!engine.Init(dir, kRate) || !engine.Play(song, dir))
+        return {};
+    *length_sec = engine.LengthSec();
+    for (size_t done = 0; done < frames; done += RenderHost::kBlockFrames)
+    {
+        engine.Render(pcm.data() + done * 2,
+                      (int)std::min<size_t>(RenderHost::kBlockFrames, frames - done));
+    }
+    return pcm;
+}
+
+double ThreadCpuSeconds()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+} // namespace
+
+TEST_CASE("Render host plays a song like the driver in process")
+{
+    auto song = TestSong();
+    if (!fs::exists(song))
+        SKIP("test song not found");
+    auto dir = song.parent_path().string();
+
+    constexpr size_t kFrames = kRate * 2;
+    int length_sec = 0;
+    auto want = RenderInProcess(song, kFrames, &length_sec);
+    REQUIRE(want.size() == kFrames * 2);
+
+    RenderHost host;
+    host.SetExecutable(PMDMINI_GUI_TEST_HOST);
+    REQUIRE(host.Init(dir, kRate));
+    REQUIRE(host.Play(song, dir));
+    REQUIRE(host.LengthSec() == length_sec);
+
+    // read in pieces that don't line up with the host's blocks
+    std::vector<int16_t> got(kFrames * 2);
+    for (size_t done = 0; done < kFrames; done += 700)
+        host.Render(got.data() + done * 2, (int)std::min<size_t>(700, kFrames - done));
+    REQUIRE(got == want);
+    REQUIRE(host.Stats().restarts == 0);
+
+    host.Stop();
+    std::fill(got.begin(), got.end(), 1);
+    host.Render(got.data(), 16);
+    REQUIRE(std::all_of(got.begin(), got.begin() + 32, [](int16_t s) { return s == 0; }));
+
+    // again from the start, the host's blocks now wrap around the end of the ring
+    REQUIRE(host.Play(song, dir));
+    host.Render(got.data(), (int)kFrames);
+    REQUIRE(got == want);
+}
+
+TEST_CASE("Render host is replaced after a crash or a hang and resumes in place")
+{
+    auto song = TestSong();
+    if (!fs::exists(song))
+        SKIP("test song not found");
+    auto dir = song.parent_path().string();
+
+    constexpr size_t kFrames = kRate * 3;
+    int length_sec = 0;
+    auto want = RenderInProcess(song, kFrames, &length_sec);
+    REQUIRE(want.size() == kFrames * 2);
+
+    RenderHost host;
+    host.SetExecutable(PMDMINI_GUI_TEST_HOST);
+    REQUIRE(host.Init(dir, kRate));
+    REQUIRE(host.Play(song, dir));
+
+    std::vector<int16_t> got(kFrames * 2);
+    size_t step = 900;
+    for (size_t done = 0; done < kFrames; done += step)
+    {
+        if (done == step * 30)
+            kill(host.HostPid(), SIGKILL);
+        if (done == step * 90)
+            kill(host.HostPid(), SIGSTOP);
+        host.Render(got.data() + done * 2, (int)std::min(step, kFrames - done));
+    }
+    REQUIRE(got == want);
+    REQUIRE(host.Stats().restarts >= 2);
+}
+
+TEST_CASE("Isolated engine renders through a host")
+{
+    auto song = TestSong();
+    if (!fs::exists(song))
+        SKIP("test song not found");
+    auto dir = song.parent_path().string();
+
+    constexpr size_t kFrames = 8 * RenderHost::kBlockFrames;
+    int length_sec = 0;
+    auto want = RenderInProcess(song, kFrames, &length_sec);
+
+    Engine engine;
+    engine.SetIsolated(true);
+    engine.SetHostExecutable(PMDMINI_GUI_TEST_HOST);
+    REQUIRE(engine.Init(dir, kRate));
+    REQUIRE(engine.Host() != nullptr);
+    REQUIRE(engine.Play(song, dir));
+    REQUIRE(engine.LengthSec() == length_sec);
+    std::vector<int16_t> got(kFrames * 2);
+    engine.Render(got.data(), (int)kFrames);
+    REQUIRE(got == want);
+
+    // back in process at the next Init()
+    engine.SetIsolated(false);
+    REQUIRE(engine.Init(dir, kRate));
+    REQUIRE(engine.Host() == nullptr);
+}
+
+TEST_CASE("Render host IPC overhead", "[.][benchmark]")
+{
+    auto song = TestSong();
+    if (!fs::exists(song))
+        SKIP("test song not found");
+    auto dir = song.parent_path().string();
+    constexpr size_t kFrames = kRate * 60;
+
+    int length_sec = 0;
+    double t0 = ThreadCpuSeconds();
+    auto want = RenderInProcess(song, kFrames, &length_sec);
+    double in_process = ThreadCpuSeconds() - t0;
+
+    RenderHost host;
+    host.SetExecutable(PMDMINI_GUI_TEST_HOST);
+    REQUIRE(host.Init(dir, kRate));
+    double host_start = host.Stats().host_cpu_seconds;
+    REQUIRE(host.Play(song, dir));
+
+    // read like the decoder does, a block at a time
+    std::vector<int16_t> got(kFrames * 2);
+    t0 = ThreadCpuSeconds();
+    for (size_t done = 0; done < kFrames; done += RenderHost::kBlockFrames)
+    {
+        host.Render(got.data() + done * 2,
+                    (int)std::min<size_t>(RenderHost::kBlockFrames, kFrames - done));
+    }
+    double player = ThreadCpuSeconds() - t0;
+    double hosted = host.Stats().host_cpu_seconds - host_start;
+    REQUIRE(got == want);
+
+    // what playback pays for the host, as a share of one core
+    double overhead = (hosted + player - in_process) / 60.0 * 100.0;
+    WARN("60 s of audio: in process " << in_process * 1000.0 << " ms cpu, hosted "
+                                      << hosted * 1000.0 << " ms in the host + " << player * 1000.0
+                                      << " ms in the player, overhead " << overhead
+                                      << " % of a core");
+}
+#endif
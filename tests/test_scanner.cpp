@@ -1,5 +1,77 @@
+#include "playlist.h"
 #include "scanner.h"
 #include <catch2/catch_test_macros.hpp>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::vector<TrackEntry> Drain(Scanner &scanner)
+{
+    std::vector<TrackEntry> all, batch;
+    while (true)
+    {
+        bool running = scanner.IsRunning();
+        if (scanner.ConsumeBatch(batch))
+        {
+            for (auto &e : batch)
+                all.push_back(std::move(e));
+            batch.clear();
+        }
+        else if (!running)
+            break;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return all;
+}
+
+static std::vector<TrackEntry> ScanAll(Scanner &scanner, const std::filesystem::path &dir)
+{
+    scanner.Start(dir, true, SortMode::Name);
+    return Drain(scanner);
+}
+
+// the walk the scanner replaced: one thread, recursive_directory_iterator, a stat per file
+static std::vector<TrackEntry> WalkTree(const std::filesystem::path &root)
+{
+    std::vector<TrackEntry> found;
+    std::error_code ec;
+    for (auto &entry : std::filesystem::recursive_directory_iterator(root, ec))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        auto p = entry.path();
+        if (!IsPmdFile(p.filename().string()))
+            continue;
+
+        TrackEntry e;
+        e.display_name = p.filename().string();
+        e.path = std::filesystem::absolute(p, ec);
+        e.size = entry.file_size();
+        e.modified = entry.last_write_time();
+        found.push_back(std::move(e));
+    }
+    return found;
+}
+
+// dirs x files_per_dir .M files spread over a two level tree
+static void MakeTree(const std::filesystem::path &root, int dirs, int files_per_dir)
+{
+    std::filesystem::remove_all(root);
+    for (int d = 0; d < dirs; d++)
+    {
+        auto dir = root / ("g" + std::to_string(d % 10)) / ("d" + std::to_string(d));
+        std::filesystem::create_directories(dir);
+        for (int f = 0; f < files_per_dir; f++)
+            std::ofstream(dir / ("T_" + std::to_string(f) + (f % 4 ? ".M" : ".MDT")));
+    }
+}
 
 TEST_CASE("Scanner filters extensions")
 {
@@ -9,3 +81,187 @@ TEST_CASE("Scanner filters extensions")
     REQUIRE_FALSE(IsPmdFile("song.txt"));
     REQUIRE_FALSE(IsPmdFile("readme.md"));
 }
+
+TEST_CASE("Scanner classifies variants without the filename")
+{
+    using sv = std::string_view;
+    REQUIRE(ClassifyPmdFile(sv("/music/R_00.M")) == PmdVariant::M);
+    REQUIRE(ClassifyPmdFile(sv("R_00.m2")) == PmdVariant::M2);
+    REQUIRE(ClassifyPmdFile(sv("song.M26")) == PmdVariant::M26);
+    REQUIRE(ClassifyPmdFile(sv("song.m86")) == PmdVariant::M86);
+    REQUIRE(ClassifyPmdFile(sv("MDT_stuff/ALICE.MDT")) == PmdVariant::None);
+    REQUIRE(ClassifyPmdFile(sv("dir.m/readme")) == PmdVariant::None);
+    REQUIRE(ClassifyPmdFile(sv("noext")) == PmdVariant::None);
+}
+
+TEST_CASE("Scanner batches are sorted")
+{
+    auto dir = std::filesystem::temp_directory_path() / "pmdmini-gui-scan-test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    for (auto name : {"R_10.M", "R_2.M", "R_1.M2", "R_1.M", "notes.txt"})
+        std::ofstream(dir / name) << "x";
+
+    Scanner scanner;
+    scanner.Start(dir, false, SortMode::Name);
+    while (scanner.IsRunning())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::vector<TrackEntry> batch;
+    REQUIRE(scanner.ConsumeBatch(batch));
+    REQUIRE(batch.size() == 4);
+    REQUIRE(batch[0].display_name == "R_1.M");
+    REQUIRE(batch[1].display_name == "R_1.M2");
+    REQUIRE(batch[2].display_name == "R_2.M");
+    REQUIRE(batch[3].display_name == "R_10.M");
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Parallel scan finds the same files as the sequential walk")
+{
+    auto dir = std::filesystem::temp_directory_path() / "pmdmini-gui-scan-tree";
+    MakeTree(dir, 40, 12);
+
+    Scanner sequential;
+    sequential.SetThreadCount(1);
+    Scanner parallel;
+    parallel.SetThreadCount(8);
+
+    auto a = ScanAll(sequential, dir);
+    auto b = ScanAll(parallel, dir);
+
+    std::set<std::filesystem::path> pa, pb;
+    for (auto &e : a)
+        pa.insert(e.path);
+    for (auto &e : b)
+        pb.insert(e.path);
+
+    REQUIRE(a.size() == 40 * 9);
+    REQUIRE(pa == pb);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Scanner restart does not wait for the cancelled scan")
+{
+    auto big = std::filesystem::temp_directory_path() / "pmdmini-gui-scan-cancel";
+    auto small = std::filesystem::temp_directory_path() / "pmdmini-gui-scan-small";
+    MakeTree(big, 20, 10);
+    MakeTree(small, 2, 4);
+
+    // the first scan is held inside its first directory until released
+    std::promise<void> entered, release;
+    auto released = release.get_future().share();
+    std::atomic<bool> first{true};
+    Scanner scanner;
+    scanner.SetListHook(
+        [&](const std::filesystem::path &)
+        {
+            if (!first.exchange(false))
+                return;
+            entered.set_value();
+            // bounded, so a Start() that joins fails below instead of hanging
+            released.wait_for(std::chrono::seconds(10));
+        });
+    scanner.Start(big, true, SortMode::Name);
+    entered.get_future().wait();
+    auto generation = scanner.Generation();
+
+    // the old scan is still parked in the hook when the new one starts
+    scanner.SetListHook(nullptr);
+    scanner.Start(small, true, SortMode::Name);
+    REQUIRE(scanner.Generation() == generation + 1);
+    REQUIRE(scanner.PendingCancellations() == 1);
+
+    // nothing from the old walk leaks into the new generation
+    auto found = Drain(scanner);
+    REQUIRE(found.size() == 2 * 3);
+    for (auto &e : found)
+        REQUIRE(e.path.parent_path().parent_path().parent_path().filename() == small.filename());
+
+    // released, the old scan winds down on its own thread and its listing is dropped
+    release.set_value();
+    while (scanner.PendingCancellations() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::vector<TrackEntry> batch;
+    REQUIRE_FALSE(scanner.ConsumeBatch(batch));
+    REQUIRE(scanner.Stats().dirs_listed == 5);
+    auto index = scanner.TakeIndex();
+    REQUIRE(index != nullptr);
+    REQUIRE(index->root == std::filesystem::weakly_canonical(small));
+    REQUIRE(index->FileCount() == 2 * 3);
+
+    std::filesystem::remove_all(big);
+    std::filesystem::remove_all(small);
+}
+
+TEST_CASE("Scanner throughput on a 100k file tree", "[.][benchmark]")
+{
+    auto dir = std::filesystem::temp_directory_path() / "pmdmini-gui-scan-bench";
+    MakeTree(dir, 1000, 100);
+
+    auto t0 = std::chrono::steady_clock::now();
+    auto walked = WalkTree(dir);
+    auto baseline = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    REQUIRE(walked.size() == 1000 * 75);
+    WARN("recursive_directory_iterator: " << baseline * 1000.0 << " ms, "
+                                          << walked.size() / baseline << " entries/s");
+
+    for (int threads : {1, 4, 16})
+    {
+        Scanner scanner;
+        scanner.SetThreadCount(threads);
+
+        t0 = std::chrono::steady_clock::now();
+        auto found = ScanAll(scanner, dir);
+        auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        REQUIRE(found.size() == 1000 * 75);
+        WARN(threads << " thread(s): " << secs * 1000.0 << " ms, " << found.size() / secs
+                     << " entries/s, " << baseline / secs << "x the walk");
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Scan to playlist handoff throughput", "[.][benchmark]")
+{
+    auto dir = std::filesystem::temp_directory_path() / "pmdmini-gui-handoff-bench";
+    MakeTree(dir, 1000, 100);
+
+    for (int round = 0; round < 3; round++)
+    {
+        Scanner scanner;
+        Playlist playlist;
+
+        // consumer time is what the UI thread pays per frame
+        using ms = std::chrono::duration<double, std::milli>;
+        ms consumer{0};
+        auto t0 = std::chrono::steady_clock::now();
+        scanner.Start(dir, true, SortMode::Name);
+        std::vector<TrackEntry> batch;
+        std::vector<size_t> runs;
+        while (true)
+        {
+            bool running = scanner.IsRunning();
+            auto c0 = std::chrono::steady_clock::now();
+            bool got = scanner.ConsumeBatch(batch, &runs);
+            if (got)
+                playlist.AddBatch(std::move(batch), runs);
+            consumer += std::chrono::steady_clock::now() - c0;
+
+            if (!got && !running)
+                break;
+            if (!got)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        REQUIRE(playlist.Size() == 1000 * 75);
+        WARN("scan -> playlist: " << secs * 1000.0 << " ms, " << playlist.Size() / secs
+                                  << " entries/s, consumer " << consumer.count() << " ms");
+    }
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,283 @@
+#include "clock.h"
+#include "player.h"
+#include "playlist.h"
+#include "scanner.h"
+#include "sequencer.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// playback as the app drives it, one sequencer update a frame, on a simulated clock. the
+// sink plays in real time as far as the player can tell, the run takes as long as rendering
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+namespace
+{
+
+constexpr auto kFrame = 16ms;
+// blocks of the null sink, how far apart the sink can notice anything at 44.1 kHz
+constexpr double kBlockMs = NullSink::kBlockFrames * 1000.0 / 44100;
+
+// marks where each track starts to be heard: the first block played after the sink was
+// paused for its load
+class StartSink : public NullSink
+{
+  public:
+    explicit StartSink(Clock &clock) : NullSink(1.0, clock), clock_(clock) {}
+
+    std::vector<Clock::time_point> Starts()
+    {
+        std::lock_guard lock(mutex_);
+        return starts_;
+    }
+
+  protected:
+    void Consume(const float *pcm, size_t samples, bool paused, bool resumed) override
+    {
+        (void)pcm;
+        (void)samples;
+        (void)paused;
+        if (resumed)
+        {
+            std::lock_guard lock(mutex_);
+            starts_.push_back(clock_.Now());
+        }
+    }
+
+  private:
+    Clock &clock_;
+    std::mutex mutex_;
+    std::vector<Clock::time_point> starts_;
+};
+
+struct PlayedTrack
+{
+    Clock::time_point start;
+    Clock::time_point end; // start and the track's length
+    std::optional<Clock::time_point> fade;     // the sequencer began to fade out
+    std::optional<Clock::time_point> detected; // the player reported the end
+};
+
+struct PlayedRun
+{
+    std::vector<PlayedTrack> tracks;
+    double sim_seconds = 0;
+    double wall_seconds = 0;
+};
+
+double Ms(Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// plays count tracks of songs, in order or shuffled, and notes when everything happened
+PlayedRun PlayThrough(const std::vector<fs::path> &songs, size_t count, bool shuffle,
+                      int crossfade_ms)
+{
+    SimClock clock;
+    std::mutex mutex;
+    std::vector<Clock::time_point> ended;
+    auto *sink = new StartSink(clock);
+    Player player{std::unique_ptr<AudioSink>(sink), clock};
+    player.SetOnTrackEnd(
+        [&]
+        {
+            std::lock_guard lock(mutex);
+            ended.push_back(clock.Now());
+        });
+
+    Playlist playlist;
+    for (auto &song : songs)
+        playlist.Add({song.filename().string(), song, 0, {}});
+    Sequencer sequencer(player, playlist);
+    sequencer.SetShuffle(shuffle);
+    sequencer.SetCrossfade(crossfade_ms > 0, crossfade_ms);
+
+    PlayedRun run;
+    auto wall = std::chrono::steady_clock::now();
+    auto begin = clock.Now();
+    sequencer.PlayIndex(0);
+    bool fading = false;
+    while (true)
+    {
+        auto now = clock.Now();
+        // a track's info is read once it sounds, before the next load can replace it
+        auto starts = sink->Starts();
+        for (size_t i = run.tracks.size(); i < starts.size(); i++)
+        {
+            auto info = player.GetTrackInfo();
+            auto length = std::chrono::duration<double>((double)info.duration_samples /
+                                                        std::max(info.sample_rate, 1));
+            run.tracks.push_back(
+                {starts[i], starts[i] + std::chrono::duration_cast<Clock::duration>(length)});
+        }
+        if (run.tracks.size() >= count && now > run.tracks[count - 1].end + 500ms)
+            break;
+        // a song of unknown length plays on, it's skipped after a while
+        if (!run.tracks.empty() && now > run.tracks.back().start + 20min)
+            sequencer.PlayNext();
+
+        sequencer.Update();
+        if (sequencer.IsFadingToNext() && !fading && !run.tracks.empty())
+            run.tracks.back().fade = now;
+        fading = sequencer.IsFadingToNext();
+        clock.SleepFor(kFrame);
+    }
+    run.sim_seconds = std::chrono::duration<double>(clock.Now() - begin).count();
+    run.wall_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+    player.Stop();
+
+    std::lock_guard lock(mutex);
+    run.tracks.resize(count);
+    for (auto at : ended)
+    {
+        auto it = std::find_if(run.tracks.rbegin(), run.tracks.rend(),
+                               [&](const PlayedTrack &t) { return t.start <= at; });
+        if (it != run.tracks.rend() && !it->detected)
+            it->detected = at;
+    }
+    return run;
+}
+
+struct Errors
+{
+    std::vector<double> fade_ms; // fade start against the track's end less the crossfade
+    std::vector<double> gap_ms;  // end of one track to the start of the next
+    std::vector<double> end_ms;  // end reported against the end heard
+};
+
+Errors Measure(const PlayedRun &run, int crossfade_ms)
+{
+    Errors e;
+    for (size_t i = 0; i < run.tracks.size(); i++)
+    {
+        auto &t = run.tracks[i];
+        if (t.fade)
+            e.fade_ms.push_back(Ms(*t.fade - (t.end - std::chrono::milliseconds(crossfade_ms))));
+        if (t.detected)
+            e.end_ms.push_back(Ms(*t.detected - t.end));
+        if (i + 1 < run.tracks.size())
+            e.gap_ms.push_back(Ms(run.tracks[i + 1].start - t.end));
+    }
+    return e;
+}
+
+std::string Summary(const char *name, const std::vector<double> &v)
+{
+    if (v.empty())
+        return std::string(name) + ": none";
+    double sum = 0;
+    for (double x : v)
+        sum += x;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%s: %zu, min %.1f ms, mean %.1f ms, max %.1f ms", name,
+                  v.size(), *std::min_element(v.begin(), v.end()), sum / (double)v.size(),
+                  *std::max_element(v.begin(), v.end()));
+    return line;
+}
+
+bool Within(const std::vector<double> &v, double lo, double hi)
+{
+    return std::all_of(v.begin(), v.end(), [&](double x) { return x >= lo && x <= hi; });
+}
+
+std::vector<fs::path> FirstSongs()
+{
+    auto dir = fs::path(PMDMINI_GUI_MUSIC_DIR) / "Th1_Highly_Resposive_to_Prayers";
+    std::vector<fs::path> songs;
+    for (auto *name : {"R_00.M", "R_01.M", "R_02.M"})
+    {
+        if (fs::exists(dir / name))
+            songs.push_back(dir / name);
+    }
+    return songs;
+}
+
+} // namespace
+
+TEST_CASE("Sequencer moves on at each track end, on a simulated clock")
+{
+    auto songs = FirstSongs();
+    if (songs.size() < 3)
+        SKIP("test songs not found");
+
+    auto run = PlayThrough(songs, songs.size(), false, 0);
+    auto e = Measure(run, 0);
+    WARN(Summary("end detection", e.end_ms));
+    WARN(Summary("gaps", e.gap_ms));
+
+    REQUIRE(run.tracks.size() == 3);
+    REQUIRE(e.end_ms.size() == 3);
+    // the last block of a track is taken from the ring as it starts to play
+    CHECK(Within(e.end_ms, -kBlockMs - 1, 5));
+    // noticed on the next frame, heard from the next block on
+    CHECK(Within(e.gap_ms, 0, Ms(kFrame) + kBlockMs * 2));
+    CHECK(run.sim_seconds > run.wall_seconds * 4);
+}
+
+TEST_CASE("Sequencer fades out ahead of the track end, on a simulated clock")
+{
+    auto songs = FirstSongs();
+    if (songs.size() < 3)
+        SKIP("test songs not found");
+
+    constexpr int kCrossfadeMs = 500;
+    auto run = PlayThrough(songs, songs.size(), false, kCrossfadeMs);
+    auto e = Measure(run, kCrossfadeMs);
+    WARN(Summary("fade start", e.fade_ms));
+    WARN(Summary("gaps", e.gap_ms));
+
+    REQUIRE(run.tracks.size() == 3);
+    // the last one has nothing to fade into
+    REQUIRE(e.fade_ms.size() == 2);
+    // a frame late at most, or early by the block the position runs ahead
+    CHECK(Within(e.fade_ms, -kBlockMs - 1, Ms(kFrame) + 1));
+    CHECK(Within(e.gap_ms, -kBlockMs - Ms(kFrame), Ms(kFrame) + kBlockMs * 2));
+}
+
+// every song of the first five games in the app's shuffle, as many tracks as there are songs,
+// without and with crossfade. how far the timing of the playback logic is off over a few
+// hundred tracks
+TEST_CASE("Sequencer timing over a shuffled playlist", "[.][benchmark]")
+{
+    std::vector<fs::path> songs;
+    for (auto *game : {"Th1_Highly_Resposive_to_Prayers", "Th2_the_Story_of_Eastern_Wonderland",
+                       "Th3_Phantasmagoria_of_Dim.Dream", "Th4_Lotus_Land_Story",
+                       "Th5_Mystic_Square"})
+    {
+        auto dir = fs::path(PMDMINI_GUI_MUSIC_DIR) / game;
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(dir, ec);
+             it != fs::recursive_directory_iterator(); it.increment(ec))
+        {
+            if (it->is_regular_file() && IsPmdFile(it->path().filename().string()))
+                songs.push_back(it->path());
+        }
+    }
+    if (songs.empty())
+        SKIP("test songs not found");
+
+    for (int crossfade_ms : {0, 1000})
+    {
+        auto run = PlayThrough(songs, songs.size(), true, crossfade_ms);
+        auto e = Measure(run, crossfade_ms);
+        char line[160];
+        std::snprintf(line, sizeof(line),
+                      "crossfade %d ms: %zu tracks, %.0f s played in %.1f s (%.0fx)",
+                      crossfade_ms, run.tracks.size(), run.sim_seconds, run.wall_seconds,
+                      run.sim_seconds / std::max(run.wall_seconds, 1e-3));
+        WARN(line);
+        WARN(Summary("  fade start", e.fade_ms));
+        WARN(Summary("  gaps", e.gap_ms));
+        WARN(Summary("  end detection", e.end_ms));
+    }
+}
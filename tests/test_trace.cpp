@@ -0,0 +1,143 @@
+#include "trace.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// null if the trace couldn't be written
+nlohmann::json WriteAndRead()
+{
+    auto path = fs::temp_directory_path() / "pmdmini_gui_test_trace.json";
+    if (!Trace::WriteChromeJson(path))
+        return {};
+    std::ifstream in(path);
+    auto json = nlohmann::json::parse(in);
+    in.close();
+    fs::remove(path);
+    return json;
+}
+
+// tid of the thread called name, 0 if there is none
+int ThreadId(const nlohmann::json &trace, const std::string &name)
+{
+    if (trace.is_null())
+        return 0;
+    for (auto &e : trace["traceEvents"])
+    {
+        if (e["ph"] == "M" && e["args"]["name"] == name)
+            return e["tid"];
+    }
+    return 0;
+}
+
+size_t Count(const nlohmann::json &trace, int tid, const std::string &name)
+{
+    size_t n = 0;
+    for (auto &e : trace["traceEvents"])
+    {
+        if (e["ph"] == "X" && e["tid"] == tid && e["name"] == name)
+            n++;
+    }
+    return n;
+}
+
+} // namespace
+
+TEST_CASE("Trace writes the events of each thread as Chrome trace JSON")
+{
+    Trace::Clear();
+    std::thread worker(
+        [&]
+        {
+            Trace::SetThreadName("test worker");
+            for (int i = 0; i < 3; i++)
+                TraceScope scope("work");
+        });
+    worker.join();
+    {
+        Trace::SetThreadName("test main");
+        TraceScope scope("outer");
+        TraceScope inner("inner");
+    }
+
+    auto trace = WriteAndRead();
+    int worker_tid = ThreadId(trace, "test worker");
+    int main_tid = ThreadId(trace, "test main");
+    REQUIRE(worker_tid > 0);
+    REQUIRE(main_tid > 0);
+    CHECK(worker_tid != main_tid);
+    CHECK(Count(trace, worker_tid, "work") == 3);
+    CHECK(Count(trace, main_tid, "outer") == 1);
+    CHECK(Count(trace, main_tid, "inner") == 1);
+
+    for (auto &e : trace["traceEvents"])
+    {
+        if (e["ph"] == "X")
+            CHECK(e["dur"].get<double>() >= 0);
+    }
+}
+
+TEST_CASE("Trace keeps the newest events of a thread")
+{
+    Trace::Clear();
+    Trace::SetThreadName("test main");
+    for (size_t i = 0; i < Trace::kThreadEvents + 100; i++)
+        Trace::Record(i < 100 ? "old" : "new", i * 1000, i * 1000 + 10);
+
+    auto trace = WriteAndRead();
+    int tid = ThreadId(trace, "test main");
+    CHECK(Count(trace, tid, "old") == 0);
+    CHECK(Count(trace, tid, "new") == Trace::kThreadEvents);
+}
+
+TEST_CASE("Trace turns its ticks into the time that passed")
+{
+    Trace::Clear();
+    Trace::SetThreadName("test main");
+    {
+        TraceScope scope("sleep");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    auto trace = WriteAndRead();
+    int tid = ThreadId(trace, "test main");
+    double dur = -1;
+    for (auto &e : trace["traceEvents"])
+    {
+        if (e["ph"] == "X" && e["tid"] == tid && e["name"] == "sleep")
+            dur = e["dur"].get<double>();
+    }
+    // microseconds, a sleep may run long but not short
+    CHECK(dur >= 4900);
+    CHECK(dur < 500000);
+}
+
+// what a trace point adds to a hot path: the scope, two tick reads and the record. the best
+// of a few rounds, a busy machine only makes some of them slow. meant to stay under 50 ns in an
+// optimized build
+TEST_CASE("Trace point cost", "[.][benchmark]")
+{
+    constexpr int kEvents = 200000;
+    double best = 1e9;
+    for (int round = 0; round < 5; round++)
+    {
+        Trace::Clear();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kEvents; i++)
+            TraceScope scope("bench");
+        auto took = std::chrono::steady_clock::now() - start;
+        best = std::min(best, std::chrono::duration<double, std::nano>(took).count() / kEvents);
+    }
+    Trace::Clear();
+
+    WARN(best << " ns per trace point");
+}
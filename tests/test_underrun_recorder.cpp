@@ -0,0 +1,71 @@
+#include "underrun_recorder.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+namespace
+{
+
+std::string ReadAll(const fs::path &path)
+{
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+} // namespace
+
+TEST_CASE("UnderrunRecorder reports the window before an underrun")
+{
+    auto dir = fs::temp_directory_path() / "pmdmini-gui-underruns";
+    fs::remove_all(dir);
+
+    UnderrunRecorder recorder;
+    CHECK_FALSE(recorder.Active());
+    recorder.SetDirectory(dir);
+    REQUIRE(recorder.Active());
+    recorder.SetTrack("R_00.M");
+
+    auto now = std::chrono::steady_clock::now();
+    // outside the window, left out
+    recorder.Decode(now - 8s, 1ms, 1024, 100);
+    recorder.Decode(now - 20ms, 3ms, 1024, 2048);
+    recorder.Frame(now - 16ms, 2ms, 14ms);
+    recorder.Callback(now - 10ms, 50us, 2048, 0, false);
+    recorder.Callback(now, 40us, 2048, 0, true);
+    recorder.Underrun(now);
+    // the one a moment later is in the same report
+    recorder.Underrun(now + 1ms);
+
+    for (int i = 0; i < 200 && recorder.Reports().empty(); i++)
+        std::this_thread::sleep_for(10ms);
+    auto reports = recorder.Reports();
+    REQUIRE(reports.size() == 1);
+    CHECK(reports[0].parent_path() == dir);
+
+    auto text = ReadAll(reports[0]);
+    CHECK(text.find("R_00.M") != std::string::npos);
+    CHECK(text.find("decode blocks: 1, longest 3.000\n") != std::string::npos);
+    CHECK(text.find("-20.000 3.000 1024 2048\n") != std::string::npos);
+    CHECK(text.find("callbacks: 2") != std::string::npos);
+    CHECK(text.find("0.000 0.040 2048 0 dry\n") != std::string::npos);
+    CHECK(text.find("-16.000 2.000 14.000\n") != std::string::npos);
+#ifdef __linux__
+    CHECK(text.find("scheduling") != std::string::npos);
+    CHECK(text.find("schedstat") != std::string::npos);
+#endif
+
+    // too soon after the first for a report of its own
+    recorder.Underrun(std::chrono::steady_clock::now());
+    std::this_thread::sleep_for(300ms);
+    CHECK(recorder.Reports().size() == 1);
+    fs::remove_all(dir);
+}
@@ -0,0 +1,138 @@
+#include "watcher.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static std::shared_ptr<const LibraryIndex> ScanIndex(const fs::path &root)
+{
+    Scanner scanner;
+    scanner.Start(root, true, SortMode::Name);
+    while (scanner.IsRunning())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return scanner.TakeIndex();
+}
+
+// collects changes until the expected number of upserts and removals came in
+static WatchChanges WaitForChanges(DirectoryWatcher &watcher, size_t upserts, size_t removed)
+{
+    WatchChanges all, changes;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < deadline &&
+           (all.upserts.size() < upserts || all.removed.size() < removed))
+    {
+        if (watcher.ConsumeChanges(changes))
+        {
+            for (auto &e : changes.upserts)
+                all.upserts.push_back(std::move(e));
+            for (auto &p : changes.removed)
+                all.removed.push_back(std::move(p));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return all;
+}
+
+static void CheckWatcher(bool force_polling)
+{
+    auto root = fs::temp_directory_path() / "pmdmini-gui-watch";
+    fs::remove_all(root);
+    fs::create_directories(root / "a");
+    std::ofstream(root / "a" / "OLD.M");
+
+    DirectoryWatcher watcher;
+    watcher.SetForcePolling(force_polling);
+    watcher.SetPollInterval(std::chrono::milliseconds(20));
+    watcher.SetCoalesceDelay(std::chrono::milliseconds(20));
+    watcher.Start(ScanIndex(root));
+    REQUIRE(watcher.IsPolling() == force_polling);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // a new nested folder is picked up as a whole
+    fs::create_directories(root / "b" / "c");
+    std::ofstream(root / "b" / "c" / "NEW.M2");
+    std::ofstream(root / "a" / "ignored.txt");
+    auto changes = WaitForChanges(watcher, 1, 0);
+    REQUIRE(changes.upserts.size() == 1);
+    REQUIRE(changes.upserts[0].display_name == "NEW.M2");
+    REQUIRE(changes.removed.empty());
+
+    // rename is a removal plus an upsert
+    fs::rename(root / "a" / "OLD.M", root / "a" / "RENAMED.M");
+    changes = WaitForChanges(watcher, 1, 1);
+    REQUIRE(changes.upserts.size() == 1);
+    REQUIRE(changes.upserts[0].display_name == "RENAMED.M");
+    REQUIRE(changes.removed.size() == 1);
+    REQUIRE(changes.removed[0].filename() == "OLD.M");
+
+    // rewritten in place: the folder's mtime stays, the file's size and mtime don't
+    auto dir_time = fs::last_write_time(root / "a");
+    std::ofstream(root / "a" / "RENAMED.M", std::ios::app) << "data";
+    fs::last_write_time(root / "a" / "RENAMED.M", dir_time + std::chrono::seconds(2));
+    fs::last_write_time(root / "a", dir_time);
+    changes = WaitForChanges(watcher, 1, 0);
+    REQUIRE(changes.upserts.size() == 1);
+    REQUIRE(changes.upserts[0].size == 4);
+    REQUIRE(changes.removed.empty());
+
+    fs::remove_all(root / "b");
+    changes = WaitForChanges(watcher, 0, 1);
+    REQUIRE(changes.removed.size() == 1);
+    REQUIRE(changes.removed[0].filename() == "NEW.M2");
+
+    watcher.Stop();
+    fs::remove_all(root);
+}
+
+#ifdef __linux__
+TEST_CASE("Watcher applies inotify events as diffs")
+{
+    CheckWatcher(false);
+}
+#endif
+
+TEST_CASE("Watcher falls back to polling directories and files")
+{
+    CheckWatcher(true);
+}
+
+// a poll only checks the files of a slice of the library, the next polls go on from there
+TEST_CASE("Polling finds a file rewritten in place beyond one poll's worth of files")
+{
+    auto root = fs::temp_directory_path() / "pmdmini-gui-watch-sweep";
+    fs::remove_all(root);
+    constexpr size_t kDirs = 8;
+    constexpr size_t kFiles = DirectoryWatcher::kSweepFiles / 2;
+    for (size_t d = 0; d < kDirs; d++)
+    {
+        fs::create_directories(root / ("d" + std::to_string(d)));
+        for (size_t f = 0; f < kFiles; f++)
+            std::ofstream(root / ("d" + std::to_string(d)) / ("T" + std::to_string(f) + ".M"));
+    }
+
+    DirectoryWatcher watcher;
+    watcher.SetForcePolling(true);
+    watcher.SetPollInterval(std::chrono::milliseconds(20));
+    watcher.SetCoalesceDelay(std::chrono::milliseconds(20));
+    watcher.Start(ScanIndex(root));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // one file in every folder, whichever the sweep is at they all come round
+    for (size_t d = 0; d < kDirs; d++)
+    {
+        auto dir = root / ("d" + std::to_string(d));
+        auto dir_time = fs::last_write_time(dir);
+        std::ofstream(dir / "T0.M", std::ios::app) << "data";
+        fs::last_write_time(dir / "T0.M", dir_time + std::chrono::seconds(2));
+        fs::last_write_time(dir, dir_time);
+    }
+    auto changes = WaitForChanges(watcher, kDirs, 0);
+    CHECK(changes.upserts.size() == kDirs);
+    CHECK(changes.removed.empty());
+
+    watcher.Stop();
+    fs::remove_all(root);
+}